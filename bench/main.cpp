@@ -0,0 +1,623 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Micro-benchmarks for the common/ primitives. Every result is also written
+// to a JSON file, so a change to one of these headers can be compared
+// against the numbers of the commit before it:
+//   bench [--out FILE] [--filter SUBSTRING] [--quick]
+
+#include "Log.hpp"
+#include "Threadpool.hpp"
+#include "Timer.hpp"
+#include "Client.hpp"
+#include "Frame.hpp"
+#include "LegacyParser.hpp"
+#include "StateCodec.hpp"
+#include "Journal.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+
+using namespace Network;
+using Clock = std::chrono::steady_clock;
+
+int64_t
+nanosSince(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+struct BenchResult {
+    std::string name;
+    // what varied between runs of the same benchmark, e.g. "producers=4"
+    std::string params;
+    size_t iterations;
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+// collects results, prints them as they come and writes them out as JSON
+class BenchReport {
+public:
+    BenchReport(std::string filter, bool quick)
+        : filter_(std::move(filter))
+        , quick_(quick) { };
+
+    bool
+    wanted(const std::string& name) const {
+        return filter_.empty() || name.find(filter_) != std::string::npos;
+    };
+
+    // scales an iteration count down for --quick runs
+    size_t
+    iterations(size_t full) const {
+        return quick_ ? std::max<size_t>(1, full / 10) : full;
+    };
+
+    void
+    add(BenchResult result) {
+        printf("%-34s %-14s", result.name.c_str(), result.params.c_str());
+        for (auto& metric : result.metrics)
+            printf(" %s=%.4g", metric.first.c_str(), metric.second);
+        printf("\n");
+        fflush(stdout);
+        results_.push_back(std::move(result));
+    };
+
+    // appends mean and percentiles of samples taken in nanoseconds
+    static void
+    summarize(std::vector<double>& samples, BenchResult& result, const char* unit = "ns") {
+        if (samples.empty())
+            return;
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (auto s : samples)
+            sum += s;
+        auto at = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, (size_t)(p * samples.size()))];
+        };
+        std::string u = unit;
+        result.metrics.push_back({ "mean_" + u, sum / samples.size() });
+        result.metrics.push_back({ "p50_" + u, at(0.5) });
+        result.metrics.push_back({ "p90_" + u, at(0.9) });
+        result.metrics.push_back({ "p99_" + u, at(0.99) });
+        result.metrics.push_back({ "max_" + u, samples.back() });
+    };
+
+    int
+    write(const std::string& path) const {
+        std::ofstream out(path);
+        if (!out)
+            return 1;
+        out.precision(10);
+        out << "{\n  \"version\": 1,\n";
+        out << "  \"cpus\": " << std::thread::hardware_concurrency() << ",\n";
+        out << "  \"quick\": " << (quick_ ? "true" : "false") << ",\n";
+        out << "  \"results\": [\n";
+        for (size_t i = 0; i < results_.size(); ++i) {
+            auto& r = results_[i];
+            out << "    { \"name\": \"" << r.name << "\", \"params\": \"" << r.params
+                << "\", \"iterations\": " << r.iterations;
+            for (auto& metric : r.metrics)
+                out << ", \"" << metric.first << "\": " << metric.second;
+            out << " }" << (i + 1 < results_.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n}\n";
+        return out.good() ? 0 : 1;
+    };
+
+private:
+    std::string filter_;
+    bool quick_;
+    std::vector<BenchResult> results_;
+
+};
+
+// waits until count reaches target without sleeping through the end of a
+// throughput run
+void
+spinUntil(const std::atomic<size_t>& count, size_t target)
+{
+    while (count.load(std::memory_order_acquire) < target)
+        std::this_thread::yield();
+}
+
+// submit: caller to task start on an idle pool, one task at a time.
+// throughput: producers submit concurrently, tasks just count.
+template<typename Submit>
+void
+benchPool(BenchReport& report, const std::string& name, Submit&& submit)
+{
+    if (!report.wanted(name))
+        return;
+    {
+        auto n = report.iterations(20000);
+        std::vector<double> samples;
+        samples.reserve(n);
+        std::atomic<size_t> done(0);
+        for (size_t i = 0; i < n; ++i) {
+            auto start = Clock::now();
+            int64_t started = 0;
+            submit([&started, &done, start]() {
+                started = nanosSince(start);
+                done.fetch_add(1, std::memory_order_release);
+            });
+            spinUntil(done, i + 1);
+            samples.push_back((double)started);
+        }
+        BenchResult result { name + ".submit_latency", "producers=1", n, {} };
+        BenchReport::summarize(samples, result);
+        report.add(result);
+    }
+    for (size_t producers : { 1, 4 }) {
+        auto n = report.iterations(200000);
+        std::atomic<size_t> done(0);
+        auto start = Clock::now();
+        std::vector<std::thread> threads;
+        for (size_t p = 0; p < producers; ++p) {
+            threads.emplace_back([&submit, &done, n, producers]() {
+                for (size_t i = 0; i < n / producers; ++i)
+                    submit([&done]() { done.fetch_add(1, std::memory_order_release); });
+            });
+        }
+        for (auto& t : threads)
+            t.join();
+        spinUntil(done, n / producers * producers);
+        auto ns = nanosSince(start);
+        report.add({ name + ".throughput", "producers=" + std::to_string(producers), n,
+                     { { "tasks_per_s", n / (ns / 1e9) }, { "ns_per_task", (double)ns / n } } });
+    }
+}
+
+void
+benchPools(BenchReport& report)
+{
+    {
+        thread_pool pool;
+        benchPool(report, "thread_pool", [&pool](std::function<void()> task) {
+            pool.run(std::move(task));
+        });
+    }
+    {
+        ThreadPool pool;
+        benchPool(report, "ThreadPool", [&pool](std::function<void()> task) {
+            pool.run(std::move(task));
+        });
+    }
+    auto name = std::string("Executor.launch_latency");
+    if (report.wanted(name)) {
+        // workers are reused, so this is the cost of handing a job over
+        Executor executor(ThreadRole::Pool, 4, 0);
+        auto n = report.iterations(5000);
+        std::vector<double> samples;
+        for (size_t i = 0; i < n; ++i) {
+            int64_t started = 0;
+            auto start = Clock::now();
+            auto task = executor.launch([&started, start](Executor::TaskContext&) {
+                started = nanosSince(start);
+            });
+            task.wait();
+            samples.push_back((double)started);
+        }
+        BenchResult result { name, "workers=4", n, {} };
+        BenchReport::summarize(samples, result);
+        report.add(result);
+    }
+}
+
+void
+benchTimers(BenchReport& report)
+{
+    for (double periodMs : { 1.0, 10.0 }) {
+        auto name = std::string("timer.period");
+        if (!report.wanted(name))
+            break;
+        auto runs = (int)report.iterations(periodMs < 5 ? 1000 : 100);
+        std::vector<Clock::time_point> fired;
+        fired.reserve(runs + 1);
+        // blocks until every run is done
+        timer t([&fired]() { fired.push_back(Clock::now()); },
+                []() { return true; }, periodMs / 1000, runs);
+        std::vector<double> errors;
+        double sum = 0;
+        for (size_t i = 1; i < fired.size(); ++i) {
+            auto period = std::chrono::duration<double, std::micro>(fired[i] - fired[i - 1]).count();
+            sum += period;
+            errors.push_back(std::fabs(period - periodMs * 1000));
+        }
+        BenchResult result { name, "period_ms=" + std::to_string((int)periodMs), fired.size(), {} };
+        if (fired.size() > 1)
+            result.metrics.push_back({ "mean_period_us", sum / (fired.size() - 1) });
+        BenchReport::summarize(errors, result, "jitter_us");
+        report.add(result);
+    }
+
+    auto name = std::string("TimerWheel.schedule_cancel");
+    if (report.wanted(name)) {
+        auto n = report.iterations(1000000);
+        uint64_t now = 0;
+        TimerWheel wheel(now);
+        std::vector<TimerWheel::Handle> handles(1024);
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            auto& handle = handles[i & 1023];
+            wheel.cancel(handle);
+            handle = wheel.schedule(now + 1000 + (i * 7919) % 5000000, i);
+        }
+        auto ns = nanosSince(start);
+        report.add({ name, "live=1024", n, { { "ns_per_op", (double)ns / n } } });
+    }
+}
+
+// null sink for std::cout while logging is measured
+class NullBuffer : public std::streambuf {
+protected:
+    int
+    overflow(int c) override {
+        return c;
+    };
+
+    std::streamsize
+    xsputn(const char*, std::streamsize n) override {
+        return n;
+    };
+};
+
+void
+benchLog(BenchReport& report)
+{
+    auto name = std::string("consoleLog");
+    if (!report.wanted(name))
+        return;
+    NullBuffer null;
+    auto saved = std::cout.rdbuf(&null);
+    std::vector<BenchResult> results;
+    for (size_t threads : { 1, 4 }) {
+        auto n = report.iterations(200000);
+        auto start = Clock::now();
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t) {
+            workers.emplace_back([n, threads]() {
+                for (size_t i = 0; i < n / threads; ++i)
+                    consoleLog("bench - message %d of %d, value %f", (int)i, (int)n, i * 0.5);
+            });
+        }
+        for (auto& w : workers)
+            w.join();
+        auto ns = nanosSince(start);
+        results.push_back({ name, "threads=" + std::to_string(threads), n,
+                            { { "calls_per_s", n / (ns / 1e9) }, { "ns_per_call", (double)ns / n } } });
+    }
+    std::cout.rdbuf(saved);
+    for (auto& result : results)
+        report.add(result);
+}
+
+#ifndef _WIN32
+// a connected loopback tcp pair, the way a client talks to a local server
+bool
+loopbackPair(Socket& client, Socket& server)
+{
+    Socket listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (listener == INVALID_SOCKET ||
+        bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(listener, 1) != 0 ||
+        getsockname(listener, (sockaddr*)&addr, &len) != 0) {
+        _close(listener);
+        return false;
+    }
+    client = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(client, (sockaddr*)&addr, sizeof(addr)) != 0) {
+        _close(listener);
+        return false;
+    }
+    server = accept(listener, nullptr, nullptr);
+    _close(listener);
+    int on = 1;
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    return server != INVALID_SOCKET;
+}
+#endif
+
+void
+benchSocket(BenchReport& report)
+{
+#ifndef _WIN32
+    auto name = std::string("writeToSocket");
+    if (!report.wanted(name))
+        return;
+    for (size_t size : { 16, 64, 1024 }) {
+        Socket client, server;
+        if (!loopbackPair(client, server))
+            return;
+        // the reader just drains, so the writer is what is measured
+        std::thread reader([server]() {
+            char buf[65536];
+            while (recv(server, buf, sizeof(buf), 0) > 0);
+        });
+        auto n = report.iterations(size > 100 ? 50000 : 200000);
+        std::vector<char> data(size, 'x');
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; ++i)
+            writeToSocket(client, data.data(), size);
+        auto ns = nanosSince(start);
+        shutdown(client, SHUT_WR);
+        reader.join();
+        _close(client);
+        _close(server);
+        report.add({ name, "bytes=" + std::to_string(size), n,
+                     { { "ns_per_call", (double)ns / n }, { "mb_per_s", n * size / (ns / 1e3) } } });
+    }
+#endif
+}
+
+// ping-pong over loopback, both ends reading through the latency profile:
+// what a reply costs in round trip time and in CPU with and without spinning
+void
+benchWakeup(BenchReport& report)
+{
+#ifndef _WIN32
+    auto name = std::string("recv.wakeup");
+    if (!report.wanted(name))
+        return;
+    auto cpuNanos = []() {
+        timespec ts;
+        clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+        return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    };
+    LatencyProfile plain = defaultLatencyProfile();
+    LatencyProfile spinning = lowLatencyProfile();
+    for (auto profile : { &plain, &spinning }) {
+        Socket client, server;
+        if (!loopbackPair(client, server))
+            return;
+        applyLatencyProfile(client, *profile);
+        applyLatencyProfile(server, *profile);
+        std::thread echo([server, profile]() {
+            char buf[64];
+            int len;
+            while ((len = receiveFromSocket(server, buf, sizeof(buf), *profile)) > 0)
+                writeToSocket(server, buf, len);
+        });
+        auto n = report.iterations(20000);
+        std::vector<double> samples;
+        samples.reserve(n);
+        char buf[64] = { 'x' };
+        auto cpu = cpuNanos();
+        for (size_t i = 0; i < n; ++i) {
+            auto start = Clock::now();
+            writeToSocket(client, buf, 1);
+            if (receiveFromSocket(client, buf, sizeof(buf), *profile) <= 0)
+                break;
+            samples.push_back((double)nanosSince(start));
+        }
+        cpu = cpuNanos() - cpu;
+        shutdown(client, SHUT_WR);
+        echo.join();
+        _close(client);
+        _close(server);
+        BenchResult result { name, profile->enabled ? "spin=" + std::to_string(profile->spinUs) + "us"
+                                                    : "profile=off", samples.size(), {} };
+        result.metrics.push_back({ "cpu_ns_per_rtt", samples.empty() ? 0.0 : (double)cpu / samples.size() });
+        BenchReport::summarize(samples, result);
+        report.add(std::move(result));
+    }
+#endif
+}
+
+// one receive thread recording every chunk it reads, as the server does
+// with --journal
+void
+benchJournal(BenchReport& report)
+{
+#ifndef _WIN32
+    auto name = std::string("journal.record");
+    if (!report.wanted(name))
+        return;
+    char dir[] = "/tmp/bench-journal-XXXXXX";
+    if (!mkdtemp(dir))
+        return;
+    for (size_t size : { 64, 1024 }) {
+        if (journalOpen(dir) != 0)
+            break;
+        auto n = report.iterations(size > 100 ? 200000 : 1000000);
+        std::vector<char> data(size, 'x');
+        // the first record maps the writer's segment, keep it out of the run
+        journalRecord(JOURNAL_OPEN, 1);
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; ++i)
+            journalRecord(JOURNAL_DATA, 1, data.data(), size);
+        auto ns = nanosSince(start);
+        journalClose();
+        report.add({ name, "bytes=" + std::to_string(size), n,
+                     { { "ns_per_record", (double)ns / n }, { "mb_per_s", n * size / (ns / 1e3) } } });
+    }
+    if (auto d = opendir(dir)) {
+        while (auto entry = readdir(d)) {
+            if (entry->d_name[0] != '.')
+                unlink((std::string(dir) + "/" + entry->d_name).c_str());
+        }
+        closedir(d);
+    }
+    rmdir(dir);
+#endif
+}
+
+void
+benchFrames(BenchReport& report)
+{
+    const char payload[] = "0123456789abcdef0123456789abcdef";
+    const size_t len = sizeof(payload) - 1;
+
+    if (report.wanted("frame.encode")) {
+        auto n = report.iterations(2000000);
+        std::string out;
+        out.reserve(FRAME_MAX_LEN);
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            out.clear();
+            encodeFrames(out, Channel::Motion, 0, payload, len);
+        }
+        auto ns = nanosSince(start);
+        report.add({ "frame.encode", "bytes=32", n, { { "ns_per_msg", (double)ns / n } } });
+    }
+
+    if (report.wanted("frame.decode")) {
+        // many frames per buffer, as one recv() would hand them over
+        std::string stream;
+        for (int i = 0; i < 256; ++i)
+            encodeFrames(stream, (Channel)(1 + i % 3), 0, payload, len);
+        auto rounds = report.iterations(8000);
+        FrameReader reader;
+        size_t messages = 0;
+        auto onMessage = [&messages](Channel, uint8_t, const char*, int) { ++messages; };
+        auto onLegacy = [](const char*, int) { };
+        auto start = Clock::now();
+        for (size_t r = 0; r < rounds; ++r)
+            reader.feed(stream.data(), (int)stream.size(), onMessage, onLegacy);
+        auto ns = nanosSince(start);
+        report.add({ "frame.decode", "bytes=32", messages, { { "ns_per_msg", (double)ns / messages } } });
+    }
+
+    if (report.wanted("ChannelMux.push_next")) {
+        auto n = report.iterations(1000000);
+        ChannelMux mux;
+        char frame[FRAME_MAX_LEN];
+        auto start = Clock::now();
+        for (size_t i = 0; i < n; ++i) {
+            mux.push((Channel)(1 + i % 3), payload, len);
+            mux.next(frame);
+        }
+        auto ns = nanosSince(start);
+        report.add({ "ChannelMux.push_next", "bytes=32", n, { { "ns_per_msg", (double)ns / n } } });
+    }
+}
+
+void
+benchParsers(BenchReport& report)
+{
+    if (report.wanted("LegacyParser.parse")) {
+        std::string buf;
+        char msg[128];
+        for (int i = 0; i < 64; ++i) {
+            auto n = snprintf(msg, sizeof(msg), "'{'j0':{'lx':'%d','ly':'%d','b0':'%d','b1':'0'}}'\n",
+                              i * 311 - 9000, 12000 - i * 97, i & 1);
+            buf.append(msg, n);
+        }
+        auto best = detectScanLevel();
+        for (auto level : { ScanLevel::Scalar, ScanLevel::SSE42, ScanLevel::AVX2 }) {
+            if (level > best)
+                break;
+            LegacyParser parser(level);
+            auto rounds = report.iterations(20000);
+            size_t messages = 0;
+            auto start = Clock::now();
+            for (size_t r = 0; r < rounds; ++r)
+                messages += parser.parse(buf.data(), buf.size(), [](const LegacyMessage&) { });
+            auto ns = nanosSince(start);
+            const char* names[] = { "scalar", "sse42", "avx2" };
+            report.add({ "LegacyParser.parse", std::string("scan=") + names[(int)level], messages,
+                         { { "ns_per_msg", (double)ns / messages } } });
+        }
+    }
+
+    if (report.wanted("StateCodec")) {
+        // 8 samples of a sweeping stick per message, the decoder's acks fed
+        // back so most messages are deltas
+        auto n = report.iterations(200000);
+        StateEncoder encoder;
+        StateDecoder decoder;
+        PadSample batch[8];
+        char out[STATE_MAX_BYTES];
+        char reply[STATE_CONTROL_MAX_BYTES];
+        uint64_t time = 0;
+        int64_t encodeNs = 0, decodeNs = 0;
+        size_t bytes = 0;
+        for (size_t i = 0; i < n; ++i) {
+            for (auto& s : batch) {
+                time += 1000;
+                s = { time, (int16_t)(20000 * sin(time / 2e5)), (int16_t)(20000 * cos(time / 2e5)),
+                      (uint16_t)((time / 250000) & 1) };
+            }
+            PadSamples pad = { 0, batch, 8 };
+            auto start = Clock::now();
+            auto len = encoder.encode(&pad, 1, out);
+            encodeNs += nanosSince(start);
+            bytes += len;
+            start = Clock::now();
+            decoder.decode(out, (int)len, [](uint8_t, const PadSample*, size_t) { });
+            decodeNs += nanosSince(start);
+            if (auto replyLen = decoder.reply(reply))
+                encoder.onControl(reply, (int)replyLen);
+        }
+        report.add({ "StateCodec.encode", "samples=8", n,
+                     { { "ns_per_msg", (double)encodeNs / n }, { "bytes_per_msg", (double)bytes / n } } });
+        report.add({ "StateCodec.decode", "samples=8", n, { { "ns_per_msg", (double)decodeNs / n } } });
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    std::string out = "bench.json";
+    std::string filter;
+    bool quick = false;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            out = argv[++i];
+        else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc)
+            filter = argv[++i];
+        else if (strcmp(argv[i], "--quick") == 0)
+            quick = true;
+        else {
+            printf("usage: bench [--out FILE] [--filter SUBSTRING] [--quick]\n");
+            return 1;
+        }
+    }
+
+    BenchReport report(filter, quick);
+    benchFrames(report);
+    benchParsers(report);
+    benchLog(report);
+    benchSocket(report);
+    benchWakeup(report);
+    benchJournal(report);
+    benchTimers(report);
+    benchPools(report);
+
+    if (report.write(out) != 0) {
+        printf("can't write %s\n", out.c_str());
+        return 1;
+    }
+    printf("results written to %s\n", out.c_str());
+    return 0;
+}
@@ -1,183 +1,420 @@
-/*
-*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
-*
-*  This program is free software; you can redistribute it and/or modify
-*  it under the terms of the GNU General Public License as published by
-*  the Free Software Foundation; either version 3 of the License, or
-*  (at your option) any later version.
-*
-*  This program is distributed in the hope that it will be useful,
-*  but WITHOUT ANY WARRANTY; without even the implied warranty of
-*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-*  GNU General Public License for more details.
-*
-*  You should have received a copy of the GNU General Public License
-*  along with this program. If not, see <https://www.gnu.org/licenses/>.
-*/
-
-#include "Log.hpp"
-#include "Networker.hpp"
-#include "Timer.hpp"
-
-#include "SDL.h"
-
-#include <cstdlib>
-#ifndef _WIN32
-#include <sys/io.h>
-#else
-#include <io.h>
-#endif
-#include <fcntl.h>
-#include <ios>
-
-#ifndef _WIN32
-#define sprintf_ sprintf
-#else
-#define sprintf_ sprintf_s
-#endif
-
-SDL_GameController *controller = NULL;
-const int JOYSTICK_DEAD_ZONE = 4000;
-SDL_Event e;
-int16_t lx, ly, ba, bb;
-
-int
-initializeSDL()
-{
-    if (SDL_Init(SDL_INIT_JOYSTICK | SDL_INIT_GAMECONTROLLER) < 0) {
-        DBGOUT("SDL could not initialize! SDL Error: %s", SDL_GetError());
-        return 1;
-    }
-    return 0;
-}
-
-int
-getController()
-{
-    SDL_GameController *ctrl = NULL;
-
-    auto njoysticks = SDL_NumJoysticks();
-    DBGOUT("getControllers: %d found", njoysticks);
-    for (int i = 0; i < njoysticks; ++i) {
-        if (SDL_IsGameController(i)) {
-            controller = SDL_GameControllerOpen(i);
-            if (controller) {
-                DBGOUT("Opened gamecontroller %i", i);
-                return 0;
-            }
-            else {
-                DBGOUT("Could not open gamecontroller %i: %s", i, SDL_GetError());
-                return 1;
-            }
-        }
-    }
-    return 1;
-}
-
-void
-getJoyState()
-{
-    //pollJoystick();
-    SDL_PollEvent(&e);
-
-    lx = SDL_GameControllerGetAxis(controller,
-        SDL_GameControllerAxis::SDL_CONTROLLER_AXIS_LEFTX);
-    ly = SDL_GameControllerGetAxis(controller,
-        SDL_GameControllerAxis::SDL_CONTROLLER_AXIS_LEFTY);
-    ba = SDL_GameControllerGetButton(controller,
-        SDL_GameControllerButton::SDL_CONTROLLER_BUTTON_A);
-    bb = SDL_GameControllerGetButton(controller,
-        SDL_GameControllerButton::SDL_CONTROLLER_BUTTON_B);
-
-    if (std::abs(lx) < JOYSTICK_DEAD_ZONE) lx = 0;
-    if (std::abs(ly) < JOYSTICK_DEAD_ZONE) ly = 0;
-
-    DBGOUT("lx: %d", lx);
-    DBGOUT("ly: %d", ly);
-    DBGOUT("ba: %d", ba);
-    DBGOUT("bb: %d", bb);
-}
-
-void
-recvCb(Socket& ClientSocket, const char* recvbuf, int recvResult)
-{
-    DBGOUT("rxcb - bytes received: %d", recvResult);
-    DBGOUT("rxcb - bytes : %s", recvbuf);
-}
-
-int
-sendHandler(Socket Socket, std::atomic<bool>& running)
-{
-    DBGOUT("txh - sendHandler - start...");
-
-    int sendResult = 1;
-
-    char sendbuf[DEFAULT_BUFLEN];
-
-    timer writer([Socket, &running, &sendResult, &sendbuf]() {
-        getJoyState();
-        sprintf_(sendbuf,
-            "'{'j0':{'lx':'%d','ly':'%d','b0':'%d','b1':'%d'}}'",
-            lx, ly, ba, bb);
-        std::string data(sendbuf);
-        if(!data.empty())
-            sendResult = writeToSocket(Socket, data);
-        if (sendResult == SOCKET_ERROR) {
-            DBGOUT("txh - send failed with error: %d", _socketError());
-            running = false;
-        }
-        else if (sendResult == 0) {
-            DBGOUT("txh - connection closed by server...");
-        }
-        else {
-            //DBGOUT("txh - bytes sent: %d", sendResult);
-        }
-    }, [&sendResult, &running]() {
-        return (sendResult > 0 && running.load());
-    }, 0.05, -1);
-
-    DBGOUT("txh - sendHandler - done");
-    return 1;
-}
-
-#define MAXTRIES 5
-#define TRY_OR_DIE(x)   if (res = x != 0) {             \
-                            if (tries < MAXTRIES - 1) { \
-                                ++tries;                \
-                                continue;               \
-                            }                           \
-                            return res;                 \
-                        }
-
-int
-run()
-{
-    int res;
-    Networker nw;
-    int tries;
-
-    do {
-        tries = 0;
-        nw.startClient("192.168.2.98", DEFAULT_PORT);
-        //TRY_OR_DIE(nw.startClient("localhost", DEFAULT_PORT));
-        TRY_OR_DIE(nw.startStreaming(&recvCb, &sendHandler));
-    } while (true);
-
-    return 0;
-}
-
-#undef main
-int
-main(int argc, char **argv)
-{
-    initializeSDL();
-    getController();
-
-    int ret = run();
-
-    system("pause");
-
-    SDL_Quit();
-
-    return ret;
-}
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "AllocTrack.hpp"
+#include "PerfCounters.hpp"
+#include "Log.hpp"
+#include "Networker.hpp"
+#include "Timer.hpp"
+#include "RateController.hpp"
+#include "SampleBatch.hpp"
+#include "StateCodec.hpp"
+#include "Feedback.hpp"
+
+#include "SDL.h"
+
+#include <cstdlib>
+#ifndef _WIN32
+#include <sys/io.h>
+#else
+#include <io.h>
+#endif
+#include <fcntl.h>
+#include <ios>
+#include <memory>
+
+#ifndef _WIN32
+#define sprintf_ sprintf
+#else
+#define sprintf_ sprintf_s
+#endif
+
+SDL_GameController *controller = NULL;
+const int JOYSTICK_DEAD_ZONE = 4000;
+SDL_Event e;
+int16_t lx, ly, ba, bb;
+
+int
+initializeSDL()
+{
+    if (SDL_Init(SDL_INIT_JOYSTICK | SDL_INIT_GAMECONTROLLER) < 0) {
+        DBGOUT("SDL could not initialize! SDL Error: %s", SDL_GetError());
+        return 1;
+    }
+    return 0;
+}
+
+int
+getController()
+{
+    SDL_GameController *ctrl = NULL;
+
+    auto njoysticks = SDL_NumJoysticks();
+    DBGOUT("getControllers: %d found", njoysticks);
+    for (int i = 0; i < njoysticks; ++i) {
+        if (SDL_IsGameController(i)) {
+            controller = SDL_GameControllerOpen(i);
+            if (controller) {
+                DBGOUT("Opened gamecontroller %i", i);
+                return 0;
+            }
+            else {
+                DBGOUT("Could not open gamecontroller %i: %s", i, SDL_GetError());
+                return 1;
+            }
+        }
+    }
+    return 1;
+}
+
+void
+getJoyState()
+{
+    //pollJoystick();
+    SDL_PollEvent(&e);
+
+    lx = SDL_GameControllerGetAxis(controller,
+        SDL_GameControllerAxis::SDL_CONTROLLER_AXIS_LEFTX);
+    ly = SDL_GameControllerGetAxis(controller,
+        SDL_GameControllerAxis::SDL_CONTROLLER_AXIS_LEFTY);
+    ba = SDL_GameControllerGetButton(controller,
+        SDL_GameControllerButton::SDL_CONTROLLER_BUTTON_A);
+    bb = SDL_GameControllerGetButton(controller,
+        SDL_GameControllerButton::SDL_CONTROLLER_BUTTON_B);
+
+    if (std::abs(lx) < JOYSTICK_DEAD_ZONE) lx = 0;
+    if (std::abs(ly) < JOYSTICK_DEAD_ZONE) ly = 0;
+}
+
+// drives the pad's motors and light, on the capture thread that owns it
+class SdlFeedbackDevice : public FeedbackDevice {
+public:
+    SdlFeedbackDevice(SDL_GameController* pad)
+        : pad_(pad) { };
+
+    const char*
+    name() const override {
+        return "sdl";
+    };
+
+    void
+    rumble(uint8_t, uint16_t low, uint16_t high, uint16_t durationMs) override {
+#if SDL_VERSION_ATLEAST(2, 0, 9)
+        if (SDL_GameControllerRumble(pad_, low, high, durationMs) != 0)
+            DBGOUT("feedback - rumble failed: %s", SDL_GetError());
+#endif
+    };
+
+    void
+    led(uint8_t, uint8_t r, uint8_t g, uint8_t b) override {
+#if SDL_VERSION_ATLEAST(2, 0, 14)
+        if (SDL_GameControllerHasLED(pad_) && SDL_GameControllerSetLED(pad_, r, g, b) != 0)
+            DBGOUT("feedback - led failed: %s", SDL_GetError());
+#endif
+    };
+
+private:
+    SDL_GameController* pad_;
+
+};
+
+// set once in main, before the capture thread is started
+std::unique_ptr<FeedbackDevice> feedbackDevice;
+
+std::unique_ptr<FeedbackDevice>
+createFeedbackDevice()
+{
+    if (controller)
+        return std::unique_ptr<FeedbackDevice>(new SdlFeedbackDevice(controller));
+    DBGOUT("feedback - no pad, using a mock");
+    return std::unique_ptr<FeedbackDevice>(new MockFeedbackDevice());
+}
+
+StateEncoder encoder;
+// filled by the receive thread, drained by the capture thread, so neither
+// ever waits on the other or on the send loop
+FeedbackRing feedback;
+
+void
+recvCb(Socket& ClientSocket, const char* recvbuf, int recvResult)
+{
+    if (encoder.onControl(recvbuf, recvResult))
+        return;
+    Feedback fb;
+    if (decodeFeedback(recvbuf, recvResult, fb)) {
+        if (!feedback.push(fb))
+            DBGOUT("rxcb - feedback queue full, dropping");
+        return;
+    }
+    DBGOUT("rxcb - bytes received: %d", recvResult);
+    DBGOUT("rxcb - bytes : %s", recvbuf);
+}
+
+#define PING_INTERVAL_MS 1000
+#define SAMPLE_INTERVAL_US 1000
+
+SampleRing samples;
+auto captureStart = std::chrono::steady_clock::now();
+
+uint64_t
+captureTime()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - captureStart).count();
+}
+
+// applies what the server sent since the last tick; acks close the loop on
+// a press, from its capture to the server injecting it
+void
+applyFeedback()
+{
+    auto captureBase = std::chrono::duration_cast<std::chrono::microseconds>(
+        captureStart.time_since_epoch()).count();
+    Feedback pending[8];
+    size_t count;
+    while ((count = feedback.pop(pending, 8))) {
+        for (size_t i = 0; i < count; ++i) {
+            auto& fb = pending[i];
+            if (fb.kind != FEEDBACK_ACK) {
+                feedbackDevice->apply(fb);
+                continue;
+            }
+            DBGOUT("fb - press acked %lld us after capture",
+                   (long long)(captureTime() - fb.time));
+            traceSpan("press-ack", fb.time, captureBase + (int64_t)fb.time, traceNow());
+        }
+    }
+}
+
+// samples the pad at a fixed 1 kHz, independently of the send rate; only
+// samples that differ from the previous one go into the ring
+void
+captureHandler(std::atomic<bool>& capturing)
+{
+    DBGOUT("cap - captureHandler - start...");
+    applyThreadRole(ThreadRole::Capture);
+    ALLOC_THREAD_NAME("capture");
+    PadSample last = {};
+    bool first = true;
+    auto interval = std::chrono::microseconds(SAMPLE_INTERVAL_US);
+    auto next = std::chrono::steady_clock::now();
+    while (capturing.load()) {
+        ALLOC_SCOPE("capture");
+        applyFeedback();
+        auto polled = traceEnabled() ? traceNow() : 0;
+        getJoyState();
+        PadSample sample = { captureTime(), lx, ly,
+                             (uint16_t)((ba ? 1 : 0) | (bb ? 2 : 0)) };
+        if (first || sample.lx != last.lx || sample.ly != last.ly ||
+            sample.buttons != last.buttons) {
+            traceSpan("poll", sample.time, polled, traceNow());
+            DBGOUT("cap - lx: %d ly: %d buttons: %d", lx, ly, sample.buttons);
+            if (!samples.push(sample))
+                DBGOUT("cap - sample ring full, dropping sample");
+            last = sample;
+            first = false;
+        }
+        next += interval;
+        auto now = std::chrono::steady_clock::now();
+        // don't try to catch up after a stall, just resume the cadence
+        if (now - next > 10 * interval)
+            next = now;
+        std::this_thread::sleep_until(next);
+    }
+    DBGOUT("cap - captureHandler - done");
+}
+
+// the pre-framing joystick message, for hosts that only parse text
+size_t
+encodeText(const PadSample& sample, char* out)
+{
+    return (size_t)snprintf(out, STATE_MAX_BYTES,
+                            "'{'j0':{'lx':'%d','ly':'%d','b0':'%d','b1':'%d'}}'",
+                            sample.lx, sample.ly, sample.buttons & 1, (sample.buttons >> 1) & 1);
+}
+
+int
+sendHandler(Networker& nw, std::atomic<bool>& running)
+{
+    DBGOUT("txh - sendHandler - start...");
+    ALLOC_THREAD_NAME("send");
+
+    int sendResult = 1;
+
+    char sendbuf[STATE_MAX_BYTES];
+    PadSample batch[SAMPLE_BATCH_MAX];
+    PadSample last = {};
+
+    RateController rate;
+    encoder.reset();
+    // text carries one sample per message
+    auto capsSeen = nw.getHostCapabilitiesChanges();
+    auto caps = nw.getHostCapabilities();
+    bool text = caps.encodings != ENCODING_STATE;
+    size_t batchMax = text ? 1 : std::min<size_t>(caps.batchMax, SAMPLE_BATCH_MAX);
+    auto encode = [&text, &sendbuf](const PadSample* samples, size_t count) {
+        PERF_SECTION("encode");
+        if (text)
+            return encodeText(samples[count - 1], sendbuf);
+        PadSamples pad = { 0, samples, count };
+        return encoder.encode(&pad, 1, sendbuf);
+    };
+    // sample times are relative to captureStart, trace times aren't
+    auto captureBase = std::chrono::duration_cast<std::chrono::microseconds>(
+        captureStart.time_since_epoch()).count();
+    auto lastPing = std::chrono::steady_clock::now();
+
+    std::atomic<bool> capturing(true);
+    auto capture_thread = std::thread(captureHandler, std::ref(capturing));
+
+    while (sendResult > 0 && running.load()) {
+        // a host that accepted after the fallback gets what it agreed to
+        // from here on, starting with a keyframe
+        if (nw.getHostCapabilitiesChanges() != capsSeen) {
+            capsSeen = nw.getHostCapabilitiesChanges();
+            caps = nw.getHostCapabilities();
+            text = caps.encodings != ENCODING_STATE;
+            batchMax = text ? 1 : std::min<size_t>(caps.batchMax, SAMPLE_BATCH_MAX);
+            encoder.reset();
+        }
+        ALLOC_STEADY_SCOPE("sample-encode-send");
+        bool changed = false;
+        size_t count;
+        while (sendResult > 0 && (count = samples.pop(batch, batchMax))) {
+            changed = true;
+            // button edges jump ahead of plain stick motion
+            auto channel = Channel::Motion;
+            for (size_t i = 0; i < count; ++i) {
+                if (batch[i].buttons != (i ? batch[i - 1].buttons : last.buttons))
+                    channel = Channel::Button;
+            }
+            last = batch[count - 1];
+            auto encoding = traceEnabled() ? traceNow() : 0;
+            auto len = encode(batch, count);
+            auto sending = traceEnabled() ? traceNow() : 0;
+            sendResult = nw.sendToHost(channel, sendbuf, len);
+            rate.sent();
+            if (traceEnabled()) {
+                auto sent = traceNow();
+                for (size_t i = 0; i < count; ++i)
+                    traceSpan("queue", batch[i].time, captureBase + (int64_t)batch[i].time, encoding);
+                traceSamples("encode", batch, count, encoding, sending);
+                traceSamples("send", batch, count, sending, sent);
+                traceSamplesFlow("wire", batch, count, sent, true);
+            }
+        }
+        // keepalives also answer keyframe requests while the pad is idle
+        if (!changed && (rate.keepaliveDue() || (!text && encoder.keyframePending()))) {
+            last.time = captureTime();
+            auto len = encode(&last, 1);
+            sendResult = nw.sendToHost(Channel::Motion, sendbuf, len);
+            rate.sent();
+        }
+        if (sendResult == SOCKET_ERROR) {
+            DBGOUT("txh - send failed with error: %d", _socketError());
+            running = false;
+            break;
+        }
+        else if (sendResult == 0) {
+            DBGOUT("txh - connection closed by server...");
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if ((caps.features & FEATURE_PING) &&
+            now - lastPing > std::chrono::milliseconds(PING_INTERVAL_MS)) {
+            nw.pingHost();
+            lastPing = now;
+        }
+
+        std::this_thread::sleep_for(
+            rate.next(changed, nw.getHostRtt(), nw.getQueuedBytes()));
+    }
+
+    capturing = false;
+    capture_thread.join();
+
+    DBGOUT("txh - sendHandler - done");
+    return 1;
+}
+
+#define MAXTRIES 5
+#define TRY_OR_DIE(x)   if (res = x != 0) {             \
+                            if (tries < MAXTRIES - 1) { \
+                                ++tries;                \
+                                continue;               \
+                            }                           \
+                            return res;                 \
+                        }
+
+int
+run(Transport transport, const LatencyProfile& latency)
+{
+    int res;
+    Networker nw;
+    int tries;
+
+    nw.setTransport(transport);
+    nw.setLatencyProfile(latency);
+
+    auto writer = [&nw](Socket, std::atomic<bool>& running) {
+        sendHandler(nw, running);
+    };
+
+    do {
+        tries = 0;
+        nw.startClient("192.168.2.98", DEFAULT_PORT);
+        //TRY_OR_DIE(nw.startClient("localhost", DEFAULT_PORT));
+        TRY_OR_DIE(nw.startStreaming(&recvCb, writer));
+    } while (true);
+
+    return 0;
+}
+
+#undef main
+int
+main(int argc, char **argv)
+{
+    initializeSDL();
+    getController();
+    feedbackDevice = createFeedbackDevice();
+
+    // --shm talks to an injector on this machine through shared memory,
+    // --low-latency spins on the server's replies instead of blocking, for
+    // --spin US microseconds if given; see LatencyProfile.hpp
+    auto transport = Transport::Tcp;
+    auto latency = defaultLatencyProfile();
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--shm") == 0)
+            transport = Transport::SharedMemory;
+        if (strcmp(argv[i], "--low-latency") == 0)
+            latency = lowLatencyProfile();
+        if (strcmp(argv[i], "--spin") == 0 && i + 1 < argc)
+            latency = lowLatencyProfile((uint32_t)atoi(argv[++i]));
+    }
+
+    int ret = run(transport, latency);
+    ALLOC_REPORT();
+    PERF_REPORT();
+    latencyReport();
+    traceDump();
+
+    system("pause");
+
+    SDL_Quit();
+
+    return ret;
+}
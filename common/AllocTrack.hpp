@@ -0,0 +1,251 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+// Opt-in allocation tracking. Build with TRACK_ALLOCATIONS defined to
+// replace the global operator new/delete with counting versions; without it
+// every macro below compiles to nothing.
+//
+//   ALLOC_SCOPE("name")         counts what the enclosing block allocates
+//   ALLOC_STEADY_SCOPE("name")  same, and the block must stop allocating
+//                               once it has run ALLOC_WARMUP_ENTRIES times
+//   ALLOC_THREAD_NAME("name")   labels the calling thread in the report
+//   ALLOC_REPORT()              prints per thread and per scope totals
+//
+// An allocation only counts against the innermost scope, so a plain scope
+// nested in a steady one marks an expected allocation, e.g. setting up
+// state for a new connection. Setting TCPJOY_ALLOC_STRICT=1 in the
+// environment aborts the process on the first steady state allocation.
+
+#ifdef TRACK_ALLOCATIONS
+
+#include <atomic>
+#include <algorithm>
+#include <new>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ALLOC_MAX_TAGS          64
+#define ALLOC_MAX_THREADS       256
+#define ALLOC_WARMUP_ENTRIES    256
+
+struct AllocTag {
+    AllocTag(const char* name, bool steady);
+
+    const char* name;
+    bool steady;
+    std::atomic<uint64_t> entries;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> violations;
+};
+
+struct AllocThread {
+    char name[16];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> bytes;
+};
+
+struct AllocScope;
+
+// plain arrays and atomics only: nothing here may allocate
+static AllocTag* allocTags[ALLOC_MAX_TAGS];
+static std::atomic<int> allocTagCount(0);
+static AllocThread allocThreads[ALLOC_MAX_THREADS];
+static std::atomic<int> allocThreadCount(0);
+static thread_local AllocThread* allocSelf = nullptr;
+static thread_local AllocScope* allocInnermost = nullptr;
+static thread_local bool allocInHook = false;
+
+AllocTag::AllocTag(const char* name, bool steady)
+    : name(name)
+    , steady(steady)
+    , entries(0)
+    , count(0)
+    , bytes(0)
+    , violations(0)
+{
+    int index = allocTagCount.fetch_add(1);
+    if (index < ALLOC_MAX_TAGS)
+        allocTags[index] = this;
+}
+
+struct AllocScope {
+    AllocScope(AllocTag& tag)
+        : tag(tag)
+        , parent(allocInnermost) {
+        tag.entries.fetch_add(1, std::memory_order_relaxed);
+        allocInnermost = this;
+    };
+
+    ~AllocScope() {
+        allocInnermost = parent;
+    };
+
+    AllocTag& tag;
+    AllocScope* parent;
+};
+
+bool
+allocStrict()
+{
+    static int strict = -1;
+    if (strict < 0) {
+        auto env = getenv("TCPJOY_ALLOC_STRICT");
+        strict = env && env[0] == '1';
+    }
+    return strict == 1;
+}
+
+AllocThread*
+allocThread()
+{
+    if (!allocSelf) {
+        int index = allocThreadCount.fetch_add(1);
+        allocSelf = &allocThreads[index < ALLOC_MAX_THREADS ? index : ALLOC_MAX_THREADS - 1];
+    }
+    return allocSelf;
+}
+
+void
+allocSetThreadName(const char* name)
+{
+    auto self = allocThread();
+    strncpy(self->name, name, sizeof(self->name) - 1);
+}
+
+void
+allocRecord(size_t size)
+{
+    if (allocInHook)
+        return;
+    allocInHook = true;
+    auto self = allocThread();
+    self->count.fetch_add(1, std::memory_order_relaxed);
+    self->bytes.fetch_add(size, std::memory_order_relaxed);
+    if (auto scope = allocInnermost) {
+        auto& tag = scope->tag;
+        tag.count.fetch_add(1, std::memory_order_relaxed);
+        tag.bytes.fetch_add(size, std::memory_order_relaxed);
+        if (tag.steady && tag.entries.load(std::memory_order_relaxed) > ALLOC_WARMUP_ENTRIES) {
+            tag.violations.fetch_add(1, std::memory_order_relaxed);
+            if (allocStrict()) {
+                fprintf(stderr, "alloc - %zu bytes allocated in steady scope '%s'\n",
+                        size, tag.name);
+                abort();
+            }
+        }
+    }
+    allocInHook = false;
+}
+
+void
+allocReport()
+{
+    fprintf(stderr, "alloc - per thread:\n");
+    int threads = std::min(allocThreadCount.load(), ALLOC_MAX_THREADS);
+    for (int i = 0; i < threads; ++i) {
+        auto& t = allocThreads[i];
+        fprintf(stderr, "  %-16s %10llu allocs %12llu bytes\n",
+                t.name[0] ? t.name : "?",
+                (unsigned long long)t.count.load(), (unsigned long long)t.bytes.load());
+    }
+    fprintf(stderr, "alloc - per scope:\n");
+    int tags = std::min(allocTagCount.load(), ALLOC_MAX_TAGS);
+    for (int i = 0; i < tags; ++i) {
+        auto& tag = *allocTags[i];
+        fprintf(stderr, "  %-24s %s %10llu entries %10llu allocs %12llu bytes %8llu in steady state\n",
+                tag.name, tag.steady ? "steady" : "      ",
+                (unsigned long long)tag.entries.load(), (unsigned long long)tag.count.load(),
+                (unsigned long long)tag.bytes.load(), (unsigned long long)tag.violations.load());
+    }
+}
+
+void*
+operator new(size_t size)
+{
+    allocRecord(size);
+    if (auto p = malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void*
+operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void*
+operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    allocRecord(size);
+    return malloc(size ? size : 1);
+}
+
+void*
+operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void
+operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete[](void* p) noexcept
+{
+    free(p);
+}
+
+void
+operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void
+operator delete[](void* p, size_t) noexcept
+{
+    free(p);
+}
+
+#define ALLOC_CONCAT_(a, b) a ## b
+#define ALLOC_CONCAT(a, b) ALLOC_CONCAT_(a, b)
+#define ALLOC_SCOPE_(name, steady)                                              \
+    static AllocTag ALLOC_CONCAT(allocTag_, __LINE__)(name, steady);            \
+    AllocScope ALLOC_CONCAT(allocScope_, __LINE__)(ALLOC_CONCAT(allocTag_, __LINE__))
+#define ALLOC_SCOPE(name) ALLOC_SCOPE_(name, false)
+#define ALLOC_STEADY_SCOPE(name) ALLOC_SCOPE_(name, true)
+#define ALLOC_THREAD_NAME(name) allocSetThreadName(name)
+#define ALLOC_REPORT() allocReport()
+
+#else
+
+#define ALLOC_SCOPE(name)
+#define ALLOC_STEADY_SCOPE(name)
+#define ALLOC_THREAD_NAME(name)
+#define ALLOC_REPORT()
+
+#endif
@@ -19,7 +19,10 @@
 
 #include <functional>
 #include <string>
-#include <future>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #ifndef _WIN32
 #include <stdio.h>
@@ -31,7 +34,11 @@
 #include <netdb.h>
 #include <sys/types.h>
 #include <netinet/in.h>
+#include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/tcp.h>
+#include <errno.h>
 
 #else
 #undef UNICODE
@@ -48,6 +55,11 @@
 #endif
 
 #include "Log.hpp"
+#include "Frame.hpp"
+#include "Handshake.hpp"
+#include "LatencyProfile.hpp"
+#include "ShmRing.hpp"
+#include "Threadpool.hpp"
 
 #ifndef _WIN32
 using Socket = int;
@@ -61,6 +73,13 @@ using Host = std::string;
 
 using PortNumber = uint16_t;
 
+// a peer hanging up mid-write should surface as an error, not SIGPIPE
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS MSG_NOSIGNAL
+#else
+#define SEND_FLAGS 0
+#endif
+
 #define DEFAULT_BUFLEN 8192
 #define DEFAULT_PORT 8888
 
@@ -69,6 +88,11 @@ namespace Network
 
 using SocketHandler = std::function<void(Socket, std::atomic<bool>&)>;
 using SocketCallback = std::function<void(Socket&, const char*, int)>;
+// what a server agreed on with one of its clients
+using HandshakeCallback = std::function<void(Socket, const Capabilities&)>;
+// a connection is gone; runs before its socket is closed, so the
+// descriptor can't have been reused yet
+using DisconnectCallback = std::function<void(Socket)>;
 
 void
 _close(Socket socket)
@@ -80,6 +104,17 @@ _close(Socket socket)
 #endif
 }
 
+// wakes up anything blocked on the socket without releasing the descriptor
+void
+_shutdown(Socket socket)
+{
+#ifndef _WIN32
+    shutdown(socket, SHUT_RDWR);
+#else
+    shutdown(socket, SD_BOTH);
+#endif
+}
+
 int
 _socketError()
 {
@@ -90,24 +125,156 @@ _socketError()
 #endif
 }
 
+int
+writeToSocket(Socket socket, const char* data, size_t len) {
+    size_t sent = 0;
+    while (sent < len) {
+        auto res = send(socket, data + sent, (int)(len - sent), SEND_FLAGS);
+        if (res == SOCKET_ERROR) {
+            DBGOUT("send failed with error: %d", _socketError());
+            return res;
+        }
+        sent += res;
+    }
+    return (int)sent;
+};
+
 int
 writeToSocket(Socket socket, const std::string& data) {
-    const char *sendbuf = data.c_str();
-    auto res = send(socket, sendbuf, (int)strlen(sendbuf), 0);
-    if (res == SOCKET_ERROR) {
-        DBGOUT("send failed with error: %d", _socketError());
+    return writeToSocket(socket, data.c_str(), strlen(data.c_str()));
+};
+
+// applies what it can of profile to socket; an option the platform or our
+// privileges don't allow is logged and skipped
+int
+applyLatencyProfile(Socket socket, const LatencyProfile& profile)
+{
+    if (!profile.enabled)
+        return 0;
+    int failed = 0;
+    auto set = [socket, &failed](int level, int name, int value, const char* what) {
+        if (setsockopt(socket, level, name, (const char*)&value, sizeof(value)) != 0) {
+            DBGOUT("latency - can't set %s (error %d)", what, _socketError());
+            ++failed;
+        }
+    };
+    if (profile.noDelay)
+        set(IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+    if (profile.rcvBuf)
+        set(SOL_SOCKET, SO_RCVBUF, profile.rcvBuf, "SO_RCVBUF");
+    if (profile.sndBuf)
+        set(SOL_SOCKET, SO_SNDBUF, profile.sndBuf, "SO_SNDBUF");
+#ifdef SO_BUSY_POLL
+    if (profile.busyPollUs)
+        set(SOL_SOCKET, SO_BUSY_POLL, (int)profile.busyPollUs, "SO_BUSY_POLL");
+#endif
+#ifdef TCP_QUICKACK
+    if (profile.quickAck)
+        set(IPPROTO_TCP, TCP_QUICKACK, 1, "TCP_QUICKACK");
+#endif
+#ifdef SO_TIMESTAMPNS
+    if (profile.timestamps)
+        set(SOL_SOCKET, SO_TIMESTAMPNS, 1, "SO_TIMESTAMPNS");
+#endif
+    return failed ? 1 : 0;
+}
+
+#ifndef _WIN32
+// one recvmsg, stampNs set to the kernel's receive timestamp if the socket
+// hands them out, 0 otherwise
+int
+_recvStamped(Socket socket, char* buf, int len, int flags, int64_t& stampNs)
+{
+    iovec iov { buf, (size_t)len };
+    char control[CMSG_SPACE(sizeof(timespec))];
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    auto res = (int)recvmsg(socket, &msg, flags);
+    stampNs = 0;
+#ifdef SCM_TIMESTAMPNS
+    if (res > 0) {
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                timespec ts;
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                stampNs = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+            }
+        }
+    }
+#endif
+    return res;
+}
+#endif
+
+// reads from socket the way profile says: polls for up to its spin budget,
+// then blocks. Without a profile, or on Windows, a plain blocking recv.
+int
+receiveFromSocket(Socket socket, char* buf, int len, const LatencyProfile& profile)
+{
+#ifndef _WIN32
+    if (!profile.enabled)
+        return (int)recv(socket, buf, len, 0);
+    // spinning on a single core only delays the peer we are waiting for
+    static const bool canSpin = std::thread::hardware_concurrency() > 1;
+    int64_t stamp = 0;
+    uint64_t spun = 0;
+    auto kind = LatencyRead::Ready;
+    auto res = _recvStamped(socket, buf, len, MSG_DONTWAIT, stamp);
+    if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        kind = LatencyRead::Caught;
+        auto start = std::chrono::steady_clock::now();
+        auto budget = std::chrono::microseconds(canSpin ? profile.spinUs : 0);
+        while (true) {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            if (elapsed >= budget) {
+                spun = std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+                kind = LatencyRead::Parked;
+                res = _recvStamped(socket, buf, len, 0, stamp);
+                break;
+            }
+            _cpuRelax();
+            res = _recvStamped(socket, buf, len, MSG_DONTWAIT, stamp);
+            if (res >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+                spun = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - start).count();
+                break;
+            }
+        }
+    }
+    if (res <= 0)
         return res;
+#ifdef TCP_QUICKACK
+    if (profile.quickAck) {
+        int on = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_QUICKACK, &on, sizeof(on));
     }
+#endif
+    latencyRecord(kind, spun, stamp);
     return res;
-};
+#else
+    (void)profile;
+    return (int)recv(socket, buf, len, 0);
+#endif
+}
 
 class Client {
 public:
     Client()
-        : connectSocket_(INVALID_SOCKET)
+        : portNumber_(DEFAULT_PORT)
+        , connectSocket_(INVALID_SOCKET)
         , connected_(false)
         , receiving_(false)
-        , transmitting_(false) { };
+        , transmitting_(false)
+        , flushing_(false)
+        , srtt_(0)
+        , handshake_(HandshakeState::Idle)
+        , hostCaps_(legacyCapabilities())
+        , hostCapsChanges_(0)
+        , latency_(defaultLatencyProfile())
+        , sendExecutor_(ThreadRole::Send, 1, 0) { };
     // todo: disable copy semantics and enable move semantics
     ~Client() {};
 
@@ -130,11 +297,12 @@ public:
             DBGOUT("unable to create socket");
             return 1;
         }
+        applyLatencyProfile(connectSocket_, latency_);
 
         sockaddr_in serv_addr;
 
         serv_addr.sin_family = AF_INET;
-        serv_addr.sin_port = htons(DEFAULT_PORT);
+        serv_addr.sin_port = htons(portNumber_);
         serv_addr.sin_addr = *((struct in_addr *)host_->h_addr);
         bzero(&(serv_addr.sin_zero), 8);
 
@@ -177,6 +345,7 @@ public:
                 DBGOUT("socket failed with error: %ld", _socketError());
                 return 1;
             }
+            applyLatencyProfile(connectSocket_, latency_);
 
             res = connect(connectSocket_, addressAttempt->ai_addr,
                 (int)addressAttempt->ai_addrlen);
@@ -201,6 +370,27 @@ public:
         return 0;
     };
 
+    // applies to connections made from now on, see LatencyProfile.hpp
+    void
+    setLatencyProfile(const LatencyProfile& profile) {
+        latency_ = profile;
+    };
+
+    // attaches to a same-host server over shared memory instead of a socket
+    int
+    attach(const std::string& name) {
+        DBGOUT("attaching to %s...", name.c_str());
+        if (link_.connect(name) != 0)
+            return 1;
+        connected_ = true;
+        return 0;
+    };
+
+    bool
+    isAttached() {
+        return link_.isMapped();
+    };
+
     int
     disconnect() {
         DBGOUT("closing connected socket...");
@@ -217,8 +407,170 @@ public:
         return res;
     };
 
+    // queues a message on a channel and pushes out as many frames as possible,
+    // most urgent channel first
+    int
+    send(Channel channel, const char* data, size_t len) {
+        mux_.push(channel, data, len);
+        auto res = flush();
+        // nothing written here means the drain was left to a thread already
+        // flushing, which takes our message along; the connection is fine
+        return res == 0 ? (int)len : res;
+    };
+
+    int
+    send(Channel channel, const std::string& data) {
+        return send(channel, data.c_str(), data.size());
+    };
+
+    // returns the bytes this thread wrote, 0 if another thread was already
+    // draining the mux, SOCKET_ERROR if a write failed
+    int
+    flush() {
+        char frame[FRAME_MAX_LEN];
+        int total = 0;
+        // only one thread drains the mux at a time; anything queued while
+        // another thread is draining gets picked up by that thread
+        while (!mux_.empty() && !flushing_.exchange(true)) {
+            while (auto len = mux_.next(frame)) {
+                auto res = writeRaw(frame, len);
+                if (res == SOCKET_ERROR) {
+                    flushing_ = false;
+                    return res;
+                }
+                total += res;
+            }
+            flushing_ = false;
+        }
+        return total;
+    };
+
+    int
+    writeRaw(const char* data, size_t len) {
+        if (link_.isMapped())
+            return link_.write(data, len);
+        return writeToSocket(connectSocket_, data, len);
+    };
+
+    // blocking read from whichever transport is connected
+    int
+    receive(char* buf, int len) {
+        if (link_.isMapped())
+            return link_.read(buf, len);
+        return receiveFromSocket(connectSocket_, buf, len, latency_);
+    };
+
+    // sends a ping on the control channel, the peer's transport echoes it
+    // back as a pong carrying the same timestamp
+    int
+    ping() {
+        char buf[24];
+        auto len = snprintf(buf, sizeof(buf), "%c%lld", CONTROL_PING, (long long)nowMicros());
+        return send(Channel::Control, buf, len);
+    };
+
+    // folds a pong into the smoothed round trip time (rfc 6298 style, 1/8 gain)
+    void
+    onPong(const char* data, int len) {
+        if (len < 2)
+            return;
+        auto sample = nowMicros() - strtoll(data + 1, nullptr, 10);
+        if (sample < 0)
+            return;
+        auto srtt = srtt_.load();
+        srtt_ = srtt ? srtt + (sample - srtt) / 8 : sample;
+    };
+
+    // smoothed round trip time in microseconds, 0 until the first pong
+    int64_t
+    getRtt() {
+        return srtt_.load();
+    };
+
+    // advertises what this build can do and waits for the host's choice; a
+    // host that doesn't answer in time is taken to be text only until its
+    // accept turns up, if ever
+    void
+    handshake(int timeoutMs = HANDSHAKE_TIMEOUT_MS) {
+        std::unique_lock<std::mutex> lck(handshakeMutex_);
+        handshake_ = HandshakeState::Waiting;
+        hostCaps_ = legacyCapabilities();
+        ++hostCapsChanges_;
+        lck.unlock();
+
+        char hello[HANDSHAKE_LEN];
+        if (send(Channel::Control, hello,
+                 encodeHandshake(CONTROL_HELLO, localCapabilities(), hello)) == SOCKET_ERROR)
+            DBGOUT("handshake - hello failed with error: %d", _socketError());
+
+        lck.lock();
+        if (!handshakeCv_.wait_for(lck, std::chrono::milliseconds(timeoutMs),
+                                   [this]() { return handshake_ == HandshakeState::Done; })) {
+            DBGOUT("handshake - no answer from host, falling back to text");
+            handshake_ = HandshakeState::FellBack;
+        }
+    };
+
+    // an accept that comes in after the fallback upgrades the session; the
+    // host's parser tells text from state messages one by one, so the
+    // sender only has to notice getHostCapabilitiesChanges() move
+    void
+    onAccept(const char* data, int len) {
+        Capabilities caps;
+        if (!decodeHandshake(data, len, caps))
+            return;
+        std::lock_guard<std::mutex> lck(handshakeMutex_);
+        if (handshake_ != HandshakeState::Waiting && handshake_ != HandshakeState::FellBack)
+            return;
+        DBGOUT("handshake - %shost v%d, using %s, batch %d, features %x",
+               handshake_ == HandshakeState::FellBack ? "late accept, " : "",
+               caps.version, encodingName(caps.encodings), caps.batchMax, caps.features);
+        hostCaps_ = caps;
+        ++hostCapsChanges_;
+        handshake_ = HandshakeState::Done;
+        handshakeCv_.notify_all();
+    };
+
+    // what the last handshake settled on
+    Capabilities
+    getHostCapabilities() {
+        std::lock_guard<std::mutex> lck(handshakeMutex_);
+        return hostCaps_;
+    };
+
+    // moves every time an accept changes getHostCapabilities(), cheap
+    // enough to poll once per send
+    uint32_t
+    getHostCapabilitiesChanges() {
+        return hostCapsChanges_.load(std::memory_order_acquire);
+    };
+
+    // bytes waiting in the mux plus, for tcp, unsent bytes in the kernel
+    size_t
+    queuedBytes() {
+        size_t queued = mux_.pendingBytes();
+#if defined(TIOCOUTQ)
+        int outq = 0;
+        if (!link_.isMapped() && isConnected() &&
+            ioctl(connectSocket_, TIOCOUTQ, &outq) == 0 && outq > 0)
+            queued += outq;
+#endif
+        return queued;
+    };
+
+    ChannelMux&
+    getMux() {
+        return mux_;
+    };
+
     int
     closeConnectedSocket() {
+        if (isConnected() && link_.isMapped()) {
+            DBGOUT("detaching shared memory link...");
+            connected_ = false;
+            link_.close();
+            return 0;
+        }
         if (isConnected()) {
             DBGOUT("shutting down connected socket...");
             connected_ = false;
@@ -236,15 +588,18 @@ public:
         return 1;
     };
 
-    std::shared_future<void>
+    // runs cb on the client's send worker; cancelling the task clears the
+    // transmitting flag cb is handed
+    Executor::Task
     setSendHandler(SocketHandler& cb) {
         sendHandler_ = cb;
         DBGOUT("setSendHandler...");
-        sendFuture_ = std::async([this, cb]() {
+        transmitting_ = true;
+        sendTask_ = sendExecutor_.launch([this, cb](Executor::TaskContext& ctx) {
+            ctx.setInterrupt([this]() { transmitting_ = false; });
             cb(connectSocket_, transmitting_);
         });
-        transmitting_ = true;
-        return sendFuture_;
+        return sendTask_;
     };
 
     Socket
@@ -268,6 +623,20 @@ public:
     };
 
 private:
+    enum class HandshakeState {
+        Idle,
+        Waiting,
+        // timed out and streaming text, still listening for an accept
+        FellBack,
+        Done
+    };
+
+    static int64_t
+    nowMicros() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+
     Host host_;
     PortNumber portNumber_;
     Socket connectSocket_;
@@ -278,7 +647,25 @@ private:
 
     std::atomic<bool> transmitting_;
     SocketHandler sendHandler_;
-    std::shared_future<void> sendFuture_;
+    Executor::Task sendTask_;
+
+    ChannelMux mux_;
+    std::atomic<bool> flushing_;
+
+    ShmLink link_;
+
+    std::atomic<int64_t> srtt_;
+
+    std::mutex handshakeMutex_;
+    std::condition_variable handshakeCv_;
+    HandshakeState handshake_;
+    Capabilities hostCaps_;
+    std::atomic<uint32_t> hostCapsChanges_;
+
+    LatencyProfile latency_;
+
+    // last, so the send task is joined before anything it uses goes away
+    Executor sendExecutor_;
 
 };
 
@@ -0,0 +1,220 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <atomic>
+
+#include <stdint.h>
+
+#include "Log.hpp"
+#include "SampleBatch.hpp"
+
+// Server to client feedback, on the control channel, only for clients that
+// negotiated FEATURE_FEEDBACK:
+//   rumble    [FEEDBACK_MAGIC] [FEEDBACK_RUMBLE] [pad]
+//             low, high motor strength and duration in ms, 16 bits each
+//   led       [FEEDBACK_MAGIC] [FEEDBACK_LED] [pad] [r] [g] [b]
+//   ack       [FEEDBACK_MAGIC] [FEEDBACK_ACK] [pad] varint sample time
+// Multi-byte fields are little endian. An ack tells the client its button
+// edge captured at sample time has been injected. Like the state codec's,
+// the leading byte is outside the ascii range.
+#define FEEDBACK_MAGIC          0xBA
+#define FEEDBACK_RUMBLE         0x01
+#define FEEDBACK_LED            0x02
+#define FEEDBACK_ACK            0x03
+
+#define FEEDBACK_MAX_BYTES      16
+#define FEEDBACK_QUEUE_SIZE     64
+
+namespace Network
+{
+
+struct Feedback {
+    uint8_t kind;
+    uint8_t pad;
+    // rumble
+    uint16_t low;
+    uint16_t high;
+    uint16_t durationMs;
+    // led
+    uint8_t r;
+    uint8_t g;
+    uint8_t b;
+    // ack
+    uint64_t time;
+};
+
+// from the receive thread to whichever thread owns the pad
+using FeedbackRing = SpscRing<Feedback, FEEDBACK_QUEUE_SIZE>;
+
+bool
+isFeedback(const char* data, int len)
+{
+    return len >= 3 && (uint8_t)data[0] == FEEDBACK_MAGIC;
+}
+
+size_t
+putU16(char* out, uint16_t value)
+{
+    out[0] = (char)(value & 0xff);
+    out[1] = (char)(value >> 8);
+    return 2;
+}
+
+uint16_t
+getU16(const char* in)
+{
+    return (uint16_t)((uint8_t)in[0] | (uint8_t)in[1] << 8);
+}
+
+// each writes one message into out (FEEDBACK_MAX_BYTES) and returns its
+// length
+size_t
+encodeRumble(uint8_t pad, uint16_t low, uint16_t high, uint16_t durationMs, char* out)
+{
+    out[0] = (char)FEEDBACK_MAGIC;
+    out[1] = FEEDBACK_RUMBLE;
+    out[2] = (char)pad;
+    size_t n = 3;
+    n += putU16(out + n, low);
+    n += putU16(out + n, high);
+    n += putU16(out + n, durationMs);
+    return n;
+}
+
+size_t
+encodeLed(uint8_t pad, uint8_t r, uint8_t g, uint8_t b, char* out)
+{
+    out[0] = (char)FEEDBACK_MAGIC;
+    out[1] = FEEDBACK_LED;
+    out[2] = (char)pad;
+    out[3] = (char)r;
+    out[4] = (char)g;
+    out[5] = (char)b;
+    return 6;
+}
+
+size_t
+encodeFeedbackAck(uint8_t pad, uint64_t time, char* out)
+{
+    out[0] = (char)FEEDBACK_MAGIC;
+    out[1] = FEEDBACK_ACK;
+    out[2] = (char)pad;
+    return 3 + putVarint(out + 3, time);
+}
+
+// false if the message is truncated or of a kind this build doesn't know
+bool
+decodeFeedback(const char* data, int len, Feedback& fb)
+{
+    if (!isFeedback(data, len))
+        return false;
+    fb = Feedback();
+    fb.kind = (uint8_t)data[1];
+    fb.pad = (uint8_t)data[2];
+    switch (fb.kind) {
+    case FEEDBACK_RUMBLE:
+        if (len < 9)
+            return false;
+        fb.low = getU16(data + 3);
+        fb.high = getU16(data + 5);
+        fb.durationMs = getU16(data + 7);
+        return true;
+    case FEEDBACK_LED:
+        if (len < 6)
+            return false;
+        fb.r = (uint8_t)data[3];
+        fb.g = (uint8_t)data[4];
+        fb.b = (uint8_t)data[5];
+        return true;
+    case FEEDBACK_ACK:
+        return getVarint(data + 3, len - 3, fb.time) != 0;
+    default:
+        return false;
+    }
+}
+
+// Where feedback ends up on the client: the pad itself, or a mock when
+// there is none. Only ever driven from one thread.
+class FeedbackDevice {
+public:
+    virtual ~FeedbackDevice() { };
+
+    virtual const char*
+    name() const = 0;
+
+    virtual void
+    rumble(uint8_t pad, uint16_t low, uint16_t high, uint16_t durationMs) = 0;
+
+    virtual void
+    led(uint8_t pad, uint8_t r, uint8_t g, uint8_t b) = 0;
+
+    // acks aren't device output, the caller measures them
+    void
+    apply(const Feedback& fb) {
+        switch (fb.kind) {
+        case FEEDBACK_RUMBLE:
+            rumble(fb.pad, fb.low, fb.high, fb.durationMs);
+            break;
+        case FEEDBACK_LED:
+            led(fb.pad, fb.r, fb.g, fb.b);
+            break;
+        default:
+            break;
+        }
+    };
+};
+
+// logs and counts what a pad would have done, for headless clients
+class MockFeedbackDevice : public FeedbackDevice {
+public:
+    const char*
+    name() const override {
+        return "mock";
+    };
+
+    void
+    rumble(uint8_t pad, uint16_t low, uint16_t high, uint16_t durationMs) override {
+        ++rumbles_;
+        DBGOUT("feedback - pad %d rumble %d/%d for %d ms", pad, low, high, durationMs);
+    };
+
+    void
+    led(uint8_t pad, uint8_t r, uint8_t g, uint8_t b) override {
+        ++leds_;
+        DBGOUT("feedback - pad %d led #%02x%02x%02x", pad, r, g, b);
+    };
+
+    uint64_t
+    rumbles() const {
+        return rumbles_.load();
+    };
+
+    uint64_t
+    leds() const {
+        return leds_.load();
+    };
+
+private:
+    std::atomic<uint64_t> rumbles_ {0};
+    std::atomic<uint64_t> leds_ {0};
+
+};
+
+}
@@ -0,0 +1,411 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <deque>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Log.hpp"
+#include "Handoff.hpp"
+
+// Every frame starts with a 6 byte header:
+//   [0] FRAME_MAGIC
+//   [1] channel
+//   [2] flags (FRAME_FLAG_*)
+//   [3] stream id (0 for direct connections)
+//   [4] payload length, low byte
+//   [5] payload length, high byte
+// Messages larger than FRAME_MAX_CHUNK are split into several frames, only
+// the last of which carries FRAME_FLAG_FIN, up to FRAME_MAX_MESSAGE in all;
+// a peer that sends more on one channel without finishing is dropped. A peer
+// that doesn't open with FRAME_MAGIC is treated as a legacy raw text stream.
+#define FRAME_MAGIC         0xA5
+#define FRAME_HEADER_LEN    6
+#define FRAME_MAX_CHUNK     512
+#define FRAME_MAX_LEN       (FRAME_HEADER_LEN + FRAME_MAX_CHUNK)
+#define FRAME_MAX_MESSAGE   (64 * 1024)
+
+#define FRAME_FLAG_FIN      0x01
+
+// control channel messages answered by the transport itself, never handed
+// to the application callbacks
+#define CONTROL_PING        'p'
+#define CONTROL_PONG        'P'
+
+namespace Network
+{
+
+// logical channels, ordered by default priority (lower is more urgent)
+enum class Channel : uint8_t {
+    Control = 0,
+    Button,
+    Motion,
+    Telemetry,
+    Text,
+    Count
+};
+
+constexpr size_t CHANNEL_COUNT = static_cast<size_t>(Channel::Count);
+
+struct FrameHeader {
+    Channel channel;
+    uint8_t flags;
+    uint8_t stream;
+    uint16_t length;
+};
+
+void
+encodeFrameHeader(char* out, const FrameHeader& header)
+{
+    out[0] = (char)FRAME_MAGIC;
+    out[1] = (char)header.channel;
+    out[2] = (char)header.flags;
+    out[3] = (char)header.stream;
+    out[4] = (char)(header.length & 0xff);
+    out[5] = (char)(header.length >> 8);
+}
+
+bool
+decodeFrameHeader(const char* in, FrameHeader& header)
+{
+    auto bytes = reinterpret_cast<const uint8_t*>(in);
+    if (bytes[0] != FRAME_MAGIC || bytes[1] >= CHANNEL_COUNT)
+        return false;
+    header.channel = static_cast<Channel>(bytes[1]);
+    header.flags = bytes[2];
+    header.stream = bytes[3];
+    header.length = (uint16_t)(bytes[4] | (bytes[5] << 8));
+    return header.length <= FRAME_MAX_CHUNK;
+}
+
+// appends a whole message to out as one or more frames
+void
+encodeFrames(std::string& out, Channel channel, uint8_t stream, const char* data, size_t len)
+{
+    char header[FRAME_HEADER_LEN];
+    size_t offset = 0;
+    do {
+        size_t chunk = std::min(len - offset, (size_t)FRAME_MAX_CHUNK);
+        bool fin = offset + chunk == len;
+        encodeFrameHeader(header, { channel,
+                                    (uint8_t)(fin ? FRAME_FLAG_FIN : 0),
+                                    stream,
+                                    (uint16_t)chunk });
+        out.append(header, FRAME_HEADER_LEN);
+        out.append(data + offset, chunk);
+        offset += chunk;
+    } while (offset < len);
+}
+
+bool
+isPing(Channel channel, const char* data, int len)
+{
+    return channel == Channel::Control && len > 0 && data[0] == CONTROL_PING;
+}
+
+bool
+isPong(Channel channel, const char* data, int len)
+{
+    return channel == Channel::Control && len > 0 && data[0] == CONTROL_PONG;
+}
+
+// writes the pong frame echoing a ping into out (FRAME_MAX_LEN bytes) and
+// returns its length
+size_t
+encodePong(const char* ping, int len, char* out)
+{
+    len = std::min(len, FRAME_MAX_CHUNK);
+    encodeFrameHeader(out, { Channel::Control, FRAME_FLAG_FIN, 0, (uint16_t)len });
+    memcpy(out + FRAME_HEADER_LEN, ping, len);
+    out[FRAME_HEADER_LEN] = CONTROL_PONG;
+    return FRAME_HEADER_LEN + len;
+}
+
+// Queues outgoing messages per channel and hands them back out as frames,
+// always picking the most urgent channel with pending data. Large messages
+// are chunked so that a frame on an urgent channel never waits behind more
+// than one bulk chunk.
+class ChannelMux {
+public:
+    ChannelMux() : pendingBytes_(0) {
+        for (size_t i = 0; i < CHANNEL_COUNT; ++i)
+            priority_[i] = (uint8_t)i;
+    };
+
+    void
+    setPriority(Channel channel, uint8_t priority) {
+        std::lock_guard<std::mutex> lck(mutex_);
+        priority_[(size_t)channel] = priority;
+    };
+
+    void
+    push(Channel channel, const char* data, size_t len, uint8_t stream = 0) {
+        std::lock_guard<std::mutex> lck(mutex_);
+        auto& msg = queues_[(size_t)channel].push();
+        msg.data.assign(data, len);
+        msg.offset = 0;
+        msg.stream = stream;
+        pendingBytes_ += len;
+    };
+
+    // writes the next frame into out (at least FRAME_MAX_LEN bytes), returns
+    // its length or 0 when nothing is pending
+    size_t
+    next(char* out) {
+        std::lock_guard<std::mutex> lck(mutex_);
+        int best = -1;
+        for (size_t i = 0; i < CHANNEL_COUNT; ++i) {
+            if (!queues_[i].count)
+                continue;
+            if (best < 0 || priority_[i] < priority_[best])
+                best = (int)i;
+        }
+        if (best < 0)
+            return 0;
+
+        auto& queue = queues_[best];
+        auto& msg = queue.front();
+        size_t chunk = std::min(msg.data.size() - msg.offset, (size_t)FRAME_MAX_CHUNK);
+        bool fin = msg.offset + chunk == msg.data.size();
+
+        FrameHeader header { static_cast<Channel>(best),
+                             (uint8_t)(fin ? FRAME_FLAG_FIN : 0),
+                             msg.stream,
+                             (uint16_t)chunk };
+        encodeFrameHeader(out, header);
+        memcpy(out + FRAME_HEADER_LEN, msg.data.data() + msg.offset, chunk);
+
+        msg.offset += chunk;
+        pendingBytes_ -= chunk;
+        if (fin)
+            queue.pop();
+        return FRAME_HEADER_LEN + chunk;
+    };
+
+    size_t
+    pendingBytes() {
+        return pendingBytes_.load();
+    };
+
+    bool
+    empty() {
+        return pendingBytes_.load() == 0;
+    };
+
+private:
+    struct Message {
+        std::string data;
+        size_t offset {0};
+        uint8_t stream {0};
+    };
+
+    // a ring of messages whose buffers are reused, so a steady stream of
+    // sends stops allocating once the ring and its strings have grown
+    struct Queue {
+        std::vector<Message> slots;
+        size_t head {0};
+        size_t count {0};
+
+        Message&
+        push() {
+            if (count == slots.size()) {
+                std::rotate(slots.begin(), slots.begin() + head, slots.end());
+                head = 0;
+                slots.resize(std::max<size_t>(4, slots.size() * 2));
+            }
+            return slots[(head + count++) % slots.size()];
+        };
+
+        Message&
+        front() {
+            return slots[head];
+        };
+
+        void
+        pop() {
+            head = (head + 1) % slots.size();
+            --count;
+        };
+    };
+
+    std::mutex mutex_;
+    std::array<Queue, CHANNEL_COUNT> queues_;
+    std::array<uint8_t, CHANNEL_COUNT> priority_;
+    std::atomic<size_t> pendingBytes_;
+
+};
+
+// Incremental decoder for one connection's byte stream. Chunks are
+// reassembled per channel, so an urgent message can complete while a bulk
+// message on another channel is still in flight.
+class FrameReader {
+public:
+    using MessageCallback = std::function<void(Channel, uint8_t, const char*, int)>;
+    using RawCallback = std::function<void(const char*, int)>;
+
+    enum class Mode {
+        Unknown,
+        Framed,
+        Legacy
+    };
+
+    FrameReader()
+        : mode_(Mode::Unknown)
+        , headerLen_(0)
+        , remaining_(0) {
+        // room for a whole frame per channel up front, so only messages
+        // spanning several frames ever grow these once reading has started
+        for (auto& partial : partial_)
+            partial.reserve(FRAME_MAX_CHUNK);
+    };
+
+    void
+    reset() {
+        mode_ = Mode::Unknown;
+        headerLen_ = 0;
+        remaining_ = 0;
+        for (auto& partial : partial_)
+            partial.clear();
+    };
+
+    Mode
+    mode() const {
+        return mode_;
+    };
+
+    // the reassembly state, so a connection can move to another process
+    // halfway through a frame
+    void
+    save(HandoffWriter& out) const {
+        out.put(mode_);
+        out.put(header_);
+        out.put((uint32_t)headerLen_);
+        out.put(current_);
+        out.put((uint32_t)remaining_);
+        for (auto& partial : partial_)
+            out.putBytes(partial.data(), partial.size());
+    };
+
+    bool
+    load(HandoffReader& in) {
+        uint32_t headerLen = 0, remaining = 0;
+        in.get(mode_);
+        in.get(header_);
+        in.get(headerLen);
+        in.get(current_);
+        in.get(remaining);
+        for (auto& partial : partial_)
+            in.getBytes(partial);
+        headerLen_ = headerLen;
+        remaining_ = remaining;
+        bool oversize = std::any_of(partial_.begin(), partial_.end(),
+            [](const std::string& partial) { return partial.size() > FRAME_MAX_MESSAGE; });
+        if (!in.ok() || headerLen_ > FRAME_HEADER_LEN || remaining_ > FRAME_MAX_CHUNK || oversize) {
+            reset();
+            return false;
+        }
+        return true;
+    };
+
+    // returns false if the stream is corrupt and the connection should be dropped.
+    // The callbacks are taken as templates so that passing a lambda doesn't
+    // build a std::function, and possibly allocate, on every read.
+    template<typename OnMessage, typename OnLegacy>
+    bool
+    feed(const char* data, int len, OnMessage&& onMessage, OnLegacy&& onLegacy) {
+        if (len <= 0)
+            return true;
+
+        if (mode_ == Mode::Unknown) {
+            mode_ = (uint8_t)data[0] == FRAME_MAGIC ? Mode::Framed : Mode::Legacy;
+            DBGOUT("framing - peer is %s", mode_ == Mode::Framed ? "framed" : "legacy");
+        }
+
+        if (mode_ == Mode::Legacy) {
+            onLegacy(data, len);
+            return true;
+        }
+
+        while (len > 0) {
+            if (remaining_ == 0 && headerLen_ < FRAME_HEADER_LEN) {
+                auto n = std::min(len, (int)(FRAME_HEADER_LEN - headerLen_));
+                memcpy(header_.data() + headerLen_, data, n);
+                headerLen_ += n;
+                data += n;
+                len -= n;
+                if (headerLen_ < FRAME_HEADER_LEN)
+                    return true;
+                if (!decodeFrameHeader(header_.data(), current_)) {
+                    DBGOUT("framing - bad frame header");
+                    return false;
+                }
+                // bounds what a peer that never finishes a message can make
+                // us hold
+                if (partial_[(size_t)current_.channel].size() + current_.length > FRAME_MAX_MESSAGE) {
+                    DBGOUT("framing - message over %d bytes", FRAME_MAX_MESSAGE);
+                    return false;
+                }
+                remaining_ = current_.length;
+                if (remaining_ == 0)
+                    complete(onMessage);
+                continue;
+            }
+
+            auto n = std::min(len, (int)remaining_);
+            partial_[(size_t)current_.channel].append(data, n);
+            remaining_ -= n;
+            data += n;
+            len -= n;
+            if (remaining_ == 0)
+                complete(onMessage);
+        }
+        return true;
+    };
+
+private:
+    template<typename OnMessage>
+    void
+    complete(OnMessage& onMessage) {
+        headerLen_ = 0;
+        if (!(current_.flags & FRAME_FLAG_FIN))
+            return;
+        auto& msg = partial_[(size_t)current_.channel];
+        onMessage(current_.channel, current_.stream, msg.c_str(), (int)msg.size());
+        // clear() keeps the capacity for the next message
+        msg.clear();
+    };
+
+    Mode mode_;
+    std::array<char, FRAME_HEADER_LEN> header_;
+    size_t headerLen_;
+    FrameHeader current_;
+    size_t remaining_;
+    std::array<std::string, CHANNEL_COUNT> partial_;
+
+};
+
+}
@@ -0,0 +1,265 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <string>
+#include <type_traits>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+
+#include "Log.hpp"
+
+// Hot restart: a new server process connects to the running one over a
+// unix socket, which hands it the listening and established sockets as
+// SCM_RIGHTS messages, each with whatever state the connection needs to
+// carry on mid-stream. Bytes that arrive in between wait in the kernel's
+// socket buffers, so nothing sent by a client is lost.
+//
+// Messages, one per SOCK_SEQPACKET packet, first byte is the type:
+//   new -> old   'H' version           hello, asks for a takeover
+//   old -> new   'R'                   version mismatch, keep running
+//   old -> new   'L' shard             + listening socket
+//   old -> new   'C' shard state       + connection socket
+//   old -> new   'E' connections       end of the handoff
+//   new -> old   'A'                   everything adopted, old may exit
+// State is written in host layout, so any change to a saved structure has
+// to bump HANDOFF_VERSION.
+#define HANDOFF_VERSION         3
+#define HANDOFF_MAX_MESSAGE     65536
+#define HANDOFF_TIMEOUT_MS      5000
+
+#define HANDOFF_HELLO           'H'
+#define HANDOFF_REJECT          'R'
+#define HANDOFF_LISTENER        'L'
+#define HANDOFF_CONNECTION      'C'
+#define HANDOFF_END             'E'
+#define HANDOFF_ACK             'A'
+
+namespace Network
+{
+
+// appends plain values and length prefixed byte strings to out
+class HandoffWriter {
+public:
+    HandoffWriter(std::string& out)
+        : out_(out) { };
+
+    template<typename T>
+    void
+    put(const T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "handoff state must be plain data");
+        out_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    };
+
+    void
+    putBytes(const char* data, size_t len) {
+        put((uint32_t)len);
+        out_.append(data, len);
+    };
+
+private:
+    std::string& out_;
+
+};
+
+// reads back what a HandoffWriter wrote; every get fails once the input
+// ran short
+class HandoffReader {
+public:
+    HandoffReader(const char* data, size_t len)
+        : data_(data)
+        , len_(len)
+        , at_(0)
+        , ok_(true) { };
+
+    template<typename T>
+    bool
+    get(T& value) {
+        static_assert(std::is_trivially_copyable<T>::value, "handoff state must be plain data");
+        if (!ok_ || len_ - at_ < sizeof(T))
+            return ok_ = false;
+        memcpy(&value, data_ + at_, sizeof(T));
+        at_ += sizeof(T);
+        return true;
+    };
+
+    // points data into the input, valid as long as the input is
+    bool
+    getBytes(const char*& data, size_t& len) {
+        uint32_t n;
+        if (!get(n) || len_ - at_ < n)
+            return ok_ = false;
+        data = data_ + at_;
+        len = n;
+        at_ += n;
+        return true;
+    };
+
+    bool
+    getBytes(std::string& out) {
+        const char* data;
+        size_t len;
+        if (!getBytes(data, len))
+            return false;
+        out.assign(data, len);
+        return true;
+    };
+
+    bool
+    ok() const {
+        return ok_;
+    };
+
+private:
+    const char* data_;
+    size_t len_;
+    size_t at_;
+    bool ok_;
+
+};
+
+#ifndef _WIN32
+void
+setHandoffTimeout(int sock)
+{
+    timeval tv;
+    tv.tv_sec = HANDOFF_TIMEOUT_MS / 1000;
+    tv.tv_usec = (HANDOFF_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+sockaddr_un
+handoffAddress(const std::string& path)
+{
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+// sends one message, passing fd along unless it is -1
+int
+sendHandoff(int sock, char type, const std::string& payload, int fd = -1)
+{
+    if (payload.size() + 1 > HANDOFF_MAX_MESSAGE) {
+        DBGOUT("handoff - %c message too large: %d", type, (int)payload.size());
+        return 1;
+    }
+    iovec iov[2];
+    iov[0].iov_base = &type;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = const_cast<char*>(payload.data());
+    iov[1].iov_len = payload.size();
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        cmsghdr align;
+    } control;
+    if (fd >= 0) {
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    }
+    while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0) {
+        if (errno != EINTR) {
+            DBGOUT("handoff - sendmsg failed with error: %d", errno);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// receives one message; fd is -1 when none came with it
+int
+recvHandoff(int sock, char& type, std::string& payload, int& fd)
+{
+    payload.resize(HANDOFF_MAX_MESSAGE);
+    iovec iov[2];
+    iov[0].iov_base = &type;
+    iov[0].iov_len = 1;
+    iov[1].iov_base = &payload[0];
+    iov[1].iov_len = payload.size();
+
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        cmsghdr align;
+    } control;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    fd = -1;
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0) {
+        if (errno != EINTR) {
+            DBGOUT("handoff - recvmsg failed with error: %d", errno);
+            return 1;
+        }
+    }
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    }
+    if (n == 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        DBGOUT("handoff - %s", n == 0 ? "peer hung up" : "message truncated");
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        return 1;
+    }
+    payload.resize(n - 1);
+    return 0;
+}
+
+// the peer has to be the same user, anyone else could walk off with the
+// clients' sockets
+bool
+isHandoffPeerTrusted(int sock)
+{
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+        return false;
+    return cred.uid == getuid();
+}
+#endif
+
+}
@@ -0,0 +1,200 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <algorithm>
+
+#include <stdint.h>
+#include <string.h>
+
+#include "Log.hpp"
+#include "Frame.hpp"
+#include "SampleBatch.hpp"
+#include "StateCodec.hpp"
+
+// Capability negotiation. A client opens its framed stream with a hello on
+// the control channel listing everything it can do, and the server's
+// transport answers with an accept holding what both ends will use. Both
+// share one layout:
+//   [0] CONTROL_HELLO or CONTROL_ACCEPT
+//   [1] version
+//   [2] encodings (ENCODING_*), a single one in an accept
+//   [3] transports (TRANSPORT_*)
+//   [4] features (FEATURE_*), low byte
+//   [5] features, high byte
+//   [6] most samples per pad in one message
+//   [7] most pads in one message
+// Later versions may only append fields, so anything past these is ignored.
+// A server from before the handshake hands the hello to its application,
+// which drops it as unparseable text, and never answers; a client that
+// hears nothing within HANDSHAKE_TIMEOUT_MS streams framed legacy text,
+// and still switches over if an accept turns up later, so a host that was
+// only slow to answer isn't stuck with text. Servers from before framing
+// can't be reached either way: they only take whole remote messages
+// (k:, m:, lu, ld), not joystick text, and a frame header is noise to them.
+#define CONTROL_HELLO       'h'
+#define CONTROL_ACCEPT      'a'
+
+#define HANDSHAKE_VERSION       1
+#define HANDSHAKE_LEN           8
+#define HANDSHAKE_TIMEOUT_MS    500
+
+namespace Network
+{
+
+// ordered by preference, the highest bit both ends share wins
+enum Encoding : uint8_t {
+    ENCODING_TEXT       = 1 << 0,
+    ENCODING_STATE      = 1 << 1
+};
+
+enum TransportMask : uint8_t {
+    TRANSPORT_TCP       = 1 << 0,
+    TRANSPORT_SHM       = 1 << 1
+};
+
+enum Feature : uint16_t {
+    // the transport answers pings
+    FEATURE_PING        = 1 << 0,
+    // rumble, led and press acks from server to client, see Feedback.hpp
+    FEATURE_FEEDBACK    = 1 << 1
+};
+
+struct Capabilities {
+    uint8_t version;
+    uint8_t encodings;
+    uint8_t transports;
+    uint16_t features;
+    uint8_t batchMax;
+    uint8_t padsMax;
+};
+
+// everything this build can do
+Capabilities
+localCapabilities()
+{
+    return { HANDSHAKE_VERSION, ENCODING_TEXT | ENCODING_STATE,
+             TRANSPORT_TCP | TRANSPORT_SHM, FEATURE_PING | FEATURE_FEEDBACK,
+             SAMPLE_BATCH_MAX, STATE_MAX_PADS };
+}
+
+// what a peer that never answered the hello is assumed to understand
+Capabilities
+legacyCapabilities()
+{
+    return { 0, ENCODING_TEXT, TRANSPORT_TCP, 0, 1, 1 };
+}
+
+uint8_t
+fastestEncoding(uint8_t encodings)
+{
+    for (int bit = 7; bit > 0; --bit) {
+        if (encodings & (1 << bit))
+            return (uint8_t)(1 << bit);
+    }
+    // every peer parses text
+    return ENCODING_TEXT;
+}
+
+const char*
+encodingName(uint8_t encoding)
+{
+    switch (encoding) {
+    case ENCODING_STATE:
+        return "state";
+    case ENCODING_TEXT:
+        return "text";
+    default:
+        return "unknown";
+    }
+}
+
+// the set both ends support, down to the single fastest encoding
+Capabilities
+negotiate(const Capabilities& local, const Capabilities& peer)
+{
+    Capabilities agreed;
+    agreed.version = std::min(local.version, peer.version);
+    agreed.encodings = fastestEncoding(local.encodings & peer.encodings);
+    agreed.transports = local.transports & peer.transports;
+    agreed.features = local.features & peer.features;
+    agreed.batchMax = std::max<uint8_t>(1, std::min(local.batchMax, peer.batchMax));
+    agreed.padsMax = std::max<uint8_t>(1, std::min(local.padsMax, peer.padsMax));
+    return agreed;
+}
+
+bool
+isHello(Channel channel, const char* data, int len)
+{
+    return channel == Channel::Control && len > 0 && data[0] == CONTROL_HELLO;
+}
+
+bool
+isAccept(Channel channel, const char* data, int len)
+{
+    return channel == Channel::Control && len > 0 && data[0] == CONTROL_ACCEPT;
+}
+
+// writes a hello or an accept into out (HANDSHAKE_LEN bytes) and returns
+// its length
+size_t
+encodeHandshake(char type, const Capabilities& caps, char* out)
+{
+    out[0] = type;
+    out[1] = (char)caps.version;
+    out[2] = (char)caps.encodings;
+    out[3] = (char)caps.transports;
+    out[4] = (char)(caps.features & 0xff);
+    out[5] = (char)(caps.features >> 8);
+    out[6] = (char)caps.batchMax;
+    out[7] = (char)caps.padsMax;
+    return HANDSHAKE_LEN;
+}
+
+// false if the message is too short to be a handshake
+bool
+decodeHandshake(const char* data, int len, Capabilities& caps)
+{
+    if (len < HANDSHAKE_LEN || !data[1])
+        return false;
+    caps.version = (uint8_t)data[1];
+    caps.encodings = (uint8_t)data[2];
+    caps.transports = (uint8_t)data[3];
+    caps.features = (uint16_t)((uint8_t)data[4] | (uint8_t)data[5] << 8);
+    caps.batchMax = (uint8_t)data[6];
+    caps.padsMax = (uint8_t)data[7];
+    return true;
+}
+
+// writes the accept frame answering a hello into out (FRAME_MAX_LEN bytes)
+// and returns its length, 0 if the hello is malformed
+size_t
+encodeAccept(const char* hello, int len, char* out, Capabilities& agreed)
+{
+    Capabilities peer;
+    if (!decodeHandshake(hello, len, peer))
+        return 0;
+    agreed = negotiate(localCapabilities(), peer);
+    DBGOUT("handshake - peer v%d, agreed on %s, batch %d, features %x",
+           peer.version, encodingName(agreed.encodings), agreed.batchMax, agreed.features);
+    encodeFrameHeader(out, { Channel::Control, FRAME_FLAG_FIN, 0, HANDSHAKE_LEN });
+    return FRAME_HEADER_LEN + encodeHandshake(CONTROL_ACCEPT, agreed, out + FRAME_HEADER_LEN);
+}
+
+}
@@ -0,0 +1,412 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+#endif
+
+#include "Log.hpp"
+#include "KeyMap.hpp"
+
+#define INJECTOR_BUTTON_LEFT    0
+#define INJECTOR_BUTTON_RIGHT   1
+#define INJECTOR_CLICK_MS       10
+#define RECORDING_MAX_EVENTS    65536
+
+// Where injected input ends up. The server talks to this interface only,
+// so the same code drives SendInput on Windows, uinput on Linux, or an
+// in-memory recording when neither is available.
+class Injector {
+public:
+    Injector(KeyTranslationTable::Lookup lookup,
+             std::array<uint16_t, KEYMOD_COUNT> modifierKeys)
+        : keymap_(std::move(lookup), modifierKeys) { };
+
+    virtual ~Injector() { };
+
+    virtual const char*
+    name() const = 0;
+
+    virtual void
+    moveRelative(int dx, int dy) = 0;
+
+    virtual void
+    button(int index, bool down) = 0;
+
+    void
+    click(int index) {
+        button(index, true);
+        std::this_thread::sleep_for(std::chrono::milliseconds(INJECTOR_CLICK_MS));
+        button(index, false);
+    };
+
+    // types a whole message as one batch of key events
+    void
+    text(const char* text, int len) {
+        std::lock_guard<std::mutex> lck(textMutex_);
+        keymap_.setLayout(layout());
+        keyEvents_.clear();
+        keymap_.buildEvents(text, len, keyEvents_);
+        if (!keyEvents_.empty())
+            keys(keyEvents_.data(), keyEvents_.size());
+    };
+
+protected:
+    virtual LayoutId
+    layout() {
+        return 0;
+    };
+
+    virtual void
+    keys(const KeyEvent* events, size_t count) = 0;
+
+private:
+    std::mutex textMutex_;
+    KeyTranslationTable keymap_;
+    std::vector<KeyEvent> keyEvents_;
+
+};
+
+#ifdef _WIN32
+class SendInputInjector : public Injector {
+public:
+    SendInputInjector()
+        : Injector([](char c, LayoutId layout) {
+                       return (int16_t)VkKeyScanEx(c, (HKL)layout);
+                   },
+                   { VK_SHIFT, VK_CONTROL, VK_MENU }) { };
+
+    const char*
+    name() const override {
+        return "sendinput";
+    };
+
+    void
+    moveRelative(int dx, int dy) override {
+        INPUT input;
+        mouseSetup(input);
+        input.mi.dx = dx;
+        input.mi.dy = dy;
+        input.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_VIRTUALDESK;
+        SendInput(1, &input, sizeof(INPUT));
+    };
+
+    void
+    button(int index, bool down) override {
+        INPUT input;
+        mouseSetup(input);
+        if (index == INJECTOR_BUTTON_RIGHT)
+            input.mi.dwFlags = down ? MOUSEEVENTF_RIGHTDOWN : MOUSEEVENTF_RIGHTUP;
+        else
+            input.mi.dwFlags = down ? MOUSEEVENTF_LEFTDOWN : MOUSEEVENTF_LEFTUP;
+        SendInput(1, &input, sizeof(INPUT));
+    };
+
+protected:
+    LayoutId
+    layout() override {
+        return (LayoutId)GetKeyboardLayout(0);
+    };
+
+    void
+    keys(const KeyEvent* events, size_t count) override {
+        thread_local std::vector<INPUT> inputs;
+        inputs.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            auto& input = inputs[i];
+            ZeroMemory(&input, sizeof(input));
+            input.type = INPUT_KEYBOARD;
+            input.ki.wVk = events[i].keycode;
+            input.ki.dwFlags = events[i].up ? KEYEVENTF_KEYUP : 0;
+        }
+        SendInput((UINT)inputs.size(), inputs.data(), sizeof(INPUT));
+    };
+
+private:
+    static void
+    mouseSetup(INPUT& input) {
+        ZeroMemory(&input, sizeof(input));
+        input.type = INPUT_MOUSE;
+        input.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_VIRTUALDESK;
+    };
+
+};
+#endif
+
+#ifndef _WIN32
+// VkKeyScanEx style lookup for a US layout, in evdev key codes
+int16_t
+usKeyLookup(char c, LayoutId)
+{
+    static const struct {
+        const char* plain;
+        const char* shifted;
+        uint16_t codes[13];
+    } rows[] = {
+        { "`1234567890-=", "~!@#$%^&*()_+",
+          { KEY_GRAVE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8,
+            KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL } },
+        { "qwertyuiop[]\\", "QWERTYUIOP{}|",
+          { KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O,
+            KEY_P, KEY_LEFTBRACE, KEY_RIGHTBRACE, KEY_BACKSLASH } },
+        { "asdfghjkl;'", "ASDFGHJKL:\"",
+          { KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L,
+            KEY_SEMICOLON, KEY_APOSTROPHE } },
+        { "zxcvbnm,./", "ZXCVBNM<>?",
+          { KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M, KEY_COMMA, KEY_DOT,
+            KEY_SLASH } },
+    };
+    switch (c) {
+    case ' ':  return KEY_SPACE;
+    case '\n': return KEY_ENTER;
+    case '\t': return KEY_TAB;
+    case '\b': return KEY_BACKSPACE;
+    default:   break;
+    }
+    if (!c)
+        return -1;
+    for (auto& row : rows) {
+        if (auto p = strchr(row.plain, c))
+            return (int16_t)row.codes[p - row.plain];
+        if (auto p = strchr(row.shifted, c))
+            return (int16_t)(row.codes[p - row.shifted] | (KEYMOD_SHIFT << 8));
+    }
+    return -1;
+}
+
+// A virtual mouse and keyboard created through /dev/uinput.
+class UinputInjector : public Injector {
+public:
+    UinputInjector()
+        : Injector(usKeyLookup, { KEY_LEFTSHIFT, KEY_LEFTCTRL, KEY_LEFTALT })
+        , fd_(-1) { };
+
+    ~UinputInjector() {
+        if (fd_ >= 0) {
+            ioctl(fd_, UI_DEV_DESTROY);
+            close(fd_);
+        }
+    };
+
+    int
+    open() {
+        fd_ = ::open("/dev/uinput", O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+        if (fd_ < 0) {
+            DBGOUT("uinput - unable to open /dev/uinput: %s", strerror(errno));
+            return 1;
+        }
+        ioctl(fd_, UI_SET_EVBIT, EV_KEY);
+        ioctl(fd_, UI_SET_EVBIT, EV_REL);
+        ioctl(fd_, UI_SET_EVBIT, EV_SYN);
+        ioctl(fd_, UI_SET_RELBIT, REL_X);
+        ioctl(fd_, UI_SET_RELBIT, REL_Y);
+        ioctl(fd_, UI_SET_KEYBIT, BTN_LEFT);
+        ioctl(fd_, UI_SET_KEYBIT, BTN_RIGHT);
+        for (int key = KEY_ESC; key <= KEY_MICMUTE; ++key)
+            ioctl(fd_, UI_SET_KEYBIT, key);
+
+        uinput_setup setup;
+        memset(&setup, 0, sizeof(setup));
+        setup.id.bustype = BUS_VIRTUAL;
+        setup.id.vendor = 0x1209;
+        setup.id.product = 0x7470;
+        strncpy(setup.name, "tcpjoy virtual input", UINPUT_MAX_NAME_SIZE - 1);
+        if (ioctl(fd_, UI_DEV_SETUP, &setup) < 0 || ioctl(fd_, UI_DEV_CREATE) < 0) {
+            DBGOUT("uinput - unable to create device: %s", strerror(errno));
+            close(fd_);
+            fd_ = -1;
+            return 1;
+        }
+        return 0;
+    };
+
+    const char*
+    name() const override {
+        return "uinput";
+    };
+
+    void
+    moveRelative(int dx, int dy) override {
+        input_event events[3];
+        size_t n = 0;
+        if (dx)
+            set(events[n++], EV_REL, REL_X, dx);
+        if (dy)
+            set(events[n++], EV_REL, REL_Y, dy);
+        set(events[n++], EV_SYN, SYN_REPORT, 0);
+        emit(events, n);
+    };
+
+    void
+    button(int index, bool down) override {
+        input_event events[2];
+        set(events[0], EV_KEY, index == INJECTOR_BUTTON_RIGHT ? BTN_RIGHT : BTN_LEFT, down);
+        set(events[1], EV_SYN, SYN_REPORT, 0);
+        emit(events, 2);
+    };
+
+protected:
+    void
+    keys(const KeyEvent* events, size_t count) override {
+        thread_local std::vector<input_event> batch;
+        batch.resize(count * 2);
+        for (size_t i = 0; i < count; ++i) {
+            set(batch[i * 2], EV_KEY, events[i].keycode, events[i].up ? 0 : 1);
+            set(batch[i * 2 + 1], EV_SYN, SYN_REPORT, 0);
+        }
+        emit(batch.data(), batch.size());
+    };
+
+private:
+    static void
+    set(input_event& event, uint16_t type, uint16_t code, int32_t value) {
+        memset(&event, 0, sizeof(event));
+        event.type = type;
+        event.code = code;
+        event.value = value;
+    };
+
+    void
+    emit(const input_event* events, size_t count) {
+        if (::write(fd_, events, count * sizeof(input_event)) < 0)
+            DBGOUT("uinput - write failed: %s", strerror(errno));
+    };
+
+    int fd_;
+
+};
+#endif
+
+struct RecordedEvent {
+    enum class Kind : uint8_t {
+        Move,
+        Button,
+        Key
+    };
+    Kind kind;
+    int a;
+    int b;
+    uint64_t time;
+};
+
+// Keeps the last RECORDING_MAX_EVENTS injected events in memory, plus
+// running totals, for headless runs and load tests.
+class RecordingInjector : public Injector {
+public:
+    RecordingInjector()
+        : Injector([](char c, LayoutId) {
+                       return (int16_t)(c ? (uint8_t)c : -1);
+                   },
+                   { 0x100, 0x101, 0x102 })
+        , head_(0)
+        , total_(0) {
+        // allocated once up front, recording never allocates afterwards
+        events_.resize(RECORDING_MAX_EVENTS);
+    };
+
+    const char*
+    name() const override {
+        return "recording";
+    };
+
+    void
+    moveRelative(int dx, int dy) override {
+        record(RecordedEvent::Kind::Move, dx, dy);
+    };
+
+    void
+    button(int index, bool down) override {
+        record(RecordedEvent::Kind::Button, index, down);
+    };
+
+    // copies out the retained events, oldest first
+    std::vector<RecordedEvent>
+    events() {
+        std::lock_guard<std::mutex> lck(mutex_);
+        std::vector<RecordedEvent> out;
+        size_t count = (size_t)std::min<uint64_t>(total_, RECORDING_MAX_EVENTS);
+        out.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+            out.push_back(events_[(head_ + RECORDING_MAX_EVENTS - count + i) % RECORDING_MAX_EVENTS]);
+        return out;
+    };
+
+    uint64_t
+    total() {
+        std::lock_guard<std::mutex> lck(mutex_);
+        return total_;
+    };
+
+protected:
+    void
+    keys(const KeyEvent* events, size_t count) override {
+        for (size_t i = 0; i < count; ++i)
+            record(RecordedEvent::Kind::Key, events[i].keycode, !events[i].up);
+    };
+
+private:
+    void
+    record(RecordedEvent::Kind kind, int a, int b) {
+        auto time = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        std::lock_guard<std::mutex> lck(mutex_);
+        events_[head_] = { kind, a, b, (uint64_t)time };
+        head_ = (head_ + 1) % RECORDING_MAX_EVENTS;
+        ++total_;
+    };
+
+    std::mutex mutex_;
+    std::vector<RecordedEvent> events_;
+    size_t head_;
+    uint64_t total_;
+
+};
+
+// the platform's real backend, or a recording one if it isn't usable or
+// record is set
+std::unique_ptr<Injector>
+createInjector(bool record)
+{
+    if (!record) {
+#ifdef _WIN32
+        return std::unique_ptr<Injector>(new SendInputInjector());
+#else
+        std::unique_ptr<UinputInjector> uinput(new UinputInjector());
+        if (uinput->open() == 0)
+            return uinput;
+        DBGOUT("injector - uinput unavailable, recording instead");
+#endif
+    }
+    return std::unique_ptr<Injector>(new RecordingInjector());
+}
@@ -0,0 +1,521 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include <chrono>
+#include <tuple>
+
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "Log.hpp"
+#include "AllocTrack.hpp"
+
+// Ingress journal: every chunk of bytes a server reads, with the connection
+// it came from and when, for incident analysis and replay. Enabled with
+// journalOpen(); with it off every call below returns after one load and
+// branch.
+//
+// Every receive thread appends to its own segment files, so capture takes
+// no lock and shares no cache line with another writer: a record is a clock
+// read and a copy into a shared file mapping, which the kernel writes back
+// on its own and which survives the process crashing. A full segment is
+// closed and the next one preallocated and mapped, the only syscalls on
+// the receive path. Files are named <started>-<pid>-w<writer>-<sequence>.jnl
+// and laid out as
+//   header    JournalSegmentHeader, padded to JOURNAL_HEADER_LEN
+//   records   JournalRecordHeader then the payload, padded to 8 bytes
+// in host byte order. A record's size is stored last, so a reader stops at
+// the first zero size: the end of what was written, even mid-segment.
+#define JOURNAL_MAGIC           0x4c4a4a54
+#define JOURNAL_VERSION         1
+#define JOURNAL_HEADER_LEN      64
+#define JOURNAL_RECORD_LEN      24
+#define JOURNAL_SEGMENT_BYTES   (64u << 20)
+#define JOURNAL_MIN_SEGMENT     (1u << 20)
+
+enum JournalKind : uint8_t {
+    // payload is the bytes read, exactly as they came in
+    JOURNAL_DATA = 0,
+    // the connection was accepted, or closed
+    JOURNAL_OPEN,
+    JOURNAL_CLOSE
+};
+
+struct JournalSegmentHeader {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t writer;
+    uint32_t pid;
+    // JOURNAL_RECORD_LEN, so a reader can tell the layout is its own
+    uint32_t recordLen;
+    // microseconds since the epoch, when the journal was opened and when
+    // this segment was
+    uint64_t started;
+    uint64_t created;
+    uint64_t sequence;
+};
+
+struct JournalRecordHeader {
+    // header and padded payload, 0 past the last record
+    uint32_t size;
+    uint8_t kind;
+    uint8_t reserved[3];
+    uint32_t connection;
+    uint32_t length;
+    // microseconds since the epoch
+    uint64_t time;
+};
+
+static_assert(sizeof(JournalSegmentHeader) <= JOURNAL_HEADER_LEN, "journal header layout");
+static_assert(sizeof(JournalRecordHeader) == JOURNAL_RECORD_LEN, "journal record layout");
+
+// wall clock, so records line up with other logs of an incident
+uint64_t
+journalNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+#ifndef _WIN32
+
+// one thread's segments; only that thread appends
+class JournalWriter {
+public:
+    JournalWriter(const std::string& dir, uint16_t id, size_t segmentBytes, uint64_t started)
+        : dir_(dir)
+        , id_(id)
+        , segmentBytes_(segmentBytes)
+        , started_(started) { };
+
+    ~JournalWriter() {
+        close();
+    };
+
+    bool
+    append(JournalKind kind, uint32_t connection, uint64_t time, const char* data, size_t len) {
+        size_t size = (JOURNAL_RECORD_LEN + len + 7) & ~(size_t)7;
+        if (offset_ + size > size_ && !rotate(size)) {
+            ++dropped_;
+            return false;
+        }
+        auto record = reinterpret_cast<JournalRecordHeader*>(base_ + offset_);
+        record->kind = kind;
+        record->connection = connection;
+        record->length = (uint32_t)len;
+        record->time = time;
+        if (len)
+            memcpy(base_ + offset_ + JOURNAL_RECORD_LEN, data, len);
+        __atomic_store_n(&record->size, (uint32_t)size, __ATOMIC_RELEASE);
+        offset_ += size;
+        ++records_;
+        bytes_ += len;
+        return true;
+    };
+
+    // unmaps the current segment, trimmed to what was written
+    void
+    close() {
+        if (!base_)
+            return;
+        munmap(base_, size_);
+        if (ftruncate(fd_, offset_) != 0)
+            DBGOUT("journal - trimming segment failed with error: %d", errno);
+        ::close(fd_);
+        base_ = nullptr;
+        fd_ = -1;
+        offset_ = size_ = 0;
+    };
+
+    uint64_t records() const { return records_; };
+    uint64_t bytes() const { return bytes_; };
+    uint64_t dropped() const { return dropped_; };
+    uint64_t segments() const { return sequence_; };
+
+private:
+    bool
+    rotate(size_t need) {
+        close();
+        if (failed_ || need > segmentBytes_ - JOURNAL_HEADER_LEN)
+            return false;
+        char name[64];
+        snprintf(name, sizeof(name), "/%llu-%u-w%02u-%06llu.jnl",
+                 (unsigned long long)started_, (unsigned)getpid(), (unsigned)id_,
+                 (unsigned long long)sequence_);
+        auto path = dir_ + name;
+        fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        // allocated up front, so a full disk fails here instead of raising
+        // SIGBUS on a store into the mapping
+        int err = fd_ < 0 ? errno : posix_fallocate(fd_, 0, segmentBytes_);
+        void* base = err ? MAP_FAILED
+            : mmap(nullptr, segmentBytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (base == MAP_FAILED) {
+            DBGOUT("journal - can't create %s (error %d), recording stops",
+                   path.c_str(), err ? err : errno);
+            if (fd_ >= 0)
+                ::close(fd_);
+            fd_ = -1;
+            failed_ = true;
+            return false;
+        }
+        base_ = static_cast<char*>(base);
+        size_ = segmentBytes_;
+        offset_ = JOURNAL_HEADER_LEN;
+        auto header = reinterpret_cast<JournalSegmentHeader*>(base_);
+        header->magic = JOURNAL_MAGIC;
+        header->version = JOURNAL_VERSION;
+        header->writer = id_;
+        header->pid = (uint32_t)getpid();
+        header->recordLen = JOURNAL_RECORD_LEN;
+        header->started = started_;
+        header->created = journalNow();
+        header->sequence = sequence_++;
+        return true;
+    };
+
+    std::string dir_;
+    uint16_t id_;
+    size_t segmentBytes_;
+    uint64_t started_;
+
+    int fd_ {-1};
+    char* base_ {nullptr};
+    size_t size_ {0};
+    size_t offset_ {0};
+    uint64_t sequence_ {0};
+    bool failed_ {false};
+
+    uint64_t records_ {0};
+    uint64_t bytes_ {0};
+    uint64_t dropped_ {0};
+
+};
+
+// writers live until journalClose(), a thread's is made on its first record
+static std::atomic<bool> journalOn(false);
+static std::mutex journalMutex;
+static std::string journalDir;
+static size_t journalSegmentBytes = JOURNAL_SEGMENT_BYTES;
+// read before the mutex to tell a writer from an earlier journal
+static std::atomic<uint64_t> journalStarted(0);
+static std::vector<std::unique_ptr<JournalWriter>> journalWriters;
+static thread_local JournalWriter* journalWriter = nullptr;
+static thread_local uint64_t journalWriterStarted = 0;
+
+#endif
+
+bool
+journalEnabled()
+{
+#ifndef _WIN32
+    return journalOn.load(std::memory_order_relaxed);
+#else
+    return false;
+#endif
+}
+
+// starts recording into dir, which is created if missing
+int
+journalOpen(const std::string& dir, size_t segmentBytes = JOURNAL_SEGMENT_BYTES)
+{
+#ifndef _WIN32
+    std::lock_guard<std::mutex> lck(journalMutex);
+    if (journalOn)
+        return 1;
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        DBGOUT("journal - can't create %s (error %d)", dir.c_str(), errno);
+        return 1;
+    }
+    journalDir = dir;
+    journalSegmentBytes = std::max<size_t>(segmentBytes, JOURNAL_MIN_SEGMENT);
+    journalStarted = journalNow();
+    journalOn = true;
+    DBGOUT("journal - recording into %s, %zu byte segments", dir.c_str(), journalSegmentBytes);
+    return 0;
+#else
+    DBGOUT("journal - not supported on this platform");
+    return 1;
+#endif
+}
+
+void
+journalRecord(JournalKind kind, uint32_t connection, const char* data = nullptr, size_t len = 0)
+{
+#ifndef _WIN32
+    if (!journalOn.load(std::memory_order_relaxed))
+        return;
+    // a writer from an earlier journal was freed with it
+    if (!journalWriter || journalWriterStarted != journalStarted.load(std::memory_order_acquire)) {
+        ALLOC_SCOPE("journal-setup");
+        std::lock_guard<std::mutex> lck(journalMutex);
+        if (!journalOn)
+            return;
+        journalWriters.emplace_back(new JournalWriter(journalDir, (uint16_t)journalWriters.size(),
+                                                      journalSegmentBytes, journalStarted.load()));
+        journalWriter = journalWriters.back().get();
+        journalWriterStarted = journalStarted.load();
+    }
+    journalWriter->append(kind, connection, journalNow(), data, len);
+#endif
+}
+
+// stops recording; only once the receive threads have stopped, as their
+// writers go away with it
+void
+journalClose()
+{
+#ifndef _WIN32
+    std::lock_guard<std::mutex> lck(journalMutex);
+    if (!journalOn.exchange(false))
+        return;
+    uint64_t records = 0, bytes = 0, dropped = 0, segments = 0;
+    for (auto& writer : journalWriters) {
+        writer->close();
+        records += writer->records();
+        bytes += writer->bytes();
+        dropped += writer->dropped();
+        segments += writer->segments();
+    }
+    journalWriters.clear();
+    DBGOUT("journal - %llu records, %llu bytes in %llu segments, %llu dropped",
+           (unsigned long long)records, (unsigned long long)bytes,
+           (unsigned long long)segments, (unsigned long long)dropped);
+#endif
+}
+
+struct JournalEntry {
+    uint64_t time;
+    // index into sessions() plus one
+    uint32_t session;
+    uint32_t connection;
+    const char* data;
+    uint32_t length;
+    JournalKind kind;
+};
+
+// one connection from its open record, or its first one when the journal
+// started after it, to its close record or the end of its writer's files
+struct JournalSession {
+    uint32_t connection;
+    uint32_t pid;
+    uint16_t writer;
+    uint64_t opened;
+    uint64_t closed;
+    uint64_t bytes;
+    // positions in entries(), in time order
+    std::vector<uint32_t> entries;
+};
+
+// Maps every segment of a journal read-only and indexes its records by
+// time and by session. Safe to use on a journal still being written, it
+// then sees what was there when it was opened.
+class JournalReader {
+public:
+    ~JournalReader() {
+        close();
+    };
+
+    int
+    open(const std::string& dir) {
+#ifndef _WIN32
+        close();
+        DIR* d = opendir(dir.c_str());
+        if (!d) {
+            DBGOUT("journal - can't open %s (error %d)", dir.c_str(), errno);
+            return 1;
+        }
+        while (auto ent = readdir(d)) {
+            std::string name(ent->d_name);
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".jnl") == 0)
+                map(dir + "/" + name);
+        }
+        closedir(d);
+        std::sort(segments_.begin(), segments_.end(), [](const Segment& a, const Segment& b) {
+            auto& x = *a.header;
+            auto& y = *b.header;
+            return std::tie(x.started, x.pid, x.writer, x.sequence) <
+                   std::tie(y.started, y.pid, y.writer, y.sequence);
+        });
+        index();
+        return 0;
+#else
+        return 1;
+#endif
+    };
+
+    void
+    close() {
+#ifndef _WIN32
+        for (auto& segment : segments_)
+            munmap((void*)segment.base, segment.size);
+#endif
+        segments_.clear();
+        entries_.clear();
+        sessions_.clear();
+    };
+
+    size_t
+    segments() const {
+        return segments_.size();
+    };
+
+    const std::vector<JournalEntry>&
+    entries() const {
+        return entries_;
+    };
+
+    const std::vector<JournalSession>&
+    sessions() const {
+        return sessions_;
+    };
+
+    // position of the first entry at or after time
+    size_t
+    seek(uint64_t time) const {
+        return std::lower_bound(entries_.begin(), entries_.end(), time,
+            [](const JournalEntry& entry, uint64_t t) { return entry.time < t; }) - entries_.begin();
+    };
+
+    // calls fn(const JournalEntry&) for every entry in [from, to) in time
+    // order, only for one session unless session is 0; returns how many
+    template<typename Fn>
+    size_t
+    forEach(uint64_t from, uint64_t to, uint32_t session, Fn&& fn) const {
+        size_t count = 0;
+        if (!session) {
+            for (size_t i = seek(from); i < entries_.size() && entries_[i].time < to; ++i, ++count)
+                fn(entries_[i]);
+            return count;
+        }
+        if (session > sessions_.size())
+            return 0;
+        auto& positions = sessions_[session - 1].entries;
+        auto it = std::lower_bound(positions.begin(), positions.end(), from,
+            [this](uint32_t at, uint64_t t) { return entries_[at].time < t; });
+        for (; it != positions.end() && entries_[*it].time < to; ++it, ++count)
+            fn(entries_[*it]);
+        return count;
+    };
+
+private:
+    struct Segment {
+        const char* base;
+        size_t size;
+        const JournalSegmentHeader* header;
+    };
+
+#ifndef _WIN32
+    void
+    map(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 || (size_t)st.st_size < JOURNAL_HEADER_LEN) {
+            if (fd >= 0)
+                ::close(fd);
+            return;
+        }
+        void* base = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED)
+            return;
+        auto header = static_cast<const JournalSegmentHeader*>(base);
+        if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+            header->recordLen != JOURNAL_RECORD_LEN) {
+            DBGOUT("journal - skipping %s, not a segment this build reads", path.c_str());
+            munmap(base, st.st_size);
+            return;
+        }
+        segments_.push_back({ static_cast<const char*>(base), (size_t)st.st_size, header });
+    };
+#endif
+
+    uint32_t
+    startSession(const JournalSegmentHeader& header, uint32_t connection, uint64_t time) {
+        sessions_.push_back({ connection, header.pid, header.writer, time, 0, 0, {} });
+        return (uint32_t)sessions_.size();
+    };
+
+    void
+    index() {
+        // a writer's connections are only ever in its own files, so sessions
+        // are followed per writer, its segments in sequence order
+        std::unordered_map<uint32_t, uint32_t> live;
+        const JournalSegmentHeader* stream = nullptr;
+        for (auto& segment : segments_) {
+            auto& header = *segment.header;
+            if (!stream || stream->started != header.started || stream->pid != header.pid ||
+                stream->writer != header.writer)
+                live.clear();
+            stream = &header;
+            size_t at = JOURNAL_HEADER_LEN;
+            while (at + JOURNAL_RECORD_LEN <= segment.size) {
+                auto record = reinterpret_cast<const JournalRecordHeader*>(segment.base + at);
+                uint32_t size = record->size;
+                std::atomic_thread_fence(std::memory_order_acquire);
+                if (size < JOURNAL_RECORD_LEN || at + size > segment.size ||
+                    record->length > size - JOURNAL_RECORD_LEN)
+                    break;
+                auto kind = (JournalKind)record->kind;
+                auto it = live.find(record->connection);
+                uint32_t session;
+                if (it == live.end() || kind == JOURNAL_OPEN) {
+                    session = startSession(header, record->connection, record->time);
+                    live[record->connection] = session;
+                } else {
+                    session = it->second;
+                }
+                if (kind == JOURNAL_CLOSE) {
+                    sessions_[session - 1].closed = record->time;
+                    live.erase(record->connection);
+                }
+                sessions_[session - 1].bytes += record->length;
+                entries_.push_back({ record->time, session, record->connection,
+                                     segment.base + at + JOURNAL_RECORD_LEN, record->length, kind });
+                at += size;
+            }
+        }
+        std::stable_sort(entries_.begin(), entries_.end(),
+            [](const JournalEntry& a, const JournalEntry& b) { return a.time < b.time; });
+        for (size_t i = 0; i < entries_.size(); ++i)
+            sessions_[entries_[i].session - 1].entries.push_back((uint32_t)i);
+    };
+
+    std::vector<Segment> segments_;
+    std::vector<JournalEntry> entries_;
+    std::vector<JournalSession> sessions_;
+
+};
@@ -0,0 +1,141 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <functional>
+
+#include <stdint.h>
+
+#include "Log.hpp"
+
+// modifier bits, laid out like the high byte of VkKeyScanEx's result
+enum KeyModifier : uint8_t {
+    KEYMOD_NONE     = 0,
+    KEYMOD_SHIFT    = 1 << 0,
+    KEYMOD_CTRL     = 1 << 1,
+    KEYMOD_ALT      = 1 << 2,
+    KEYMOD_COUNT    = 3
+};
+
+struct KeyEvent {
+    uint16_t keycode;
+    bool up;
+};
+
+struct KeyTranslation {
+    uint16_t keycode;
+    uint8_t modifiers;
+    bool valid;
+};
+
+using LayoutId = uintptr_t;
+
+// Maps characters to key codes plus the modifiers needed to type them. The
+// platform lookup is only consulted when a layout is seen for the first
+// time; after that every character is a table read. Tables are never
+// rebuilt: a layout id names one loaded layout, and switching layouts or
+// reloading an edited one hands out a different id. Key codes are opaque
+// here, so the same table serves virtual keys on Windows and evdev codes
+// on Linux.
+class KeyTranslationTable {
+public:
+    // returns VkKeyScanEx style values: key code in the low byte, modifier
+    // bits in the high byte, -1 when the character can't be typed
+    using Lookup = std::function<int16_t(char, LayoutId)>;
+
+    KeyTranslationTable(Lookup lookup,
+                        std::array<uint16_t, KEYMOD_COUNT> modifierKeys)
+        : lookup_(std::move(lookup))
+        , modifierKeys_(modifierKeys)
+        , layout_(0)
+        , current_(nullptr) { };
+
+    // cheap when the layout hasn't changed
+    void
+    setLayout(LayoutId layout) {
+        if (current_ && layout == layout_)
+            return;
+        layout_ = layout;
+        auto it = tables_.find(layout);
+        if (it == tables_.end()) {
+            DBGOUT("keymap - building table for layout %lx", (unsigned long)layout);
+            it = tables_.emplace(layout, Table()).first;
+            for (int c = 0; c < 256; ++c) {
+                auto res = lookup_((char)c, layout);
+                auto& entry = it->second[c];
+                entry.valid = res != -1;
+                entry.keycode = (uint16_t)(res & 0xff);
+                entry.modifiers = (uint8_t)((res >> 8) & (KEYMOD_SHIFT | KEYMOD_CTRL | KEYMOD_ALT));
+            }
+        }
+        current_ = &it->second;
+    };
+
+    const KeyTranslation&
+    translate(char c) const {
+        return (*current_)[(unsigned char)c];
+    };
+
+    // appends the key presses that type text to out. Modifiers are only
+    // pressed or released when they differ between characters, and are
+    // all released at the end. Returns the number of events appended.
+    size_t
+    buildEvents(const char* text, int len, std::vector<KeyEvent>& out) const {
+        if (!current_)
+            return 0;
+        size_t before = out.size();
+        uint8_t held = KEYMOD_NONE;
+        for (int i = 0; i < len; ++i) {
+            auto& key = translate(text[i]);
+            if (!key.valid)
+                continue;
+            switchModifiers(held, key.modifiers, out);
+            held = key.modifiers;
+            out.push_back({ key.keycode, false });
+            out.push_back({ key.keycode, true });
+        }
+        switchModifiers(held, KEYMOD_NONE, out);
+        return out.size() - before;
+    };
+
+private:
+    using Table = std::array<KeyTranslation, 256>;
+
+    void
+    switchModifiers(uint8_t from, uint8_t to, std::vector<KeyEvent>& out) const {
+        // release in reverse order, press in order
+        for (int m = KEYMOD_COUNT - 1; m >= 0; --m) {
+            if ((from & (1 << m)) && !(to & (1 << m)))
+                out.push_back({ modifierKeys_[m], true });
+        }
+        for (int m = 0; m < KEYMOD_COUNT; ++m) {
+            if (!(from & (1 << m)) && (to & (1 << m)))
+                out.push_back({ modifierKeys_[m], false });
+        }
+    };
+
+    Lookup lookup_;
+    std::array<uint16_t, KEYMOD_COUNT> modifierKeys_;
+    std::unordered_map<LayoutId, Table> tables_;
+    LayoutId layout_;
+    const Table* current_;
+
+};
@@ -0,0 +1,172 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "Log.hpp"
+
+// Opt-in receive profile for machines that can give a core to input. A
+// blocking recv costs a scheduler wakeup every time data arrives, often
+// tens of microseconds; with the profile on, a read first polls the socket
+// for up to spinUs and only then parks in recv. The socket is also set up
+// for small messages:
+//   TCP_NODELAY      nothing waits on Nagle
+//   TCP_QUICKACK     acks go out at once, re-armed after every read as the
+//                    kernel drops back to delayed acks on its own
+//   SO_BUSY_POLL     the kernel polls the device queue inside a read, on
+//                    drivers that support it; a budget of its own, the
+//                    spin doesn't change it
+//   SO_RCVBUF/SNDBUF a receive buffer that never closes the window on a
+//                    burst, a send buffer small enough that stale input
+//                    can't queue up behind a slow peer
+//   SO_TIMESTAMPNS   the kernel stamps every read with its receive time
+// The timestamps let latencyReport() weigh the CPU burnt spinning against
+// the wakeup latency it saved: reads caught while spinning are compared
+// with the ones that parked. Run with a spin budget of 0 to measure the
+// parked baseline alone.
+#define LATENCY_SPIN_US         50
+#define LATENCY_BUSY_POLL_US    50
+#define LATENCY_RCVBUF          (256 * 1024)
+#define LATENCY_SNDBUF          (16 * 1024)
+
+namespace Network
+{
+
+struct LatencyProfile {
+    bool enabled;
+    // how long a read polls the socket before blocking
+    uint32_t spinUs;
+    // SO_BUSY_POLL, 0 leaves it alone
+    uint32_t busyPollUs;
+    bool noDelay;
+    bool quickAck;
+    // 0 leaves the kernel's buffer autotuning alone
+    int rcvBuf;
+    int sndBuf;
+    // SO_TIMESTAMPNS, for latencyReport()
+    bool timestamps;
+};
+
+LatencyProfile
+defaultLatencyProfile()
+{
+    return { false, 0, 0, false, false, 0, 0, false };
+}
+
+LatencyProfile
+lowLatencyProfile(uint32_t spinUs = LATENCY_SPIN_US)
+{
+    return { true, spinUs, LATENCY_BUSY_POLL_US, true, true, LATENCY_RCVBUF, LATENCY_SNDBUF, true };
+}
+
+enum class LatencyRead {
+    // data was already there, nobody waited
+    Ready,
+    // data arrived while spinning
+    Caught,
+    // the spin budget ran out and the read blocked
+    Parked
+};
+
+// process wide, every profiled read adds to it
+struct LatencyStats {
+    std::atomic<uint64_t> reads[3];
+    std::atomic<uint64_t> spinNs;
+    // kernel receive to the read returning, summed over the reads that
+    // came with a kernel timestamp
+    std::atomic<uint64_t> wakeNs[3];
+    std::atomic<uint64_t> stamped[3];
+};
+
+static LatencyStats latencyStats {};
+
+int64_t
+latencyWallNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// stampNs is the kernel's wall clock receive timestamp, 0 if there wasn't one
+void
+latencyRecord(LatencyRead kind, uint64_t spinNs, int64_t stampNs)
+{
+    auto k = (int)kind;
+    latencyStats.reads[k].fetch_add(1, std::memory_order_relaxed);
+    if (spinNs)
+        latencyStats.spinNs.fetch_add(spinNs, std::memory_order_relaxed);
+    if (stampNs) {
+        auto wake = latencyWallNanos() - stampNs;
+        if (wake > 0) {
+            latencyStats.wakeNs[k].fetch_add((uint64_t)wake, std::memory_order_relaxed);
+            latencyStats.stamped[k].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+// prints what spinning cost and what it bought, if anything was profiled
+void
+latencyReport()
+{
+    uint64_t reads[3], wake[3], stamped[3];
+    uint64_t total = 0;
+    for (int k = 0; k < 3; ++k) {
+        reads[k] = latencyStats.reads[k].load();
+        wake[k] = latencyStats.wakeNs[k].load();
+        stamped[k] = latencyStats.stamped[k].load();
+        total += reads[k];
+    }
+    if (!total)
+        return;
+    auto meanUs = [&](LatencyRead kind) {
+        auto k = (int)kind;
+        return stamped[k] ? wake[k] / 1e3 / stamped[k] : 0.0;
+    };
+    auto caught = reads[(int)LatencyRead::Caught];
+    auto parked = reads[(int)LatencyRead::Parked];
+    double spinMs = latencyStats.spinNs.load() / 1e6;
+    fprintf(stderr, "latency - %llu reads: %llu ready, %llu caught spinning, %llu parked\n",
+            (unsigned long long)total, (unsigned long long)reads[(int)LatencyRead::Ready],
+            (unsigned long long)caught, (unsigned long long)parked);
+    fprintf(stderr, "latency - spun %.1f ms of CPU, %.2f us per read\n",
+            spinMs, spinMs * 1e3 / total);
+    if (!stamped[(int)LatencyRead::Caught] || !stamped[(int)LatencyRead::Parked]) {
+        fprintf(stderr, "latency - wakeup %.2f us caught, %.2f us parked, not enough of "
+                "both to compare\n", meanUs(LatencyRead::Caught), meanUs(LatencyRead::Parked));
+        return;
+    }
+    auto gainUs = meanUs(LatencyRead::Parked) - meanUs(LatencyRead::Caught);
+    fprintf(stderr, "latency - wakeup %.2f us caught vs %.2f us parked\n",
+            meanUs(LatencyRead::Caught), meanUs(LatencyRead::Parked));
+    if (gainUs <= 0) {
+        // typically a peer starved of the core we spun on
+        fprintf(stderr, "latency - spinning saved nothing, the plain profile is cheaper\n");
+        return;
+    }
+    fprintf(stderr, "latency - %.2f us saved per caught read, %.1f ms in total, "
+            "%.1f us of CPU per us saved\n", gainUs, gainUs * caught / 1e3,
+            spinMs * 1e3 / (gainUs * caught));
+}
+
+}
@@ -0,0 +1,463 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define LEGACY_PARSER_X86
+#include <immintrin.h>
+#endif
+
+#if defined(LEGACY_PARSER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define LEGACY_PARSER_DISPATCH
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#endif
+
+#include "Log.hpp"
+
+// Parser for the pre-framing text protocol:
+//   client -> server   '{'j0':{'lx':'%d','ly':'%d','b0':'%d','b1':'%d'}}'
+//   remote -> server   k:<text>  m:<dx>,<dy>  ld  lu
+// Messages may arrive back to back in one buffer, optionally separated by
+// '\n' or '\0'. A first pass finds every structural character with SIMD and
+// records its offset; the second pass only walks those offsets. A joystick
+// frame cut off by the end of a buffer is kept in the connection's
+// LegacyCarry and finished with the next one, never emitted half read.
+
+// longer unterminated tails are garbage rather than a frame cut in two
+#define LEGACY_MAX_CARRY    256
+
+namespace Network
+{
+
+enum class LegacyKind {
+    Joystick,
+    Text,
+    MouseMove,
+    MouseDown,
+    MouseUp
+};
+
+enum LegacyAxis {
+    LEGACY_LX = 0,
+    LEGACY_LY,
+    LEGACY_B0,
+    LEGACY_B1,
+    LEGACY_VALUE_COUNT
+};
+
+struct LegacyMessage {
+    LegacyKind kind;
+    int pad;
+    int values[LEGACY_VALUE_COUNT];
+    const char* text;
+    int textLen;
+};
+
+// what a connection's last buffer ended with that wasn't a whole message
+struct LegacyCarry {
+    size_t len {0};
+    char data[LEGACY_MAX_CARRY];
+};
+
+enum class ScanLevel {
+    Scalar,
+    SSE42,
+    AVX2
+};
+
+static const char legacyStructurals[] = { '\'', ':', ',', '{', '}', '\n', '\0' };
+constexpr int LEGACY_STRUCTURAL_COUNT = sizeof(legacyStructurals);
+
+bool
+isLegacyStructural(char c)
+{
+    return c == '\'' || c == ':' || c == ',' || c == '{' ||
+           c == '}' || c == '\n' || c == '\0';
+}
+
+#ifdef LEGACY_PARSER_X86
+int
+_trailingZeros(uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#endif
+}
+#endif
+
+size_t
+scanStructuralsScalar(const char* buf, size_t begin, size_t len, uint32_t* out)
+{
+    size_t count = 0;
+    for (size_t i = begin; i < len; ++i) {
+        if (isLegacyStructural(buf[i]))
+            out[count++] = (uint32_t)i;
+    }
+    return count;
+}
+
+#ifdef LEGACY_PARSER_DISPATCH
+TARGET_SSE42 size_t
+scanStructuralsSSE42(const char* buf, size_t len, uint32_t* out)
+{
+    const __m128i set = _mm_loadu_si128(
+        reinterpret_cast<const __m128i*>("':,{}\n\0\0\0\0\0\0\0\0\0\0"));
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(buf + i));
+        __m128i hits = _mm_cmpestrm(set, LEGACY_STRUCTURAL_COUNT, chunk, 16,
+                                    _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_BIT_MASK);
+        uint32_t mask = (uint32_t)_mm_cvtsi128_si32(hits) & 0xffff;
+        while (mask) {
+            out[count++] = (uint32_t)(i + _trailingZeros(mask));
+            mask &= mask - 1;
+        }
+    }
+    return count + scanStructuralsScalar(buf, i, len, out + count);
+}
+
+TARGET_AVX2 size_t
+scanStructuralsAVX2(const char* buf, size_t len, uint32_t* out)
+{
+    __m256i needles[LEGACY_STRUCTURAL_COUNT];
+    for (int n = 0; n < LEGACY_STRUCTURAL_COUNT; ++n)
+        needles[n] = _mm256_set1_epi8(legacyStructurals[n]);
+
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(buf + i));
+        __m256i hits = _mm256_cmpeq_epi8(chunk, needles[0]);
+        for (int n = 1; n < LEGACY_STRUCTURAL_COUNT; ++n)
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, needles[n]));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+        while (mask) {
+            out[count++] = (uint32_t)(i + _trailingZeros(mask));
+            mask &= mask - 1;
+        }
+    }
+    return count + scanStructuralsScalar(buf, i, len, out + count);
+}
+#endif
+
+ScanLevel
+detectScanLevel()
+{
+#ifdef LEGACY_PARSER_DISPATCH
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return ScanLevel::AVX2;
+    if (__builtin_cpu_supports("sse4.2"))
+        return ScanLevel::SSE42;
+#endif
+    return ScanLevel::Scalar;
+}
+
+class LegacyParser {
+public:
+    LegacyParser(ScanLevel level = detectScanLevel())
+        : level_(level) {
+        index_.resize(DEFAULT_LEGACY_INDEX + LEGACY_MAX_CARRY);
+        joined_.resize(DEFAULT_LEGACY_INDEX + LEGACY_MAX_CARRY);
+    };
+
+    ScanLevel
+    level() const {
+        return level_;
+    };
+
+    // calls sink(const LegacyMessage&) for every message in buf, returns
+    // how many were found. A frame buf ends in the middle of is dropped.
+    template<typename Sink>
+    size_t
+    parse(const char* buf, size_t len, Sink&& sink) {
+        size_t tail;
+        return parseAll(buf, len, tail, sink);
+    };
+
+    // the same for one connection's stream: what carry holds from its last
+    // buffer goes first, and a frame buf ends in the middle of is kept there
+    template<typename Sink>
+    size_t
+    parse(const char* buf, size_t len, LegacyCarry& carry, Sink&& sink) {
+        if (carry.len) {
+            if (joined_.size() < carry.len + len)
+                joined_.resize(carry.len + len);
+            memcpy(joined_.data(), carry.data, carry.len);
+            memcpy(joined_.data() + carry.len, buf, len);
+            buf = joined_.data();
+            len += carry.len;
+            carry.len = 0;
+        }
+        size_t tail;
+        auto found = parseAll(buf, len, tail, sink);
+        if (len - tail > LEGACY_MAX_CARRY) {
+            DBGOUT("legacy - dropping %d unterminated bytes", (int)(len - tail));
+        } else {
+            memcpy(carry.data, buf + tail, len - tail);
+            carry.len = len - tail;
+        }
+        return found;
+    };
+
+private:
+    static constexpr size_t DEFAULT_LEGACY_INDEX = 8192;
+
+    // tail is set to where an unfinished message starts, len if none
+    template<typename Sink>
+    size_t
+    parseAll(const char* buf, size_t len, size_t& tail, Sink&& sink) {
+        if (index_.size() < len + 1)
+            index_.resize(len + 1);
+        count_ = scan(buf, len, index_.data());
+        buf_ = buf;
+        len_ = len;
+        cursor_ = 0;
+        tail = len;
+
+        size_t found = 0;
+        size_t pos = 0;
+        while (pos < len) {
+            LegacyMessage msg;
+            memset(&msg, 0, sizeof(msg));
+            incomplete_ = false;
+            size_t end = parseOne(pos, msg);
+            if (end == pos) {
+                if (incomplete_) {
+                    tail = pos;
+                    break;
+                }
+                // unknown or malformed input
+                pos = resync(pos);
+                continue;
+            }
+            sink(msg);
+            ++found;
+            pos = skipSeparators(end);
+        }
+        return found;
+    };
+
+    size_t
+    scan(const char* buf, size_t len, uint32_t* out) {
+#ifdef LEGACY_PARSER_DISPATCH
+        switch (level_) {
+        case ScanLevel::AVX2:
+            return scanStructuralsAVX2(buf, len, out);
+        case ScanLevel::SSE42:
+            return scanStructuralsSSE42(buf, len, out);
+        default:
+            break;
+        }
+#endif
+        return scanStructuralsScalar(buf, 0, len, out);
+    };
+
+    // offset of the first structural at or after pos, or len_
+    size_t
+    structuralFrom(size_t pos) {
+        while (cursor_ < count_ && index_[cursor_] < pos)
+            ++cursor_;
+        return cursor_ < count_ ? index_[cursor_] : len_;
+    };
+
+    // where parsing picks up after garbage at pos: just past the next
+    // separator or at the next frame's opening, whichever comes first. A
+    // failed frame may have walked the cursor past either, so it restarts
+    // from pos.
+    size_t
+    resync(size_t pos) {
+        cursor_ = std::lower_bound(index_.begin(), index_.begin() + count_,
+                                   (uint32_t)(pos + 1)) - index_.begin();
+        size_t at = structuralFrom(pos + 1);
+        while (at < len_) {
+            if (buf_[at] == '\n' || buf_[at] == '\0')
+                return at + 1;
+            if (buf_[at] == '\'' && at + 1 < len_ && buf_[at + 1] == '{')
+                return at;
+            at = structuralFrom(at + 1);
+        }
+        return len_;
+    };
+
+    size_t
+    nextSeparator(size_t pos) {
+        size_t at = structuralFrom(pos);
+        while (at < len_ && buf_[at] != '\n' && buf_[at] != '\0')
+            at = structuralFrom(at + 1);
+        return at;
+    };
+
+    size_t
+    skipSeparators(size_t pos) {
+        while (pos < len_ && (buf_[pos] == '\n' || buf_[pos] == '\0' ||
+                              buf_[pos] == ' ' || buf_[pos] == '\r'))
+            ++pos;
+        return pos;
+    };
+
+    // parses a signed decimal at pos into value, returns the offset after it;
+    // values past what an int holds saturate, however many digits follow
+    size_t
+    parseInt(size_t pos, int& value) {
+        bool negative = false;
+        if (pos < len_ && (buf_[pos] == '-' || buf_[pos] == '+')) {
+            negative = buf_[pos] == '-';
+            ++pos;
+        }
+        const int64_t limit = negative ? -(int64_t)INT_MIN : INT_MAX;
+        int64_t result = 0;
+        size_t start = pos;
+        while (pos < len_ && (unsigned)(buf_[pos] - '0') < 10) {
+            result = std::min(result * 10 + (buf_[pos] - '0'), limit);
+            ++pos;
+        }
+        value = (int)(negative ? -result : result);
+        return pos == start ? start : pos;
+    };
+
+    // returns the offset just past the message at pos, or pos if there isn't one
+    size_t
+    parseOne(size_t pos, LegacyMessage& msg) {
+        const char* p = buf_ + pos;
+        size_t left = len_ - pos;
+
+        if (left >= 2 && p[0] == '\'' && p[1] == '{')
+            return parseJoystick(pos, msg);
+
+        // the first byte of a message, the rest comes with the next read
+        if (left == 1 && (p[0] == '\'' || p[0] == 'l' || p[0] == 'k' || p[0] == 'm')) {
+            incomplete_ = true;
+            return pos;
+        }
+
+        if (left >= 2 && p[0] == 'l' && (p[1] == 'd' || p[1] == 'u')) {
+            msg.kind = p[1] == 'd' ? LegacyKind::MouseDown : LegacyKind::MouseUp;
+            return pos + 2;
+        }
+
+        if (left >= 2 && p[0] == 'k' && p[1] == ':') {
+            // text runs to the next separator, or the end of the buffer
+            size_t end = nextSeparator(pos + 2);
+            msg.kind = LegacyKind::Text;
+            msg.text = buf_ + pos + 2;
+            msg.textLen = (int)(end - pos - 2);
+            return end;
+        }
+
+        if (left >= 2 && p[0] == 'm' && p[1] == ':') {
+            msg.kind = LegacyKind::MouseMove;
+            size_t at = parseInt(pos + 2, msg.values[0]);
+            if (at < len_ && buf_[at] == ',')
+                at = parseInt(at + 1, msg.values[1]);
+            return at;
+        }
+
+        return pos;
+    };
+
+    // returns pos for a malformed frame, and also sets incomplete_ if the
+    // buffer ends before the frame does
+    size_t
+    parseJoystick(size_t pos, LegacyMessage& msg) {
+        msg.kind = LegacyKind::Joystick;
+        int depth = 0;
+        size_t keyStart = 0, keyEnd = 0;
+        // skip the frame's opening quote
+        size_t at = structuralFrom(pos + 1);
+        while (at < len_) {
+            char c = buf_[at];
+            if (c == '{') {
+                ++depth;
+            } else if (c == '}') {
+                if (--depth == 0) {
+                    // closing quote of the frame
+                    if (at + 1 < len_ && buf_[at + 1] == '\'')
+                        return at + 2;
+                    return at + 1;
+                }
+            } else if (c == '\'') {
+                // another frame opening: this one was cut short
+                if (at + 1 < len_ && buf_[at + 1] == '{')
+                    return pos;
+                size_t close = structuralFrom(at + 1);
+                if (close >= len_)
+                    break;
+                // no key or value is followed by '{', a frame opening is
+                if (buf_[close] != '\'' || (close + 1 < len_ && buf_[close + 1] == '{'))
+                    return pos;
+                keyStart = at + 1;
+                keyEnd = close;
+                at = close;
+            } else if (c == ':') {
+                size_t next = structuralFrom(at + 1);
+                if (next < len_ && buf_[next] == '\'' && keyEnd - keyStart == 2) {
+                    int value = 0;
+                    parseInt(next + 1, value);
+                    storeValue(buf_ + keyStart, value, msg);
+                } else if (next < len_ && buf_[next] == '{' &&
+                           keyEnd > keyStart && buf_[keyStart] == 'j') {
+                    parseInt(keyStart + 1, msg.pad);
+                }
+            } else if (c == '\n' || c == '\0') {
+                return pos;
+            }
+            at = structuralFrom(at + 1);
+        }
+        incomplete_ = true;
+        return pos;
+    };
+
+    void
+    storeValue(const char* key, int value, LegacyMessage& msg) {
+        if (key[0] == 'l' && key[1] == 'x')
+            msg.values[LEGACY_LX] = value;
+        else if (key[0] == 'l' && key[1] == 'y')
+            msg.values[LEGACY_LY] = value;
+        else if (key[0] == 'b' && key[1] == '0')
+            msg.values[LEGACY_B0] = value;
+        else if (key[0] == 'b' && key[1] == '1')
+            msg.values[LEGACY_B1] = value;
+    };
+
+    ScanLevel level_;
+    std::vector<uint32_t> index_;
+    // a carried tail and the next buffer, back to back
+    std::vector<char> joined_;
+    bool incomplete_ {false};
+    size_t count_ {0};
+    size_t cursor_ {0};
+    const char* buf_ {nullptr};
+    size_t len_ {0};
+
+};
+
+}
@@ -0,0 +1,451 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <map>
+#include <list>
+#include <memory>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cmath>
+
+#include <stdint.h>
+
+#include "Log.hpp"
+#include "Frame.hpp"
+#include "Client.hpp"
+#include "Server.hpp"
+#include "ThreadRole.hpp"
+
+#define DEFAULT_NETEM_PORT  8890
+#define NETEM_PARETO_ALPHA  2.5
+#define NETEM_PI            3.14159265358979323846
+
+namespace Network
+{
+
+enum class NetEmDistribution {
+    Uniform,
+    Normal,
+    Pareto
+};
+
+struct NetEmConfig {
+    uint64_t seed {1};
+    // one way delay added to every message, and its spread
+    double delayMs {0};
+    double jitterMs {0};
+    NetEmDistribution distribution {NetEmDistribution::Uniform};
+    // Gilbert-Elliott loss: chance of entering the lossy state, and of
+    // staying in it (0 gives independent losses)
+    double lossRate {0};
+    double lossBurst {0};
+    // a lost message is delivered this much later instead of dropped, the
+    // way tcp would retransmit it, holding back everything behind it
+    double retransmitMs {0};
+    // chance a message skips the delay and overtakes the ones queued
+    double reorderRate {0};
+    // 0 for unlimited
+    double bandwidthKbps {0};
+};
+
+uint64_t
+splitmix64(uint64_t x)
+{
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+// Decides the fate of each message on one direction of one connection.
+// Every decision comes from its own generator, so for a given seed the
+// sequence of losses, delays and reorders is the same on every run and
+// every platform; only the bandwidth queue depends on arrival times.
+class NetEmModel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Verdict {
+        bool drop;
+        Clock::time_point due;
+    };
+
+    NetEmModel(const NetEmConfig& config, uint64_t seed)
+        : config_(config)
+        , state_(seed)
+        , lossy_(false) { };
+
+    // droppable: false for streams that can't survive a hole, e.g. legacy
+    // text, whose losses always turn into retransmissions
+    Verdict
+    next(size_t bytes, Clock::time_point now, bool droppable) {
+        Verdict verdict { false, now };
+
+        lossy_ = uniform() < (lossy_ ? config_.lossBurst : config_.lossRate);
+        bool reorder = uniform() < config_.reorderRate;
+        auto delay = sampleDelayMs();
+
+        if (lossy_ && droppable && config_.retransmitMs <= 0) {
+            verdict.drop = true;
+            return verdict;
+        }
+
+        auto departs = now;
+        if (config_.bandwidthKbps > 0) {
+            departs = std::max(now, linkFree_);
+            linkFree_ = departs + toDuration(bytes * 8 / config_.bandwidthKbps);
+            departs = linkFree_;
+        }
+
+        if (reorder && !lossy_) {
+            verdict.due = departs;
+            return verdict;
+        }
+        verdict.due = departs + toDuration(delay + (lossy_ ? config_.retransmitMs : 0));
+        // in order delivery unless reordered, so jitter never overtakes
+        verdict.due = std::max(verdict.due, lastDue_);
+        lastDue_ = verdict.due;
+        return verdict;
+    };
+
+private:
+    static Clock::duration
+    toDuration(double ms) {
+        return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::milli>(ms));
+    };
+
+    // [0, 1) from the top 53 bits, identical on every standard library
+    double
+    uniform() {
+        state_ = splitmix64(state_);
+        return (state_ >> 11) * (1.0 / 9007199254740992.0);
+    };
+
+    double
+    sampleDelayMs() {
+        double delay = config_.delayMs;
+        switch (config_.distribution) {
+        case NetEmDistribution::Uniform:
+            delay += config_.jitterMs * (2 * uniform() - 1);
+            break;
+        case NetEmDistribution::Normal: {
+            // box-muller
+            double u = std::max(uniform(), 1e-12);
+            double v = uniform();
+            delay += config_.jitterMs * std::sqrt(-2 * std::log(u)) * std::cos(2 * NETEM_PI * v);
+            break;
+        }
+        case NetEmDistribution::Pareto: {
+            // heavy tailed, scaled so the mean extra delay is jitterMs
+            double u = std::max(uniform(), 1e-6);
+            delay += config_.jitterMs * (NETEM_PARETO_ALPHA - 1) *
+                     (std::pow(u, -1 / NETEM_PARETO_ALPHA) - 1);
+            break;
+        }
+        }
+        return std::max(0.0, delay);
+    };
+
+    NetEmConfig config_;
+    uint64_t state_;
+    bool lossy_;
+    Clock::time_point linkFree_;
+    Clock::time_point lastDue_;
+
+};
+
+// One direction of a proxied connection: messages wait in a queue ordered
+// by delivery time and a writer thread sends them out when due.
+class NetEmPipe {
+public:
+    using Clock = NetEmModel::Clock;
+
+    NetEmPipe(const NetEmConfig& config, uint64_t seed, Socket out)
+        : model_(config, seed)
+        , out_(out)
+        , alive_(true)
+        , delivered_(0)
+        , dropped_(0) {
+        writer_ = std::thread([this]() {
+            applyThreadRole(ThreadRole::NetEm);
+            writeLoop();
+        });
+    };
+
+    ~NetEmPipe() {
+        stop();
+        if (writer_.joinable())
+            writer_.join();
+    };
+
+    void
+    push(std::string&& bytes, bool droppable) {
+        {
+            std::lock_guard<std::mutex> lck(mutex_);
+            if (!alive_)
+                return;
+            auto verdict = model_.next(bytes.size(), Clock::now(), droppable);
+            if (verdict.drop) {
+                ++dropped_;
+                return;
+            }
+            // equal keys keep their insertion order
+            queue_.emplace(verdict.due, std::move(bytes));
+        }
+        cv_.notify_one();
+    };
+
+    void
+    stop() {
+        {
+            std::lock_guard<std::mutex> lck(mutex_);
+            if (!alive_)
+                return;
+            alive_ = false;
+        }
+        cv_.notify_one();
+    };
+
+    bool
+    isAlive() {
+        std::lock_guard<std::mutex> lck(mutex_);
+        return alive_;
+    };
+
+    size_t
+    delivered() {
+        std::lock_guard<std::mutex> lck(mutex_);
+        return delivered_;
+    };
+
+    size_t
+    dropped() {
+        std::lock_guard<std::mutex> lck(mutex_);
+        return dropped_;
+    };
+
+private:
+    void
+    writeLoop() {
+        std::unique_lock<std::mutex> lck(mutex_);
+        while (alive_) {
+            if (queue_.empty()) {
+                cv_.wait(lck);
+                continue;
+            }
+            auto next = queue_.begin();
+            if (next->first > Clock::now()) {
+                cv_.wait_until(lck, next->first);
+                continue;
+            }
+            auto bytes = std::move(next->second);
+            queue_.erase(next);
+            lck.unlock();
+            auto res = writeToSocket(out_, bytes.data(), bytes.size());
+            lck.lock();
+            if (res == SOCKET_ERROR) {
+                alive_ = false;
+                break;
+            }
+            ++delivered_;
+        }
+        _shutdown(out_);
+    };
+
+    NetEmModel model_;
+    Socket out_;
+    std::thread writer_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::multimap<Clock::time_point, std::string> queue_;
+    bool alive_;
+    size_t delivered_;
+    size_t dropped_;
+
+};
+
+// Sits between a client and a server and puts every message through a
+// NetEmModel in each direction. Framed streams are handled as whole
+// messages, so losses and reorders never corrupt the framing; legacy text
+// streams are only delayed, losses become retransmissions.
+class NetEmProxy {
+public:
+    NetEmProxy()
+        : targetPort_(DEFAULT_PORT)
+        , connections_(0)
+        , running_(false) { };
+
+    ~NetEmProxy() {
+        stop();
+    };
+
+    int
+    start(const NetEmConfig& config, PortNumber port,
+          const std::string& targetHost, PortNumber targetPort) {
+        DBGOUT("netem - starting, forwarding to %s:%d...", targetHost.c_str(), targetPort);
+        config_ = config;
+        targetHost_ = targetHost;
+        targetPort_ = targetPort;
+        if (listener_.start(port) != 0)
+            return 1;
+        running_ = true;
+        return 0;
+    };
+
+    // blocks until stop() is called
+    int
+    run() {
+        if (!running_)
+            return 1;
+        while (running_) {
+            Socket downstream = listener_.acceptConnection();
+            if (downstream == INVALID_SOCKET)
+                continue;
+            Client target;
+            if (target.connectToHost(targetHost_, targetPort_) != 0) {
+                DBGOUT("netem - unable to reach the target");
+                _close(downstream);
+                continue;
+            }
+            std::lock_guard<std::mutex> lck(mutex_);
+            prune();
+            sessions_.emplace_back(new Session(config_, connections_++,
+                                               downstream, target.getSocket()));
+        }
+        std::list<std::unique_ptr<Session>> sessions;
+        {
+            std::lock_guard<std::mutex> lck(mutex_);
+            sessions.swap(sessions_);
+        }
+        sessions.clear();
+        return 0;
+    };
+
+    void
+    stop() {
+        if (!running_.exchange(false))
+            return;
+        DBGOUT("netem - stopping...");
+        listener_.stopListening();
+        std::lock_guard<std::mutex> lck(mutex_);
+        for (auto& session : sessions_)
+            session->stop();
+    };
+
+private:
+    // one proxied connection: a reader thread and a pipe per direction
+    class Session {
+    public:
+        Session(const NetEmConfig& config, uint64_t index, Socket downstream, Socket upstream)
+            : downstream_(downstream)
+            , upstream_(upstream)
+            , toUpstream_(config, splitmix64(config.seed ^ (index * 2)), upstream)
+            , toDownstream_(config, splitmix64(config.seed ^ (index * 2 + 1)), downstream) {
+            readers_[0] = std::thread([this]() {
+                applyThreadRole(ThreadRole::NetEm);
+                forward(downstream_, toUpstream_);
+            });
+            readers_[1] = std::thread([this]() {
+                applyThreadRole(ThreadRole::NetEm);
+                forward(upstream_, toDownstream_);
+            });
+        };
+
+        ~Session() {
+            stop();
+            for (auto& reader : readers_)
+                reader.join();
+            DBGOUT("netem - session done, up %d/%d down %d/%d delivered/dropped",
+                   (int)toUpstream_.delivered(), (int)toUpstream_.dropped(),
+                   (int)toDownstream_.delivered(), (int)toDownstream_.dropped());
+            toUpstream_.stop();
+            toDownstream_.stop();
+            _close(downstream_);
+            _close(upstream_);
+        };
+
+        void
+        stop() {
+            _shutdown(downstream_);
+            _shutdown(upstream_);
+        };
+
+        bool
+        isAlive() {
+            return toUpstream_.isAlive() && toDownstream_.isAlive();
+        };
+
+    private:
+        void
+        forward(Socket from, NetEmPipe& pipe) {
+            char buf[DEFAULT_BUFLEN];
+            FrameReader reader;
+            auto onMessage = [&pipe](Channel channel, uint8_t stream, const char* data, int len) {
+                std::string frames;
+                encodeFrames(frames, channel, stream, data, len);
+                pipe.push(std::move(frames), true);
+            };
+            auto onLegacy = [&pipe](const char* data, int len) {
+                pipe.push(std::string(data, len), false);
+            };
+            while (true) {
+                int res = (int)recv(from, buf, sizeof(buf), 0);
+                if (res <= 0 || !reader.feed(buf, res, onMessage, onLegacy))
+                    break;
+            }
+            // a hang up on either side ends both directions
+            pipe.stop();
+            stop();
+        };
+
+        Socket downstream_;
+        Socket upstream_;
+        NetEmPipe toUpstream_;
+        NetEmPipe toDownstream_;
+        std::thread readers_[2];
+
+    };
+
+    // called with mutex_ held
+    void
+    prune() {
+        sessions_.remove_if([](const std::unique_ptr<Session>& session) {
+            return !session->isAlive();
+        });
+    };
+
+    NetEmConfig config_;
+    std::string targetHost_;
+    PortNumber targetPort_;
+    Server listener_;
+
+    std::mutex mutex_;
+    std::list<std::unique_ptr<Session>> sessions_;
+    uint64_t connections_;
+    std::atomic<bool> running_;
+
+};
+
+}
@@ -1,186 +1,500 @@
-/*
-*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
-*
-*  This program is free software; you can redistribute it and/or modify
-*  it under the terms of the GNU General Public License as published by
-*  the Free Software Foundation; either version 3 of the License, or
-*  (at your option) any later version.
-*
-*  This program is distributed in the hope that it will be useful,
-*  but WITHOUT ANY WARRANTY; without even the implied warranty of
-*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-*  GNU General Public License for more details.
-*
-*  You should have received a copy of the GNU General Public License
-*  along with this program. If not, see <https://www.gnu.org/licenses/>.
-*/
-
-#pragma once
-
-#include <functional>
-#include <string>
-#include <future>
-
-#include "Log.hpp"
-#include "Server.hpp"
-#include "Client.hpp"
-#include "Timer.hpp"
-
-namespace Network
-{
-
-class Networker
-{
-public:
-    Networker()
-        : server_()
-        , client_() {
-        init();
-    };
-    ~Networker() {
-        cleanup();
-    };
-
-    int
-    init() {
-#ifdef _WIN32
-        WSADATA wsaData;
-        DBGOUT("starting Winsock...");
-        int res = WSAStartup(MAKEWORD(2, 2), &wsaData);
-        if (res != 0) {
-            DBGOUT("WSAStartup failed with error: %d", res);
-            return res;
-        }
-#endif
-        return 0;
-    };
-
-    void
-    cleanup() {
-        closeServer();
-#ifdef _WIN32
-        DBGOUT("cleaning up Winsock...");
-        WSACleanup();
-#endif
-    }
-
-    // server
-    int
-    startServer(PortNumber port) {
-        return server_.start(port);
-    };
-
-    int
-    runServer(SocketCallback&& recvcb) {
-        server_.setRecvCb(recvcb);
-        auto res = serverRecvHandlerAsync();
-        res.get();
-        return server_.closeclientSocket();
-    };
-
-    void
-    setRecvCb(SocketCallback& recvcb) {
-        server_.setRecvCb(recvcb);
-    };
-
-    std::future<void>
-    serverRecvHandlerAsync() {
-        return std::async([this]() {
-            Socket ClientSocket = server_.acceptClient();
-            DBGOUT("rx - recvHandler - start...");
-            int     recvResult = 1;
-            char    recvbuf[DEFAULT_BUFLEN];
-            int     recvbuflen = DEFAULT_BUFLEN;
-
-            while (recvResult > 0) {
-                DBGOUT("rx - waiting on socket...");
-                recvResult = recv(ClientSocket, recvbuf, recvbuflen, 0);
-                if (recvResult > 0) {
-                    server_.getRecvCb()(ClientSocket, recvbuf, recvResult);
-                } else if (recvResult == 0) {
-                    DBGOUT("rx - connection closed by client...");
-                    break;
-                } else {
-                    DBGOUT("rx - recv failed with error: %d", _socketError());
-                    break;
-                }
-            };
-            DBGOUT("rx - recvHandler - done");
-        });
-    };
-
-    void
-    closeServer() {
-        if (server_.isRunning()) {
-            DBGOUT("closing server...");
-            server_.stopListening();
-        }
-    };
-
-    bool
-    getServerStatus() {
-        return server_.isRunning();
-    }
-
-    // client
-    int
-    startClient(const std::string& host, PortNumber port) {
-        int res = client_.connectToHost(host, port);
-        if (res == 0)
-            clientRecvTask_ = clientRecvHandlerAsync();
-        return res;
-    };
-
-    std::future<void>
-    clientRecvHandlerAsync() {
-        return std::async([this]() {
-            DBGOUT("rx - recvHandler - start...");
-            Socket Socket = client_.getSocket();
-            int     recvResult = 1;
-            char    recvbuf[DEFAULT_BUFLEN];
-            int     recvbuflen = DEFAULT_BUFLEN;
-
-            while (recvResult > 0 && client_.isConnected()) {
-                DBGOUT("rx - waiting on socket...");
-                recvResult = recv(Socket, recvbuf, recvbuflen, 0);
-                if (recvResult > 0) {
-                    client_.getRecvCb()(Socket, recvbuf, recvResult);
-                } else if (recvResult == 0) {
-                    DBGOUT("rx - connection closed by client...");
-                    break;
-                } else {
-                    DBGOUT("rx - recv failed with error: %d", _socketError());
-                    break;
-                }
-            };
-            DBGOUT("rx - recvHandler - done");
-        });
-    };
-
-    void
-    writeToHost(const std::string& data) {
-        client_.write(data);
-    };
-
-    int
-    startStreaming( SocketCallback&& recvcb, SocketHandler&& writer) {
-        client_.setRecvCb(recvcb);
-        auto txHandler = client_.setSendHandler(writer);
-        txHandler.get();
-        auto res = client_.disconnect();
-        if (res == SOCKET_ERROR) {
-            DBGOUT("startStreaming - disconnect failed with error: %d", _socketError());
-            return 1;
-        }
-        return 0;
-    };
-
-private:
-    std::future<void> clientRecvTask_;
-
-    Server server_;
-    Client client_;
-
-};
-
-}
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <functional>
+#include <string>
+#include <mutex>
+
+#include "Log.hpp"
+#include "AllocTrack.hpp"
+#include "PerfCounters.hpp"
+#include "Trace.hpp"
+#include "Journal.hpp"
+#include "Frame.hpp"
+#include "Server.hpp"
+#include "Client.hpp"
+#include "Relay.hpp"
+#include "NetEm.hpp"
+#include "ShardedServer.hpp"
+#include "ShmRing.hpp"
+#include "Timer.hpp"
+#include "ThreadRole.hpp"
+#include "Threadpool.hpp"
+
+namespace Network
+{
+
+enum class Transport {
+    Tcp,
+    SharedMemory
+};
+
+class Networker
+{
+public:
+    Networker()
+        : transport_(Transport::Tcp)
+        , shmName_(DEFAULT_SHM_NAME)
+        , server_()
+        , client_()
+        , executor_(ThreadRole::Network) {
+        init();
+    };
+    ~Networker() {
+        cleanup();
+    };
+
+    int
+    init() {
+#ifdef _WIN32
+        WSADATA wsaData;
+        DBGOUT("starting Winsock...");
+        int res = WSAStartup(MAKEWORD(2, 2), &wsaData);
+        if (res != 0) {
+            DBGOUT("WSAStartup failed with error: %d", res);
+            return res;
+        }
+#endif
+        return 0;
+    };
+
+    void
+    cleanup() {
+        closeShardedServer();
+        closeNetEm();
+        closeRelay();
+        closeServer();
+#ifdef _WIN32
+        DBGOUT("cleaning up Winsock...");
+        WSACleanup();
+#endif
+    }
+
+    // selects how startServer/startClient reach the peer; the shared memory
+    // transport only works between processes on the same host
+    void
+    setTransport(Transport transport, const std::string& shmName = DEFAULT_SHM_NAME) {
+        transport_ = transport;
+        shmName_ = shmName;
+    };
+
+    Transport
+    getTransport() {
+        return transport_;
+    };
+
+    // trades CPU for receive latency on the plain server's and the client's
+    // TCP connections, see LatencyProfile.hpp; call before connecting
+    void
+    setLatencyProfile(const LatencyProfile& profile) {
+        server_.setLatencyProfile(profile);
+        client_.setLatencyProfile(profile);
+    };
+
+    // server
+    int
+    startServer(PortNumber port) {
+        if (transport_ == Transport::SharedMemory)
+            return serverLink_.listen(shmName_);
+        return server_.start(port);
+    };
+
+    int
+    runServer(SocketCallback&& recvcb) {
+        server_.setRecvCb(recvcb);
+        auto res = serverRecvHandlerAsync();
+        {
+            std::lock_guard<std::mutex> lck(serverTaskMutex_);
+            serverTask_ = res;
+        }
+        res.wait();
+        if (transport_ == Transport::SharedMemory)
+            return serverLink_.isListening() ? 0 : 1;
+        return server_.closeclientSocket();
+    };
+
+    void
+    setRecvCb(SocketCallback& recvcb) {
+        server_.setRecvCb(recvcb);
+    };
+
+    // called with what each client that said hello was answered, on the
+    // thread serving it, for the plain and sharded servers alike; call
+    // before either is run
+    void
+    setHandshakeCb(HandshakeCallback cb) {
+        handshakeCb_ = cb;
+        shardedServer_.setHandshakeCb(std::move(cb));
+    };
+
+    // called once a connection is gone, on the thread that served it and
+    // before its socket is closed, for the plain and sharded servers alike;
+    // call before either is run
+    void
+    setDisconnectCb(DisconnectCallback cb) {
+        disconnectCb_ = cb;
+        shardedServer_.setDisconnectCb(std::move(cb));
+    };
+
+    Executor::Task
+    serverRecvHandlerAsync() {
+        return executor_.launch([this](Executor::TaskContext& ctx) {
+            if (transport_ == Transport::SharedMemory) {
+                if (serverLink_.waitForPeer() != 0)
+                    return;
+                DBGOUT("rx - recvHandler - start...");
+                Socket none = INVALID_SOCKET;
+                recvLoop([this](char* buf, int len) {
+                    return serverLink_.read(buf, len);
+                }, [this](const char* data, size_t len) {
+                    std::lock_guard<std::mutex> lck(writeMutex_);
+                    return serverLink_.write(data, len);
+                }, none, server_.getRecvCb(), ctx);
+                if (disconnectCb_)
+                    disconnectCb_(none);
+                DBGOUT("rx - recvHandler - done");
+                return;
+            }
+
+            Socket ClientSocket = server_.acceptClient();
+            if (ClientSocket == INVALID_SOCKET)
+                return;
+            ctx.setInterrupt([ClientSocket]() { _shutdown(ClientSocket); });
+            DBGOUT("rx - recvHandler - start...");
+            recvLoop([this, ClientSocket](char* buf, int len) {
+                return server_.receive(ClientSocket, buf, len);
+            }, [this, ClientSocket](const char* data, size_t len) {
+                std::lock_guard<std::mutex> lck(writeMutex_);
+                return writeToSocket(ClientSocket, data, len);
+            }, ClientSocket, server_.getRecvCb(), ctx);
+            if (disconnectCb_)
+                disconnectCb_(ClientSocket);
+            DBGOUT("rx - recvHandler - done");
+        });
+    };
+
+    // stops the plain server; a connection being served is shut down so
+    // runServer returns once its receive loop is done
+    void
+    closeServer() {
+        {
+            std::lock_guard<std::mutex> lck(serverTaskMutex_);
+            serverTask_.cancel();
+        }
+        if (serverLink_.isListening()) {
+            DBGOUT("closing shared memory server...");
+            serverLink_.unlink();
+        }
+        if (server_.isRunning()) {
+            DBGOUT("closing server...");
+            server_.stopListening();
+        }
+    };
+
+    // cancels and joins every receive task still running; nothing the
+    // servers run calls back or journals after this returns
+    void
+    joinTasks() {
+        executor_.shutdown();
+    };
+
+    // sends a small control message (one frame at most) back to the client
+    // behind socket, as handed to the receive callback. Safe from any
+    // thread: a sharded connection is only written by its shard, and
+    // frames to the plain server's client or the shared memory ring are
+    // written one at a time.
+    int
+    reply(Socket socket, Channel channel, const char* data, size_t len) {
+        if (len > FRAME_MAX_CHUNK)
+            return SOCKET_ERROR;
+        char frame[FRAME_MAX_LEN];
+        encodeFrameHeader(frame, { channel, FRAME_FLAG_FIN, 0, (uint16_t)len });
+        memcpy(frame + FRAME_HEADER_LEN, data, len);
+        if (shardedServer_.owns(socket))
+            return shardedServer_.send(socket, frame, FRAME_HEADER_LEN + len);
+        std::lock_guard<std::mutex> lck(writeMutex_);
+        if (transport_ == Transport::SharedMemory && socket == INVALID_SOCKET)
+            return serverLink_.write(frame, FRAME_HEADER_LEN + len);
+        return writeToSocket(socket, frame, FRAME_HEADER_LEN + len);
+    };
+
+    bool
+    getServerStatus() {
+        if (transport_ == Transport::SharedMemory)
+            return serverLink_.isListening();
+        return server_.isRunning();
+    }
+
+    // sharded server, for many concurrent clients
+    int
+    startShardedServer(PortNumber port, size_t shards = 0, uint32_t idleMs = 0) {
+        return shardedServer_.start(port, shards, idleMs);
+    };
+
+    int
+    runShardedServer(SocketCallback&& recvcb) {
+        return shardedServer_.run(std::move(recvcb));
+    };
+
+    void
+    closeShardedServer() {
+        shardedServer_.stop();
+    };
+
+    // hot restart, see Handoff.hpp: a sharded server serving handoffs on a
+    // path is taken over by the next one started with the same path
+    void
+    setShardedHandoffHooks(HandoffHooks hooks) {
+        shardedServer_.setHandoffHooks(std::move(hooks));
+    };
+
+    TakeOver
+    takeOverShardedServer(const std::string& path, uint32_t idleMs = 0) {
+        return shardedServer_.takeOver(path, idleMs);
+    };
+
+    int
+    serveShardedHandoff(const std::string& path) {
+        return shardedServer_.serveHandoff(path);
+    };
+
+    bool
+    shardedServerHandedOff() {
+        return shardedServer_.handedOff();
+    };
+
+    // relay
+    int
+    startRelay(PortNumber upstreamPort, PortNumber downstreamPort) {
+        return relay_.start(upstreamPort, downstreamPort);
+    };
+
+    int
+    runRelay() {
+        return relay_.run();
+    };
+
+    void
+    closeRelay() {
+        relay_.stop();
+    };
+
+    // network emulator, a proxy that degrades the link to a server
+    int
+    startNetEm(const NetEmConfig& config, PortNumber port,
+               const std::string& targetHost, PortNumber targetPort) {
+        return netEm_.start(config, port, targetHost, targetPort);
+    };
+
+    int
+    runNetEm() {
+        return netEm_.run();
+    };
+
+    void
+    closeNetEm() {
+        netEm_.stop();
+    };
+
+    // client
+    int
+    startClient(const std::string& host, PortNumber port) {
+        // the previous reader must be out of the shared mapping before it
+        // gets replaced
+        if (transport_ == Transport::SharedMemory && clientRecvTask_.valid())
+            clientRecvTask_.wait();
+        int res = transport_ == Transport::SharedMemory
+            ? client_.attach(shmName_)
+            : client_.connectToHost(host, port);
+        if (res == 0) {
+            clientRecvTask_ = clientRecvHandlerAsync();
+            client_.handshake();
+        }
+        return res;
+    };
+
+    Executor::Task
+    clientRecvHandlerAsync() {
+        return executor_.launch([this](Executor::TaskContext& ctx) {
+            DBGOUT("rx - recvHandler - start...");
+            Socket Socket = client_.getSocket();
+            if (transport_ == Transport::Tcp)
+                ctx.setInterrupt([Socket]() { _shutdown(Socket); });
+            recvLoop([this](char* buf, int len) {
+                return client_.isConnected() ? client_.receive(buf, len) : 0;
+            }, [this](const char* data, size_t len) {
+                return client_.writeRaw(data, len);
+            }, Socket, client_.getRecvCb(), ctx);
+            DBGOUT("rx - recvHandler - done");
+        });
+    };
+
+    void
+    writeToHost(const std::string& data) {
+        client_.write(data);
+    };
+
+    int
+    sendToHost(Channel channel, const char* data, size_t len) {
+        return client_.send(channel, data, len);
+    };
+
+    int
+    sendToHost(Channel channel, const std::string& data) {
+        return client_.send(channel, data);
+    };
+
+    int
+    pingHost() {
+        return client_.ping();
+    };
+
+    // smoothed round trip time to the host in microseconds, 0 if unknown
+    int64_t
+    getHostRtt() {
+        return client_.getRtt();
+    };
+
+    // the encoding, batching and features agreed on with the host
+    Capabilities
+    getHostCapabilities() {
+        return client_.getHostCapabilities();
+    };
+
+    // moves whenever getHostCapabilities() changes, e.g. on a late accept
+    uint32_t
+    getHostCapabilitiesChanges() {
+        return client_.getHostCapabilitiesChanges();
+    };
+
+    size_t
+    getQueuedBytes() {
+        return client_.queuedBytes();
+    };
+
+    int
+    startStreaming( SocketCallback&& recvcb, SocketHandler&& writer) {
+        client_.setRecvCb(recvcb);
+        auto txHandler = client_.setSendHandler(writer);
+        txHandler.wait();
+        // a reader blocked in recv isn't woken by closing the socket under
+        // it, so stop it first
+        clientRecvTask_.cancel();
+        if (transport_ == Transport::Tcp)
+            clientRecvTask_.wait();
+        auto res = client_.disconnect();
+        if (res == SOCKET_ERROR) {
+            DBGOUT("startStreaming - disconnect failed with error: %d", _socketError());
+            return 1;
+        }
+        return 0;
+    };
+
+private:
+    // pumps one connection until it closes or the task is cancelled,
+    // handing every complete message, or every raw chunk from a legacy peer,
+    // to cb. Pings and hellos are answered here, pongs go to the client's
+    // rtt estimator and accepts finish its handshake. Reads go to the
+    // executor worker's buffer.
+    template<typename Read, typename Write>
+    void
+    recvLoop(Read&& read, Write&& write, Socket& socket, SocketCallback& cb,
+             Executor::TaskContext& ctx) {
+        int     recvResult = 1;
+        char*   recvbuf = ctx.buffer();
+        int     recvbuflen = (int)std::min<size_t>(ctx.bufferSize(), DEFAULT_BUFLEN) - 1;
+
+        ALLOC_THREAD_NAME("rx");
+        FrameReader reader;
+        auto onMessage = [this, &write, &cb, &socket](Channel channel, uint8_t,
+                                                      const char* data, int len) {
+            if (isPing(channel, data, len)) {
+                char pong[FRAME_MAX_LEN];
+                write(pong, encodePong(data, len, pong));
+            } else if (isPong(channel, data, len)) {
+                client_.onPong(data, len);
+            } else if (isHello(channel, data, len)) {
+                char accept[FRAME_MAX_LEN];
+                Capabilities agreed;
+                if (auto n = encodeAccept(data, len, accept, agreed)) {
+                    write(accept, n);
+                    if (handshakeCb_)
+                        handshakeCb_(socket, agreed);
+                }
+            } else if (isAccept(channel, data, len)) {
+                client_.onAccept(data, len);
+            } else {
+                cb(socket, data, len);
+            }
+        };
+        auto onLegacy = [&cb, &socket](const char* data, int len) {
+            cb(socket, data, len);
+        };
+
+        journalRecord(JOURNAL_OPEN, (uint32_t)socket);
+        while (recvResult > 0 && !ctx.cancelled()) {
+            DBGOUT("rx - waiting on socket...");
+            recvResult = read(recvbuf, recvbuflen);
+            if (recvResult > 0) {
+                journalRecord(JOURNAL_DATA, (uint32_t)socket, recvbuf, recvResult);
+                ALLOC_STEADY_SCOPE("rx-frame");
+                PERF_SECTION("rx-frame");
+                if (traceEnabled())
+                    traceSetReceived(traceNow());
+                recvbuf[recvResult] = '\0';
+                if (!reader.feed(recvbuf, recvResult, onMessage, onLegacy)) {
+                    DBGOUT("rx - dropping connection on framing error...");
+                    break;
+                }
+            } else if (recvResult == 0) {
+                DBGOUT("rx - connection closed by peer...");
+                break;
+            } else {
+                DBGOUT("rx - recv failed with error: %d", _socketError());
+                break;
+            }
+        };
+        journalRecord(JOURNAL_CLOSE, (uint32_t)socket);
+    };
+
+    Executor::Task clientRecvTask_;
+    // the plain server's current connection
+    Executor::Task serverTask_;
+    std::mutex serverTaskMutex_;
+
+    Transport transport_;
+    std::string shmName_;
+
+    Server server_;
+    Client client_;
+    Relay relay_;
+    NetEmProxy netEm_;
+    ShardedServer shardedServer_;
+    ShmLink serverLink_;
+    // one frame at a time to the plain server's client or the ring
+    std::mutex writeMutex_;
+    HandshakeCallback handshakeCb_;
+    DisconnectCallback disconnectCb_;
+
+    // last, so its tasks are joined before what they use is torn down
+    Executor executor_;
+
+};
+
+}
@@ -0,0 +1,304 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+// Opt-in hardware performance counters. Build with PERF_COUNTERS defined
+// to bracket tagged sections with perf_event_open counters; without it
+// every macro below compiles to nothing.
+//
+//   PERF_SECTION("name")   counts cycles, instructions, cache misses and
+//                          branch misses spent in the enclosing block
+//   PERF_REPORT()          prints per thread and per section totals, and
+//                          the averages per entry
+//
+// Each thread opens one counter group on its first section, closes it when
+// it exits, and reads the whole group with a single read() on entry and on
+// exit, about a microsecond each, so sections should wrap a whole message
+// rather than a few instructions. Nested sections each count everything
+// inside them. Threads past PERF_MAX_THREADS count nothing. Kernel time is
+// included where the system allows it, otherwise only user space is
+// counted. Where counters can't be opened at all (containers, VMs,
+// perf_event_paranoid), sections still count their entries.
+
+#ifdef PERF_COUNTERS
+
+#include <atomic>
+#include <algorithm>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#define PERF_MAX_SECTIONS   32
+#define PERF_MAX_THREADS    64
+
+enum PerfEvent {
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_EVENT_COUNT
+};
+
+static const char* perfEventNames[PERF_EVENT_COUNT] = {
+    "cycles", "instructions", "cache-misses", "branch-misses"
+};
+
+struct PerfTag {
+    PerfTag(const char* name);
+
+    const char* name;
+    int index;
+};
+
+struct PerfTotals {
+    std::atomic<uint64_t> entries;
+    std::atomic<uint64_t> counts[PERF_EVENT_COUNT];
+};
+
+struct PerfThread {
+    char name[16];
+    int group;
+    // position of each event in the group's read, -1 if it didn't open
+    int slot[PERF_EVENT_COUNT];
+    // every event's descriptor, the leader's is group
+    int fds[PERF_EVENT_COUNT];
+    bool kernel;
+    PerfTotals sections[PERF_MAX_SECTIONS];
+};
+
+static PerfTag* perfTags[PERF_MAX_SECTIONS];
+static std::atomic<int> perfTagCount(0);
+static PerfThread perfThreads[PERF_MAX_THREADS];
+static std::atomic<int> perfThreadCount(0);
+
+PerfTag::PerfTag(const char* name)
+    : name(name)
+{
+    index = perfTagCount.fetch_add(1);
+    if (index < PERF_MAX_SECTIONS)
+        perfTags[index] = this;
+    else
+        index = PERF_MAX_SECTIONS - 1;
+}
+
+#ifdef __linux__
+int
+perfOpen(uint64_t config, int group, bool kernel)
+{
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.exclude_kernel = !kernel;
+    attr.exclude_hv = 1;
+    // this thread, any cpu
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, PERF_FLAG_FD_CLOEXEC);
+}
+#endif
+
+// opens the calling thread's counter group, leaving group at -1 if the
+// system won't give us one
+void
+perfOpenGroup(PerfThread& self)
+{
+    self.group = -1;
+    for (auto& slot : self.slot)
+        slot = -1;
+    for (auto& fd : self.fds)
+        fd = -1;
+#ifdef __linux__
+    static const uint64_t configs[PERF_EVENT_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    // kernel and user first, user only where paranoia forbids the kernel
+    self.kernel = true;
+    self.group = perfOpen(configs[0], -1, true);
+    if (self.group < 0) {
+        self.kernel = false;
+        self.group = perfOpen(configs[0], -1, false);
+    }
+    if (self.group < 0) {
+        static std::atomic<bool> warned(false);
+        if (!warned.exchange(true))
+            fprintf(stderr, "perf - counters unavailable (error %d), sections only count entries\n", errno);
+        return;
+    }
+    int members = 0;
+    self.fds[PERF_CYCLES] = self.group;
+    self.slot[PERF_CYCLES] = members++;
+    for (int e = 1; e < PERF_EVENT_COUNT; ++e) {
+        self.fds[e] = perfOpen(configs[e], self.group, self.kernel);
+        if (self.fds[e] >= 0)
+            self.slot[e] = members++;
+    }
+#endif
+}
+
+// closes the group of a thread that is exiting; its totals stay for the
+// report, which goes by slot rather than group
+void
+perfCloseGroup(PerfThread& self)
+{
+    self.group = -1;
+#ifdef __linux__
+    for (auto& fd : self.fds) {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+    }
+#endif
+}
+
+// the calling thread's entry, and its counters' lifetime. Threads past
+// PERF_MAX_THREADS get no entry and their sections count nothing.
+struct PerfThreadHandle {
+    ~PerfThreadHandle() {
+        if (self)
+            perfCloseGroup(*self);
+    };
+
+    PerfThread* self {nullptr};
+    bool overflow {false};
+};
+
+static thread_local PerfThreadHandle perfSelf;
+
+PerfThread*
+perfThread()
+{
+    if (!perfSelf.self && !perfSelf.overflow) {
+        int index = perfThreadCount.fetch_add(1);
+        if (index >= PERF_MAX_THREADS) {
+            perfSelf.overflow = true;
+            return nullptr;
+        }
+        auto self = &perfThreads[index];
+#ifdef __linux__
+        pthread_getname_np(pthread_self(), self->name, sizeof(self->name));
+#endif
+        perfOpenGroup(*self);
+        perfSelf.self = self;
+    }
+    return perfSelf.self;
+}
+
+// reads the whole group at once, values in event order
+bool
+perfRead(const PerfThread& self, uint64_t* values)
+{
+#ifdef __linux__
+    struct {
+        uint64_t count;
+        uint64_t values[PERF_EVENT_COUNT];
+    } data;
+    if (read(self.group, &data, sizeof(data)) < (ssize_t)sizeof(uint64_t))
+        return false;
+    for (int e = 0; e < PERF_EVENT_COUNT; ++e)
+        values[e] = self.slot[e] >= 0 && (uint64_t)self.slot[e] < data.count
+            ? data.values[self.slot[e]] : 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
+struct PerfSection {
+    PerfSection(PerfTag& tag)
+        : tag(tag)
+        , self(perfThread())
+        , counting(self && self->group >= 0 && perfRead(*self, start)) { };
+
+    ~PerfSection() {
+        if (!self)
+            return;
+        auto& totals = self->sections[tag.index];
+        totals.entries.fetch_add(1, std::memory_order_relaxed);
+        uint64_t end[PERF_EVENT_COUNT];
+        if (!counting || !perfRead(*self, end))
+            return;
+        for (int e = 0; e < PERF_EVENT_COUNT; ++e)
+            totals.counts[e].fetch_add(end[e] - start[e], std::memory_order_relaxed);
+    };
+
+    PerfTag& tag;
+    PerfThread* self;
+    uint64_t start[PERF_EVENT_COUNT];
+    bool counting;
+};
+
+void
+perfReport()
+{
+    int started = perfThreadCount.load();
+    int threads = std::min(started, PERF_MAX_THREADS);
+    int tags = std::min(perfTagCount.load(), PERF_MAX_SECTIONS);
+    fprintf(stderr, "perf - per thread and section, averages per entry:\n");
+    if (started > PERF_MAX_THREADS)
+        fprintf(stderr, "  %d more threads weren't counted\n", started - PERF_MAX_THREADS);
+    for (int i = 0; i < threads; ++i) {
+        auto& t = perfThreads[i];
+        fprintf(stderr, "  %s (%s)\n", t.name[0] ? t.name : "?",
+                t.slot[PERF_CYCLES] < 0 ? "no counters" : t.kernel ? "user+kernel" : "user only");
+        for (int s = 0; s < tags; ++s) {
+            auto& totals = t.sections[s];
+            auto entries = totals.entries.load();
+            if (!entries)
+                continue;
+            fprintf(stderr, "    %-20s %10llu entries", perfTags[s]->name, (unsigned long long)entries);
+            for (int e = 0; e < PERF_EVENT_COUNT; ++e) {
+                if (t.slot[e] < 0)
+                    fprintf(stderr, " %s -", perfEventNames[e]);
+                else
+                    fprintf(stderr, " %s %.1f", perfEventNames[e],
+                            (double)totals.counts[e].load() / entries);
+            }
+            if (t.slot[PERF_CYCLES] >= 0 && t.slot[PERF_INSTRUCTIONS] >= 0 &&
+                totals.counts[PERF_CYCLES].load())
+                fprintf(stderr, " ipc %.2f", (double)totals.counts[PERF_INSTRUCTIONS].load() /
+                                             totals.counts[PERF_CYCLES].load());
+            fprintf(stderr, "\n");
+        }
+    }
+}
+
+#define PERF_CONCAT_(a, b) a ## b
+#define PERF_CONCAT(a, b) PERF_CONCAT_(a, b)
+#define PERF_SECTION(name)                                                      \
+    static PerfTag PERF_CONCAT(perfTag_, __LINE__)(name);                       \
+    PerfSection PERF_CONCAT(perfSection_, __LINE__)(PERF_CONCAT(perfTag_, __LINE__))
+#define PERF_REPORT() perfReport()
+
+#else
+
+#define PERF_SECTION(name)
+#define PERF_REPORT()
+
+#endif
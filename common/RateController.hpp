@@ -0,0 +1,109 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define RATE_KEEPALIVE_HZ       20.0
+#define RATE_MAX_HZ             500.0
+#define RATE_RAMP_UP            2.0
+#define RATE_DECAY              0.75
+#define RATE_IDLE_HOLD_MS       250
+#define RATE_MAX_QUEUED_BYTES   4096
+#define RATE_MAX_IN_FLIGHT      8
+
+struct RateLimits {
+    double minHz {RATE_KEEPALIVE_HZ};
+    double maxHz {RATE_MAX_HZ};
+    // multiplier applied per active sample, and per idle sample once the
+    // hold has expired
+    double rampUp {RATE_RAMP_UP};
+    double decay {RATE_DECAY};
+    std::chrono::milliseconds idleHold {RATE_IDLE_HOLD_MS};
+    // halve the rate while more than this is waiting to go out
+    size_t maxQueuedBytes {RATE_MAX_QUEUED_BYTES};
+    // never have more than this many frames in flight over one rtt
+    double maxInFlight {RATE_MAX_IN_FLIGHT};
+};
+
+// Picks the interval until the next input sample. The rate climbs quickly
+// towards maxHz while the input is changing, holds for a moment after it
+// stops, then decays back to the keepalive rate. Measured rtt and the local
+// send queue put a ceiling on it, so a slow or congested link isn't pushed
+// harder than it can drain.
+class RateController {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    RateController(const RateLimits& limits = RateLimits())
+        : limits_(limits)
+        , hz_(limits.minHz)
+        , lastActive_(Clock::now() - limits.idleHold)
+        , lastSent_(Clock::now()) { };
+
+    // active: the sampled state differs from the last one sent
+    // rttMicros: smoothed round trip time, 0 if not measured yet
+    // queuedBytes: bytes still waiting to be written
+    std::chrono::microseconds
+    next(bool active, int64_t rttMicros, size_t queuedBytes) {
+        auto now = Clock::now();
+        if (active) {
+            lastActive_ = now;
+            hz_ *= limits_.rampUp;
+        } else if (now - lastActive_ > limits_.idleHold) {
+            hz_ *= limits_.decay;
+        }
+
+        double ceiling = limits_.maxHz;
+        if (rttMicros > 0)
+            ceiling = std::min(ceiling, limits_.maxInFlight * 1e6 / rttMicros);
+        if (queuedBytes > limits_.maxQueuedBytes)
+            hz_ /= 2;
+
+        hz_ = std::max(limits_.minHz, std::min(hz_, ceiling));
+        return std::chrono::microseconds((int64_t)(1e6 / hz_));
+    };
+
+    // true when nothing has been sent for a keepalive period
+    bool
+    keepaliveDue() const {
+        return Clock::now() - lastSent_ >=
+            std::chrono::microseconds((int64_t)(1e6 / limits_.minHz));
+    };
+
+    void
+    sent() {
+        lastSent_ = Clock::now();
+    };
+
+    double
+    rate() const {
+        return hz_;
+    };
+
+private:
+    RateLimits limits_;
+    double hz_;
+    Clock::time_point lastActive_;
+    Clock::time_point lastSent_;
+
+};
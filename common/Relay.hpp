@@ -0,0 +1,408 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <memory>
+#include <deque>
+#include <vector>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <bitset>
+
+#include "Log.hpp"
+#include "Frame.hpp"
+#include "Handshake.hpp"
+#include "Client.hpp"
+#include "Server.hpp"
+#include "ThreadRole.hpp"
+
+#define DEFAULT_RELAY_PORT          8889
+#define DEFAULT_RELAY_QUEUE_BYTES   (64 * 1024)
+// how often an idle subscriber's input is drained
+#define RELAY_DRAIN_MS              50
+// back-off after a failed accept, so a persistent error doesn't spin
+#define RELAY_ACCEPT_RETRY_MS       100
+// stream ids are one byte in the frame header
+#define RELAY_MAX_STREAMS           256
+
+namespace Network
+{
+
+// One upstream message, already encoded as wire frames. Every subscriber
+// queue holds a reference to the same buffer; nothing is copied per
+// subscriber.
+struct RelayMessage {
+    std::string frames;
+    Channel channel;
+};
+
+using SharedMessage = std::shared_ptr<const RelayMessage>;
+
+// A downstream connection with its own bounded queue and writer thread. A
+// subscriber that can't keep up only ever loses its own backlog: the
+// publisher never waits on its socket.
+class Subscriber {
+public:
+    Subscriber(Socket socket, size_t maxQueuedBytes)
+        : socket_(socket)
+        , maxQueuedBytes_(maxQueuedBytes)
+        , queuedBytes_(0)
+        , dropped_(0)
+        , alive_(true) {
+        writer_ = std::thread([this]() {
+            applyThreadRole(ThreadRole::Relay);
+            writeLoop();
+        });
+    };
+
+    ~Subscriber() {
+        stop();
+        if (writer_.joinable())
+            writer_.join();
+        _close(socket_);
+    };
+
+    void
+    enqueue(const SharedMessage& msg) {
+        {
+            std::lock_guard<std::mutex> lck(mutex_);
+            if (!alive_)
+                return;
+            // drop whole messages, oldest first, so the stream stays decodable
+            while (!queue_.empty() &&
+                   queuedBytes_ + msg->frames.size() > maxQueuedBytes_) {
+                queuedBytes_ -= queue_.front()->frames.size();
+                queue_.pop_front();
+                ++dropped_;
+            }
+            queue_.push_back(msg);
+            queuedBytes_ += msg->frames.size();
+        }
+        cv_.notify_one();
+    };
+
+    void
+    stop() {
+        {
+            std::lock_guard<std::mutex> lck(mutex_);
+            if (!alive_)
+                return;
+            alive_ = false;
+        }
+        cv_.notify_one();
+        _shutdown(socket_);
+    };
+
+    bool
+    isAlive() {
+        std::lock_guard<std::mutex> lck(mutex_);
+        return alive_;
+    };
+
+    size_t
+    dropped() {
+        std::lock_guard<std::mutex> lck(mutex_);
+        return dropped_;
+    };
+
+private:
+    // subscribers answer with acks, keyframe requests and pongs meant for
+    // a client, none of which the relay acts on; reading them keeps the
+    // subscriber's writes from blocking. Returns false once it hung up.
+    bool
+    drainInput() {
+        char buf[DEFAULT_BUFLEN];
+        while (true) {
+#ifndef _WIN32
+            auto res = recv(socket_, buf, sizeof(buf), MSG_DONTWAIT);
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+                return true;
+#else
+            u_long available = 0;
+            if (ioctlsocket(socket_, FIONREAD, &available) != 0 || !available)
+                return true;
+            auto res = recv(socket_, buf, sizeof(buf), 0);
+#endif
+            if (res <= 0)
+                return false;
+        }
+    };
+
+    void
+    writeLoop() {
+        std::vector<SharedMessage> batch;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lck(mutex_);
+                cv_.wait_for(lck, std::chrono::milliseconds(RELAY_DRAIN_MS),
+                             [this] { return !alive_ || !queue_.empty(); });
+                if (!alive_)
+                    return;
+                batch.assign(queue_.begin(), queue_.end());
+                queue_.clear();
+                queuedBytes_ = 0;
+            }
+            if (!drainInput()) {
+                DBGOUT("relay - subscriber hung up, dropping it");
+                stop();
+                return;
+            }
+            for (auto& msg : batch) {
+                auto res = writeToSocket(socket_, msg->frames.data(), msg->frames.size());
+                if (res == SOCKET_ERROR) {
+                    DBGOUT("relay - subscriber write failed, dropping it");
+                    stop();
+                    return;
+                }
+            }
+            batch.clear();
+        }
+    };
+
+    Socket socket_;
+    std::thread writer_;
+
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::deque<SharedMessage> queue_;
+    const size_t maxQueuedBytes_;
+    size_t queuedBytes_;
+    size_t dropped_;
+    bool alive_;
+
+};
+
+// Accepts controller streams on one port and republishes every message to
+// all subscribers connected on another. Each upstream is given a stream id
+// which is stamped into the frame headers, so subscribers can tell the
+// sources apart.
+class Relay {
+public:
+    Relay(size_t maxQueuedBytes = DEFAULT_RELAY_QUEUE_BYTES)
+        : maxQueuedBytes_(maxQueuedBytes)
+        , running_(false) { };
+
+    ~Relay() {
+        stop();
+    };
+
+    int
+    start(PortNumber upstreamPort, PortNumber downstreamPort) {
+        DBGOUT("relay - starting...");
+        if (upstream_.start(upstreamPort) != 0)
+            return 1;
+        if (downstream_.start(downstreamPort) != 0) {
+            upstream_.stopListening();
+            return 1;
+        }
+        running_ = true;
+        return 0;
+    };
+
+    // blocks until stop() is called
+    int
+    run() {
+        if (!running_)
+            return 1;
+
+        auto subscriberAcceptor = std::thread([this]() {
+            applyThreadRole(ThreadRole::Relay);
+            while (running_) {
+                Socket socket = downstream_.acceptConnection();
+                if (socket == INVALID_SOCKET) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(RELAY_ACCEPT_RETRY_MS));
+                    continue;
+                }
+                std::lock_guard<std::mutex> lck(subscribersMutex_);
+                pruneSubscribers();
+                subscribers_.emplace_back(new Subscriber(socket, maxQueuedBytes_));
+                DBGOUT("relay - %d subscribers", (int)subscribers_.size());
+            }
+        });
+
+        while (running_) {
+            Socket socket = upstream_.acceptConnection();
+            if (socket == INVALID_SOCKET) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(RELAY_ACCEPT_RETRY_MS));
+                continue;
+            }
+            std::lock_guard<std::mutex> lck(upstreamsMutex_);
+            reapUpstreams();
+            int stream = 0;
+            while (stream < RELAY_MAX_STREAMS && streams_[stream])
+                ++stream;
+            if (stream == RELAY_MAX_STREAMS) {
+                DBGOUT("relay - all %d stream ids in use, refusing upstream", RELAY_MAX_STREAMS);
+                _close(socket);
+                continue;
+            }
+            streams_[stream] = true;
+            std::unique_ptr<Upstream> upstream(new Upstream());
+            upstream->socket = socket;
+            upstream->stream = (uint8_t)stream;
+            auto up = upstream.get();
+            upstream->thread = std::thread([this, up]() {
+                applyThreadRole(ThreadRole::Relay);
+                readUpstream(up->socket, up->stream);
+                std::lock_guard<std::mutex> lck(upstreamsMutex_);
+                _close(up->socket);
+                up->socket = INVALID_SOCKET;
+                streams_[up->stream] = false;
+                up->done = true;
+            });
+            upstreams_.push_back(std::move(upstream));
+        }
+
+        subscriberAcceptor.join();
+
+        // join outside the lock, the readers take it on their way out
+        std::list<std::unique_ptr<Upstream>> upstreams;
+        {
+            std::lock_guard<std::mutex> lck(upstreamsMutex_);
+            upstreams.swap(upstreams_);
+        }
+        for (auto& upstream : upstreams)
+            upstream->thread.join();
+        {
+            std::lock_guard<std::mutex> lck(subscribersMutex_);
+            subscribers_.clear();
+        }
+        return 0;
+    };
+
+    void
+    stop() {
+        if (!running_.exchange(false))
+            return;
+        DBGOUT("relay - stopping...");
+        upstream_.stopListening();
+        downstream_.stopListening();
+        {
+            std::lock_guard<std::mutex> lck(upstreamsMutex_);
+            for (auto& upstream : upstreams_) {
+                if (upstream->socket != INVALID_SOCKET)
+                    _shutdown(upstream->socket);
+            }
+        }
+        std::lock_guard<std::mutex> lck(subscribersMutex_);
+        for (auto& sub : subscribers_)
+            sub->stop();
+    };
+
+    void
+    publish(const SharedMessage& msg) {
+        std::lock_guard<std::mutex> lck(subscribersMutex_);
+        for (auto& sub : subscribers_)
+            sub->enqueue(msg);
+    };
+
+private:
+    // one upstream connection and the thread reading it; the thread closes
+    // the socket and frees the stream id on its way out, and the entry is
+    // reaped on the next accept
+    struct Upstream {
+        Socket socket {INVALID_SOCKET};
+        uint8_t stream {0};
+        std::thread thread;
+        bool done {false};
+    };
+
+    void
+    readUpstream(Socket socket, uint8_t stream) {
+        DBGOUT("relay - upstream %d connected", stream);
+
+        char recvbuf[DEFAULT_BUFLEN];
+        FrameReader reader;
+        auto onMessage = [this, socket, stream](Channel channel, uint8_t, const char* data, int len) {
+            // the upstream measures its rtt to the relay, not to subscribers
+            if (isPing(channel, data, len)) {
+                char pong[FRAME_MAX_LEN];
+                writeToSocket(socket, pong, encodePong(data, len, pong));
+                return;
+            }
+            // subscribers are servers of this same build, so the relay can
+            // agree on their behalf
+            if (isHello(channel, data, len)) {
+                char accept[FRAME_MAX_LEN];
+                Capabilities agreed;
+                if (auto n = encodeAccept(data, len, accept, agreed))
+                    writeToSocket(socket, accept, n);
+                return;
+            }
+            auto msg = std::make_shared<RelayMessage>();
+            msg->channel = channel;
+            encodeFrames(msg->frames, channel, stream, data, len);
+            publish(msg);
+        };
+        // legacy peers have no message boundaries, so each read is relayed
+        // as one motion message
+        auto onLegacy = [&onMessage](const char* data, int len) {
+            onMessage(Channel::Motion, 0, data, len);
+        };
+
+        while (running_) {
+            int res = recv(socket, recvbuf, DEFAULT_BUFLEN, 0);
+            if (res <= 0)
+                break;
+            if (!reader.feed(recvbuf, res, onMessage, onLegacy))
+                break;
+        }
+        DBGOUT("relay - upstream %d gone", stream);
+    };
+
+    // called with upstreamsMutex_ held; the finished threads have nothing
+    // left to do but return, so joining them doesn't wait on anything
+    void
+    reapUpstreams() {
+        for (auto it = upstreams_.begin(); it != upstreams_.end();) {
+            if ((*it)->done) {
+                (*it)->thread.join();
+                it = upstreams_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    };
+
+    // called with subscribersMutex_ held
+    void
+    pruneSubscribers() {
+        subscribers_.remove_if([](const std::unique_ptr<Subscriber>& sub) {
+            return !sub->isAlive();
+        });
+    };
+
+    Server upstream_;
+    Server downstream_;
+    const size_t maxQueuedBytes_;
+
+    std::mutex upstreamsMutex_;
+    std::list<std::unique_ptr<Upstream>> upstreams_;
+    // stream ids held by live upstreams
+    std::bitset<RELAY_MAX_STREAMS> streams_;
+
+    std::mutex subscribersMutex_;
+    std::list<std::unique_ptr<Subscriber>> subscribers_;
+
+    std::atomic<bool> running_;
+
+};
+
+}
@@ -0,0 +1,347 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <array>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <unordered_map>
+
+#include <stdint.h>
+
+#include "Log.hpp"
+#include "AllocTrack.hpp"
+#include "Trace.hpp"
+#include "ThreadRole.hpp"
+
+// High rate pad samples: the capture ring on the client and the timed
+// replay on the server. The wire encoding lives in StateCodec.hpp.
+#define SAMPLE_BATCH_MAX        64
+#define SAMPLE_RING_SIZE        1024
+
+// how far behind the client clock the replay may fall before the timeline
+// is re-anchored instead of stretched
+#define REPLAY_MAX_DELAY_US     50000
+// samples waiting to be replayed, over every stream; the queue starts at
+// SAMPLE_RING_SIZE and grows outside the caller's steady scope up to this,
+// past which the most overdue sample makes room
+#define REPLAY_QUEUE_MAX        (16 * SAMPLE_RING_SIZE)
+
+namespace Network
+{
+
+struct PadSample {
+    uint64_t time;
+    int16_t lx;
+    int16_t ly;
+    uint16_t buttons;
+};
+
+size_t
+putVarint(char* out, uint64_t value)
+{
+    size_t n = 0;
+    while (value >= 0x80) {
+        out[n++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    out[n++] = (char)value;
+    return n;
+}
+
+// returns the number of bytes read, 0 if the varint is truncated
+size_t
+getVarint(const char* in, size_t len, uint64_t& value)
+{
+    value = 0;
+    for (size_t n = 0; n < len && n < 10; ++n) {
+        value |= (uint64_t)(in[n] & 0x7f) << (7 * n);
+        if (!(in[n] & 0x80))
+            return n + 1;
+    }
+    return 0;
+}
+
+uint64_t
+zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+int64_t
+unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+// Single producer, single consumer ring, e.g. between the capture thread
+// and the transmit thread. A full ring drops the newest item.
+template<typename T, size_t N>
+class SpscRing {
+public:
+    SpscRing()
+        : head_(0)
+        , tail_(0) { };
+
+    bool
+    push(const T& item) {
+        auto head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == N)
+            return false;
+        slots_[head % N] = item;
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    };
+
+    // copies out up to max items, returns how many
+    size_t
+    pop(T* out, size_t max) {
+        auto tail = tail_.load(std::memory_order_relaxed);
+        auto count = std::min(max, (size_t)(head_.load(std::memory_order_acquire) - tail));
+        for (size_t i = 0; i < count; ++i)
+            out[i] = slots_[(tail + i) % N];
+        tail_.store(tail + count, std::memory_order_release);
+        return count;
+    };
+
+    bool
+    empty() {
+        return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+    };
+
+private:
+    std::array<T, N> slots_;
+    alignas(64) std::atomic<uint64_t> head_;
+    alignas(64) std::atomic<uint64_t> tail_;
+
+};
+
+using SampleRing = SpscRing<PadSample, SAMPLE_RING_SIZE>;
+
+// traces a stage, or one end of the wire flow, for every sampled sample in
+// a batch; samples are identified by their capture time
+void
+traceSamples(const char* name, const PadSample* samples, size_t count,
+             int64_t begin, int64_t end)
+{
+    if (!traceEnabled())
+        return;
+    for (size_t i = 0; i < count; ++i)
+        traceSpan(name, samples[i].time, begin, end);
+}
+
+void
+traceSamplesFlow(const char* name, const PadSample* samples, size_t count,
+                 int64_t at, bool start)
+{
+    if (!traceEnabled())
+        return;
+    for (size_t i = 0; i < count; ++i)
+        traceFlow(name, samples[i].time, at, start);
+}
+
+// Plays received samples back into a sink with the spacing they were
+// captured at. Samples are keyed by source (the connection) and pad. Each
+// stream's client clock is anchored to the local clock on
+// its first sample; a batch arriving late pushes the anchor back by the
+// lateness (up to REPLAY_MAX_DELAY_US) so the relative timing survives
+// network jitter, anything later than that restarts the timeline. Batches
+// arriving early slowly win that delay back.
+class SampleReplayer {
+public:
+    using Sink = std::function<void(uint32_t, uint8_t, const PadSample&)>;
+    using Clock = std::chrono::steady_clock;
+
+    SampleReplayer(Sink sink)
+        : sink_(std::move(sink))
+        , running_(false)
+        , dropped_(0) {
+        queue_.reserve(SAMPLE_RING_SIZE);
+    };
+
+    ~SampleReplayer() {
+        stop();
+    };
+
+    void
+    start() {
+        if (running_.exchange(true))
+            return;
+        thread_ = std::thread([this]() { run(); });
+    };
+
+    void
+    stop() {
+        uint64_t dropped;
+        {
+            // under the lock, so the thread can't miss it between checking
+            // running_ and going to sleep
+            std::lock_guard<std::mutex> lck(mutex_);
+            if (!running_.exchange(false))
+                return;
+            dropped = dropped_;
+        }
+        if (dropped)
+            DBGOUT("replay - dropped %llu overdue samples on a full queue",
+                   (unsigned long long)dropped);
+        cv_.notify_all();
+        if (thread_.joinable())
+            thread_.join();
+    };
+
+    void
+    submit(uint32_t source, uint8_t pad, const PadSample* samples, size_t count) {
+        if (!count)
+            return;
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lck(mutex_);
+        auto key = (uint64_t)source << 8 | pad;
+        auto it = anchors_.find(key);
+        if (it == anchors_.end()) {
+            ALLOC_SCOPE("replay-stream-setup");
+            it = anchors_.emplace(key, Anchor()).first;
+        }
+        auto& anchor = it->second;
+        auto due = [&anchor](uint64_t time) {
+            return anchor.local + std::chrono::microseconds((int64_t)(time - anchor.remote));
+        };
+        if (!anchor.valid || samples[0].time < anchor.remote ||
+            now - due(samples[0].time) > std::chrono::microseconds(REPLAY_MAX_DELAY_US)) {
+            anchor.valid = true;
+            anchor.remote = samples[0].time;
+            anchor.local = now;
+        } else if (due(samples[0].time) < now) {
+            anchor.local += now - due(samples[0].time);
+        } else {
+            // early: give back a little of the delay added for past jitter
+            anchor.local -= (due(samples[0].time) - now) / 16;
+        }
+        auto queued = traceEnabled() ? traceNow() : 0;
+        if (queue_.size() + count > queue_.capacity() && queue_.capacity() < REPLAY_QUEUE_MAX) {
+            ALLOC_SCOPE("replay-queue-grow");
+            queue_.reserve(std::min<size_t>(REPLAY_QUEUE_MAX,
+                                            std::max(queue_.capacity() * 2, queue_.size() + count)));
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (queue_.size() == queue_.capacity()) {
+                // the most overdue sample makes room
+                std::pop_heap(queue_.begin(), queue_.end(), later);
+                queue_.pop_back();
+                ++dropped_;
+            }
+            queue_.push_back({ due(samples[i].time), queued, source, pad, samples[i] });
+            std::push_heap(queue_.begin(), queue_.end(), later);
+        }
+        cv_.notify_one();
+    };
+
+    // takes every sample still waiting for source out of the queue, in due
+    // order, and calls fn(uint8_t pad, const PadSample&) for each; the
+    // stream is anchored afresh if source submits again
+    template<typename Fn>
+    void
+    withdraw(uint32_t source, Fn&& fn) {
+        std::lock_guard<std::mutex> lck(mutex_);
+        auto split = std::partition(queue_.begin(), queue_.end(),
+            [source](const Pending& p) { return p.source != source; });
+        std::sort(split, queue_.end(),
+            [](const Pending& a, const Pending& b) { return a.due < b.due; });
+        for (auto it = split; it != queue_.end(); ++it)
+            fn(it->pad, it->sample);
+        queue_.erase(split, queue_.end());
+        std::make_heap(queue_.begin(), queue_.end(), later);
+        for (auto it = anchors_.begin(); it != anchors_.end();) {
+            if ((uint32_t)(it->first >> 8) == source)
+                it = anchors_.erase(it);
+            else
+                ++it;
+        }
+    };
+
+private:
+    struct Anchor {
+        bool valid {false};
+        uint64_t remote {0};
+        Clock::time_point local;
+    };
+
+    struct Pending {
+        Clock::time_point due;
+        int64_t queued;
+        uint32_t source;
+        uint8_t pad;
+        PadSample sample;
+    };
+
+    // the queue is a heap with the earliest due sample on top
+    static bool
+    later(const Pending& a, const Pending& b) {
+        return a.due > b.due;
+    };
+
+    void
+    run() {
+        applyThreadRole(ThreadRole::Replay);
+        ALLOC_THREAD_NAME("replay");
+        std::unique_lock<std::mutex> lck(mutex_);
+        while (running_) {
+            if (queue_.empty()) {
+                cv_.wait(lck);
+                continue;
+            }
+            // batches from different streams interleave, play the earliest
+            auto due = queue_.front().due;
+            if (due > Clock::now()) {
+                cv_.wait_until(lck, due);
+                continue;
+            }
+            std::pop_heap(queue_.begin(), queue_.end(), later);
+            auto pending = queue_.back();
+            queue_.pop_back();
+            lck.unlock();
+            if (traceSampled(pending.sample.time)) {
+                auto begin = traceNow();
+                traceSpan("coalesce", pending.sample.time, pending.queued, begin);
+                sink_(pending.source, pending.pad, pending.sample);
+                traceSpan("inject", pending.sample.time, begin, traceNow());
+            } else {
+                sink_(pending.source, pending.pad, pending.sample);
+            }
+            lck.lock();
+        }
+    };
+
+    Sink sink_;
+    std::atomic<bool> running_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Pending> queue_;
+    std::unordered_map<uint64_t, Anchor> anchors_;
+    // under mutex_
+    uint64_t dropped_;
+
+};
+
+}
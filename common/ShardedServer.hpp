@@ -0,0 +1,1116 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <unordered_map>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#endif
+
+#include "Log.hpp"
+#include "AllocTrack.hpp"
+#include "PerfCounters.hpp"
+#include "Trace.hpp"
+#include "Journal.hpp"
+#include "Frame.hpp"
+#include "Handshake.hpp"
+#include "Client.hpp"
+#include "Timer.hpp"
+#include "ThreadRole.hpp"
+#include "Handoff.hpp"
+
+#define SHARD_MAX_EVENTS 64
+// most shards a takeover accepts
+#define SHARD_MAX_HANDOFF 1024
+// replies a client hasn't read yet, past which further replies are dropped
+// whole rather than queued
+#define SHARD_MAX_OUTPUT (16 * 1024)
+// room for replies from other threads before the shard picks them up
+#define SHARD_OUTBOX_BYTES (16 * 1024)
+
+namespace Network
+{
+
+// what a shard timer is for, kept in the top half of the timer's value
+enum class ShardTimer : uint32_t {
+    Idle = 1
+};
+
+// lets the application carry its own per-connection state across a hot
+// restart
+struct HandoffHooks {
+    // appends the state kept for a connection, on the thread serving it
+    std::function<void(Socket, std::string&)> save;
+    // restores it under the connection's new socket, on the thread that
+    // serves it from then on
+    std::function<void(Socket, const char*, size_t)> load;
+};
+
+enum class TakeOver {
+    Done,
+    Nobody,
+    Failed
+};
+
+// A listener shard: its own SO_REUSEPORT socket, epoll reactor thread and
+// connection table. The kernel spreads incoming connections across the
+// shards, so nothing is shared between them on the hot path. Per-connection
+// deadlines live in one timer wheel, which sets the epoll_wait timeout.
+//
+// Only the shard thread writes to its connections. Each has an output
+// buffer for what the socket didn't take, flushed on EPOLLOUT, so a frame
+// never goes out in part; replies from other threads are posted to the
+// shard's outbox and written when the wakeup eventfd fires.
+class Shard {
+public:
+    Shard(size_t index)
+        : index_(index)
+        , listenSocket_(INVALID_SOCKET)
+        , epoll_(-1)
+        , wakeup_(-1)
+        , idleMicros_(0)
+        , timers_(now()) {
+        outbox_.reserve(SHARD_OUTBOX_BYTES);
+        outboxDrain_.reserve(SHARD_OUTBOX_BYTES);
+    };
+
+    ~Shard() {
+        close();
+    };
+
+    int
+    open(PortNumber port) {
+#ifndef _WIN32
+        // dual-stack first, plain IPv4 if the host has no IPv6
+        listenSocket_ = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listenSocket_ != INVALID_SOCKET) {
+            int off = 0;
+            setsockopt(listenSocket_, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+            setOptions();
+            sockaddr_in6 addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin6_family = AF_INET6;
+            addr.sin6_port = htons(port);
+            addr.sin6_addr = in6addr_any;
+            if (bind(listenSocket_, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+                _close(listenSocket_);
+                listenSocket_ = INVALID_SOCKET;
+            }
+        }
+        if (listenSocket_ == INVALID_SOCKET) {
+            listenSocket_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (listenSocket_ == INVALID_SOCKET) {
+                DBGOUT("shard %d - socket failed with error: %d", (int)index_, errno);
+                return 1;
+            }
+            setOptions();
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            addr.sin_port = htons(port);
+            addr.sin_addr.s_addr = htonl(INADDR_ANY);
+            if (bind(listenSocket_, (sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR) {
+                DBGOUT("shard %d - bind failed with error: %d", (int)index_, errno);
+                return 1;
+            }
+        }
+        if (listen(listenSocket_, SOMAXCONN) == SOCKET_ERROR) {
+            DBGOUT("shard %d - listen failed with error: %d", (int)index_, errno);
+            return 1;
+        }
+        return startReactor();
+#else
+        DBGOUT("shard - sharded server unavailable on this platform");
+        return 1;
+#endif
+    };
+
+#ifndef _WIN32
+    // takes over a listening socket handed off by another process
+    int
+    adopt(Socket listenSocket) {
+        listenSocket_ = listenSocket;
+        return startReactor();
+    };
+
+    // takes over a connection handed off by another process, with the
+    // reader state, unsent replies and application state handOff() sent
+    // along
+    int
+    adoptConnection(Socket socket, HandoffReader& in) {
+        auto& conn = connections_[socket];
+        if (!conn.reader.load(in) || !in.getBytes(conn.out) || !in.getBytes(conn.handoff) ||
+            conn.out.size() > SHARD_MAX_OUTPUT) {
+            DBGOUT("shard %d - bad connection state, dropping it", (int)index_);
+            connections_.erase(socket);
+            _close(socket);
+            return 1;
+        }
+        own(socket, true);
+        watch(socket);
+        // the rest of a reply the old server was halfway through
+        if (!conn.out.empty())
+            rewatch(socket, conn);
+        if (idleMicros_) {
+            conn.lastActive = now();
+            arm(ShardTimer::Idle, socket, conn.lastActive + idleMicros_, conn.idle);
+        }
+        return 0;
+    };
+
+    // sends the listening socket and every connection to the process
+    // taking over. Only valid once run() returned detached.
+    int
+    handOff(int peer) {
+        std::string payload;
+        HandoffWriter out(payload);
+        out.put((uint32_t)index_);
+        if (sendHandoff(peer, HANDOFF_LISTENER, payload, listenSocket_) != 0)
+            return 1;
+        for (auto& conn : connections_) {
+            payload.clear();
+            out.put((uint32_t)index_);
+            conn.second.reader.save(out);
+            out.putBytes(conn.second.out.data(), conn.second.out.size());
+            out.putBytes(conn.second.handoff.data(), conn.second.handoff.size());
+            if (sendHandoff(peer, HANDOFF_CONNECTION, payload, conn.first) != 0)
+                return 1;
+        }
+        return 0;
+    };
+#endif
+
+    // connections that send nothing for this long are dropped, 0 to never
+    // drop them. Call before run().
+    void
+    setIdleTimeout(uint32_t ms) {
+        idleMicros_ = (uint64_t)ms * 1000;
+    };
+
+    // where the shard marks the sockets it serves, indexed by descriptor,
+    // with its index + 1. Call before opening.
+    void
+    setOwners(std::atomic<uint16_t>* owners, size_t size) {
+        owners_ = owners;
+        ownersSize_ = size;
+    };
+
+    size_t
+    index() const {
+        return index_;
+    };
+
+    // the shard whose reactor the calling thread runs, if any
+    static Shard*&
+    current() {
+        static thread_local Shard* shard = nullptr;
+        return shard;
+    };
+
+    // queues a whole frame for a connection of this shard; shard thread
+    // only. Whatever the socket doesn't take now is sent on EPOLLOUT.
+    // Returns len, or SOCKET_ERROR if the connection is gone or so far
+    // behind that the frame was dropped.
+    int
+    send(Socket socket, const char* data, size_t len) {
+#ifndef _WIN32
+        auto it = connections_.find(socket);
+        if (it == connections_.end())
+            return SOCKET_ERROR;
+        auto& conn = it->second;
+        if (conn.out.size() + len > SHARD_MAX_OUTPUT) {
+            DBGOUT("shard %d - client not reading, dropping a reply", (int)index_);
+            return SOCKET_ERROR;
+        }
+        size_t sent = 0;
+        while (conn.out.empty() && sent < len) {
+            auto res = ::send(socket, data + sent, len - sent, SEND_FLAGS);
+            if (res > 0) {
+                sent += res;
+                continue;
+            }
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            // the read side notices and drops the connection
+            return SOCKET_ERROR;
+        }
+        if (sent < len) {
+            ALLOC_SCOPE("reply-backlog");
+            conn.out.append(data + sent, len - sent);
+            rewatch(socket, conn);
+        }
+        return (int)len;
+#else
+        return SOCKET_ERROR;
+#endif
+    };
+
+    // hands a whole frame to the shard thread for one of its connections;
+    // any thread
+    int
+    post(Socket socket, const char* data, size_t len) {
+#ifndef _WIN32
+        {
+            std::lock_guard<std::mutex> lck(outboxMutex_);
+            if (outbox_.size() + sizeof(Socket) + sizeof(uint16_t) + len > outbox_.capacity()) {
+                ALLOC_SCOPE("reply-outbox");
+                outbox_.reserve(outbox_.capacity() * 2 + len);
+            }
+            uint16_t length = (uint16_t)len;
+            outbox_.append((const char*)&socket, sizeof(socket));
+            outbox_.append((const char*)&length, sizeof(length));
+            outbox_.append(data, len);
+        }
+        wake();
+        return (int)len;
+#else
+        return SOCKET_ERROR;
+#endif
+    };
+
+    // runs the reactor on the calling thread until wake() is called. When
+    // detach is set by then the connections stay open, with their state
+    // saved for handOff().
+    void
+    run(const SocketCallback& cb, const HandoffHooks& hooks,
+        const HandshakeCallback& onHandshake, const DisconnectCallback& onDisconnect,
+        const std::atomic<bool>& running, const std::atomic<bool>& detach) {
+#ifndef _WIN32
+        onDisconnect_ = &onDisconnect;
+        current() = this;
+        // adopted connections pick their state up on the thread that
+        // serves them
+        for (auto& conn : connections_) {
+            auto& saved = conn.second.handoff;
+            if (!saved.empty() && hooks.load)
+                hooks.load(conn.first, saved.data(), saved.size());
+            saved.clear();
+        }
+
+        epoll_event events[SHARD_MAX_EVENTS];
+        while (running) {
+            int n = epoll_wait(epoll_, events, SHARD_MAX_EVENTS, timers_.timeout(now()));
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                DBGOUT("shard %d - epoll_wait failed with error: %d", (int)index_, errno);
+                break;
+            }
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == wakeup_) {
+                    // drained, so a reactor resumed after a failed handoff
+                    // doesn't keep waking up
+                    uint64_t count;
+                    if (::read(wakeup_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                        DBGOUT("shard %d - wakeup read failed", (int)index_);
+                    drainOutbox();
+                    continue;
+                }
+                if (fd == listenSocket_) {
+                    acceptAll();
+                    continue;
+                }
+                if (events[i].events & EPOLLOUT)
+                    flush(fd);
+                if (events[i].events & ~EPOLLOUT)
+                    service(fd, cb, onHandshake);
+            }
+            timers_.advance(now(), [this](uint64_t data) {
+                expire((ShardTimer)(data >> 32), (Socket)(uint32_t)data);
+            });
+        }
+        // replies posted before the stop go out, or along with the handoff
+        drainOutbox();
+        current() = nullptr;
+        if (detach) {
+            for (auto& conn : connections_) {
+                conn.second.handoff.clear();
+                if (hooks.save)
+                    hooks.save(conn.first, conn.second.handoff);
+            }
+            return;
+        }
+        for (auto& conn : connections_) {
+            if (onDisconnect)
+                onDisconnect(conn.first);
+            own(conn.first, false);
+            _close(conn.first);
+        }
+        connections_.clear();
+#endif
+    };
+
+    void
+    wake() {
+#ifndef _WIN32
+        uint64_t one = 1;
+        if (wakeup_ >= 0 && ::write(wakeup_, &one, sizeof(one)) < 0)
+            DBGOUT("shard %d - wakeup failed", (int)index_);
+#endif
+    };
+
+    void
+    close() {
+#ifndef _WIN32
+        // still here after a handoff, the other process has its own copies
+        for (auto& conn : connections_) {
+            own(conn.first, false);
+            _close(conn.first);
+        }
+        connections_.clear();
+        if (listenSocket_ != INVALID_SOCKET)
+            _close(listenSocket_);
+        if (epoll_ >= 0)
+            ::close(epoll_);
+        if (wakeup_ >= 0)
+            ::close(wakeup_);
+#endif
+        listenSocket_ = INVALID_SOCKET;
+        epoll_ = -1;
+        wakeup_ = -1;
+    };
+
+    size_t
+    connectionCount() const {
+#ifndef _WIN32
+        return connections_.size();
+#else
+        return 0;
+#endif
+    };
+
+    static uint64_t
+    now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+
+private:
+#ifndef _WIN32
+    struct Connection {
+        FrameReader reader;
+        // the part of the replies the socket hasn't taken yet
+        std::string out;
+        bool writing {false};
+        uint64_t lastActive {0};
+        TimerWheel::Handle idle {0};
+        // application state saved for, or adopted from, a handoff
+        std::string handoff;
+    };
+
+    int
+    startReactor() {
+        epoll_ = epoll_create1(EPOLL_CLOEXEC);
+        wakeup_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (epoll_ < 0 || wakeup_ < 0)
+            return 1;
+        watch(listenSocket_);
+        watch(wakeup_);
+        return 0;
+    };
+
+    void
+    arm(ShardTimer kind, Socket socket, uint64_t deadline, TimerWheel::Handle& handle) {
+        handle = timers_.schedule(deadline, (uint64_t)kind << 32 | (uint32_t)socket);
+    };
+
+    void
+    expire(ShardTimer kind, Socket socket) {
+        auto it = connections_.find(socket);
+        if (it == connections_.end())
+            return;
+        auto& conn = it->second;
+        switch (kind) {
+        case ShardTimer::Idle:
+            // reads only note the time, the timer catches up here
+            if (now() - conn.lastActive < idleMicros_) {
+                arm(kind, socket, conn.lastActive + idleMicros_, conn.idle);
+                return;
+            }
+            DBGOUT("shard %d - dropping idle client", (int)index_);
+            drop(it);
+            break;
+        }
+    };
+
+    void
+    drop(std::unordered_map<Socket, Connection>::iterator it) {
+        auto socket = it->first;
+        journalRecord(JOURNAL_CLOSE, (uint32_t)socket);
+        timers_.cancel(it->second.idle);
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, socket, nullptr);
+        // the application stops posting for the socket here, and what it
+        // already posted is written before the descriptor can be reused
+        if (onDisconnect_ && *onDisconnect_)
+            (*onDisconnect_)(socket);
+        drainOutbox();
+        own(socket, false);
+        _close(socket);
+        connections_.erase(socket);
+    };
+
+    void
+    own(Socket socket, bool owned) {
+        if (owners_ && socket >= 0 && (size_t)socket < ownersSize_)
+            owners_[socket] = owned ? (uint16_t)(index_ + 1) : 0;
+    };
+
+    // asks for EPOLLOUT while the connection has output waiting, and only
+    // then
+    void
+    rewatch(Socket socket, Connection& conn) {
+        bool writing = !conn.out.empty();
+        if (conn.writing == writing)
+            return;
+        conn.writing = writing;
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP | (writing ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.fd = socket;
+        epoll_ctl(epoll_, EPOLL_CTL_MOD, socket, &ev);
+    };
+
+    void
+    flush(Socket socket) {
+        auto it = connections_.find(socket);
+        if (it == connections_.end())
+            return;
+        auto& conn = it->second;
+        size_t sent = 0;
+        while (sent < conn.out.size()) {
+            auto res = ::send(socket, conn.out.data() + sent, conn.out.size() - sent, SEND_FLAGS);
+            if (res > 0) {
+                sent += res;
+                continue;
+            }
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            DBGOUT("shard %d - send failed with error: %d", (int)index_, errno);
+            drop(it);
+            return;
+        }
+        conn.out.erase(0, sent);
+        rewatch(socket, conn);
+    };
+
+    // writes what other threads posted; frames for connections gone since
+    // are dropped
+    void
+    drainOutbox() {
+        {
+            std::lock_guard<std::mutex> lck(outboxMutex_);
+            if (outbox_.empty())
+                return;
+            outboxDrain_.swap(outbox_);
+        }
+        size_t at = 0;
+        while (at + sizeof(Socket) + sizeof(uint16_t) <= outboxDrain_.size()) {
+            Socket socket;
+            uint16_t length;
+            memcpy(&socket, outboxDrain_.data() + at, sizeof(socket));
+            memcpy(&length, outboxDrain_.data() + at + sizeof(socket), sizeof(length));
+            at += sizeof(socket) + sizeof(length);
+            send(socket, outboxDrain_.data() + at, length);
+            at += length;
+        }
+        // keeps the capacity for the next swap
+        outboxDrain_.clear();
+    };
+
+    void
+    setOptions() {
+        int on = 1;
+        setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        setsockopt(listenSocket_, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    };
+
+    void
+    watch(int fd) {
+        epoll_event ev;
+        ev.events = EPOLLIN | EPOLLRDHUP;
+        ev.data.fd = fd;
+        epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev);
+    };
+
+    void
+    acceptAll() {
+        while (true) {
+            sockaddr_storage addr;
+            socklen_t len = sizeof(addr);
+            Socket socket = accept4(listenSocket_, (sockaddr*)&addr, &len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (socket == INVALID_SOCKET) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    DBGOUT("shard %d - accept failed with error: %d", (int)index_, errno);
+                return;
+            }
+            int on = 1;
+            setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+            auto& conn = connections_[socket];
+            journalRecord(JOURNAL_OPEN, (uint32_t)socket);
+            own(socket, true);
+            watch(socket);
+            if (idleMicros_) {
+                conn.lastActive = now();
+                arm(ShardTimer::Idle, socket, conn.lastActive + idleMicros_, conn.idle);
+            }
+#ifdef DEBUG
+            // the peer address comes free with accept4, only format it
+            // when it is going to be printed
+            char ipstr[INET6_ADDRSTRLEN] = "?";
+            int port = 0;
+            if (addr.ss_family == AF_INET6) {
+                auto s = (sockaddr_in6*)&addr;
+                inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof(ipstr));
+                port = ntohs(s->sin6_port);
+            } else if (addr.ss_family == AF_INET) {
+                auto s = (sockaddr_in*)&addr;
+                inet_ntop(AF_INET, &s->sin_addr, ipstr, sizeof(ipstr));
+                port = ntohs(s->sin_port);
+            }
+            DBGOUT("shard %d - client %s:%d connected", (int)index_, ipstr, port);
+#endif
+        }
+    };
+
+    void
+    service(Socket socket, const SocketCallback& cb, const HandshakeCallback& onHandshake) {
+        auto it = connections_.find(socket);
+        if (it == connections_.end())
+            return;
+        auto& reader = it->second.reader;
+        if (idleMicros_)
+            it->second.lastActive = now();
+        auto onMessage = [this, &cb, &onHandshake, &socket](Channel channel, uint8_t,
+                                                            const char* data, int len) {
+            if (isPing(channel, data, len)) {
+                char pong[FRAME_MAX_LEN];
+                send(socket, pong, encodePong(data, len, pong));
+                return;
+            }
+            if (isHello(channel, data, len)) {
+                char accept[FRAME_MAX_LEN];
+                Capabilities agreed;
+                if (auto n = encodeAccept(data, len, accept, agreed)) {
+                    send(socket, accept, n);
+                    if (onHandshake)
+                        onHandshake(socket, agreed);
+                }
+                return;
+            }
+            cb(socket, data, len);
+        };
+        auto onLegacy = [&cb, &socket](const char* data, int len) {
+            cb(socket, data, len);
+        };
+
+        while (true) {
+            int res = (int)recv(socket, recvbuf_, DEFAULT_BUFLEN - 1, 0);
+            if (res > 0) {
+                journalRecord(JOURNAL_DATA, (uint32_t)socket, recvbuf_, res);
+                ALLOC_STEADY_SCOPE("rx-frame");
+                PERF_SECTION("rx-frame");
+                if (traceEnabled())
+                    traceSetReceived(traceNow());
+                recvbuf_[res] = '\0';
+                if (!reader.feed(recvbuf_, res, onMessage, onLegacy))
+                    break;
+                if (res < DEFAULT_BUFLEN - 1)
+                    return;
+                continue;
+            }
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (res < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        DBGOUT("shard %d - client disconnected", (int)index_);
+        drop(it);
+    };
+
+    std::unordered_map<Socket, Connection> connections_;
+    char recvbuf_[DEFAULT_BUFLEN];
+    // run()'s, for drop()
+    const DisconnectCallback* onDisconnect_ {nullptr};
+
+    // [socket][length][frame] records posted by other threads, swapped
+    // with outboxDrain_ by the shard thread
+    std::mutex outboxMutex_;
+    std::string outbox_;
+    std::string outboxDrain_;
+#endif
+    std::atomic<uint16_t>* owners_ {nullptr};
+    size_t ownersSize_ {0};
+
+    size_t index_;
+    Socket listenSocket_;
+    int epoll_;
+    int wakeup_;
+    uint64_t idleMicros_;
+    TimerWheel timers_;
+
+};
+
+// N shards, one reactor thread each; by default the shard role spreads them
+// round-robin over the online CPUs.
+class ShardedServer {
+public:
+    ShardedServer()
+        : running_(false)
+        , stopping_(false)
+        , detach_(false)
+        , handedOff_(false)
+        , handoffListener_(-1)
+        , handoffPeer_(-1) { };
+
+    ~ShardedServer() {
+        stop();
+    };
+
+    // idleMs drops connections that send nothing for that long, 0 to keep
+    // them forever
+    int
+    start(PortNumber port, size_t shards = 0, uint32_t idleMs = 0) {
+        if (!shards)
+            shards = std::max<size_t>(1, std::thread::hardware_concurrency());
+        DBGOUT("starting %d server shards...", (int)shards);
+        for (size_t i = 0; i < shards; ++i) {
+            addShard(idleMs);
+            if (shards_.back()->open(port) != 0) {
+                shards_.clear();
+                return 1;
+            }
+        }
+        running_ = true;
+        stopping_ = false;
+        return 0;
+    };
+
+    // call before start() or takeOver()
+    void
+    setHandoffHooks(HandoffHooks hooks) {
+        hooks_ = std::move(hooks);
+    };
+
+    // called on a shard thread with what each client that said hello was
+    // answered; call before run()
+    void
+    setHandshakeCb(HandshakeCallback cb) {
+        handshakeCb_ = std::move(cb);
+    };
+
+    // called on a shard thread for every connection it drops or closes,
+    // but not for those handed off; call before run()
+    void
+    setDisconnectCb(DisconnectCallback cb) {
+        disconnectCb_ = std::move(cb);
+    };
+
+    // in place of start(): takes every socket over from the server serving
+    // handoffs on path, keeping its shard count. Nobody means there is no
+    // such server and start() should be used instead.
+    TakeOver
+    takeOver(const std::string& path, uint32_t idleMs = 0) {
+#ifndef _WIN32
+        int peer = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (peer < 0)
+            return TakeOver::Failed;
+        auto addr = handoffAddress(path);
+        if (connect(peer, (sockaddr*)&addr, sizeof(addr)) != 0) {
+            auto err = errno;
+            ::close(peer);
+            if (err == ENOENT || err == ECONNREFUSED)
+                return TakeOver::Nobody;
+            DBGOUT("handoff - connect failed with error: %d", err);
+            return TakeOver::Failed;
+        }
+        setHandoffTimeout(peer);
+        if (receiveHandoff(peer, idleMs) != 0) {
+            ::close(peer);
+            shards_.clear();
+            return TakeOver::Failed;
+        }
+        ::close(peer);
+        running_ = true;
+        stopping_ = false;
+        return TakeOver::Done;
+#else
+        return TakeOver::Nobody;
+#endif
+    };
+
+    // lets a server started later take over from this one through path,
+    // a unix socket only the same user may connect to. Call before run().
+    int
+    serveHandoff(const std::string& path) {
+#ifndef _WIN32
+        handoffListener_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if (handoffListener_ < 0)
+            return 1;
+        // a leftover from a server that died, or the one we just took over
+        unlink(path.c_str());
+        auto addr = handoffAddress(path);
+        if (bind(handoffListener_, (sockaddr*)&addr, sizeof(addr)) != 0 ||
+            chmod(path.c_str(), 0600) != 0 ||
+            listen(handoffListener_, 1) != 0) {
+            DBGOUT("handoff - can't listen on %s, error: %d", path.c_str(), errno);
+            ::close(handoffListener_);
+            handoffListener_ = -1;
+            return 1;
+        }
+        handoffPath_ = path;
+        DBGOUT("handoff - serving takeovers on %s", path.c_str());
+        return 0;
+#else
+        return 1;
+#endif
+    };
+
+    // blocks until stop() is called, or until another process took every
+    // connection over; cb is invoked concurrently from every shard thread,
+    // with the connection's socket as its identity
+    int
+    run(SocketCallback cb) {
+        if (!running_)
+            return 1;
+        std::thread handoffThread;
+        if (handoffListener_ >= 0)
+            handoffThread = std::thread([this]() { acceptHandoffs(); });
+        while (true) {
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < shards_.size(); ++i) {
+                threads.emplace_back([this, i, &cb]() {
+                    applyThreadRole(ThreadRole::Shard, (int)i);
+                    ALLOC_THREAD_NAME("shard");
+                    shards_[i]->run(cb, hooks_, handshakeCb_, disconnectCb_, running_, detach_);
+                });
+            }
+            for (auto& t : threads)
+                t.join();
+            if (!detach_)
+                break;
+            if (finishHandoff() == 0)
+                break;
+            // the shards still hold every connection, pick up where we were
+            DBGOUT("handoff - failed, resuming");
+            if (stopping_)
+                break;
+            running_ = true;
+        }
+        closeHandoff(handoffThread);
+        std::lock_guard<std::mutex> lck(mutex_);
+        shards_.clear();
+        return 0;
+    };
+
+    void
+    stop() {
+        stopping_ = true;
+        pause();
+    };
+
+    bool
+    isRunning() {
+        return running_.load();
+    };
+
+    // true once run() returned because another process took over
+    bool
+    handedOff() {
+        return handedOff_.load();
+    };
+
+    size_t
+    shardCount() {
+        return shards_.size();
+    };
+
+    // true if a shard serves the connection behind socket
+    bool
+    owns(Socket socket) {
+        return owner(socket) != 0;
+    };
+
+    // sends a whole frame to a connection a shard serves; any thread. On
+    // the shard's own thread it is written (or buffered) right away, from
+    // anywhere else it is handed to the shard.
+    int
+    send(Socket socket, const char* data, size_t len) {
+        auto index = owner(socket);
+        if (!index || len > UINT16_MAX)
+            return SOCKET_ERROR;
+        auto shard = Shard::current();
+        if (shard && shard->index() == (size_t)index - 1)
+            return shard->send(socket, data, len);
+        std::lock_guard<std::mutex> lck(mutex_);
+        if (index > shards_.size())
+            return SOCKET_ERROR;
+        return shards_[index - 1]->post(socket, data, len);
+    };
+
+private:
+    void
+    addShard(uint32_t idleMs) {
+#ifndef _WIN32
+        if (!owners_) {
+            // a descriptor can't be past the limit we were started with
+            rlimit limit;
+            ownersSize_ = 1 << 16;
+            if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY)
+                ownersSize_ = std::min<size_t>(limit.rlim_cur, 1 << 20);
+            ALLOC_SCOPE("shard-owners");
+            owners_.reset(new std::atomic<uint16_t>[ownersSize_]);
+            for (size_t i = 0; i < ownersSize_; ++i)
+                owners_[i] = 0;
+        }
+#endif
+        shards_.emplace_back(new Shard(shards_.size()));
+        shards_.back()->setIdleTimeout(idleMs);
+        shards_.back()->setOwners(owners_.get(), ownersSize_);
+    };
+
+    // the index + 1 of the shard serving socket, 0 for none
+    uint16_t
+    owner(Socket socket) {
+        if (!owners_ || socket < 0 || (size_t)socket >= ownersSize_)
+            return 0;
+        return owners_[socket].load();
+    };
+
+    void
+    pause() {
+        if (!running_.exchange(false))
+            return;
+        std::lock_guard<std::mutex> lck(mutex_);
+        for (auto& shard : shards_)
+            shard->wake();
+    };
+
+#ifndef _WIN32
+    // the taking over side, after connecting
+    int
+    receiveHandoff(int peer, uint32_t idleMs) {
+        if (!isHandoffPeerTrusted(peer)) {
+            DBGOUT("handoff - server belongs to another user");
+            return 1;
+        }
+        std::string payload;
+        HandoffWriter out(payload);
+        out.put((uint32_t)HANDOFF_VERSION);
+        if (sendHandoff(peer, HANDOFF_HELLO, payload) != 0)
+            return 1;
+
+        size_t adopted = 0;
+        while (true) {
+            char type;
+            int fd;
+            if (recvHandoff(peer, type, payload, fd) != 0)
+                return 1;
+            HandoffReader in(payload.data(), payload.size());
+            uint32_t index = 0;
+            if (type == HANDOFF_LISTENER || type == HANDOFF_CONNECTION) {
+                if (fd < 0 || !in.get(index) || index >= SHARD_MAX_HANDOFF ||
+                    (type == HANDOFF_CONNECTION && index >= shards_.size())) {
+                    DBGOUT("handoff - bad %c message", type);
+                    if (fd >= 0)
+                        ::close(fd);
+                    return 1;
+                }
+            }
+            switch (type) {
+            case HANDOFF_LISTENER:
+                while (shards_.size() <= index)
+                    addShard(idleMs);
+                if (shards_[index]->adopt(fd) != 0)
+                    return 1;
+                break;
+            case HANDOFF_CONNECTION:
+                if (shards_[index]->adoptConnection(fd, in) == 0)
+                    ++adopted;
+                break;
+            case HANDOFF_END: {
+                uint32_t sent = 0;
+                in.get(sent);
+                DBGOUT("handoff - took over %d shards, %d of %d connections",
+                       (int)shards_.size(), (int)adopted, (int)sent);
+                payload.clear();
+                return sendHandoff(peer, HANDOFF_ACK, payload);
+            }
+            case HANDOFF_REJECT:
+                DBGOUT("handoff - running server speaks another handoff version");
+                return 1;
+            default:
+                DBGOUT("handoff - unexpected %c message", type);
+                return 1;
+            }
+        }
+    };
+
+    // waits for a process to take over, then stops the shards with their
+    // connections detached for run() to hand off
+    void
+    acceptHandoffs() {
+        while (true) {
+            int peer = accept4(handoffListener_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (peer < 0) {
+                if (errno == EINTR)
+                    continue;
+                // closeHandoff() shut the listener down
+                return;
+            }
+            setHandoffTimeout(peer);
+            char type;
+            int fd;
+            std::string payload;
+            uint32_t version = 0;
+            if (!isHandoffPeerTrusted(peer) ||
+                recvHandoff(peer, type, payload, fd) != 0 || type != HANDOFF_HELLO) {
+                DBGOUT("handoff - ignoring a bad takeover request");
+                ::close(peer);
+                continue;
+            }
+            HandoffReader in(payload.data(), payload.size());
+            if (!in.get(version) || version != HANDOFF_VERSION) {
+                DBGOUT("handoff - refusing handoff version %d", (int)version);
+                payload.clear();
+                sendHandoff(peer, HANDOFF_REJECT, payload);
+                ::close(peer);
+                continue;
+            }
+            DBGOUT("handoff - handing off to a new server...");
+            std::unique_lock<std::mutex> lck(handoffMutex_);
+            handoffPeer_ = peer;
+            detach_ = true;
+            lck.unlock();
+            pause();
+            lck.lock();
+            handoffCv_.wait(lck, [this]() { return !detach_; });
+            if (handedOff_ || stopping_)
+                return;
+        }
+    };
+
+    // with every shard stopped and detached: sends it all to the peer and
+    // waits for it to take over
+    int
+    finishHandoff() {
+        int res = 1;
+        {
+            std::lock_guard<std::mutex> lck(handoffMutex_);
+            int peer = handoffPeer_;
+            size_t count = 0;
+            bool sent = true;
+            for (auto& shard : shards_) {
+                count += shard->connectionCount();
+                if (sent && shard->handOff(peer) != 0)
+                    sent = false;
+            }
+            std::string payload;
+            HandoffWriter out(payload);
+            out.put((uint32_t)count);
+            char type;
+            int fd;
+            if (sent && sendHandoff(peer, HANDOFF_END, payload) == 0 &&
+                recvHandoff(peer, type, payload, fd) == 0 && type == HANDOFF_ACK) {
+                DBGOUT("handoff - %d connections handed off", (int)count);
+                handedOff_ = true;
+                res = 0;
+            }
+            ::close(peer);
+            handoffPeer_ = -1;
+            detach_ = false;
+        }
+        handoffCv_.notify_all();
+        return res;
+    };
+
+    void
+    closeHandoff(std::thread& handoffThread) {
+        if (handoffListener_ < 0)
+            return;
+        shutdown(handoffListener_, SHUT_RDWR);
+        {
+            // a takeover that came in as the shards were stopping anyway
+            std::lock_guard<std::mutex> lck(handoffMutex_);
+            if (detach_) {
+                ::close(handoffPeer_);
+                handoffPeer_ = -1;
+                detach_ = false;
+                stopping_ = true;
+            }
+        }
+        handoffCv_.notify_all();
+        if (handoffThread.joinable())
+            handoffThread.join();
+        ::close(handoffListener_);
+        handoffListener_ = -1;
+        // after a handoff the path belongs to the new server
+        if (!handedOff_)
+            unlink(handoffPath_.c_str());
+    };
+#else
+    int
+    finishHandoff() {
+        return 1;
+    };
+
+    void
+    acceptHandoffs() { };
+
+    void
+    closeHandoff(std::thread&) { };
+#endif
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    // which shard serves each descriptor, see owner()
+    std::unique_ptr<std::atomic<uint16_t>[]> owners_;
+    size_t ownersSize_ {0};
+    std::atomic<bool> running_;
+    std::atomic<bool> stopping_;
+    std::atomic<bool> detach_;
+    std::atomic<bool> handedOff_;
+    HandoffHooks hooks_;
+    HandshakeCallback handshakeCb_;
+    DisconnectCallback disconnectCb_;
+    std::string handoffPath_;
+    int handoffListener_;
+    int handoffPeer_;
+    std::mutex handoffMutex_;
+    std::condition_variable handoffCv_;
+
+};
+}
@@ -0,0 +1,464 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <algorithm>
+#include <thread>
+#include <new>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#endif
+
+#include "Log.hpp"
+
+#define DEFAULT_SHM_NAME        "/tcpjoy"
+#define DEFAULT_SHM_CAPACITY    (64 * 1024)
+#define SHM_MAGIC               0x74636a79
+#define SHM_SPIN_ITERATIONS     4096
+#define SHM_WAIT_TIMEOUT_MS     100
+
+namespace Network
+{
+
+#ifndef _WIN32
+
+// The futexes live in the shared mapping, so they must not be the
+// process-private kind.
+int
+_futexWait(std::atomic<uint32_t>* addr, uint32_t expected, int timeoutMs)
+{
+    timespec ts { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+    return (int)syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+                        FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+void
+_futexWake(std::atomic<uint32_t>* addr)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(addr),
+            FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+
+void
+_cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+}
+
+// Single producer, single consumer byte ring. Positions only ever grow and
+// are masked on access; the futex words are only touched when the other
+// side has announced it is about to sleep.
+struct ShmRingHeader {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> dataSeq;
+    std::atomic<uint32_t> readerWaiting;
+    alignas(64) std::atomic<uint32_t> spaceSeq;
+    std::atomic<uint32_t> writerWaiting;
+};
+
+enum ShmState : uint32_t {
+    SHM_IDLE = 0,
+    SHM_ATTACHED,
+    SHM_CLOSED
+};
+
+// Either side may die without closing the link, so each records its pid
+// and checks the other's whenever a wait times out.
+struct ShmControl {
+    uint32_t magic;
+    uint32_t capacity;
+    alignas(64) std::atomic<uint32_t> state;
+    // the server's, then the attached client's; 0 while unknown
+    std::atomic<int32_t> pids[2];
+    ShmRingHeader rings[2];
+};
+
+#endif
+
+// A duplex same-host link made of two rings in one shared memory object.
+// The server side creates it and waits for a peer; the client attaches to
+// it by name. Both sides carry the same frame stream as a socket would.
+class ShmLink {
+public:
+    ShmLink()
+        : fd_(-1)
+        , control_(nullptr)
+        , size_(0)
+        , owner_(false)
+        , shutdown_(false) { };
+
+    ~ShmLink() {
+        unlink();
+        unmap();
+    };
+
+    int
+    listen(const std::string& name, size_t capacity = DEFAULT_SHM_CAPACITY) {
+#ifndef _WIN32
+        unmap();
+        name_ = name;
+        owner_ = true;
+        shutdown_ = false;
+        // capacity must be a power of two for the position masks
+        size_t cap = 1;
+        while (cap < capacity)
+            cap <<= 1;
+
+        shm_unlink(name_.c_str());
+        fd_ = shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd_ < 0) {
+            DBGOUT("shm - unable to create %s", name_.c_str());
+            return 1;
+        }
+        size_ = sizeof(ShmControl) + 2 * cap;
+        if (ftruncate(fd_, size_) != 0 || map() != 0) {
+            DBGOUT("shm - unable to size %s", name_.c_str());
+            return 1;
+        }
+        new (control_) ShmControl();
+        control_->capacity = (uint32_t)cap;
+        control_->pids[0] = (int32_t)getpid();
+        reset();
+        control_->magic = SHM_MAGIC;
+        DBGOUT("shm - listening on %s", name_.c_str());
+        return 0;
+#else
+        DBGOUT("shm - shared memory transport unavailable on this platform");
+        return 1;
+#endif
+    };
+
+    // server side: blocks until a client attaches or the link is closed
+    int
+    waitForPeer() {
+#ifndef _WIN32
+        if (!control_ || shutdown_)
+            return 1;
+        // a client can only attach to an idle link, so the rings are only
+        // recycled once the previous one has gone
+        if (control_->state.load() == SHM_CLOSED)
+            reset();
+        uint32_t state;
+        while ((state = control_->state.load()) == SHM_IDLE && !shutdown_)
+            _futexWait(&control_->state, SHM_IDLE, SHM_WAIT_TIMEOUT_MS);
+        if (state != SHM_ATTACHED || shutdown_)
+            return 1;
+        DBGOUT("shm - peer attached");
+        return 0;
+#else
+        return 1;
+#endif
+    };
+
+    int
+    connect(const std::string& name) {
+#ifndef _WIN32
+        unmap();
+        name_ = name;
+        owner_ = false;
+        fd_ = shm_open(name_.c_str(), O_RDWR, 0600);
+        if (fd_ < 0) {
+            DBGOUT("shm - no server on %s", name_.c_str());
+            return 1;
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0 || (size_t)st.st_size < sizeof(ShmControl)) {
+            unmap();
+            return 1;
+        }
+        size_ = st.st_size;
+        if (map() != 0 || control_->magic != SHM_MAGIC) {
+            unmap();
+            return 1;
+        }
+        // the rings must lie inside the object, whatever its header says
+        uint32_t cap = control_->capacity;
+        if (!cap || (cap & (cap - 1)) || size_ < sizeof(ShmControl) + 2 * (size_t)cap) {
+            DBGOUT("shm - %s is malformed", name_.c_str());
+            unmap();
+            return 1;
+        }
+        uint32_t idle = SHM_IDLE;
+        if (!control_->state.compare_exchange_strong(idle, SHM_ATTACHED)) {
+            DBGOUT("shm - %s is busy", name_.c_str());
+            unmap();
+            return 1;
+        }
+        control_->pids[1] = (int32_t)getpid();
+        _futexWake(&control_->state);
+        DBGOUT("shm - attached to %s", name_.c_str());
+        return 0;
+#else
+        return 1;
+#endif
+    };
+
+    bool
+    isOpen() const {
+#ifndef _WIN32
+        return control_ && control_->state.load() == SHM_ATTACHED;
+#else
+        return false;
+#endif
+    };
+
+    bool
+    isMapped() const {
+        return control_ != nullptr;
+    };
+
+    // server side: created and not yet shut down
+    bool
+    isListening() const {
+        return owner_ && control_ != nullptr && !shutdown_;
+    };
+
+    // blocks while the ring is full, returns len or SOCKET_ERROR
+    int
+    write(const char* data, size_t len) {
+#ifndef _WIN32
+        if (!isOpen())
+            return -1;
+        auto& ring = txRing();
+        const uint64_t cap = control_->capacity;
+        char* buf = txData();
+        size_t written = 0;
+        while (written < len) {
+            uint64_t head = ring.head.load(std::memory_order_relaxed);
+            uint64_t space = cap - (head - ring.tail.load(std::memory_order_acquire));
+            if (space == 0) {
+                if (!waitFor(ring.spaceSeq, ring.writerWaiting, [&]() {
+                        return head - ring.tail.load(std::memory_order_acquire) < cap; }))
+                    return -1;
+                continue;
+            }
+            size_t n = std::min((size_t)space, len - written);
+            size_t offset = head & (cap - 1);
+            size_t first = std::min(n, (size_t)(cap - offset));
+            memcpy(buf + offset, data + written, first);
+            memcpy(buf, data + written + first, n - first);
+            ring.head.store(head + n, std::memory_order_seq_cst);
+            written += n;
+            ring.dataSeq.fetch_add(1, std::memory_order_release);
+            if (ring.readerWaiting.load(std::memory_order_seq_cst))
+                _futexWake(&ring.dataSeq);
+        }
+        return (int)len;
+#else
+        return -1;
+#endif
+    };
+
+    // blocks until data is available, returns the byte count, 0 once the
+    // peer has closed and the ring is drained, or -1
+    int
+    read(char* out, size_t len) {
+#ifndef _WIN32
+        if (!control_)
+            return -1;
+        auto& ring = rxRing();
+        const uint64_t cap = control_->capacity;
+        const char* buf = rxData();
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        uint64_t avail = ring.head.load(std::memory_order_acquire) - tail;
+        if (avail == 0) {
+            if (!waitFor(ring.dataSeq, ring.readerWaiting, [&]() {
+                    return ring.head.load(std::memory_order_acquire) != tail; }))
+                return 0;
+            avail = ring.head.load(std::memory_order_acquire) - tail;
+        }
+        size_t n = std::min((size_t)avail, len);
+        size_t offset = tail & (cap - 1);
+        size_t first = std::min(n, (size_t)(cap - offset));
+        memcpy(out, buf + offset, first);
+        memcpy(out + first, buf, n - first);
+        ring.tail.store(tail + n, std::memory_order_seq_cst);
+        ring.spaceSeq.fetch_add(1, std::memory_order_release);
+        if (ring.writerWaiting.load(std::memory_order_seq_cst))
+            _futexWake(&ring.spaceSeq);
+        return (int)n;
+#else
+        return -1;
+#endif
+    };
+
+    // marks the link closed and wakes both sides; the mapping stays valid
+    // until the link is destroyed or reconnected, as a reader may still be
+    // inside read()
+    void
+    close() {
+#ifndef _WIN32
+        if (!control_)
+            return;
+        if (owner_)
+            shutdown_ = true;
+        markClosed();
+#endif
+    };
+
+    void
+    unlink() {
+#ifndef _WIN32
+        close();
+        if (owner_ && !name_.empty())
+            shm_unlink(name_.c_str());
+#endif
+    };
+
+private:
+#ifndef _WIN32
+    int
+    map() {
+        void* addr = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+        if (addr == MAP_FAILED)
+            return 1;
+        control_ = static_cast<ShmControl*>(addr);
+        return 0;
+    };
+
+    void
+    reset() {
+        for (auto& ring : control_->rings) {
+            ring.head = 0;
+            ring.tail = 0;
+            ring.readerWaiting = 0;
+            ring.writerWaiting = 0;
+        }
+        control_->pids[1] = 0;
+        control_->state.store(SHM_IDLE);
+    };
+
+    // ends this session, the server can still take the next one
+    void
+    markClosed() {
+        control_->state.store(SHM_CLOSED);
+        _futexWake(&control_->state);
+        for (auto& ring : control_->rings) {
+            _futexWake(&ring.dataSeq);
+            _futexWake(&ring.spaceSeq);
+        }
+    };
+
+    // false once the other side's process is gone
+    bool
+    isPeerAlive() {
+        pid_t pid = control_->pids[owner_ ? 1 : 0].load();
+        return pid <= 0 || kill(pid, 0) == 0 || errno == EPERM;
+    };
+
+    // ring 0 carries client to server, ring 1 server to client
+    ShmRingHeader&
+    txRing() {
+        return control_->rings[owner_ ? 1 : 0];
+    };
+
+    ShmRingHeader&
+    rxRing() {
+        return control_->rings[owner_ ? 0 : 1];
+    };
+
+    char*
+    txData() {
+        return reinterpret_cast<char*>(control_ + 1) + (owner_ ? control_->capacity : 0);
+    };
+
+    const char*
+    rxData() {
+        return reinterpret_cast<char*>(control_ + 1) + (owner_ ? 0 : control_->capacity);
+    };
+
+    // spins for a while before parking on the futex; returns false if the
+    // link was closed before ready() became true
+    template<typename Pred>
+    bool
+    waitFor(std::atomic<uint32_t>& seq, std::atomic<uint32_t>& waiting, Pred&& ready) {
+        // spinning on a single core only delays the peer we are waiting for
+        static const int spins = std::thread::hardware_concurrency() > 1 ? SHM_SPIN_ITERATIONS : 0;
+        for (int i = 0; i < spins; ++i) {
+            if (ready())
+                return true;
+            _cpuRelax();
+        }
+        while (true) {
+            uint32_t current = seq.load(std::memory_order_acquire);
+            waiting.store(1, std::memory_order_seq_cst);
+            if (ready()) {
+                waiting.store(0, std::memory_order_relaxed);
+                return true;
+            }
+            if (control_->state.load() != SHM_ATTACHED) {
+                waiting.store(0, std::memory_order_relaxed);
+                return false;
+            }
+            bool timedOut = _futexWait(&seq, current, SHM_WAIT_TIMEOUT_MS) != 0 && errno == ETIMEDOUT;
+            waiting.store(0, std::memory_order_relaxed);
+            if (timedOut && !isPeerAlive()) {
+                DBGOUT("shm - peer died, closing the link");
+                markClosed();
+                return false;
+            }
+        }
+    };
+#endif
+
+    void
+    unmap() {
+#ifndef _WIN32
+        if (control_)
+            munmap(control_, size_);
+        control_ = nullptr;
+        if (fd_ >= 0)
+            ::close(fd_);
+        fd_ = -1;
+#endif
+    };
+
+    std::string name_;
+    int fd_;
+#ifndef _WIN32
+    ShmControl* control_;
+#else
+    void* control_;
+#endif
+    size_t size_;
+    bool owner_;
+    std::atomic<bool> shutdown_;
+
+};
+
+}
@@ -0,0 +1,462 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <vector>
+#include <atomic>
+#include <chrono>
+
+#include <stdint.h>
+
+#include "Log.hpp"
+#include "Handoff.hpp"
+#include "SampleBatch.hpp"
+
+// Controller state stream, one message per transmit tick:
+//   state     [STATE_MAGIC] [flags] varint seq
+//             varint seq - base seq      (delta frames only)
+//             [pad count], then per pad [pad] [sample count] samples
+//   ack       [STATE_ACK] varint seq     decoder -> encoder
+//   request   [STATE_KEYFRAME_REQUEST]   decoder -> encoder
+// A sample is a zigzag time delta, a mask of the changed fields
+// (STATE_FIELD_*), then a zigzag delta per changed axis and the xor of the
+// button bits. A pad's first sample is coded against its state in the base
+// message, the last one the decoder acknowledged, or against zero in a
+// keyframe; the following samples against the previous one. The leading
+// bytes are outside the ascii range so none of these can be mistaken for a
+// legacy text message.
+#define STATE_MAGIC                 0xB7
+#define STATE_ACK                   0xB8
+#define STATE_KEYFRAME_REQUEST      0xB9
+
+#define STATE_FLAG_KEYFRAME         0x01
+
+#define STATE_FIELD_LX              0x01
+#define STATE_FIELD_LY              0x02
+#define STATE_FIELD_BUTTONS         0x04
+
+#define STATE_MAX_PADS              8
+#define STATE_SAMPLE_MAX_BYTES      20
+#define STATE_MAX_BYTES             (24 + STATE_MAX_PADS * (2 + SAMPLE_BATCH_MAX * STATE_SAMPLE_MAX_BYTES))
+#define STATE_CONTROL_MAX_BYTES     11
+
+// messages remembered on both ends as possible delta bases
+#define STATE_HISTORY               32
+#define STATE_KEYFRAME_INTERVAL_MS  1000
+// the decoder acks every Nth message, and every keyframe
+#define STATE_ACK_INTERVAL          8
+
+namespace Network
+{
+
+struct PadSamples {
+    uint8_t pad;
+    const PadSample* samples;
+    size_t count;
+};
+
+// every pad's latest sample as of one message
+struct StateSnapshot {
+    uint64_t seq {0};
+    bool valid {false};
+    uint32_t pads {0};
+    std::array<PadSample, STATE_MAX_PADS> state {};
+};
+
+bool
+isStateMessage(const char* data, int len)
+{
+    return len >= 4 && (uint8_t)data[0] == STATE_MAGIC;
+}
+
+size_t
+encodeSample(const PadSample& prev, const PadSample& cur, char* out)
+{
+    size_t n = putVarint(out, zigzag((int64_t)(cur.time - prev.time)));
+    uint8_t mask = (cur.lx != prev.lx ? STATE_FIELD_LX : 0) |
+                   (cur.ly != prev.ly ? STATE_FIELD_LY : 0) |
+                   (cur.buttons != prev.buttons ? STATE_FIELD_BUTTONS : 0);
+    out[n++] = (char)mask;
+    if (mask & STATE_FIELD_LX)
+        n += putVarint(out + n, zigzag((int64_t)cur.lx - prev.lx));
+    if (mask & STATE_FIELD_LY)
+        n += putVarint(out + n, zigzag((int64_t)cur.ly - prev.ly));
+    if (mask & STATE_FIELD_BUTTONS)
+        n += putVarint(out + n, cur.buttons ^ prev.buttons);
+    return n;
+}
+
+// returns the bytes consumed, 0 if the sample is truncated
+size_t
+decodeSample(const char* in, size_t len, const PadSample& prev, PadSample& cur)
+{
+    uint64_t v;
+    size_t at = 0, used;
+    cur = prev;
+    if (!(used = getVarint(in, len, v)))
+        return 0;
+    at += used;
+    cur.time = prev.time + unzigzag(v);
+    if (at >= len)
+        return 0;
+    uint8_t mask = (uint8_t)in[at++];
+    if (mask & STATE_FIELD_LX) {
+        if (!(used = getVarint(in + at, len - at, v)))
+            return 0;
+        at += used;
+        cur.lx = (int16_t)(prev.lx + unzigzag(v));
+    }
+    if (mask & STATE_FIELD_LY) {
+        if (!(used = getVarint(in + at, len - at, v)))
+            return 0;
+        at += used;
+        cur.ly = (int16_t)(prev.ly + unzigzag(v));
+    }
+    if (mask & STATE_FIELD_BUTTONS) {
+        if (!(used = getVarint(in + at, len - at, v)))
+            return 0;
+        at += used;
+        cur.buttons = (uint16_t)(prev.buttons ^ v);
+    }
+    return at;
+}
+
+size_t
+encodeKeyframeRequest(char* out)
+{
+    out[0] = (char)STATE_KEYFRAME_REQUEST;
+    return 1;
+}
+
+// Client side. encode() runs on the transmit thread, onControl() on the
+// receive thread; the two only share atomics.
+class StateEncoder {
+public:
+    StateEncoder() {
+        reset();
+    };
+
+    // starts over with a keyframe, e.g. on a new connection
+    void
+    reset() {
+        seq_ = 0;
+        acked_ = 0;
+        keyframeRequested_ = true;
+        current_ = StateSnapshot();
+        for (auto& entry : history_)
+            entry.valid = false;
+    };
+
+    // writes one state message for the given pads into out (STATE_MAX_BYTES)
+    // and returns its length
+    size_t
+    encode(const PadSamples* pads, size_t count, char* out) {
+        auto now = std::chrono::steady_clock::now();
+        ++seq_;
+
+        const StateSnapshot* base = nullptr;
+        auto acked = acked_.load();
+        if (!keyframeRequested_.exchange(false) && acked && seq_ - acked < STATE_HISTORY &&
+            now - lastKeyframe_ < std::chrono::milliseconds(STATE_KEYFRAME_INTERVAL_MS)) {
+            auto& entry = history_[acked % STATE_HISTORY];
+            if (entry.valid && entry.seq == acked)
+                base = &entry;
+        }
+        bool keyframe = !base;
+
+        size_t n = 0;
+        out[n++] = (char)STATE_MAGIC;
+        out[n++] = (char)(keyframe ? STATE_FLAG_KEYFRAME : 0);
+        n += putVarint(out + n, seq_);
+        if (!keyframe)
+            n += putVarint(out + n, seq_ - base->seq);
+        size_t padCountAt = n++;
+        uint8_t padCount = 0;
+
+        static const PadSample zero = {};
+        uint32_t sent = 0;
+        for (size_t i = 0; i < count; ++i) {
+            auto& p = pads[i];
+            if (p.pad >= STATE_MAX_PADS || !p.count || (sent & (1u << p.pad)))
+                continue;
+            auto samples = std::min(p.count, (size_t)SAMPLE_BATCH_MAX);
+            const PadSample* prev = base && (base->pads & (1u << p.pad))
+                ? &base->state[p.pad] : &zero;
+            out[n++] = (char)p.pad;
+            out[n++] = (char)samples;
+            for (size_t s = 0; s < samples; ++s) {
+                n += encodeSample(*prev, p.samples[s], out + n);
+                prev = &p.samples[s];
+            }
+            current_.state[p.pad] = *prev;
+            current_.pads |= 1u << p.pad;
+            sent |= 1u << p.pad;
+            ++padCount;
+        }
+        // a keyframe restates every pad, not only the ones that moved
+        if (keyframe) {
+            for (uint8_t pad = 0; pad < STATE_MAX_PADS; ++pad) {
+                if (!(current_.pads & (1u << pad)) || (sent & (1u << pad)))
+                    continue;
+                out[n++] = (char)pad;
+                out[n++] = 1;
+                n += encodeSample(zero, current_.state[pad], out + n);
+                ++padCount;
+            }
+            lastKeyframe_ = now;
+        }
+        out[padCountAt] = (char)padCount;
+
+        current_.seq = seq_;
+        current_.valid = true;
+        history_[seq_ % STATE_HISTORY] = current_;
+        return n;
+    };
+
+    // consumes an ack or keyframe request, returns false for anything else
+    bool
+    onControl(const char* data, int len) {
+        if (len < 1)
+            return false;
+        switch ((uint8_t)data[0]) {
+        case STATE_ACK: {
+            uint64_t seq;
+            if (!getVarint(data + 1, len - 1, seq))
+                return true;
+            // acks can only move forward
+            auto acked = acked_.load();
+            while (seq > acked && !acked_.compare_exchange_weak(acked, seq));
+            return true;
+        }
+        case STATE_KEYFRAME_REQUEST:
+            DBGOUT("state - keyframe requested");
+            keyframeRequested_ = true;
+            return true;
+        default:
+            return false;
+        }
+    };
+
+    bool
+    keyframePending() {
+        return keyframeRequested_.load();
+    };
+
+private:
+    uint64_t seq_;
+    std::atomic<uint64_t> acked_;
+    std::atomic<bool> keyframeRequested_;
+    std::chrono::steady_clock::time_point lastKeyframe_;
+    StateSnapshot current_;
+    std::array<StateSnapshot, STATE_HISTORY> history_;
+
+};
+
+enum class StateResult {
+    Ok,
+    NeedKeyframe,
+    Malformed
+};
+
+// Server side, one per connection.
+class StateDecoder {
+public:
+    StateDecoder()
+        : lastSeq_(0)
+        , synced_(false)
+        , sinceAck_(0)
+        , ackDue_(false)
+        , requestDue_(false)
+        , sinceRequest_(STATE_ACK_INTERVAL) {
+        samples_.reserve(SAMPLE_BATCH_MAX);
+    };
+
+    // calls sink(uint8_t pad, const PadSample* samples, size_t count) for
+    // every pad in the message
+    template<typename Sink>
+    StateResult
+    decode(const char* data, int len, Sink&& sink) {
+        if (!isStateMessage(data, len))
+            return StateResult::Malformed;
+        size_t end = (size_t)len;
+        size_t at = 1;
+        bool keyframe = data[at++] & STATE_FLAG_KEYFRAME;
+        uint64_t seq, distance = 0;
+        size_t used;
+        if (!(used = getVarint(data + at, end - at, seq)))
+            return StateResult::Malformed;
+        at += used;
+        if (!keyframe) {
+            if (!(used = getVarint(data + at, end - at, distance)) || !distance || distance > seq)
+                return StateResult::Malformed;
+            at += used;
+        }
+        if (at >= end)
+            return StateResult::Malformed;
+        size_t padCount = (uint8_t)data[at++];
+
+        // older than what we already have, the relay or a reconnect reordered it
+        if (!keyframe && seq <= lastSeq_)
+            return StateResult::Ok;
+
+        const StateSnapshot* base = nullptr;
+        if (!keyframe) {
+            auto& entry = history_[(seq - distance) % STATE_HISTORY];
+            if (!entry.valid || entry.seq != seq - distance)
+                return needKeyframe();
+            base = &entry;
+        }
+
+        // a gap means messages were dropped upstream; their pads' state is
+        // unknown until the next keyframe, so nothing after it can be a base
+        if (keyframe) {
+            current_ = StateSnapshot();
+            synced_ = true;
+        } else if (seq != lastSeq_ + 1) {
+            synced_ = false;
+            requestDue_ = true;
+        }
+        lastSeq_ = seq;
+
+        static const PadSample zero = {};
+        for (size_t i = 0; i < padCount; ++i) {
+            if (at + 2 > end)
+                return StateResult::Malformed;
+            uint8_t pad = (uint8_t)data[at++];
+            size_t count = (uint8_t)data[at++];
+            if (pad >= STATE_MAX_PADS || count > SAMPLE_BATCH_MAX)
+                return StateResult::Malformed;
+            samples_.resize(count);
+            const PadSample* prev = base && (base->pads & (1u << pad))
+                ? &base->state[pad] : &zero;
+            for (size_t s = 0; s < count; ++s) {
+                if (!(used = decodeSample(data + at, end - at, *prev, samples_[s])))
+                    return StateResult::Malformed;
+                at += used;
+                prev = &samples_[s];
+            }
+            if (count) {
+                current_.state[pad] = samples_[count - 1];
+                current_.pads |= 1u << pad;
+                sink(pad, samples_.data(), count);
+            }
+        }
+
+        if (synced_) {
+            current_.seq = seq;
+            current_.valid = true;
+            history_[seq % STATE_HISTORY] = current_;
+            if (keyframe || ++sinceAck_ >= STATE_ACK_INTERVAL)
+                ackDue_ = true;
+        }
+        return StateResult::Ok;
+    };
+
+    // writes the control message owed to the encoder, if any, into out
+    // (STATE_CONTROL_MAX_BYTES) and returns its length
+    size_t
+    reply(char* out) {
+        ++sinceRequest_;
+        if (requestDue_) {
+            requestDue_ = false;
+            // one request per ack interval is enough while waiting
+            if (sinceRequest_ < STATE_ACK_INTERVAL)
+                return 0;
+            sinceRequest_ = 0;
+            return encodeKeyframeRequest(out);
+        }
+        if (ackDue_) {
+            ackDue_ = false;
+            sinceAck_ = 0;
+            out[0] = (char)STATE_ACK;
+            return 1 + putVarint(out + 1, current_.seq);
+        }
+        return 0;
+    };
+
+    // everything a decoder in another process needs to keep applying
+    // deltas against the bases the encoder knows were acked
+    void
+    save(HandoffWriter& out) const {
+        out.put(lastSeq_);
+        out.put(synced_);
+        out.put((uint32_t)sinceAck_);
+        out.put(ackDue_);
+        out.put(requestDue_);
+        out.put((uint32_t)sinceRequest_);
+        out.put(current_);
+        uint32_t valid = 0;
+        for (auto& snapshot : history_)
+            valid += snapshot.valid;
+        out.put(valid);
+        for (size_t i = 0; i < history_.size(); ++i) {
+            if (!history_[i].valid)
+                continue;
+            out.put((uint32_t)i);
+            out.put(history_[i]);
+        }
+    };
+
+    bool
+    load(HandoffReader& in) {
+        uint32_t sinceAck = 0, sinceRequest = 0, valid = 0;
+        in.get(lastSeq_);
+        in.get(synced_);
+        in.get(sinceAck);
+        in.get(ackDue_);
+        in.get(requestDue_);
+        in.get(sinceRequest);
+        in.get(current_);
+        in.get(valid);
+        sinceAck_ = sinceAck;
+        sinceRequest_ = sinceRequest;
+        for (uint32_t n = 0; n < valid && in.ok(); ++n) {
+            uint32_t i = 0;
+            StateSnapshot snapshot;
+            if (in.get(i) && in.get(snapshot) && i < history_.size())
+                history_[i] = snapshot;
+        }
+        // a decoder that lost its state asks for a keyframe instead
+        if (!in.ok()) {
+            *this = StateDecoder();
+            return false;
+        }
+        return true;
+    };
+
+private:
+    StateResult
+    needKeyframe() {
+        requestDue_ = true;
+        return StateResult::NeedKeyframe;
+    };
+
+    uint64_t lastSeq_;
+    bool synced_;
+    size_t sinceAck_;
+    bool ackDue_;
+    bool requestDue_;
+    size_t sinceRequest_;
+    StateSnapshot current_;
+    std::array<StateSnapshot, STATE_HISTORY> history_;
+    std::vector<PadSample> samples_;
+
+};
+
+}
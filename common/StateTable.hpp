@@ -0,0 +1,209 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+
+#include <stdint.h>
+
+#include "Log.hpp"
+
+#define STATE_TABLE_SLOTS   256
+// a slot nobody wrote to for this long is left out of forEachLive
+#define STATE_STALE_MS      250
+// the key of a released slot, which probes walk past
+#define STATE_RELEASED      (~0ull)
+
+namespace Network
+{
+
+struct ControllerState {
+    // local steady clock microseconds of the last write
+    uint64_t updated;
+    int16_t lx;
+    int16_t ly;
+    uint16_t buttons;
+    // last relative pointer move, and how many moves the slot has seen
+    int32_t mx;
+    int32_t my;
+    uint32_t moves;
+};
+
+// Latest state of every connected controller, one slot per connection and
+// pad. Fields are stored as parallel arrays so a reader sweeping every slot
+// for one field touches as few cache lines as possible. Each slot is a
+// seqlock: its single writer never blocks, readers retry until they copy
+// out a consistent snapshot, and nobody takes a lock. A slot belongs to its
+// connection until release(), which the server calls once the connection is
+// gone, so a slot never has two writers.
+class StateTable {
+public:
+    StateTable() {
+        for (size_t i = 0; i < STATE_TABLE_SLOTS; ++i) {
+            keys_[i] = 0;
+            seq_[i] = 0;
+            updated_[i] = 0;
+            lx_[i] = 0;
+            ly_[i] = 0;
+            buttons_[i] = 0;
+            mx_[i] = 0;
+            my_[i] = 0;
+            moves_[i] = 0;
+        }
+    };
+
+    static uint64_t
+    now() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    };
+
+    // finds or claims the slot for a connection's pad, -1 if the table is
+    // full of connected controllers
+    int
+    acquire(uint32_t connection, uint8_t pad) {
+        uint64_t key = ((uint64_t)connection << 8 | pad) + 1;
+        size_t start = (size_t)(key * 0x9E3779B97F4A7C15ull >> 56) % STATE_TABLE_SLOTS;
+        // released slots keep a mark instead of going back to empty, so a
+        // probe can still stop at the first empty one; the key isn't in
+        // the table past it
+        int released = -1;
+        for (size_t n = 0; n < STATE_TABLE_SLOTS; ++n) {
+            size_t i = (start + n) % STATE_TABLE_SLOTS;
+            uint64_t current = keys_[i].load(std::memory_order_acquire);
+            if (current == key)
+                return (int)i;
+            if (current == STATE_RELEASED && released < 0)
+                released = (int)i;
+            if (current == 0) {
+                if (released < 0 && keys_[i].compare_exchange_strong(current, key))
+                    return (int)i;
+                break;
+            }
+        }
+        // reuse the first released slot on the way
+        uint64_t current = STATE_RELEASED;
+        if (released >= 0 && keys_[released].compare_exchange_strong(current, key)) {
+            write(released, ControllerState());
+            return released;
+        }
+        // or, if another connection just took that one, any other
+        for (size_t n = 0; n < STATE_TABLE_SLOTS; ++n) {
+            size_t i = (start + n) % STATE_TABLE_SLOTS;
+            current = keys_[i].load(std::memory_order_acquire);
+            if ((current == STATE_RELEASED || current == 0) &&
+                keys_[i].compare_exchange_strong(current, key)) {
+                write((int)i, ControllerState());
+                return (int)i;
+            }
+        }
+        DBGOUT("state table - full");
+        return -1;
+    };
+
+    // gives up every slot of connection; called by the thread serving it,
+    // once nothing writes to them anymore
+    void
+    release(uint32_t connection) {
+        for (size_t i = 0; i < STATE_TABLE_SLOTS; ++i) {
+            uint64_t key = keys_[i].load(std::memory_order_acquire);
+            if (key && key != STATE_RELEASED && (uint32_t)((key - 1) >> 8) == connection)
+                keys_[i].store(STATE_RELEASED, std::memory_order_release);
+        }
+    };
+
+    // only ever called by the slot's owner
+    void
+    write(int slot, const ControllerState& state) {
+        auto seq = seq_[slot].load(std::memory_order_relaxed);
+        seq_[slot].store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        updated_[slot].store(state.updated, std::memory_order_relaxed);
+        lx_[slot].store(state.lx, std::memory_order_relaxed);
+        ly_[slot].store(state.ly, std::memory_order_relaxed);
+        buttons_[slot].store(state.buttons, std::memory_order_relaxed);
+        mx_[slot].store(state.mx, std::memory_order_relaxed);
+        my_[slot].store(state.my, std::memory_order_relaxed);
+        moves_[slot].store(state.moves, std::memory_order_relaxed);
+        seq_[slot].store(seq + 2, std::memory_order_release);
+    };
+
+    void
+    read(int slot, ControllerState& state) const {
+        while (true) {
+            auto before = seq_[slot].load(std::memory_order_acquire);
+            if (before & 1)
+                continue;
+            state.updated = updated_[slot].load(std::memory_order_relaxed);
+            state.lx = lx_[slot].load(std::memory_order_relaxed);
+            state.ly = ly_[slot].load(std::memory_order_relaxed);
+            state.buttons = buttons_[slot].load(std::memory_order_relaxed);
+            state.mx = mx_[slot].load(std::memory_order_relaxed);
+            state.my = my_[slot].load(std::memory_order_relaxed);
+            state.moves = moves_[slot].load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq_[slot].load(std::memory_order_relaxed) == before)
+                return;
+        }
+    };
+
+    // calls fn(int slot, const ControllerState&) for every slot written to
+    // within STATE_STALE_MS
+    template<typename Fn>
+    void
+    forEachLive(Fn&& fn) const {
+        auto stale = now() - STATE_STALE_MS * 1000;
+        ControllerState state;
+        for (size_t i = 0; i < STATE_TABLE_SLOTS; ++i) {
+            auto key = keys_[i].load(std::memory_order_acquire);
+            if (!key || key == STATE_RELEASED ||
+                updated_[i].load(std::memory_order_relaxed) < stale)
+                continue;
+            read((int)i, state);
+            fn((int)i, state);
+        }
+    };
+
+    // calls fn(uint8_t pad, const ControllerState&) for every live slot
+    // owned by connection
+    template<typename Fn>
+    void
+    forConnection(uint32_t connection, Fn&& fn) const {
+        forEachLive([this, connection, &fn](int slot, const ControllerState& state) {
+            uint64_t key = keys_[slot].load(std::memory_order_relaxed) - 1;
+            if ((uint32_t)(key >> 8) == connection)
+                fn((uint8_t)(key & 0xff), state);
+        });
+    };
+
+private:
+    std::array<std::atomic<uint64_t>, STATE_TABLE_SLOTS> keys_;
+    alignas(64) std::array<std::atomic<uint32_t>, STATE_TABLE_SLOTS> seq_;
+    alignas(64) std::array<std::atomic<uint64_t>, STATE_TABLE_SLOTS> updated_;
+    alignas(64) std::array<std::atomic<int16_t>, STATE_TABLE_SLOTS> lx_;
+    alignas(64) std::array<std::atomic<int16_t>, STATE_TABLE_SLOTS> ly_;
+    alignas(64) std::array<std::atomic<uint16_t>, STATE_TABLE_SLOTS> buttons_;
+    alignas(64) std::array<std::atomic<int32_t>, STATE_TABLE_SLOTS> mx_;
+    alignas(64) std::array<std::atomic<int32_t>, STATE_TABLE_SLOTS> my_;
+    alignas(64) std::array<std::atomic<uint32_t>, STATE_TABLE_SLOTS> moves_;
+
+};
+
+}
@@ -0,0 +1,354 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#endif
+
+#include "Log.hpp"
+
+// Scheduling of every thread the library and the programs start, by role.
+// Each role has a name, a CPU set, and either a nice value or a SCHED_FIFO
+// priority. Threads call applyThreadRole() first thing and log where they
+// actually ended up, since a priority the process isn't allowed to take is
+// refused rather than fatal.
+//
+// Configure with TCPJOY_THREADS, roles separated by ';':
+//   TCPJOY_THREADS="inject:cpus=2,fifo=60;shard:cpus=4-7;pool:nice=5"
+//   cpus=LIST   CPUs the role may run on, e.g. 0,2-3 (default: any)
+//   spread=1    numbered threads of the role each take one CPU of the set
+//   fifo=N      SCHED_FIFO priority N (1-99)
+//   nice=N      nice value N
+// Shards spread over every CPU unless configured otherwise.
+
+enum class ThreadRole {
+    Network = 0,    // accept and per-connection receive loops
+    Shard,          // sharded server reactors
+    Inject,         // injection, the server's mouse loop
+    Replay,         // timed sample replay
+    Capture,        // client pad sampling
+    Send,           // client send loop
+    Timer,          // timer workers
+    Pool,           // thread pool workers
+    Relay,          // relay fan-out
+    NetEm,          // network emulator
+    Count
+};
+
+enum class ThreadPolicy {
+    Default,
+    Nice,
+    Fifo
+};
+
+struct ThreadRoleConfig {
+    const char* name;
+    uint64_t cpus;      // 0 for any
+    bool spread;
+    ThreadPolicy policy;
+    int priority;
+};
+
+constexpr size_t THREAD_ROLE_COUNT = static_cast<size_t>(ThreadRole::Count);
+
+// parses "0,2-3" into a mask, returns false if it isn't a cpu list
+bool
+parseCpuList(const char* list, size_t len, uint64_t& mask)
+{
+    mask = 0;
+    size_t at = 0;
+    while (at < len) {
+        char* end;
+        long first = strtol(list + at, &end, 10);
+        long last = first;
+        if (end == list + at)
+            return false;
+        at = end - list;
+        if (at < len && list[at] == '-') {
+            last = strtol(list + at + 1, &end, 10);
+            at = end - list;
+        }
+        if (first < 0 || last < first || last > 63)
+            return false;
+        for (long cpu = first; cpu <= last; ++cpu)
+            mask |= 1ull << cpu;
+        if (at < len && list[at] != ',')
+            return false;
+        ++at;
+    }
+    return mask != 0;
+}
+
+size_t
+formatCpuList(uint64_t mask, char* out, size_t size)
+{
+    size_t n = 0;
+    out[0] = '\0';
+    for (int cpu = 0; cpu < 64 && n < size; ++cpu) {
+        if (!(mask & (1ull << cpu)))
+            continue;
+        int last = cpu;
+        while (last < 63 && (mask & (1ull << (last + 1))))
+            ++last;
+        n += snprintf(out + n, size - n, n ? ",%d" : "%d", cpu);
+        if (last > cpu && n < size)
+            n += snprintf(out + n, size - n, "-%d", last);
+        cpu = last;
+    }
+    return std::min(n, size);
+}
+
+// applies one "role:key=value,..." entry, returns false if it is malformed
+bool
+parseThreadRole(const char* entry, size_t len, ThreadRoleConfig* roles)
+{
+    auto colon = (const char*)memchr(entry, ':', len);
+    if (!colon)
+        return false;
+    ThreadRoleConfig* role = nullptr;
+    for (size_t i = 0; i < THREAD_ROLE_COUNT; ++i) {
+        if (strlen(roles[i].name) == (size_t)(colon - entry) &&
+            !strncmp(roles[i].name, entry, colon - entry))
+            role = &roles[i];
+    }
+    if (!role)
+        return false;
+    const char* at = colon + 1;
+    const char* end = entry + len;
+    while (at < end) {
+        auto eq = (const char*)memchr(at, '=', end - at);
+        if (!eq)
+            return false;
+        // a cpu list has commas of its own, so a value runs to the next
+        // comma followed by a key
+        const char* next = eq + 1;
+        while (next < end && !(*next == ',' && !isdigit((unsigned char)next[1])))
+            ++next;
+        size_t keyLen = eq - at;
+        if (keyLen == 4 && !strncmp(at, "cpus", 4)) {
+            if (!parseCpuList(eq + 1, next - eq - 1, role->cpus))
+                return false;
+        } else if (keyLen == 6 && !strncmp(at, "spread", 6)) {
+            role->spread = atoi(eq + 1) != 0;
+        } else if (keyLen == 4 && !strncmp(at, "fifo", 4)) {
+            role->policy = ThreadPolicy::Fifo;
+            role->priority = atoi(eq + 1);
+        } else if (keyLen == 4 && !strncmp(at, "nice", 4)) {
+            role->policy = ThreadPolicy::Nice;
+            role->priority = atoi(eq + 1);
+        } else {
+            return false;
+        }
+        at = next + 1;
+    }
+    return true;
+}
+
+struct ThreadRoleTable {
+    ThreadRoleTable() {
+        ThreadRoleConfig defaults[THREAD_ROLE_COUNT] = {
+            { "net",     0, false, ThreadPolicy::Default, 0 },
+            { "shard",   0, true,  ThreadPolicy::Default, 0 },
+            { "inject",  0, false, ThreadPolicy::Default, 0 },
+            { "replay",  0, false, ThreadPolicy::Default, 0 },
+            { "capture", 0, false, ThreadPolicy::Default, 0 },
+            { "send",    0, false, ThreadPolicy::Default, 0 },
+            { "timer",   0, false, ThreadPolicy::Default, 0 },
+            { "pool",    0, false, ThreadPolicy::Default, 0 },
+            { "relay",   0, false, ThreadPolicy::Default, 0 },
+            { "netem",   0, false, ThreadPolicy::Default, 0 },
+        };
+        std::copy(defaults, defaults + THREAD_ROLE_COUNT, roles);
+        auto env = getenv("TCPJOY_THREADS");
+        while (env && *env) {
+            auto end = strchr(env, ';');
+            size_t len = end ? (size_t)(end - env) : strlen(env);
+            if (len && !parseThreadRole(env, len, roles))
+                consoleLog("threads - ignoring bad role setting '%.*s'", (int)len, env);
+            env = end ? end + 1 : nullptr;
+        }
+    };
+
+    ThreadRoleConfig roles[THREAD_ROLE_COUNT];
+};
+
+const ThreadRoleConfig&
+threadRoleConfig(ThreadRole role)
+{
+    // built on first use, so TCPJOY_THREADS is read once and never before
+    // the logger's own statics are
+    static ThreadRoleTable table;
+    return table.roles[(size_t)role];
+}
+
+// true for the first thread of role to ask, whose placement is logged;
+// the rest only log theirs in debug builds
+bool
+firstOfRole(ThreadRole role)
+{
+    static std::atomic<bool> started[THREAD_ROLE_COUNT];
+    return !started[(size_t)role].exchange(true);
+}
+
+// the CPUs this process may use, as a mask
+uint64_t
+onlineCpus()
+{
+#ifndef _WIN32
+    cpu_set_t set;
+    uint64_t mask = 0;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < 64; ++cpu) {
+            if (CPU_ISSET(cpu, &set))
+                mask |= 1ull << cpu;
+        }
+    }
+#else
+    DWORD_PTR process, system;
+    uint64_t mask = GetProcessAffinityMask(GetCurrentProcess(), &process, &system)
+        ? (uint64_t)process : 0;
+#endif
+    if (!mask) {
+        auto n = std::max<unsigned>(1, std::min<unsigned>(64, std::thread::hardware_concurrency()));
+        mask = n == 64 ? ~0ull : (1ull << n) - 1;
+    }
+    return mask;
+}
+
+// the index'th CPU of mask, wrapping around
+uint64_t
+nthCpu(uint64_t mask, size_t index)
+{
+    int count = 0;
+    for (int cpu = 0; cpu < 64; ++cpu)
+        count += (mask >> cpu) & 1;
+    index %= std::max(count, 1);
+    for (int cpu = 0; cpu < 64; ++cpu) {
+        if (((mask >> cpu) & 1) && index-- == 0)
+            return 1ull << cpu;
+    }
+    return mask;
+}
+
+// names, places and prioritizes the calling thread, then reports what
+// took effect. index numbers threads that share a role, -1 if there's one.
+void
+applyThreadRole(ThreadRole role, int index = -1)
+{
+    const auto& config = threadRoleConfig(role);
+    char name[16];
+    if (index >= 0)
+        snprintf(name, sizeof(name), "%s-%d", config.name, index);
+    else
+        snprintf(name, sizeof(name), "%s", config.name);
+
+    uint64_t cpus = config.cpus;
+    if (config.spread && index >= 0)
+        cpus = nthCpu(cpus ? cpus : onlineCpus(), (size_t)index);
+
+    char refused[64] = "";
+#ifndef _WIN32
+    pthread_setname_np(pthread_self(), name);
+    if (cpus) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu = 0; cpu < 64; ++cpu) {
+            if (cpus & (1ull << cpu))
+                CPU_SET(cpu, &set);
+        }
+        if (int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+            snprintf(refused, sizeof(refused), ", cpus refused: %s", strerror(err));
+    }
+    if (config.policy == ThreadPolicy::Fifo) {
+        sched_param param;
+        param.sched_priority = config.priority;
+        if (int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+            snprintf(refused, sizeof(refused), ", fifo %d refused: %s", config.priority, strerror(err));
+    } else if (config.policy == ThreadPolicy::Nice) {
+        // nice is per thread on Linux
+        if (setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), config.priority) != 0)
+            snprintf(refused, sizeof(refused), ", nice %d refused: %s", config.priority, strerror(errno));
+    }
+
+    // report what the kernel actually gave us
+    uint64_t effective = 0;
+    cpu_set_t set;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < 64; ++cpu) {
+            if (CPU_ISSET(cpu, &set))
+                effective |= 1ull << cpu;
+        }
+    }
+    int policy;
+    sched_param param;
+    pthread_getschedparam(pthread_self(), &policy, &param);
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid));
+    char cpuList[128];
+    formatCpuList(effective, cpuList, sizeof(cpuList));
+    char placement[256];
+    if (policy == SCHED_FIFO)
+        snprintf(placement, sizeof(placement), "%s on cpus %s, fifo %d%s",
+                 name, cpuList, param.sched_priority, refused);
+    else
+        snprintf(placement, sizeof(placement), "%s on cpus %s, nice %d%s",
+                 name, cpuList, nice, refused);
+#else
+    if (cpus && !SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)cpus))
+        snprintf(refused, sizeof(refused), ", cpus refused: %lu", GetLastError());
+    int priority = THREAD_PRIORITY_NORMAL;
+    if (config.policy == ThreadPolicy::Fifo)
+        priority = THREAD_PRIORITY_TIME_CRITICAL;
+    else if (config.policy == ThreadPolicy::Nice)
+        priority = config.priority < 0 ? THREAD_PRIORITY_ABOVE_NORMAL
+                 : config.priority > 0 ? THREAD_PRIORITY_BELOW_NORMAL
+                 : THREAD_PRIORITY_NORMAL;
+    if (!SetThreadPriority(GetCurrentThread(), priority))
+        snprintf(refused, sizeof(refused), ", priority refused: %lu", GetLastError());
+    char cpuList[128];
+    formatCpuList(cpus ? cpus : onlineCpus(), cpuList, sizeof(cpuList));
+    char placement[256];
+    snprintf(placement, sizeof(placement), "%s on cpus %s, priority %d%s", name, cpuList,
+             GetThreadPriority(GetCurrentThread()), refused);
+#endif
+    // a thread per connection would flood the log otherwise; a refusal is
+    // always worth seeing
+    if (firstOfRole(role) || refused[0])
+        consoleLog("threads - %s", placement);
+    else
+        DBGOUT("threads - %s", placement);
+}
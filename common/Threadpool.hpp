@@ -1,199 +1,443 @@
-/*
-*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
-*
-*  This program is free software; you can redistribute it and/or modify
-*  it under the terms of the GNU General Public License as published by
-*  the Free Software Foundation; either version 3 of the License, or
-*  (at your option) any later version.
-*
-*  This program is distributed in the hope that it will be useful,
-*  but WITHOUT ANY WARRANTY; without even the implied warranty of
-*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-*  GNU General Public License for more details.
-*
-*  You should have received a copy of the GNU General Public License
-*  along with this program. If not, see <https://www.gnu.org/licenses/>.
-*/
-
-#pragma once
-
-#include <vector>
-#include <queue>
-#include <memory>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-#include <future>
-#include <functional>
-
-#include <ciso646>
-
-#include "Log.hpp"
-
-class thread_pool {
-public:
-    thread_pool(size_t threads = 0)
-        : stop_(false),
-        maxThreads_(std::max<size_t>(std::thread::hardware_concurrency(), threads))
-    {
-        for (size_t i = 0; i < maxThreads_; ++i) {
-            workers_.emplace_back([this] {
-                while (true) {
-                    std::function<void()> task;
-                    {
-                        std::unique_lock<std::mutex> lock(this->queueMutex_);
-                        this->cv_.wait(lock, [this] { return this->stop_ || !this->tasks_.empty(); });
-                        if (this->stop_ && this->tasks_.empty())
-                            return;
-                        task = std::move(this->tasks_.front());
-                        this->tasks_.pop();
-                    }
-                    task();
-                }
-            });
-        }
-    }
-
-    template<class F, class... Args>
-    auto run(F&& f, Args&&... args)
-        ->std::future<typename std::result_of<F(Args...)>::type>
-    {
-        using return_type = typename std::result_of<F(Args...)>::type;
-        auto task = std::make_shared< std::packaged_task<return_type()>>(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-            );
-        std::future<return_type> res = task->get_future();
-        {
-            std::unique_lock<std::mutex> lock(queueMutex_);
-            // don't allow enqueueing after destruction of the pool
-            if (!stop_)
-                tasks_.emplace([task]() { (*task)(); });
-        }
-        cv_.notify_one();
-        return res;
-    }
-
-    ~thread_pool()
-    {
-        {
-            std::unique_lock<std::mutex> lock(queueMutex_);
-            // prevent further enqueueing
-            stop_ = true;
-        }
-        cv_.notify_all();
-        for (std::thread &worker : workers_)
-            worker.join();
-    }
-
-private:
-    std::vector<std::thread> workers_;
-    std::queue<std::function<void()>> tasks_;
-    std::mutex queueMutex_;
-    std::condition_variable cv_;
-    bool stop_;
-    const size_t maxThreads_;
-};
-
-// aberaud's ThreadPool impl from Ring
-
-class ThreadPool {
-public:
-    static ThreadPool& instance() {
-        static ThreadPool pool;
-        return pool;
-    }
-
-    ThreadPool()
-        : maxThreads_(std::max<size_t>(std::thread::hardware_concurrency(), 4))
-    {
-        threads_.reserve(maxThreads_);
-    }
-
-    ~ThreadPool()
-    {
-        join();
-    }
-
-    void run(std::function<void()>&& cb) {
-        std::unique_lock<std::mutex> l(lock_);
-
-        // launch new thread if necessary
-        if (not readyThreads_ && threads_.size() < maxThreads_) {
-            threads_.emplace_back(new ThreadState());
-            auto& t = *threads_.back();
-            t.thread = std::thread([&]() {
-                while (t.run) {
-                    std::function<void()> task;
-
-                    // pick task from queue
-                    {
-                        std::unique_lock<std::mutex> l(lock_);
-                        readyThreads_++;
-                        cv_.wait(l, [&]() {
-                            return not t.run or not tasks_.empty();
-                        });
-                        readyThreads_--;
-                        if (not t.run)
-                            break;
-                        task = std::move(tasks_.front());
-                        tasks_.pop();
-                    }
-
-                    // run task
-                    try {
-                        if (task) {
-                            task();
-                        }
-                    }
-                    catch (const std::exception& e) {
-                        DBGOUT("Exception running task: %s", e.what());
-                    }
-                }
-            });
-        }
-
-        // push task to queue
-        tasks_.emplace(std::move(cb));
-
-        // notify thread
-        l.unlock();
-        cv_.notify_one();
-    }
-
-    template<class T>
-    std::future<T> get(std::function<T()>&& cb) {
-        auto ret = std::make_shared<std::promise<T>>();
-        run(std::bind([=](std::function<T()>& mcb) mutable {
-            ret->set_value(mcb());
-        }, std::move(cb)));
-        return ret->get_future();
-    }
-    template<class T>
-    std::shared_ptr<std::future<T>> getShared(std::function<T()>&& cb) {
-        return std::make_shared<std::future<T>>(get(std::move(cb)));
-    }
-
-    void join() {
-        for (auto& t : threads_)
-            t->run = false;
-        cv_.notify_all();
-        for (auto& t : threads_)
-            t->thread.join();
-        threads_.clear();
-    }
-
-private:
-    struct ThreadState
-    {
-        std::thread thread{};
-        std::atomic_bool run{ true };
-    };
-
-    std::queue<std::function<void()>> tasks_{};
-    std::vector<std::unique_ptr<ThreadState>> threads_;
-    unsigned readyThreads_{ 0 };
-    std::mutex lock_{};
-    std::condition_variable cv_{};
-
-    const size_t maxThreads_;
-};
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <vector>
+#include <queue>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <future>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+
+#include <ciso646>
+
+#include "Log.hpp"
+#include "ThreadRole.hpp"
+
+class thread_pool {
+public:
+    thread_pool(size_t threads = 0)
+        : stop_(false),
+        maxThreads_(std::max<size_t>(std::thread::hardware_concurrency(), threads))
+    {
+        for (size_t i = 0; i < maxThreads_; ++i) {
+            workers_.emplace_back([this, i] {
+                applyThreadRole(ThreadRole::Pool, (int)i);
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(this->queueMutex_);
+                        this->cv_.wait(lock, [this] { return this->stop_ || !this->tasks_.empty(); });
+                        if (this->stop_ && this->tasks_.empty())
+                            return;
+                        task = std::move(this->tasks_.front());
+                        this->tasks_.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    template<class F, class... Args>
+    auto run(F&& f, Args&&... args)
+        ->std::future<typename std::result_of<F(Args...)>::type>
+    {
+        using return_type = typename std::result_of<F(Args...)>::type;
+        auto task = std::make_shared< std::packaged_task<return_type()>>(
+            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
+            );
+        std::future<return_type> res = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(queueMutex_);
+            // don't allow enqueueing after destruction of the pool
+            if (!stop_)
+                tasks_.emplace([task]() { (*task)(); });
+        }
+        cv_.notify_one();
+        return res;
+    }
+
+    ~thread_pool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(queueMutex_);
+            // prevent further enqueueing
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (std::thread &worker : workers_)
+            worker.join();
+    }
+
+private:
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex queueMutex_;
+    std::condition_variable cv_;
+    bool stop_;
+    const size_t maxThreads_;
+};
+
+// aberaud's ThreadPool impl from Ring
+
+class ThreadPool {
+public:
+    static ThreadPool& instance() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    ThreadPool()
+        : maxThreads_(std::max<size_t>(std::thread::hardware_concurrency(), 4))
+    {
+        threads_.reserve(maxThreads_);
+    }
+
+    ~ThreadPool()
+    {
+        join();
+    }
+
+    void run(std::function<void()>&& cb) {
+        std::unique_lock<std::mutex> l(lock_);
+
+        // launch new thread if necessary
+        if (not readyThreads_ && threads_.size() < maxThreads_) {
+            threads_.emplace_back(new ThreadState());
+            auto& t = *threads_.back();
+            auto index = (int)threads_.size() - 1;
+            t.thread = std::thread([&, index]() {
+                applyThreadRole(ThreadRole::Pool, index);
+                while (t.run) {
+                    std::function<void()> task;
+
+                    // pick task from queue
+                    {
+                        std::unique_lock<std::mutex> l(lock_);
+                        readyThreads_++;
+                        cv_.wait(l, [&]() {
+                            return not t.run or not tasks_.empty();
+                        });
+                        readyThreads_--;
+                        if (not t.run)
+                            break;
+                        task = std::move(tasks_.front());
+                        tasks_.pop();
+                    }
+
+                    // run task
+                    try {
+                        if (task) {
+                            task();
+                        }
+                    }
+                    catch (const std::exception& e) {
+                        DBGOUT("Exception running task: %s", e.what());
+                    }
+                }
+            });
+        }
+
+        // push task to queue
+        tasks_.emplace(std::move(cb));
+
+        // notify thread
+        l.unlock();
+        cv_.notify_one();
+    }
+
+    template<class T>
+    std::future<T> get(std::function<T()>&& cb) {
+        auto ret = std::make_shared<std::promise<T>>();
+        run(std::bind([=](std::function<T()>& mcb) mutable {
+            ret->set_value(mcb());
+        }, std::move(cb)));
+        return ret->get_future();
+    }
+    template<class T>
+    std::shared_ptr<std::future<T>> getShared(std::function<T()>&& cb) {
+        return std::make_shared<std::future<T>>(get(std::move(cb)));
+    }
+
+    void join() {
+        for (auto& t : threads_)
+            t->run = false;
+        cv_.notify_all();
+        for (auto& t : threads_)
+            t->thread.join();
+        threads_.clear();
+    }
+
+private:
+    struct ThreadState
+    {
+        std::thread thread{};
+        std::atomic_bool run{ true };
+    };
+
+    std::queue<std::function<void()>> tasks_{};
+    std::vector<std::unique_ptr<ThreadState>> threads_;
+    unsigned readyThreads_{ 0 };
+    std::mutex lock_{};
+    std::condition_variable cv_{};
+
+    const size_t maxThreads_;
+};
+
+// Long-lived workers for tasks that may block for a whole connection, such
+// as receive loops. launch() always runs the task on a worker, never on the
+// caller and never deferred: an idle worker takes it, or a new one is
+// started when every worker is busy. Workers outlive their tasks, so a
+// reconnect reuses a thread instead of creating one, and each worker owns a
+// buffer its tasks can use for receiving.
+
+#define EXECUTOR_MAX_WORKERS    64
+#define EXECUTOR_BUFFER_SIZE    8192
+
+class Executor {
+public:
+    class TaskContext;
+
+private:
+    struct State {
+        std::function<void(TaskContext&)> job;
+        std::function<void()> interrupt;
+        std::atomic<bool> cancelled {false};
+        bool done {false};
+        std::mutex mutex;
+        std::condition_variable cv;
+    };
+
+public:
+    // what a running task sees of the executor
+    class TaskContext {
+    public:
+        bool
+        cancelled() const {
+            return state_.cancelled.load();
+        };
+
+        // called by cancel() to unblock the task, e.g. by shutting down the
+        // socket it is reading from
+        void
+        setInterrupt(std::function<void()> interrupt) {
+            std::unique_lock<std::mutex> l(state_.mutex);
+            state_.interrupt = std::move(interrupt);
+            auto cancelled = state_.cancelled.load();
+            l.unlock();
+            if (cancelled && state_.interrupt)
+                state_.interrupt();
+        };
+
+        // the worker's buffer, only valid while the task runs
+        char*
+        buffer() {
+            return buffer_;
+        };
+
+        size_t
+        bufferSize() const {
+            return bufferSize_;
+        };
+
+    private:
+        friend class Executor;
+        TaskContext(State& state, char* buffer, size_t bufferSize)
+            : state_(state)
+            , buffer_(buffer)
+            , bufferSize_(bufferSize) { };
+
+        State& state_;
+        char* buffer_;
+        size_t bufferSize_;
+    };
+
+    using Job = std::function<void(TaskContext&)>;
+
+    class Task {
+    public:
+        Task() { };
+
+        bool
+        valid() const {
+            return (bool)state_;
+        };
+
+        // asks the task to stop, returns at once
+        void
+        cancel() {
+            if (!state_)
+                return;
+            std::function<void()> interrupt;
+            {
+                std::lock_guard<std::mutex> l(state_->mutex);
+                state_->cancelled = true;
+                interrupt = state_->interrupt;
+            }
+            if (interrupt)
+                interrupt();
+        };
+
+        void
+        wait() {
+            if (!state_)
+                return;
+            std::unique_lock<std::mutex> l(state_->mutex);
+            state_->cv.wait(l, [this]() { return state_->done; });
+        };
+
+        bool
+        done() {
+            if (!state_)
+                return true;
+            std::lock_guard<std::mutex> l(state_->mutex);
+            return state_->done;
+        };
+
+    private:
+        friend class Executor;
+        Task(std::shared_ptr<State> state)
+            : state_(std::move(state)) { };
+
+        std::shared_ptr<State> state_;
+    };
+
+    Executor(ThreadRole role,
+             size_t maxWorkers = EXECUTOR_MAX_WORKERS,
+             size_t bufferSize = EXECUTOR_BUFFER_SIZE)
+        : role_(role)
+        , maxWorkers_(maxWorkers)
+        , bufferSize_(bufferSize)
+        , idle_(0)
+        , stop_(false) { };
+
+    ~Executor() {
+        shutdown();
+    };
+
+    // queues job for a worker; after shutdown() the task is returned
+    // already finished, without running
+    Task
+    launch(Job job) {
+        auto state = std::make_shared<State>();
+        state->job = std::move(job);
+        std::unique_lock<std::mutex> l(lock_);
+        if (stop_) {
+            state->cancelled = true;
+            state->done = true;
+            return Task(state);
+        }
+        queue_.push(state);
+        if (queue_.size() > idle_ && workers_.size() < maxWorkers_) {
+            auto index = (int)workers_.size();
+            workers_.emplace_back([this, index]() { work(index); });
+        }
+        l.unlock();
+        cv_.notify_one();
+        return Task(state);
+    };
+
+    // cancels running and queued tasks and joins every worker
+    void
+    shutdown() {
+        std::vector<std::shared_ptr<State>> running;
+        {
+            std::lock_guard<std::mutex> l(lock_);
+            if (stop_)
+                return;
+            stop_ = true;
+            running = running_;
+        }
+        for (auto& state : running)
+            Task(state).cancel();
+        cv_.notify_all();
+        for (auto& worker : workers_)
+            worker.join();
+        workers_.clear();
+        while (!queue_.empty()) {
+            finish(*queue_.front());
+            queue_.pop();
+        }
+    };
+
+    size_t
+    workerCount() {
+        std::lock_guard<std::mutex> l(lock_);
+        return workers_.size();
+    };
+
+private:
+    void
+    work(int index) {
+        applyThreadRole(role_, index);
+        std::vector<char> buffer(bufferSize_);
+        std::unique_lock<std::mutex> l(lock_);
+        ++idle_;
+        while (true) {
+            cv_.wait(l, [this]() { return stop_ || !queue_.empty(); });
+            if (stop_)
+                return;
+            --idle_;
+            auto state = queue_.front();
+            queue_.pop();
+            running_.push_back(state);
+            l.unlock();
+
+            if (!state->cancelled) {
+                TaskContext context(*state, buffer.data(), buffer.size());
+                state->job(context);
+            }
+
+            // idle again before anyone waiting on the task hears it is done,
+            // so a follow-up launch reuses this worker
+            l.lock();
+            running_.erase(std::find(running_.begin(), running_.end(), state));
+            ++idle_;
+            l.unlock();
+            finish(*state);
+            l.lock();
+        }
+    };
+
+    static void
+    finish(State& state) {
+        {
+            std::lock_guard<std::mutex> l(state.mutex);
+            state.done = true;
+            state.job = nullptr;
+            state.interrupt = nullptr;
+        }
+        state.cv.notify_all();
+    };
+
+    ThreadRole role_;
+    const size_t maxWorkers_;
+    const size_t bufferSize_;
+    std::vector<std::thread> workers_;
+    std::queue<std::shared_ptr<State>> queue_;
+    std::vector<std::shared_ptr<State>> running_;
+    size_t idle_;
+    bool stop_;
+    std::mutex lock_;
+    std::condition_variable cv_;
+};
@@ -1,89 +1,306 @@
-/*
-*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
-*
-*  This program is free software; you can redistribute it and/or modify
-*  it under the terms of the GNU General Public License as published by
-*  the Free Software Foundation; either version 3 of the License, or
-*  (at your option) any later version.
-*
-*  This program is distributed in the hope that it will be useful,
-*  but WITHOUT ANY WARRANTY; without even the implied warranty of
-*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-*  GNU General Public License for more details.
-*
-*  You should have received a copy of the GNU General Public License
-*  along with this program. If not, see <https://www.gnu.org/licenses/>.
-*/
-
-#pragma once
-
-#include <chrono>
-#include <functional>
-#include <thread>
-#include <atomic>
-
-class timer
-{
-public:
-    timer() : runCount_(0) {}
-
-    timer(  std::function<void()> const&& func,
-            std::function<bool()> const&& pred,
-            double delay,
-            int run_count = 0)
-        : func_(std::move(func))
-        , pred_(std::move(pred))
-        , delay_(std::chrono::duration<double>(delay))
-        , runCount_(0)
-    {
-        if (run_count > 0 || run_count == -1)
-            run(run_count);
-    };
-
-    virtual void start( std::function<void()> const&& func,
-                        std::function<bool()> const&& pred,
-                        double delay,
-                        int run_count) {
-        func_ = func;
-        pred_ = pred;
-        delay_ = std::chrono::duration<double>(delay);
-        run(run_count);
-    }
-
-    virtual void start(int run_count) {
-        if (run_count > 0 || run_count == -1)
-            run(run_count);
-    }
-
-    void stop() {
-        isRunning_ = false;
-    }
-
-private:
-    void run(int run_count) {
-        isRunning_ = true;
-        std::thread t([this, rc = std::move(run_count)]() mutable {
-            while (isRunning_ && pred_()) {
-                std::this_thread::sleep_for(delay_);
-                if (func_) {
-                    func_();
-                    ++runCount_;
-                }
-                if (rc == 0) {
-                    isRunning_ = false;
-                }
-                else {
-                    rc = rc > 0 ? rc - 1 : rc;
-                }
-            }
-        });
-        { t.join(); }
-    }
-
-    std::atomic_int runCount_;
-    std::atomic<bool> isRunning_;
-    std::chrono::duration<double> delay_;
-    std::function<void()> func_;
-    std::function<bool()> pred_;
-
-};
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <array>
+#include <algorithm>
+
+#include <stdint.h>
+
+#include "ThreadRole.hpp"
+
+class timer
+{
+public:
+    timer() : runCount_(0) {}
+
+    timer(  std::function<void()> const&& func,
+            std::function<bool()> const&& pred,
+            double delay,
+            int run_count = 0)
+        : func_(std::move(func))
+        , pred_(std::move(pred))
+        , delay_(std::chrono::duration<double>(delay))
+        , runCount_(0)
+    {
+        if (run_count > 0 || run_count == -1)
+            run(run_count);
+    };
+
+    virtual void start( std::function<void()> const&& func,
+                        std::function<bool()> const&& pred,
+                        double delay,
+                        int run_count) {
+        func_ = func;
+        pred_ = pred;
+        delay_ = std::chrono::duration<double>(delay);
+        run(run_count);
+    }
+
+    virtual void start(int run_count) {
+        if (run_count > 0 || run_count == -1)
+            run(run_count);
+    }
+
+    void stop() {
+        isRunning_ = false;
+    }
+
+private:
+    void run(int run_count) {
+        isRunning_ = true;
+        std::thread t([this, rc = std::move(run_count)]() mutable {
+            applyThreadRole(ThreadRole::Timer);
+            while (isRunning_ && pred_()) {
+                std::this_thread::sleep_for(delay_);
+                if (func_) {
+                    func_();
+                    ++runCount_;
+                }
+                if (rc == 0) {
+                    isRunning_ = false;
+                }
+                else {
+                    rc = rc > 0 ? rc - 1 : rc;
+                }
+            }
+        });
+        { t.join(); }
+    }
+
+    std::atomic_int runCount_;
+    std::atomic<bool> isRunning_;
+    std::chrono::duration<double> delay_;
+    std::function<void()> func_;
+    std::function<bool()> pred_;
+
+};
+
+// Hashed hierarchical timing wheel for deadlines owned by one event loop,
+// e.g. per-connection heartbeats and idle timeouts. Four levels of
+// TIMER_WHEEL_SLOTS slots cover 2^32 ticks; a timer sits in the level its
+// distance falls in and moves down a level each time the level below wraps.
+// Scheduling and cancelling are O(1), nothing runs on its own thread: the
+// loop sleeps for at most timeout() and then calls advance(). Each timer
+// carries a 64 bit value which is handed back on expiry, so the wheel never
+// allocates once its node pool has grown.
+#define TIMER_WHEEL_BITS    8
+#define TIMER_WHEEL_SLOTS   (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS  4
+
+class TimerWheel {
+public:
+    // 0 is never a valid handle
+    using Handle = uint64_t;
+
+    // times are in microseconds on the caller's clock, rounded to ticks
+    TimerWheel(uint64_t now, uint32_t tickMicros = 1000)
+        : origin_(now)
+        , tickMicros_(tickMicros)
+        , tick_(0)
+        , free_(NIL)
+        , size_(0) {
+        heads_.fill(NIL);
+    };
+
+    Handle
+    schedule(uint64_t deadline, uint64_t data) {
+        uint32_t index = free_;
+        if (index == NIL) {
+            index = (uint32_t)nodes_.size();
+            nodes_.emplace_back();
+        } else {
+            free_ = nodes_[index].next;
+        }
+        auto& node = nodes_[index];
+        // round up, and never fire in the tick being processed
+        uint64_t tick = deadline > origin_
+            ? (deadline - origin_ + tickMicros_ - 1) / tickMicros_
+            : 0;
+        node.deadline = std::max(tick, tick_ + 1);
+        node.data = data;
+        place(index);
+        ++size_;
+        return (Handle)node.generation << 32 | (index + 1);
+    };
+
+    // returns false if the timer already fired or was cancelled
+    bool
+    cancel(Handle handle) {
+        uint32_t index = (uint32_t)(handle & 0xffffffff) - 1;
+        if (index >= nodes_.size())
+            return false;
+        auto& node = nodes_[index];
+        if (node.slot == NIL || node.generation != (uint32_t)(handle >> 32))
+            return false;
+        unlink(index);
+        release(index);
+        return true;
+    };
+
+    size_t
+    size() const {
+        return size_;
+    };
+
+    // milliseconds the loop may sleep before the next advance(), -1 when
+    // there is nothing to wait for. Waking early is harmless.
+    int
+    timeout(uint64_t now) const {
+        if (!size_)
+            return -1;
+        uint64_t due = origin_ + nextTick() * tickMicros_;
+        if (due <= now)
+            return 0;
+        return (int)((due - now + 999) / 1000);
+    };
+
+    // fires every timer due by now, calling expired(data) for each. The
+    // callback may schedule and cancel timers.
+    template<typename Expired>
+    size_t
+    advance(uint64_t now, Expired&& expired) {
+        uint64_t target = now > origin_ ? (now - origin_) / tickMicros_ : 0;
+        size_t fired = 0;
+        while (tick_ < target) {
+            // skip straight over ticks with nothing to do
+            if (heads_[(tick_ + 1) & (TIMER_WHEEL_SLOTS - 1)] == NIL) {
+                auto next = nextTick();
+                if (next > target) {
+                    tick_ = target;
+                    break;
+                }
+                tick_ = next - 1;
+            }
+            ++tick_;
+            // bring the next block of every wrapped level down first,
+            // outermost first so nothing lands in a slot already emptied
+            int wrapped = 0;
+            while (wrapped + 1 < TIMER_WHEEL_LEVELS &&
+                   !(tick_ & ((1ull << ((wrapped + 1) * TIMER_WHEEL_BITS)) - 1)))
+                ++wrapped;
+            for (int level = wrapped; level > 0; --level) {
+                auto slot = level * TIMER_WHEEL_SLOTS +
+                            ((tick_ >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1));
+                while (heads_[slot] != NIL) {
+                    auto index = heads_[slot];
+                    unlink(index);
+                    place(index);
+                }
+            }
+            auto slot = tick_ & (TIMER_WHEEL_SLOTS - 1);
+            while (heads_[slot] != NIL) {
+                auto index = heads_[slot];
+                auto data = nodes_[index].data;
+                unlink(index);
+                release(index);
+                expired(data);
+                ++fired;
+            }
+        }
+        return fired;
+    };
+
+private:
+    enum : uint32_t { NIL = 0xffffffff };
+
+    struct Node {
+        uint64_t deadline {0};
+        uint64_t data {0};
+        uint32_t prev {NIL};
+        uint32_t next {NIL};
+        uint32_t slot {NIL};
+        uint32_t generation {1};
+    };
+
+    // the first tick at which a slot of any level has something to fire or
+    // bring down, UINT64_MAX when empty
+    uint64_t
+    nextTick() const {
+        uint64_t next = UINT64_MAX;
+        for (int level = 0; level < TIMER_WHEEL_LEVELS; ++level) {
+            int shift = level * TIMER_WHEEL_BITS;
+            uint64_t block = tick_ >> shift;
+            for (uint64_t d = 1; d <= TIMER_WHEEL_SLOTS; ++d) {
+                if (heads_[level * TIMER_WHEEL_SLOTS +
+                           ((block + d) & (TIMER_WHEEL_SLOTS - 1))] != NIL) {
+                    next = std::min(next, (block + d) << shift);
+                    break;
+                }
+            }
+        }
+        return next;
+    };
+
+    void
+    place(uint32_t index) {
+        auto& node = nodes_[index];
+        // beyond the last level, park it as far out as possible; it gets
+        // placed again when that slot comes down
+        uint64_t span = 1ull << (TIMER_WHEEL_LEVELS * TIMER_WHEEL_BITS);
+        uint64_t deadline = std::min(node.deadline, tick_ + span - 1);
+        uint64_t delta = deadline - tick_;
+        int level = 0;
+        while (level < TIMER_WHEEL_LEVELS - 1 &&
+               delta >= (1ull << ((level + 1) * TIMER_WHEEL_BITS)))
+            ++level;
+        uint32_t slot = level * TIMER_WHEEL_SLOTS +
+                        ((deadline >> (level * TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1));
+        node.slot = slot;
+        node.prev = NIL;
+        node.next = heads_[slot];
+        if (node.next != NIL)
+            nodes_[node.next].prev = index;
+        heads_[slot] = index;
+    };
+
+    void
+    unlink(uint32_t index) {
+        auto& node = nodes_[index];
+        if (node.prev != NIL)
+            nodes_[node.prev].next = node.next;
+        else
+            heads_[node.slot] = node.next;
+        if (node.next != NIL)
+            nodes_[node.next].prev = node.prev;
+        node.slot = NIL;
+    };
+
+    void
+    release(uint32_t index) {
+        auto& node = nodes_[index];
+        ++node.generation;
+        node.next = free_;
+        free_ = index;
+        --size_;
+    };
+
+    uint64_t origin_;
+    uint64_t tickMicros_;
+    uint64_t tick_;
+    std::vector<Node> nodes_;
+    std::array<uint32_t, TIMER_WHEEL_LEVELS * TIMER_WHEEL_SLOTS> heads_;
+    uint32_t free_;
+    size_t size_;
+
+};
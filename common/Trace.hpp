@@ -0,0 +1,228 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <algorithm>
+#include <chrono>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define _getPid _getpid
+#else
+#include <unistd.h>
+#define _getPid getpid
+#endif
+
+#include "Log.hpp"
+
+// Sampled pipeline tracing. Set TCPJOY_TRACE=<file> to record and write a
+// Chrome trace-event JSON file (also loadable in Perfetto) at shutdown, and
+// TCPJOY_TRACE_RATE=N to trace one sample in N (default
+// TRACE_DEFAULT_RATE). A sample is identified by its capture timestamp,
+// which survives the wire unchanged, so the client and the server pick the
+// same samples without coordinating and their files can be merged into one
+// timeline; the wire hop shows as a flow arrow when both run on one host.
+//
+// Every thread writes to its own ring of TRACE_BUFFER_EVENTS events, so
+// recording is a clock read and a few stores. With tracing off, every call
+// below returns after one load and branch.
+#define TRACE_DEFAULT_RATE      64
+#define TRACE_BUFFER_EVENTS     4096
+#define TRACE_MAX_THREADS       64
+
+struct TraceEvent {
+    const char* name;
+    uint64_t id;
+    int64_t begin;
+    int64_t end;
+    char phase;
+};
+
+// single writer, the thread that owns it; the dump reads it once the
+// writers are stopped
+struct TraceBuffer {
+    std::array<TraceEvent, TRACE_BUFFER_EVENTS> events;
+    std::atomic<uint64_t> head;
+    std::atomic<bool> owned;
+};
+
+struct TraceConfig {
+    const char* path;
+    uint32_t rate;
+};
+
+TraceConfig
+traceLoadConfig()
+{
+    TraceConfig config = { getenv("TCPJOY_TRACE"), TRACE_DEFAULT_RATE };
+    if (auto rate = getenv("TCPJOY_TRACE_RATE"))
+        config.rate = (uint32_t)atoi(rate);
+    if (!config.path || !config.path[0])
+        config.rate = 0;
+    return config;
+}
+
+// buffers are statically allocated so tracing never allocates, and are
+// handed back when their thread exits; a later thread only takes over a
+// released buffer once every buffer has been used
+static const TraceConfig traceConfig = traceLoadConfig();
+static TraceBuffer traceBuffers[TRACE_MAX_THREADS];
+static std::atomic<int> traceBufferCount(0);
+static thread_local int64_t traceReceivedAt = 0;
+
+struct TraceBufferLease {
+    ~TraceBufferLease() {
+        if (buffer)
+            buffer->owned = false;
+    };
+
+    TraceBuffer* buffer {nullptr};
+};
+
+static thread_local TraceBufferLease traceLease;
+
+bool
+traceEnabled()
+{
+    return traceConfig.rate != 0;
+}
+
+// whether the sample with this id is traced, the same answer on every host
+bool
+traceSampled(uint64_t id)
+{
+    if (!traceConfig.rate)
+        return false;
+    return ((id * 0x9E3779B97F4A7C15ull) >> 32) % traceConfig.rate == 0;
+}
+
+int64_t
+traceNow()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+TraceBuffer*
+traceBuffer()
+{
+    if (traceLease.buffer)
+        return traceLease.buffer;
+    int index = traceBufferCount.fetch_add(1);
+    if (index < TRACE_MAX_THREADS) {
+        traceLease.buffer = &traceBuffers[index];
+    } else {
+        for (auto& buffer : traceBuffers) {
+            bool released = false;
+            if (buffer.owned.compare_exchange_strong(released, true)) {
+                buffer.head = 0;
+                traceLease.buffer = &buffer;
+                return traceLease.buffer;
+            }
+        }
+        return nullptr;
+    }
+    traceLease.buffer->owned = true;
+    return traceLease.buffer;
+}
+
+void
+traceRecord(char phase, const char* name, uint64_t id, int64_t begin, int64_t end)
+{
+    auto buffer = traceBuffer();
+    if (!buffer)
+        return;
+    auto head = buffer->head.load(std::memory_order_relaxed);
+    buffer->events[head % TRACE_BUFFER_EVENTS] = { name, id, begin, end, phase };
+    buffer->head.store(head + 1, std::memory_order_release);
+}
+
+// a stage of the sample's trip, from begin to end
+void
+traceSpan(const char* name, uint64_t id, int64_t begin, int64_t end)
+{
+    if (traceSampled(id))
+        traceRecord('X', name, id, begin, end);
+}
+
+// one end of an arrow between stages on different threads or hosts
+void
+traceFlow(const char* name, uint64_t id, int64_t at, bool start)
+{
+    if (traceSampled(id))
+        traceRecord(start ? 's' : 'f', name, id, at, at);
+}
+
+// the transport marks when the bytes being handled came off the socket
+void
+traceSetReceived(int64_t at)
+{
+    traceReceivedAt = at;
+}
+
+int64_t
+traceReceived()
+{
+    return traceReceivedAt;
+}
+
+// writes every buffered event to the TCPJOY_TRACE file, returns 0 on
+// success. Call once the traced threads are stopped.
+int
+traceDump()
+{
+    if (!traceEnabled())
+        return 0;
+    auto file = fopen(traceConfig.path, "w");
+    if (!file) {
+        DBGOUT("trace - unable to open %s", traceConfig.path);
+        return 1;
+    }
+    int pid = (int)_getPid();
+    size_t written = 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    int buffers = std::min(traceBufferCount.load(), TRACE_MAX_THREADS);
+    for (int tid = 0; tid < buffers; ++tid) {
+        auto& buffer = traceBuffers[tid];
+        uint64_t head = buffer.head.load(std::memory_order_acquire);
+        uint64_t first = head > TRACE_BUFFER_EVENTS ? head - TRACE_BUFFER_EVENTS : 0;
+        for (uint64_t i = first; i < head; ++i) {
+            auto& ev = buffer.events[i % TRACE_BUFFER_EVENTS];
+            fprintf(file, "%s{\"name\":\"%s\",\"cat\":\"input\",\"ph\":\"%c\","
+                          "\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+                    written++ ? ",\n" : "", ev.name, ev.phase,
+                    (long long)ev.begin, pid, tid);
+            if (ev.phase == 'X')
+                fprintf(file, ",\"dur\":%lld", (long long)(ev.end - ev.begin));
+            else
+                fprintf(file, ",\"id\":%llu,\"bp\":\"e\"", (unsigned long long)ev.id);
+            fprintf(file, ",\"args\":{\"sample\":%llu}}", (unsigned long long)ev.id);
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    DBGOUT("trace - wrote %d events to %s", (int)written, traceConfig.path);
+    return 0;
+}
@@ -0,0 +1,262 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Reads an ingress journal written by server --journal DIR:
+//   journal DIR                         totals and one line per session
+//   journal DIR --dump                  every record, one per line
+//   journal DIR --replay HOST[:PORT]    sends the recorded bytes back to a
+//                                       server, one connection per session
+// narrowed with --session N and --from S / --to S, in seconds from the
+// first record; --speed X replays X times as fast, 0 as fast as it can.
+// Linux only.
+
+#include "Log.hpp"
+#include "Client.hpp"
+#include "Journal.hpp"
+
+#include <cstdlib>
+#include <chrono>
+#include <thread>
+#include <unordered_map>
+
+#include <netinet/tcp.h>
+
+using namespace Network;
+
+struct JournalOptions {
+    std::string dir;
+    std::string replayHost;
+    PortNumber replayPort {DEFAULT_PORT};
+    bool dump {false};
+    uint32_t session {0};
+    double from {0};
+    double to {-1};
+    double speed {1};
+};
+
+void
+usage()
+{
+    printf("usage: journal DIR [--dump | --replay HOST[:PORT]] [--session N]\n"
+           "               [--from S] [--to S] [--speed X]\n");
+}
+
+const char*
+kindName(JournalKind kind)
+{
+    switch (kind) {
+    case JOURNAL_OPEN:
+        return "open";
+    case JOURNAL_CLOSE:
+        return "close";
+    default:
+        return "data";
+    }
+}
+
+// printable bytes as is, the rest as escapes, up to max input bytes
+std::string
+preview(const char* data, size_t len, size_t max)
+{
+    std::string out;
+    char hex[8];
+    for (size_t i = 0; i < std::min(len, max); ++i) {
+        auto c = (unsigned char)data[i];
+        if (c >= 0x20 && c < 0x7f && c != '\\') {
+            out += (char)c;
+        } else {
+            snprintf(hex, sizeof(hex), "\\x%02x", c);
+            out += hex;
+        }
+    }
+    if (len > max)
+        out += "...";
+    return out;
+}
+
+void
+summarize(const JournalReader& reader, uint64_t base)
+{
+    auto& entries = reader.entries();
+    uint64_t bytes = 0;
+    for (auto& entry : entries)
+        bytes += entry.length;
+    double span = entries.empty() ? 0 : (entries.back().time - base) / 1e6;
+    printf("%zu segments, %zu records, %llu bytes over %.3f s\n", reader.segments(),
+           entries.size(), (unsigned long long)bytes, span);
+    printf("%8s %8s %8s %4s %10s %10s %8s %10s\n",
+           "session", "conn", "pid", "wr", "opened", "closed", "records", "bytes");
+    auto& sessions = reader.sessions();
+    for (size_t i = 0; i < sessions.size(); ++i) {
+        auto& s = sessions[i];
+        char closed[16] = "-";
+        if (s.closed)
+            snprintf(closed, sizeof(closed), "%.3f", (s.closed - base) / 1e6);
+        printf("%8zu %8u %8u %4u %10.3f %10s %8zu %10llu\n", i + 1, s.connection, s.pid,
+               s.writer, (s.opened - base) / 1e6, closed, s.entries.size(),
+               (unsigned long long)s.bytes);
+    }
+}
+
+// reads and discards whatever the server sent back, so its writes to us
+// never block it
+void
+drain(Socket socket)
+{
+    char buf[DEFAULT_BUFLEN];
+    while (recv(socket, buf, sizeof(buf), MSG_DONTWAIT) > 0) { }
+}
+
+Socket
+connectTo(const sockaddr_in& addr)
+{
+    Socket socket = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket == INVALID_SOCKET)
+        return INVALID_SOCKET;
+    int on = 1;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (connect(socket, (const sockaddr*)&addr, sizeof(addr)) != 0) {
+        _close(socket);
+        return INVALID_SOCKET;
+    }
+    return socket;
+}
+
+// plays the selected records back with their original spacing; a session
+// gets its connection on its first record and loses it on its close
+int
+replay(const JournalReader& reader, const JournalOptions& options,
+       uint64_t from, uint64_t to)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options.replayPort);
+    if (inet_pton(AF_INET, options.replayHost.c_str(), &addr.sin_addr) != 1) {
+        auto host = gethostbyname(options.replayHost.c_str());
+        if (!host || host->h_addrtype != AF_INET) {
+            printf("can't resolve %s\n", options.replayHost.c_str());
+            return 1;
+        }
+        memcpy(&addr.sin_addr, host->h_addr_list[0], sizeof(addr.sin_addr));
+    }
+
+    std::unordered_map<uint32_t, Socket> sockets;
+    uint64_t first = 0, sent = 0, failed = 0;
+    auto start = std::chrono::steady_clock::now();
+    auto records = reader.forEach(from, to, options.session, [&](const JournalEntry& entry) {
+        if (!first)
+            first = entry.time;
+        if (options.speed > 0)
+            std::this_thread::sleep_until(start + std::chrono::microseconds(
+                (int64_t)((entry.time - first) / options.speed)));
+        auto it = sockets.find(entry.session);
+        if (it != sockets.end() && entry.kind != JOURNAL_DATA) {
+            _close(it->second);
+            sockets.erase(it);
+            it = sockets.end();
+        }
+        if (entry.kind == JOURNAL_CLOSE)
+            return;
+        if (it == sockets.end()) {
+            Socket socket = connectTo(addr);
+            if (socket == INVALID_SOCKET) {
+                ++failed;
+                return;
+            }
+            it = sockets.emplace(entry.session, socket).first;
+        }
+        if (!entry.length)
+            return;
+        drain(it->second);
+        if (writeToSocket(it->second, entry.data, entry.length) == SOCKET_ERROR) {
+            ++failed;
+            _close(it->second);
+            sockets.erase(it);
+            return;
+        }
+        sent += entry.length;
+    });
+    for (auto& socket : sockets) {
+        drain(socket.second);
+        _close(socket.second);
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("replayed %zu records, %llu bytes in %.3f s, %llu failures\n", records,
+           (unsigned long long)sent, elapsed, (unsigned long long)failed);
+    return failed ? 1 : 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    JournalOptions options;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = argv[i];
+        bool more = i + 1 < argc;
+        if (strcmp(arg, "--dump") == 0) {
+            options.dump = true;
+        } else if (strcmp(arg, "--replay") == 0 && more) {
+            options.replayHost = argv[++i];
+            auto colon = options.replayHost.find(':');
+            if (colon != std::string::npos) {
+                options.replayPort = (PortNumber)atoi(options.replayHost.c_str() + colon + 1);
+                options.replayHost.resize(colon);
+            }
+        } else if (strcmp(arg, "--session") == 0 && more) {
+            options.session = (uint32_t)atoi(argv[++i]);
+        } else if (strcmp(arg, "--from") == 0 && more) {
+            options.from = atof(argv[++i]);
+        } else if (strcmp(arg, "--to") == 0 && more) {
+            options.to = atof(argv[++i]);
+        } else if (strcmp(arg, "--speed") == 0 && more) {
+            options.speed = atof(argv[++i]);
+        } else if (arg[0] != '-' && options.dir.empty()) {
+            options.dir = arg;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (options.dir.empty()) {
+        usage();
+        return 1;
+    }
+
+    JournalReader reader;
+    if (reader.open(options.dir) != 0)
+        return 1;
+    auto& entries = reader.entries();
+    uint64_t base = entries.empty() ? 0 : entries.front().time;
+    uint64_t from = base + (uint64_t)(options.from * 1e6);
+    uint64_t to = options.to < 0 ? UINT64_MAX : base + (uint64_t)(options.to * 1e6);
+
+    if (!options.replayHost.empty())
+        return replay(reader, options, from, to);
+
+    if (!options.dump) {
+        summarize(reader, base);
+        return 0;
+    }
+    reader.forEach(from, to, options.session, [base](const JournalEntry& entry) {
+        printf("%12.6f %6u %6u %-5s %5u %s\n", (entry.time - base) / 1e6, entry.session,
+               entry.connection, kindName(entry.kind), entry.length,
+               preview(entry.data, entry.length, 48).c_str());
+    });
+    return 0;
+}
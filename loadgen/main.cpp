@@ -0,0 +1,739 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Load generator: many concurrent simulated clients from one process, to
+// find where a server saturates before a deployment finds it instead.
+// Every connection is a non-blocking socket on an epoll loop, driven like
+// the real client: 1 kHz synthetic pad samples, delta encoded, at the rate
+// its own RateController picks, with periodic pings for latency. Linux only.
+
+#include "Log.hpp"
+#include "Client.hpp"
+#include "Frame.hpp"
+#include "Handshake.hpp"
+#include "StateCodec.hpp"
+#include "RateController.hpp"
+#include "Timer.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#include <memory>
+#include <random>
+#include <algorithm>
+
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+using namespace Network;
+
+#define LOADGEN_MAX_EVENTS          256
+#define LOADGEN_PING_MS             250
+#define LOADGEN_CONNECT_TIMEOUT_MS  3000
+// a failed connect is retried after this, doubling with every failure in a
+// row up to the max, so a server that is down isn't hammered
+#define LOADGEN_BACKOFF_MS          10
+#define LOADGEN_BACKOFF_MAX_MS      2000
+#define LOADGEN_TICK_MS             10
+// a connection with this much unsent output stops generating until it drains
+#define LOADGEN_MAX_BACKLOG         65536
+#define LOADGEN_STICK               28000
+
+struct LoadConfig {
+    std::string host {"127.0.0.1"};
+    PortNumber port {DEFAULT_PORT};
+    size_t connections {1000};
+    // new connections per second until all are open
+    double ramp {200};
+    // connections closed and reopened per second once ramped up
+    double churn {0};
+    int duration {30};
+    size_t threads {1};
+    int pads {1};
+    // raw legacy joystick text instead of framed state messages, no pings
+    bool legacy {false};
+    int sloMs {20};
+};
+
+// counters for the current report interval, shared by every generator
+struct LoadStats {
+    std::atomic<uint64_t> attempts {0};
+    std::atomic<uint64_t> connected {0};
+    std::atomic<uint64_t> failed {0};
+    std::atomic<uint64_t> dropped {0};
+    std::atomic<uint64_t> messages {0};
+    std::atomic<uint64_t> bytes {0};
+    std::atomic<uint64_t> stalled {0};
+    std::atomic<int64_t> open {0};
+
+    std::mutex mutex;
+    // microseconds
+    std::vector<uint32_t> rtts;
+    std::vector<uint32_t> connectTimes;
+
+    void
+    addRtt(uint32_t rtt) {
+        std::lock_guard<std::mutex> lck(mutex);
+        rtts.push_back(rtt);
+    };
+
+    void
+    addConnectTime(uint32_t micros) {
+        std::lock_guard<std::mutex> lck(mutex);
+        connectTimes.push_back(micros);
+    };
+};
+
+uint64_t
+nowMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// One epoll loop and its share of the connections. Every deadline, from a
+// connection's next send to the ramp, lives in one timer wheel.
+class Generator {
+public:
+    Generator(const LoadConfig& config, const sockaddr_in& addr,
+              size_t target, double ramp, double churn, LoadStats& stats)
+        : config_(config)
+        , addr_(addr)
+        , target_(target)
+        , ramp_(ramp)
+        , churn_(churn)
+        , stats_(stats)
+        , epoll_(epoll_create1(EPOLL_CLOEXEC))
+        , start_(nowMicros())
+        , timers_(start_)
+        , opened_(0)
+        , churned_(0)
+        , failures_(0)
+        , random_(std::random_device()()) { };
+
+    ~Generator() {
+        for (auto& conn : conns_) {
+            if (conn && conn->socket != INVALID_SOCKET)
+                _close(conn->socket);
+        }
+        if (epoll_ >= 0)
+            ::close(epoll_);
+    };
+
+    void
+    run(const std::atomic<bool>& running) {
+        if (epoll_ < 0)
+            return;
+        schedule(Tick::Ramp, 0, start_);
+        if (churn_ > 0)
+            schedule(Tick::Churn, 0, start_);
+        epoll_event events[LOADGEN_MAX_EVENTS];
+        while (running) {
+            int timeout = timers_.timeout(nowMicros());
+            int n = epoll_wait(epoll_, events, LOADGEN_MAX_EVENTS,
+                               timeout < 0 ? LOADGEN_TICK_MS : std::min(timeout, LOADGEN_TICK_MS));
+            if (n < 0 && errno != EINTR)
+                break;
+            for (int i = 0; i < n; ++i) {
+                auto index = (size_t)events[i].data.u64;
+                if (index >= conns_.size() || !conns_[index])
+                    continue;
+                if (!conns_[index]->connected)
+                    finishConnect(index);
+                else
+                    service(index, events[i].events);
+            }
+            timers_.advance(nowMicros(), [this](uint64_t data) {
+                fire((Tick)(data >> 32), (size_t)(uint32_t)data);
+            });
+        }
+    };
+
+private:
+    enum class Tick : uint32_t {
+        Send = 1,
+        Ping,
+        ConnectTimeout,
+        Ramp,
+        Churn,
+        Reconnect
+    };
+
+    struct Conn {
+        Socket socket {INVALID_SOCKET};
+        bool connected {false};
+        bool writable {false};
+        uint64_t started {0};
+        FrameReader reader;
+        StateEncoder encoder;
+        RateController rate;
+        std::string out;
+        std::vector<PadSample> samples;
+        std::array<PadSample, STATE_MAX_PADS> last {};
+        uint64_t sampled {0};
+        double phase {0};
+        int64_t rtt {0};
+        TimerWheel::Handle send {0};
+        TimerWheel::Handle ping {0};
+        TimerWheel::Handle timeout {0};
+    };
+
+    TimerWheel::Handle
+    schedule(Tick tick, size_t index, uint64_t deadline) {
+        return timers_.schedule(deadline, (uint64_t)tick << 32 | (uint32_t)index);
+    };
+
+    void
+    fire(Tick tick, size_t index) {
+        auto now = nowMicros();
+        switch (tick) {
+        case Tick::Ramp: {
+            // open whatever the ramp rate says is due by now
+            auto due = std::min(target_, (size_t)((now - start_) * ramp_ / 1e6) + 1);
+            while (opened_ < due) {
+                ++opened_;
+                open();
+            }
+            if (opened_ < target_)
+                schedule(Tick::Ramp, 0, now + LOADGEN_TICK_MS * 1000);
+            return;
+        }
+        case Tick::Churn: {
+            // churn starts once the ramp is done
+            if (opened_ >= target_) {
+                auto due = (uint64_t)((now - start_) * churn_ / 1e6);
+                for (; churned_ < due && !conns_.empty(); ++churned_) {
+                    std::uniform_int_distribution<size_t> pick(0, conns_.size() - 1);
+                    auto victim = pick(random_);
+                    if (conns_[victim] && conns_[victim]->connected) {
+                        close(victim);
+                        open();
+                    }
+                }
+            } else {
+                churned_ = (uint64_t)((now - start_) * churn_ / 1e6);
+            }
+            schedule(Tick::Churn, 0, now + LOADGEN_TICK_MS * 1000);
+            return;
+        }
+        case Tick::Reconnect:
+            open();
+            return;
+        default:
+            break;
+        }
+
+        if (index >= conns_.size() || !conns_[index])
+            return;
+        auto& conn = *conns_[index];
+        switch (tick) {
+        case Tick::ConnectTimeout:
+            conn.timeout = 0;
+            close(index);
+            retry();
+            break;
+        case Tick::Send: {
+            conn.send = 0;
+            bool changed = false;
+            if (conn.out.size() < LOADGEN_MAX_BACKLOG)
+                changed = sendSamples(conn, now);
+            else
+                stats_.stalled++;
+            if (!flush(index))
+                return;
+            auto next = conn.rate.next(changed, conn.rtt, conn.out.size());
+            conn.send = schedule(Tick::Send, index, now + next.count());
+            break;
+        }
+        case Tick::Ping: {
+            char buf[24];
+            auto len = snprintf(buf, sizeof(buf), "%c%lld", CONTROL_PING, (long long)now);
+            encodeFrames(conn.out, Channel::Control, 0, buf, len);
+            if (!flush(index))
+                return;
+            conn.ping = schedule(Tick::Ping, index, now + LOADGEN_PING_MS * 1000);
+            break;
+        }
+        default:
+            break;
+        }
+    };
+
+    void
+    open() {
+        size_t index = 0;
+        while (index < conns_.size() && conns_[index])
+            ++index;
+        if (index == conns_.size())
+            conns_.emplace_back();
+        conns_[index].reset(new Conn());
+        auto& conn = *conns_[index];
+        conn.phase = std::uniform_real_distribution<double>(0, 2 * M_PI)(random_);
+        conn.started = nowMicros();
+        conn.sampled = conn.started;
+        stats_.attempts++;
+
+        conn.socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (conn.socket == INVALID_SOCKET) {
+            conns_[index].reset();
+            retry();
+            return;
+        }
+        int on = 1;
+        setsockopt(conn.socket, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        if (connect(conn.socket, (sockaddr*)&addr_, sizeof(addr_)) != 0 && errno != EINPROGRESS) {
+            _close(conn.socket);
+            conns_[index].reset();
+            retry();
+            return;
+        }
+        watch(index, EPOLLOUT, EPOLL_CTL_ADD);
+        conn.timeout = schedule(Tick::ConnectTimeout, index,
+                                conn.started + LOADGEN_CONNECT_TIMEOUT_MS * 1000);
+    };
+
+    void
+    finishConnect(size_t index) {
+        auto& conn = *conns_[index];
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(conn.socket, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            close(index);
+            retry();
+            return;
+        }
+        failures_ = 0;
+        timers_.cancel(conn.timeout);
+        conn.timeout = 0;
+        conn.connected = true;
+        auto now = nowMicros();
+        stats_.connected++;
+        stats_.open++;
+        stats_.addConnectTime((uint32_t)(now - conn.started));
+        watch(index, EPOLLIN | EPOLLRDHUP, EPOLL_CTL_MOD);
+        conn.send = schedule(Tick::Send, index, now);
+        if (!config_.legacy) {
+            // open like a real client, but stream state messages without
+            // waiting for the accept
+            char hello[HANDSHAKE_LEN];
+            encodeFrames(conn.out, Channel::Control, 0, hello,
+                         encodeHandshake(CONTROL_HELLO, localCapabilities(), hello));
+            conn.ping = schedule(Tick::Ping, index, now + LOADGEN_PING_MS * 1000);
+        }
+    };
+
+    // a connect failed: count it and open a replacement once the backoff,
+    // jittered so the retries of a whole ramp don't land together, is over
+    void
+    retry() {
+        stats_.failed++;
+        auto backoff = std::min<uint64_t>(LOADGEN_BACKOFF_MAX_MS,
+                                          (uint64_t)LOADGEN_BACKOFF_MS << std::min(failures_, 16));
+        ++failures_;
+        auto delay = std::uniform_int_distribution<uint64_t>(backoff * 500, backoff * 1000)(random_);
+        schedule(Tick::Reconnect, 0, nowMicros() + delay);
+    };
+
+    // the connection went away under us: count it and replace it
+    void
+    drop(size_t index) {
+        stats_.dropped++;
+        close(index);
+        open();
+    };
+
+    void
+    close(size_t index) {
+        auto& conn = *conns_[index];
+        timers_.cancel(conn.send);
+        timers_.cancel(conn.ping);
+        timers_.cancel(conn.timeout);
+        if (conn.connected)
+            stats_.open--;
+        epoll_ctl(epoll_, EPOLL_CTL_DEL, conn.socket, nullptr);
+        _close(conn.socket);
+        conns_[index].reset();
+    };
+
+    void
+    watch(size_t index, uint32_t events, int op) {
+        epoll_event ev;
+        ev.events = events;
+        ev.data.u64 = index;
+        epoll_ctl(epoll_, op, conns_[index]->socket, &ev);
+    };
+
+    void
+    service(size_t index, uint32_t events) {
+        auto& conn = *conns_[index];
+        if (events & EPOLLOUT) {
+            if (!flush(index))
+                return;
+        }
+        if (!(events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+            return;
+        auto onMessage = [this, &conn](Channel channel, uint8_t, const char* data, int len) {
+            if (isPong(channel, data, len)) {
+                auto rtt = (int64_t)nowMicros() - strtoll(data + 1, nullptr, 10);
+                if (rtt < 0)
+                    return;
+                conn.rtt = conn.rtt ? conn.rtt + (rtt - conn.rtt) / 8 : rtt;
+                stats_.addRtt((uint32_t)std::min<int64_t>(rtt, UINT32_MAX));
+                return;
+            }
+            conn.encoder.onControl(data, len);
+        };
+        auto onLegacy = [](const char*, int) { };
+        while (true) {
+            int res = (int)recv(conn.socket, recvbuf_, sizeof(recvbuf_), 0);
+            if (res > 0) {
+                if (!conn.reader.feed(recvbuf_, res, onMessage, onLegacy)) {
+                    drop(index);
+                    return;
+                }
+                continue;
+            }
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return;
+            if (res < 0 && errno == EINTR)
+                continue;
+            drop(index);
+            return;
+        }
+    };
+
+    // writes as much of the connection's backlog as the socket takes,
+    // false if the connection was dropped
+    bool
+    flush(size_t index) {
+        auto& conn = *conns_[index];
+        size_t sent = 0;
+        while (sent < conn.out.size()) {
+            auto res = ::send(conn.socket, conn.out.data() + sent, conn.out.size() - sent, SEND_FLAGS);
+            if (res > 0) {
+                sent += res;
+                stats_.bytes += res;
+                continue;
+            }
+            if (res < 0 && errno == EINTR)
+                continue;
+            if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                break;
+            drop(index);
+            return false;
+        }
+        conn.out.erase(0, sent);
+        // only ask for writability while something is waiting
+        if (conn.writable == conn.out.empty()) {
+            conn.writable = !conn.out.empty();
+            watch(index, EPOLLIN | EPOLLRDHUP | (conn.writable ? (uint32_t)EPOLLOUT : 0u), EPOLL_CTL_MOD);
+        }
+        return true;
+    };
+
+    // the synthetic pad: the stick sweeps circles for a few seconds, then
+    // rests for a few, with the buttons tapped while it moves
+    PadSample
+    sample(const Conn& conn, int pad, uint64_t time) const {
+        double t = (time - start_) / 1e6;
+        double phase = conn.phase + pad;
+        PadSample s = { time - start_, 0, 0, 0 };
+        if (sin(t * 0.7 + phase) > 0) {
+            s.lx = (int16_t)(LOADGEN_STICK * sin(2 * M_PI * 0.8 * t + phase));
+            s.ly = (int16_t)(LOADGEN_STICK * cos(2 * M_PI * 0.8 * t + phase));
+            s.buttons = (uint16_t)((int)(t * 3 + phase) % 3 == 0);
+        }
+        return s;
+    };
+
+    // captures every pad at 1 kHz up to now and queues one state message
+    // with the samples that changed, or a keepalive; returns whether
+    // anything changed
+    bool
+    sendSamples(Conn& conn, uint64_t now) {
+        bool changed = false;
+        bool buttons = false;
+        PadSamples pads[STATE_MAX_PADS];
+        size_t padCount = 0;
+        conn.samples.clear();
+        conn.samples.reserve(config_.pads * SAMPLE_BATCH_MAX);
+        // only the newest SAMPLE_BATCH_MAX ms matter after a stall
+        auto from = std::max(conn.sampled, now > SAMPLE_BATCH_MAX * 1000 ? now - SAMPLE_BATCH_MAX * 1000 : 0);
+        for (int pad = 0; pad < config_.pads; ++pad) {
+            size_t first = conn.samples.size();
+            for (uint64_t t = from + 1000; t <= now; t += 1000) {
+                auto s = sample(conn, pad, t);
+                auto& last = conn.last[pad];
+                if (s.lx == last.lx && s.ly == last.ly && s.buttons == last.buttons)
+                    continue;
+                buttons |= s.buttons != last.buttons;
+                conn.samples.push_back(s);
+                last = s;
+            }
+            size_t count = conn.samples.size() - first;
+            if (count || conn.encoder.keyframePending()) {
+                changed |= count > 0;
+                if (!count) {
+                    conn.last[pad].time = now - start_;
+                    conn.samples.push_back(conn.last[pad]);
+                    count = 1;
+                }
+                pads[padCount++] = { (uint8_t)pad, nullptr, count };
+            }
+        }
+        conn.sampled += (now - conn.sampled) / 1000 * 1000;
+        // pointers only once the vector stopped growing
+        size_t at = 0;
+        for (size_t i = 0; i < padCount; ++i) {
+            pads[i].samples = conn.samples.data() + at;
+            at += pads[i].count;
+        }
+        if (!padCount) {
+            // idle: keepalive with pad 0's last state, as the client does
+            conn.last[0].time = now - start_;
+            pads[padCount++] = { 0, &conn.last[0], 1 };
+        }
+
+        if (config_.legacy) {
+            // back to back with no separator, exactly as the client sends them
+            char text[128];
+            for (size_t i = 0; i < padCount; ++i) {
+                auto& s = pads[i].samples[pads[i].count - 1];
+                auto len = snprintf(text, sizeof(text),
+                                    "'{'j%d':{'lx':'%d','ly':'%d','b0':'%d','b1':'%d'}}'",
+                                    pads[i].pad, s.lx, s.ly, s.buttons & 1, (s.buttons >> 1) & 1);
+                conn.out.append(text, len);
+            }
+        } else {
+            char message[STATE_MAX_BYTES];
+            auto len = conn.encoder.encode(pads, padCount, message);
+            encodeFrames(conn.out, buttons ? Channel::Button : Channel::Motion, 0, message, len);
+        }
+        stats_.messages++;
+        return changed;
+    };
+
+    const LoadConfig& config_;
+    sockaddr_in addr_;
+    size_t target_;
+    double ramp_;
+    double churn_;
+    LoadStats& stats_;
+    int epoll_;
+    uint64_t start_;
+    TimerWheel timers_;
+    size_t opened_;
+    uint64_t churned_;
+    // connects failed in a row, reset by the next one that succeeds
+    int failures_;
+    std::mt19937 random_;
+    std::vector<std::unique_ptr<Conn>> conns_;
+    char recvbuf_[DEFAULT_BUFLEN];
+
+};
+
+uint32_t
+percentile(std::vector<uint32_t>& values, double p)
+{
+    if (values.empty())
+        return 0;
+    auto at = std::min(values.size() - 1, (size_t)(p * values.size()));
+    std::nth_element(values.begin(), values.begin() + at, values.end());
+    return values[at];
+}
+
+double
+cpuSeconds()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+// thousands of sockets need more descriptors than the usual soft limit
+void
+raiseFileLimit(size_t needed)
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return;
+    if (limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur < needed + 64)
+        printf("warning: only %d file descriptors for %d connections\n",
+               (int)limit.rlim_cur, (int)needed);
+}
+
+void
+usage()
+{
+    printf("usage: loadgen [--host H] [--port P] [--connections N] [--ramp N/s]\n"
+           "               [--churn N/s] [--duration S] [--threads T] [--pads N]\n"
+           "               [--legacy] [--slo MS]\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    LoadConfig config;
+    for (int i = 1; i < argc; ++i) {
+        auto arg = argv[i];
+        bool more = i + 1 < argc;
+        if (strcmp(arg, "--host") == 0 && more)
+            config.host = argv[++i];
+        else if (strcmp(arg, "--port") == 0 && more)
+            config.port = (PortNumber)atoi(argv[++i]);
+        else if (strcmp(arg, "--connections") == 0 && more)
+            config.connections = (size_t)atol(argv[++i]);
+        else if (strcmp(arg, "--ramp") == 0 && more)
+            config.ramp = atof(argv[++i]);
+        else if (strcmp(arg, "--churn") == 0 && more)
+            config.churn = atof(argv[++i]);
+        else if (strcmp(arg, "--duration") == 0 && more)
+            config.duration = atoi(argv[++i]);
+        else if (strcmp(arg, "--threads") == 0 && more)
+            config.threads = std::max(1, atoi(argv[++i]));
+        else if (strcmp(arg, "--pads") == 0 && more)
+            config.pads = std::max(1, std::min(STATE_MAX_PADS, atoi(argv[++i])));
+        else if (strcmp(arg, "--legacy") == 0)
+            config.legacy = true;
+        else if (strcmp(arg, "--slo") == 0 && more)
+            config.sloMs = atoi(argv[++i]);
+        else {
+            usage();
+            return 1;
+        }
+    }
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.host.c_str(), &addr.sin_addr) != 1) {
+        auto host = gethostbyname(config.host.c_str());
+        if (!host || host->h_addrtype != AF_INET) {
+            printf("can't resolve %s\n", config.host.c_str());
+            return 1;
+        }
+        memcpy(&addr.sin_addr, host->h_addr_list[0], sizeof(addr.sin_addr));
+    }
+    raiseFileLimit(config.connections);
+
+    printf("loadgen - %d connections to %s:%d, ramp %.0f/s, churn %.0f/s, %d s, %d threads, %s\n",
+           (int)config.connections, config.host.c_str(), config.port, config.ramp,
+           config.churn, config.duration, (int)config.threads,
+           config.legacy ? "legacy text" : "state messages");
+
+    LoadStats stats;
+    std::atomic<bool> running(true);
+    std::vector<std::unique_ptr<Generator>> generators;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < config.threads; ++i) {
+        // split the totals so the shares add up exactly
+        size_t share = config.connections / config.threads +
+                       (i < config.connections % config.threads ? 1 : 0);
+        generators.emplace_back(new Generator(config, addr, share,
+                                              config.ramp / config.threads,
+                                              config.churn / config.threads, stats));
+    }
+    for (auto& generator : generators)
+        threads.emplace_back([&generator, &running]() { generator->run(running); });
+
+    // one line per second; the first interval with errors and the first
+    // over the latency objective mark where the server stopped keeping up
+    printf("%5s %7s %7s %8s %6s %6s %8s %9s %6s %7s %7s %7s %7s %6s\n",
+           "sec", "open", "conn/s", "cp99ms", "fail", "drop", "msg/s", "bytes/s", "stall",
+           "p50ms", "p90ms", "p99ms", "maxms", "cpu%");
+    std::vector<uint32_t> rtts, connectTimes, allRtts;
+    int64_t peakOpen = 0, errorsAt = -1, sloAt = -1;
+    uint64_t peakAccepts = 0, totalFailed = 0, totalDropped = 0;
+    auto cpu = cpuSeconds();
+    auto next = std::chrono::steady_clock::now();
+    for (int sec = 1; sec <= config.duration; ++sec) {
+        next += std::chrono::seconds(1);
+        std::this_thread::sleep_until(next);
+        {
+            std::lock_guard<std::mutex> lck(stats.mutex);
+            rtts.swap(stats.rtts);
+            connectTimes.swap(stats.connectTimes);
+        }
+        auto open = stats.open.load();
+        auto connected = stats.connected.exchange(0);
+        auto failed = stats.failed.exchange(0);
+        auto dropped = stats.dropped.exchange(0);
+        auto messages = stats.messages.exchange(0);
+        auto bytes = stats.bytes.exchange(0);
+        auto stalled = stats.stalled.exchange(0);
+        stats.attempts.exchange(0);
+        auto now = cpuSeconds();
+        auto cpuPercent = (now - cpu) * 100;
+        cpu = now;
+
+        auto p99 = percentile(rtts, 0.99);
+        printf("%5d %7d %7d %8.2f %6d %6d %8d %9llu %6d %7.2f %7.2f %7.2f %7.2f %6.0f\n",
+               sec, (int)open, (int)connected, percentile(connectTimes, 0.99) / 1000.0,
+               (int)failed, (int)dropped, (int)messages,
+               (unsigned long long)bytes, (int)stalled,
+               percentile(rtts, 0.5) / 1000.0, percentile(rtts, 0.9) / 1000.0, p99 / 1000.0,
+               (rtts.empty() ? 0 : *std::max_element(rtts.begin(), rtts.end())) / 1000.0,
+               cpuPercent);
+        fflush(stdout);
+
+        peakOpen = std::max(peakOpen, open);
+        peakAccepts = std::max(peakAccepts, connected);
+        totalFailed += failed;
+        totalDropped += dropped;
+        if (errorsAt < 0 && (failed || dropped))
+            errorsAt = open;
+        if (sloAt < 0 && p99 > (uint32_t)config.sloMs * 1000)
+            sloAt = open;
+        allRtts.insert(allRtts.end(), rtts.begin(), rtts.end());
+        rtts.clear();
+        connectTimes.clear();
+    }
+    running = false;
+    for (auto& t : threads)
+        t.join();
+
+    printf("\nsummary\n");
+    printf("  peak connections open     %d of %d\n", (int)peakOpen, (int)config.connections);
+    printf("  peak connect rate         %d/s\n", (int)peakAccepts);
+    printf("  connect failures, drops   %d, %d\n", (int)totalFailed, (int)totalDropped);
+    if (errorsAt >= 0)
+        printf("  errors began at           %d connections\n", (int)errorsAt);
+    else
+        printf("  errors began at           never\n");
+    if (sloAt >= 0)
+        printf("  p99 over %d ms at         %d connections\n", config.sloMs, (int)sloAt);
+    else
+        printf("  p99 over %d ms at         never\n", config.sloMs);
+    if (!allRtts.empty())
+        printf("  rtt p50/p90/p99/p99.9     %.2f / %.2f / %.2f / %.2f ms\n",
+               percentile(allRtts, 0.5) / 1000.0, percentile(allRtts, 0.9) / 1000.0,
+               percentile(allRtts, 0.99) / 1000.0, percentile(allRtts, 0.999) / 1000.0);
+    // the generator pegging its cores means it, not the server, saturated
+    if (errorsAt < 0 && sloAt < 0 && peakOpen == (int64_t)config.connections)
+        printf("  the server kept up, raise --connections to find its limit\n");
+    return errorsAt >= 0 || sloAt >= 0 ? 2 : 0;
+}
@@ -1,212 +1,693 @@
-/*
-*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
-*
-*  This program is free software; you can redistribute it and/or modify
-*  it under the terms of the GNU General Public License as published by
-*  the Free Software Foundation; either version 3 of the License, or
-*  (at your option) any later version.
-*
-*  This program is distributed in the hope that it will be useful,
-*  but WITHOUT ANY WARRANTY; without even the implied warranty of
-*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
-*  GNU General Public License for more details.
-*
-*  You should have received a copy of the GNU General Public License
-*  along with this program. If not, see <https://www.gnu.org/licenses/>.
-*/
-
-#define DEBUG
-
-#include "Log.hpp"
-#include "Networker.hpp"
-
-#include <cmath>
-#include <cstdlib>
-#include <chrono>
-
-using namespace Network;
-
-INPUT ip;
-
-void
-MouseSetup(INPUT *buffer)
-{
-    ZeroMemory(buffer, sizeof(buffer));
-    buffer->type = INPUT_MOUSE;
-    buffer->mi.dx = 0;
-    buffer->mi.dy = 0;
-    buffer->mi.mouseData = 0;
-    buffer->mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_VIRTUALDESK;
-    buffer->mi.time = 0;
-    buffer->mi.dwExtraInfo = 0;
-}
-
-void
-MouseMoveAbsolute(INPUT& input, int x, int y)
-{
-    input.mi.dx = x * (65536 / GetSystemMetrics(SM_CXSCREEN));
-    input.mi.dy = y * (65536 / GetSystemMetrics(SM_CYSCREEN));
-    input.mi.dwFlags = MOUSEEVENTF_ABSOLUTE | MOUSEEVENTF_MOVE;
-
-    SendInput(1, &input, sizeof(INPUT));
-}
-
-void
-MouseMoveRelative(INPUT& input, int dx, int dy)
-{
-    input.mi.dx = dx;
-    input.mi.dy = dy;
-    input.mi.dwFlags = MOUSEEVENTF_MOVE | MOUSEEVENTF_VIRTUALDESK;
-
-    SendInput(1, &input, sizeof(INPUT));
-}
-
-void
-MouseLeftDown(INPUT& input)
-{
-    input.mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
-    SendInput(1, &input, sizeof(INPUT));
-}
-
-void
-MouseLeftUp(INPUT& input)
-{
-    input.mi.dwFlags = MOUSEEVENTF_LEFTUP;
-    SendInput(1, &input, sizeof(INPUT));
-}
-
-void
-MouseLeftClick(INPUT& input)
-{
-    input.mi.dwFlags = MOUSEEVENTF_LEFTDOWN;
-    SendInput(1, &input, sizeof(INPUT));
-
-    Sleep(10);
-
-    input.mi.dwFlags = MOUSEEVENTF_LEFTUP;
-    SendInput(1, &input, sizeof(INPUT));
-}
-
-void
-SimulateKeyDown(INPUT& input, const WORD& keycode)
-{
-    input.ki.wVk = keycode;
-    input.ki.dwFlags = 0;
-    SendInput(1, &input, sizeof(INPUT));
-}
-
-void
-SimulateKeyUp(INPUT& input, const WORD& keycode)
-{
-    input.ki.wVk = keycode;
-    input.ki.dwFlags = KEYEVENTF_KEYUP;
-    SendInput(1, &input, sizeof(INPUT));
-}
-
-void
-SimulateKeyStroke(INPUT& input, const WORD& keycode)
-{
-    SimulateKeyDown(input, keycode);
-    SimulateKeyUp(input, keycode);
-}
-
-auto start = std::chrono::steady_clock::now();
-std::mutex mouse_mutex;
-float dx = 0, dy = 0;
-
-void
-recvCb(Socket& ClientSocket, const char* recvbuf, int recvResult)
-{
-    char *token = std::strtok(strdup(recvbuf), ":\0");
-    if (strcmp(token, "k") == 0) {
-        ip.type = INPUT_KEYBOARD;
-        ip.ki.wScan = 0;
-        ip.ki.time = 0;
-        ip.ki.dwExtraInfo = 0;
-        DBGOUT("TEXT");
-        token = std::strtok(NULL, "\0");
-        int len = strlen(token);
-        for (int i = 0; i < len; i++) {
-            auto wvk = VkKeyScanEx((char)token[i], GetKeyboardLayout(0));
-            DBGOUT("Value: %c, %d", (char)token[i], wvk);
-            SimulateKeyStroke(ip, wvk);
-        }
-    }
-    else {
-        std::lock_guard<std::mutex> lck(mouse_mutex);
-        MouseSetup(&ip);
-        if (strcmp(token, "lu") == 0) {
-            DBGOUT("MOUSEUP");
-            //MouseLeftUp(ip);
-        }
-        else if (strcmp(token, "ld") == 0) {
-            DBGOUT("MOUSEDOWN");
-            //MouseLeftDown(ip);
-            MouseLeftClick(ip);
-        }
-        else if (strcmp(token, "m") == 0) {
-            int c = 0;
-            token = std::strtok(NULL, ",\0");
-            while (token != NULL && c < 2) {
-                if (c == 0) {
-                    dx = atoi(token);
-                }
-                else if (c == 1) {
-                    dy = atoi(token);
-                }
-                c++;
-                token = std::strtok(NULL, ",\0");
-            }
-            DBGOUT("MOUSEMOVE: (%d, %d)", dx, dy);
-
-            MouseMoveRelative(ip, static_cast<int>(dx), static_cast<int>(dy));
-        }
-    }
-}
-
-#include <conio.h>
-#define PI 3.14159f
-#define EPSILON 0.5f
-#define DECEL 0.8f
-
-int
-main(void)
-{
-    Networker nw;
-    auto running = true;
-    int ret = 0;
-
-    auto network_thread = std::thread([&nw, &ret, &running]() {
-        if (ret = nw.startServer(DEFAULT_PORT) != 0) {
-            return;
-        }
-        do {
-            ret = nw.runServer(&recvCb) != 0;
-        } while (ret == 0 && running);
-    });
-
-    auto mouse_thread = std::thread([&running]() {
-        while (running) {
-            dx = fabs(dx) < EPSILON ? 0.0f : dx * DECEL;
-            dy = fabs(dy) < EPSILON ? 0.0f : dy * DECEL;
-            //DBGOUT("mousemove   xv: %0.2f - yv: %0.2f", dx, dy);
-            MouseMoveRelative(ip, static_cast<int>(dx), static_cast<int>(dy));
-            std::this_thread::sleep_for(std::chrono::milliseconds(2));
-        }
-        DBGOUT("done");
-    });
-
-    auto input_thread = std::thread([&nw, &running]() {
-        getch();
-        nw.closeServer();
-        running = false;
-    });
-
-    network_thread.join();
-    mouse_thread.join();
-    input_thread.join();
-
-    system("pause");
-
-    return ret;
-}
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define DEBUG
+
+#include "AllocTrack.hpp"
+#include "PerfCounters.hpp"
+#include "Log.hpp"
+#include "Networker.hpp"
+#include "LegacyParser.hpp"
+#include "KeyMap.hpp"
+#include "Injector.hpp"
+#include "SampleBatch.hpp"
+#include "StateCodec.hpp"
+#include "StateTable.hpp"
+#include "Feedback.hpp"
+
+#include <cmath>
+#include <cstdlib>
+#include <chrono>
+#include <unordered_set>
+
+using namespace Network;
+
+// set once in main, before any thread that injects is started
+std::unique_ptr<Injector> injector;
+// likewise, for the threads that send feedback
+Networker* feedbackNet;
+
+auto start = std::chrono::steady_clock::now();
+
+// stick units per pixel of pointer movement every 2 ms, the same average
+// speed the decaying 50 ms joystick updates used to give
+#define JOY_SCALE 10240.0f
+
+// latest stick and pointer state of every connection, written by the
+// receive and replay threads, read by the mouse thread
+StateTable controllers;
+
+// recvCb runs on every shard thread in sharded mode, so each thread gets its
+// own parser, built with its index on the thread's first legacy message
+LegacyParser&
+legacyParser()
+{
+    ALLOC_SCOPE("parser-setup");
+    thread_local LegacyParser parser;
+    return parser;
+}
+
+// a short buzz confirming every injected press
+#define CLICK_RUMBLE_LOW    0x4000
+#define CLICK_RUMBLE_HIGH   0x8000
+#define CLICK_RUMBLE_MS     30
+
+// connections that negotiated feedback, added by the threads serving them
+// and read by the replay thread; writes to them hold the mutex, so a
+// connection that is gone from the set is never written to again
+std::mutex feedbackMutex;
+std::unordered_set<Socket> feedbackPeers;
+std::atomic<uint32_t> players(0);
+
+bool
+wantsFeedback(Socket socket)
+{
+    std::lock_guard<std::mutex> lck(feedbackMutex);
+    return feedbackPeers.count(socket) != 0;
+}
+
+void
+setWantsFeedback(Socket socket, bool wants)
+{
+    std::lock_guard<std::mutex> lck(feedbackMutex);
+    if (wants)
+        feedbackPeers.insert(socket);
+    else
+        feedbackPeers.erase(socket);
+}
+
+// clients that said hello but sent nothing else yet; kept by the thread
+// serving them, which also runs their recvCb
+thread_local std::unordered_set<Socket> unlit;
+
+void
+onHandshake(Socket socket, const Capabilities& agreed)
+{
+    // runs inside the receive path's steady scope
+    ALLOC_SCOPE("connection-setup");
+    bool wants = (agreed.features & FEATURE_FEEDBACK) != 0;
+    setWantsFeedback(socket, wants);
+    if (wants)
+        unlit.insert(socket);
+    else
+        unlit.erase(socket);
+}
+
+// lights the pad in its player's color once the client streams, as before
+// that it may not be listening yet
+void
+lightPad(Networker& nw, Socket socket)
+{
+    static const uint8_t colors[][3] = {
+        { 0x00, 0x40, 0xff }, { 0xff, 0x20, 0x00 },
+        { 0x00, 0xc0, 0x20 }, { 0xff, 0x00, 0xa0 }
+    };
+    if (unlit.empty() || !unlit.erase(socket))
+        return;
+    auto& color = colors[players++ % (sizeof(colors) / sizeof(colors[0]))];
+    char buf[FEEDBACK_MAX_BYTES];
+    nw.reply(socket, Channel::Control, buf, encodeLed(0, color[0], color[1], color[2], buf));
+}
+
+// rumbles on an injected press, then acks the edge with its capture time
+void
+pressFeedback(Socket socket, uint8_t pad, const PadSample& sample)
+{
+    std::lock_guard<std::mutex> lck(feedbackMutex);
+    if (!feedbackPeers.count(socket))
+        return;
+    char buf[FEEDBACK_MAX_BYTES];
+    if (sample.buttons & 1)
+        feedbackNet->reply(socket, Channel::Control, buf,
+                           encodeRumble(pad, CLICK_RUMBLE_LOW, CLICK_RUMBLE_HIGH, CLICK_RUMBLE_MS, buf));
+    feedbackNet->reply(socket, Channel::Control, buf, encodeFeedbackAck(pad, sample.time, buf));
+}
+
+int16_t
+clampAxis(int value)
+{
+    return (int16_t)std::max(-32768, std::min(32767, value));
+}
+
+// returns true when a joystick message pressed or released the left button
+bool
+injectMessage(uint32_t source, const LegacyMessage& msg)
+{
+    if (msg.kind == LegacyKind::Text) {
+        DBGOUT("TEXT");
+        injector->text(msg.text, msg.textLen);
+        return false;
+    }
+
+    int slot;
+    ControllerState state;
+    switch (msg.kind) {
+    case LegacyKind::MouseUp:
+        DBGOUT("MOUSEUP");
+        //injector->button(INJECTOR_BUTTON_LEFT, false);
+        break;
+    case LegacyKind::MouseDown:
+        DBGOUT("MOUSEDOWN");
+        //injector->button(INJECTOR_BUTTON_LEFT, true);
+        injector->click(INJECTOR_BUTTON_LEFT);
+        break;
+    case LegacyKind::MouseMove:
+        DBGOUT("MOUSEMOVE: (%d, %d)", msg.values[0], msg.values[1]);
+        injector->moveRelative(msg.values[0], msg.values[1]);
+        // the mouse thread lets the pointer coast on from here
+        if ((slot = controllers.acquire(source, (uint8_t)msg.pad)) < 0)
+            break;
+        controllers.read(slot, state);
+        state.updated = StateTable::now();
+        state.mx = msg.values[0];
+        state.my = msg.values[1];
+        ++state.moves;
+        controllers.write(slot, state);
+        break;
+    case LegacyKind::Joystick: {
+        // the stick sets pointer velocity, button A is the left button
+        if ((slot = controllers.acquire(source, (uint8_t)msg.pad)) < 0)
+            break;
+        controllers.read(slot, state);
+        auto pressed = state.buttons & 1;
+        state.updated = StateTable::now();
+        state.lx = clampAxis(msg.values[LEGACY_LX]);
+        state.ly = clampAxis(msg.values[LEGACY_LY]);
+        state.buttons = (uint16_t)((msg.values[LEGACY_B0] ? 1 : 0) |
+                                   (msg.values[LEGACY_B1] ? 2 : 0));
+        controllers.write(slot, state);
+        if ((state.buttons & 1) != pressed) {
+            injector->button(INJECTOR_BUTTON_LEFT, state.buttons & 1);
+            return true;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    return false;
+}
+
+// batched samples are replayed with their original spacing, through the
+// same path as a legacy joystick frame
+SampleReplayer replayer([](uint32_t source, uint8_t pad, const PadSample& sample) {
+    ALLOC_STEADY_SCOPE("replay-inject");
+    PERF_SECTION("replay-inject");
+    LegacyMessage msg = {};
+    msg.kind = LegacyKind::Joystick;
+    msg.pad = pad;
+    msg.values[LEGACY_LX] = sample.lx;
+    msg.values[LEGACY_LY] = sample.ly;
+    msg.values[LEGACY_B0] = sample.buttons & 1;
+    msg.values[LEGACY_B1] = (sample.buttons >> 1) & 1;
+    if (injectMessage(source, msg))
+        pressFeedback((Socket)source, pad, sample);
+});
+// one decoder per connection, erased by onDisconnect, so a reused socket
+// starts over with the keyframe every new stream opens with
+thread_local std::unordered_map<Socket, StateDecoder> decoders;
+// likewise, the legacy frame each connection's last read ended in
+thread_local std::unordered_map<Socket, LegacyCarry> carries;
+
+void
+recvCb(Networker& nw, Socket& ClientSocket, const char* recvbuf, int recvResult)
+{
+    ALLOC_STEADY_SCOPE("parse-inject");
+    PERF_SECTION("recv-dispatch");
+    lightPad(nw, ClientSocket);
+    if (isStateMessage(recvbuf, recvResult)) {
+        auto it = decoders.find(ClientSocket);
+        if (it == decoders.end()) {
+            ALLOC_SCOPE("connection-setup");
+            it = decoders.emplace(ClientSocket, StateDecoder()).first;
+        }
+        auto& decoder = it->second;
+        auto res = decoder.decode(recvbuf, recvResult,
+            [&ClientSocket](uint8_t pad, const PadSample* samples, size_t count) {
+                if (traceEnabled()) {
+                    traceSamplesFlow("wire", samples, count, traceReceived(), false);
+                    traceSamples("recv-decode", samples, count, traceReceived(), traceNow());
+                }
+                replayer.submit((uint32_t)ClientSocket, pad, samples, count);
+            });
+        if (res == StateResult::Malformed)
+            DBGOUT("dropping malformed state message");
+        char reply[STATE_CONTROL_MAX_BYTES];
+        if (auto len = decoder.reply(reply))
+            nw.reply(ClientSocket, Channel::Control, reply, len);
+        return;
+    }
+    auto carry = carries.find(ClientSocket);
+    if (carry == carries.end()) {
+        ALLOC_SCOPE("connection-setup");
+        carry = carries.emplace(ClientSocket, LegacyCarry()).first;
+    }
+    legacyParser().parse(recvbuf, recvResult, carry->second, [&ClientSocket](const LegacyMessage& msg) {
+        injectMessage((uint32_t)ClientSocket, msg);
+    });
+}
+
+// forgets everything kept per connection, on the thread that served it and
+// before its descriptor can be reused; samples still waiting to be replayed
+// for it are dropped and its controller slots freed
+void
+onDisconnect(Socket socket)
+{
+    setWantsFeedback(socket, false);
+    unlit.erase(socket);
+    decoders.erase(socket);
+    carries.erase(socket);
+    replayer.withdraw((uint32_t)socket, [](uint8_t, const PadSample&) { });
+    // after the withdraw, so no replayed sample writes to them anymore
+    controllers.release((uint32_t)socket);
+}
+
+// a hot restart carries a connection's decoder, the legacy frame its last
+// read ended in, its controller slots, the samples still waiting to be
+// replayed, whether it takes feedback and whether its pad is still to be
+// lit over to the new process; both run on the connection's shard thread,
+// where its decoder lives. The decoder goes length prefixed, so the rest
+// still loads when its state doesn't.
+void
+saveConnection(Socket socket, std::string& out)
+{
+    HandoffWriter writer(out);
+    std::string decoderState;
+    auto it = decoders.find(socket);
+    if (it != decoders.end()) {
+        HandoffWriter state(decoderState);
+        it->second.save(state);
+        decoders.erase(it);
+    }
+    writer.putBytes(decoderState.data(), decoderState.size());
+
+    auto carry = carries.find(socket);
+    if (carry != carries.end())
+        writer.putBytes(carry->second.data, carry->second.len);
+    else
+        writer.putBytes(nullptr, 0);
+
+    std::vector<std::pair<uint8_t, ControllerState>> slots;
+    controllers.forConnection((uint32_t)socket, [&slots](uint8_t pad, const ControllerState& state) {
+        slots.emplace_back(pad, state);
+    });
+    writer.put((uint32_t)slots.size());
+    for (auto& slot : slots) {
+        writer.put(slot.first);
+        writer.put(slot.second);
+    }
+
+    std::vector<std::pair<uint8_t, PadSample>> pending;
+    replayer.withdraw((uint32_t)socket, [&pending](uint8_t pad, const PadSample& sample) {
+        pending.emplace_back(pad, sample);
+    });
+    writer.put((uint32_t)pending.size());
+    for (auto& sample : pending) {
+        writer.put(sample.first);
+        writer.put(sample.second);
+    }
+
+    writer.put((uint8_t)wantsFeedback(socket));
+    setWantsFeedback(socket, false);
+    writer.put((uint8_t)(unlit.count(socket) != 0));
+}
+
+void
+loadConnection(Socket socket, const char* data, size_t len)
+{
+    ALLOC_SCOPE("connection-setup");
+    HandoffReader reader(data, len);
+    const char* state = nullptr;
+    size_t stateLen = 0;
+    if (!reader.getBytes(state, stateLen)) {
+        DBGOUT("handoff - connection state cut short, dropping it");
+        return;
+    }
+    if (stateLen) {
+        HandoffReader decoderReader(state, stateLen);
+        if (!decoders[socket].load(decoderReader)) {
+            DBGOUT("handoff - lost a decoder's state, waiting for a keyframe");
+            decoders.erase(socket);
+        }
+    }
+
+    const char* carried = nullptr;
+    size_t carriedLen = 0;
+    if (reader.getBytes(carried, carriedLen) && carriedLen) {
+        if (carriedLen <= LEGACY_MAX_CARRY) {
+            auto& carry = carries[socket];
+            memcpy(carry.data, carried, carriedLen);
+            carry.len = carriedLen;
+        } else {
+            DBGOUT("handoff - dropping an oversized legacy carry");
+        }
+    }
+
+    uint32_t count = 0;
+    reader.get(count);
+    for (uint32_t n = 0; n < count && reader.ok(); ++n) {
+        uint8_t pad;
+        ControllerState state;
+        if (!reader.get(pad) || !reader.get(state))
+            break;
+        int slot = controllers.acquire((uint32_t)socket, pad);
+        if (slot >= 0)
+            controllers.write(slot, state);
+    }
+
+    count = 0;
+    reader.get(count);
+    for (uint32_t n = 0; n < count && reader.ok(); ++n) {
+        uint8_t pad;
+        PadSample sample;
+        if (!reader.get(pad) || !reader.get(sample))
+            break;
+        replayer.submit((uint32_t)socket, pad, &sample, 1);
+    }
+
+    uint8_t feedback = 0;
+    if (reader.get(feedback))
+        setWantsFeedback(socket, feedback != 0);
+    uint8_t dark = 0;
+    if (reader.get(dark) && dark)
+        unlit.insert(socket);
+}
+
+#ifdef _WIN32
+#include <conio.h>
+#else
+#include <signal.h>
+#endif
+#define PI 3.14159f
+#define EPSILON 0.5f
+#define DECEL 0.8f
+
+#ifndef _WIN32
+// SIGINT and SIGTERM, and SIGUSR1 asking for reports, are only ever taken
+// by waitForQuit, so this has to run before any other thread is started
+void
+blockQuitSignals(sigset_t& set)
+{
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, nullptr);
+}
+#endif
+
+// returns on a key press, or on SIGINT/SIGTERM when running headless
+void
+waitForQuit()
+{
+#ifdef _WIN32
+    getch();
+#else
+    sigset_t set;
+    blockQuitSignals(set);
+    int sig;
+    // SIGUSR1 dumps the performance counters and keeps running
+    while (sigwait(&set, &sig) == 0 && sig == SIGUSR1) {
+        PERF_REPORT();
+    }
+    DBGOUT("caught signal %d, shutting down...", sig);
+#endif
+}
+
+// makes waitForQuit return as if a signal had come in
+void
+requestQuit()
+{
+#ifndef _WIN32
+    kill(getpid(), SIGTERM);
+#endif
+}
+
+int
+runRelay(Networker& nw)
+{
+    if (nw.startRelay(DEFAULT_PORT, DEFAULT_RELAY_PORT) != 0)
+        return 1;
+
+    auto input_thread = std::thread([&nw]() {
+        waitForQuit();
+        nw.closeRelay();
+    });
+
+    int ret = nw.runRelay();
+    input_thread.join();
+    return ret;
+}
+
+int
+runNetEm(Networker& nw, const NetEmConfig& config,
+         const std::string& targetHost, PortNumber targetPort)
+{
+    if (nw.startNetEm(config, DEFAULT_NETEM_PORT, targetHost, targetPort) != 0)
+        return 1;
+
+    auto input_thread = std::thread([&nw]() {
+        waitForQuit();
+        nw.closeNetEm();
+    });
+
+    int ret = nw.runNetEm();
+    input_thread.join();
+    return ret;
+}
+
+// parses the emulator's options, returns false on an unknown distribution
+bool
+parseNetEmOption(const char* name, const char* value, NetEmConfig& config,
+                 std::string& targetHost, PortNumber& targetPort)
+{
+    if (strcmp(name, "--target") == 0) {
+        std::string target(value);
+        auto colon = target.rfind(':');
+        targetHost = target.substr(0, colon);
+        if (colon != std::string::npos)
+            targetPort = (PortNumber)atoi(target.c_str() + colon + 1);
+    } else if (strcmp(name, "--delay") == 0) {
+        config.delayMs = atof(value);
+    } else if (strcmp(name, "--jitter") == 0) {
+        config.jitterMs = atof(value);
+    } else if (strcmp(name, "--dist") == 0) {
+        if (strcmp(value, "uniform") == 0)
+            config.distribution = NetEmDistribution::Uniform;
+        else if (strcmp(value, "normal") == 0)
+            config.distribution = NetEmDistribution::Normal;
+        else if (strcmp(value, "pareto") == 0)
+            config.distribution = NetEmDistribution::Pareto;
+        else
+            return false;
+    } else if (strcmp(name, "--loss") == 0) {
+        config.lossRate = atof(value);
+    } else if (strcmp(name, "--burst") == 0) {
+        config.lossBurst = atof(value);
+    } else if (strcmp(name, "--retransmit") == 0) {
+        config.retransmitMs = atof(value);
+    } else if (strcmp(name, "--reorder") == 0) {
+        config.reorderRate = atof(value);
+    } else if (strcmp(name, "--rate") == 0) {
+        config.bandwidthKbps = atof(value);
+    } else if (strcmp(name, "--seed") == 0) {
+        config.seed = strtoull(value, nullptr, 10);
+    }
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+#ifndef _WIN32
+    sigset_t quitSignals;
+    blockQuitSignals(quitSignals);
+#endif
+    Networker nw;
+    std::atomic<bool> running(true);
+    int ret = 0;
+    bool sharded = false;
+    int shards = 0;
+    int idleMs = 0;
+    std::string handoffPath;
+    bool record = false;
+    bool netem = false;
+    NetEmConfig netemConfig;
+    std::string netemHost = "127.0.0.1";
+    PortNumber netemPort = DEFAULT_PORT;
+
+    for (int i = 1; i < argc; ++i) {
+        // republish controller streams to subscribers instead of injecting them
+        if (strcmp(argv[i], "--relay") == 0)
+            return runRelay(nw);
+        // accept a client on this machine through shared memory
+        if (strcmp(argv[i], "--shm") == 0)
+            nw.setTransport(Transport::SharedMemory);
+        // serve many clients from N reactor threads, 0 for one per core
+        if (strcmp(argv[i], "--shards") == 0 && i + 1 < argc) {
+            sharded = true;
+            shards = atoi(argv[++i]);
+        }
+        // with --shards, drop clients that have sent nothing for S seconds
+        if (strcmp(argv[i], "--idle") == 0 && i + 1 < argc)
+            idleMs = atoi(argv[++i]) * 1000;
+        // with --shards, take over from the server serving handoffs on PATH
+        // if there is one, then serve them for the next restart
+        if (strcmp(argv[i], "--handoff") == 0 && i + 1 < argc)
+            handoffPath = argv[++i];
+        // keep injected input in memory instead of sending it to the system
+        if (strcmp(argv[i], "--record") == 0)
+            record = true;
+        // spin before blocking on reads and tune the socket for latency,
+        // for a machine with a core to spare; see LatencyProfile.hpp
+        if (strcmp(argv[i], "--low-latency") == 0)
+            nw.setLatencyProfile(lowLatencyProfile());
+        // with --low-latency, spin for US microseconds before blocking
+        if (strcmp(argv[i], "--spin") == 0 && i + 1 < argc)
+            nw.setLatencyProfile(lowLatencyProfile((uint32_t)atoi(argv[++i])));
+        // append every byte clients send to a journal in DIR, see Journal.hpp
+        if (strcmp(argv[i], "--journal") == 0 && i + 1 < argc && journalOpen(argv[++i]) != 0)
+            return 1;
+        // proxy clients to --target through an emulated network instead
+        if (strcmp(argv[i], "--netem") == 0) {
+            netem = true;
+        } else if (netem && strncmp(argv[i], "--", 2) == 0 && i + 1 < argc) {
+            auto name = argv[i++];
+            if (!parseNetEmOption(name, argv[i], netemConfig, netemHost, netemPort))
+                return 1;
+        }
+    }
+
+    if (netem)
+        return runNetEm(nw, netemConfig, netemHost, netemPort);
+
+    // only the shards keep the timers idle connections are dropped on
+    if (idleMs && !sharded) {
+        DBGOUT("--idle needs --shards");
+        return 1;
+    }
+
+    injector = createInjector(record);
+    DBGOUT("injecting through %s", injector->name());
+
+    feedbackNet = &nw;
+    nw.setHandshakeCb(onHandshake);
+    nw.setDisconnectCb(onDisconnect);
+    replayer.start();
+
+    auto network_thread = std::thread([&nw, &ret, &running, sharded, shards, idleMs, handoffPath]() {
+        applyThreadRole(ThreadRole::Network);
+        ALLOC_THREAD_NAME("network");
+        auto cb = [&nw](Socket& socket, const char* recvbuf, int recvResult) {
+            recvCb(nw, socket, recvbuf, recvResult);
+        };
+        if (sharded) {
+            nw.setShardedHandoffHooks({ saveConnection, loadConnection });
+            auto takeOver = TakeOver::Nobody;
+            if (!handoffPath.empty())
+                takeOver = nw.takeOverShardedServer(handoffPath, idleMs);
+            if (takeOver == TakeOver::Failed) {
+                ret = 1;
+                requestQuit();
+                return;
+            }
+            if (takeOver == TakeOver::Nobody &&
+                (ret = nw.startShardedServer(DEFAULT_PORT, shards, idleMs)) != 0) {
+                requestQuit();
+                return;
+            }
+            if (!handoffPath.empty())
+                nw.serveShardedHandoff(handoffPath);
+            ret = nw.runShardedServer(cb);
+            // every client is the new server's now, or the shards failed
+            if (ret != 0 || nw.shardedServerHandedOff())
+                requestQuit();
+            return;
+        }
+        // nothing else would wake main up when the server can't carry on
+        if ((ret = nw.startServer(DEFAULT_PORT)) != 0) {
+            requestQuit();
+            return;
+        }
+        do {
+            ret = (nw.runServer(cb) != 0);
+        } while (ret == 0 && running);
+        if (ret != 0 && running)
+            requestQuit();
+    });
+
+    auto mouse_thread = std::thread([&running]() {
+        applyThreadRole(ThreadRole::Inject);
+        ALLOC_THREAD_NAME("mouse");
+        // per slot: the last pointer move seen and its decaying velocity
+        std::array<uint32_t, STATE_TABLE_SLOTS> moves {};
+        std::array<float, STATE_TABLE_SLOTS> vx {}, vy {};
+        float carryX = 0, carryY = 0;
+        while (running) {
+            ALLOC_STEADY_SCOPE("mouse");
+            float dx = 0, dy = 0;
+            controllers.forEachLive([&](int slot, const ControllerState& state) {
+                if (state.moves != moves[slot]) {
+                    moves[slot] = state.moves;
+                    vx[slot] = (float)state.mx;
+                    vy[slot] = (float)state.my;
+                }
+                vx[slot] = fabs(vx[slot]) < EPSILON ? 0.0f : vx[slot] * DECEL;
+                vy[slot] = fabs(vy[slot]) < EPSILON ? 0.0f : vy[slot] * DECEL;
+                dx += vx[slot] + state.lx / JOY_SCALE;
+                dy += vy[slot] + state.ly / JOY_SCALE;
+            });
+            // keep the sub-pixel remainder so slow stick motion still moves
+            carryX += dx;
+            carryY += dy;
+            int px = static_cast<int>(carryX);
+            int py = static_cast<int>(carryY);
+            carryX -= px;
+            carryY -= py;
+            //DBGOUT("mousemove   xv: %0.2f - yv: %0.2f", dx, dy);
+            if (px || py)
+                injector->moveRelative(px, py);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        DBGOUT("done");
+    });
+
+    auto input_thread = std::thread([&nw, &running]() {
+        waitForQuit();
+        nw.closeShardedServer();
+        nw.closeServer();
+        running = false;
+    });
+
+    network_thread.join();
+    mouse_thread.join();
+    input_thread.join();
+    replayer.stop();
+    // the writers go away with the journal
+    nw.joinTasks();
+    journalClose();
+    ALLOC_REPORT();
+    PERF_REPORT();
+    latencyReport();
+    traceDump();
+
+#ifdef _WIN32
+    system("pause");
+#endif
+
+    return ret;
+}
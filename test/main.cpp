@@ -0,0 +1,698 @@
+/*
+*  Author: Andreas Traczyk <andreas.traczyk@savoirfairelinux.com>
+*
+*  This program is free software; you can redistribute it and/or modify
+*  it under the terms of the GNU General Public License as published by
+*  the Free Software Foundation; either version 3 of the License, or
+*  (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+*
+*  You should have received a copy of the GNU General Public License
+*  along with this program. If not, see <https://www.gnu.org/licenses/>.
+*/
+
+
+// Unit tests for the header-only pieces in common/. Each test is a
+// function of CHECKs; a failed check prints where it was and the run
+// carries on, and the exit status is the number of tests that failed.
+//   tests [SUBSTRING]    only runs the tests whose name contains SUBSTRING
+
+#include "Log.hpp"
+#include "Frame.hpp"
+#include "LegacyParser.hpp"
+#include "KeyMap.hpp"
+#include "Timer.hpp"
+#include "Client.hpp"
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <map>
+
+#include <stdio.h>
+#include <string.h>
+
+using namespace Network;
+
+static int checkFailures = 0;
+
+#define CHECK(cond)                                                     \
+    do {                                                                \
+        if (!(cond)) {                                                  \
+            printf("  %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++checkFailures;                                            \
+        }                                                               \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                  \
+    do {                                                                \
+        auto _a = (a);                                                  \
+        auto _b = (b);                                                  \
+        if (!(_a == _b)) {                                              \
+            printf("  %s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n",  \
+                   __FILE__, __LINE__, #a, #b, (long long)_a, (long long)_b); \
+            ++checkFailures;                                            \
+        }                                                               \
+    } while (0)
+
+// framing
+
+struct Message {
+    Channel channel;
+    uint8_t stream;
+    std::string data;
+};
+
+// feeds stream to one reader cut at the given offsets, returns every
+// message it completed and whatever came out of the legacy path; feed's
+// result goes to ok
+std::vector<Message>
+readInPieces(FrameReader& reader, const std::string& stream, const std::vector<size_t>& cuts,
+             std::string* legacy = nullptr, bool* ok = nullptr)
+{
+    std::vector<Message> out;
+    auto onMessage = [&out](Channel channel, uint8_t stream, const char* data, int len) {
+        out.push_back({ channel, stream, std::string(data, len) });
+    };
+    auto onLegacy = [legacy](const char* data, int len) {
+        if (legacy)
+            legacy->append(data, len);
+    };
+    bool fed = true;
+    size_t from = 0;
+    for (auto cut : cuts) {
+        fed = fed && reader.feed(stream.data() + from, (int)(cut - from), onMessage, onLegacy);
+        from = cut;
+    }
+    fed = fed && reader.feed(stream.data() + from, (int)(stream.size() - from), onMessage, onLegacy);
+    if (ok)
+        *ok = fed;
+    return out;
+}
+
+// a message of n bytes that shows where a chunk went missing or moved
+std::string
+pattern(size_t n, char seed)
+{
+    std::string data(n, 0);
+    for (size_t i = 0; i < n; ++i)
+        data[i] = (char)(seed + i * 7);
+    return data;
+}
+
+// a message three chunks long, cut in two at every offset, comes out whole
+// and once, next to the single frame message that follows it
+void
+testFrameChunkReassembly()
+{
+    auto bulk = pattern(2 * FRAME_MAX_CHUNK + 100, 'a');
+    std::string stream;
+    encodeFrames(stream, Channel::Text, 3, bulk.data(), bulk.size());
+    encodeFrames(stream, Channel::Button, 0, "b1", 2);
+    for (size_t cut = 0; cut <= stream.size(); ++cut) {
+        FrameReader reader;
+        bool ok = false;
+        auto got = readInPieces(reader, stream, { cut }, nullptr, &ok);
+        CHECK(ok);
+        CHECK_EQ(got.size(), (size_t)2);
+        if (got.size() != 2)
+            continue;
+        CHECK(got[0].channel == Channel::Text);
+        CHECK_EQ(got[0].stream, 3);
+        CHECK(got[0].data == bulk);
+        CHECK(got[1].channel == Channel::Button);
+        CHECK(got[1].data == "b1");
+    }
+}
+
+// the mux sends the most urgent channel first, cutting into a bulk message
+// between chunks, and the reader puts both back together
+void
+testFrameMuxPriority()
+{
+    ChannelMux mux;
+    auto bulk = pattern(3 * FRAME_MAX_CHUNK, 'k');
+    mux.push(Channel::Text, bulk.data(), bulk.size());
+    char frame[FRAME_MAX_LEN];
+    std::string stream;
+    stream.append(frame, mux.next(frame));
+    mux.push(Channel::Motion, "m", 1);
+    mux.push(Channel::Button, "b", 1);
+    CHECK_EQ(mux.pendingBytes(), bulk.size() - FRAME_MAX_CHUNK + 2);
+    while (auto len = mux.next(frame))
+        stream.append(frame, len);
+    CHECK(mux.empty());
+
+    FrameReader reader;
+    auto got = readInPieces(reader, stream, {});
+    CHECK_EQ(got.size(), (size_t)3);
+    if (got.size() == 3) {
+        CHECK(got[0].channel == Channel::Button);
+        CHECK(got[1].channel == Channel::Motion);
+        CHECK(got[2].channel == Channel::Text);
+        CHECK(got[2].data == bulk);
+    }
+
+    // a raised priority wins over the default order
+    mux.setPriority(Channel::Text, 0);
+    mux.setPriority(Channel::Control, 1);
+    mux.push(Channel::Control, "p", 1);
+    mux.push(Channel::Text, "t", 1);
+    CHECK_EQ(mux.next(frame), (size_t)(FRAME_HEADER_LEN + 1));
+    CHECK_EQ(frame[FRAME_HEADER_LEN], 't');
+}
+
+// a peer that doesn't open with the magic byte is raw text from then on,
+// magic bytes later in the stream included
+void
+testFrameLegacyFallback()
+{
+    std::string stream = "k:hello";
+    stream += (char)FRAME_MAGIC;
+    stream += "m:1,2";
+    FrameReader reader;
+    std::string legacy;
+    bool ok = false;
+    auto got = readInPieces(reader, stream, { 3, 7 }, &legacy, &ok);
+    CHECK(ok);
+    CHECK(got.empty());
+    CHECK(reader.mode() == FrameReader::Mode::Legacy);
+    CHECK(legacy == stream);
+}
+
+// a channel can take FRAME_MAX_MESSAGE, one byte more drops the connection
+// before it is buffered
+void
+testFrameOversize()
+{
+    auto biggest = pattern(FRAME_MAX_MESSAGE, 'z');
+    std::string stream;
+    encodeFrames(stream, Channel::Text, 0, biggest.data(), biggest.size());
+    FrameReader reader;
+    bool ok = false;
+    auto got = readInPieces(reader, stream, {}, nullptr, &ok);
+    CHECK(ok);
+    CHECK_EQ(got.size(), (size_t)1);
+
+    // non-FIN chunks forever, as a hostile peer would send them
+    std::string endless;
+    auto chunk = pattern(FRAME_MAX_CHUNK, 'e');
+    char header[FRAME_HEADER_LEN];
+    encodeFrameHeader(header, { Channel::Motion, 0, 0, (uint16_t)FRAME_MAX_CHUNK });
+    for (size_t sent = 0; sent <= FRAME_MAX_MESSAGE; sent += FRAME_MAX_CHUNK) {
+        endless.append(header, FRAME_HEADER_LEN);
+        endless += chunk;
+    }
+    FrameReader hostile;
+    got = readInPieces(hostile, endless, {}, nullptr, &ok);
+    CHECK(!ok);
+    CHECK(got.empty());
+}
+
+// legacy parser
+
+struct Joystick {
+    int pad, lx, ly, b0, b1;
+};
+
+// a frame exactly as the pre-framing client sends it
+std::string
+legacyFrame(const Joystick& j)
+{
+    char buf[128];
+    snprintf(buf, sizeof(buf), "'{'j%d':{'lx':'%d','ly':'%d','b0':'%d','b1':'%d'}}'",
+             j.pad, j.lx, j.ly, j.b0, j.b1);
+    return buf;
+}
+
+// feeds stream to one connection's parser in the given pieces and returns
+// every joystick message it emitted
+std::vector<Joystick>
+parseInPieces(LegacyParser& parser, const std::string& stream, const std::vector<size_t>& cuts)
+{
+    std::vector<Joystick> out;
+    LegacyCarry carry;
+    size_t from = 0;
+    auto sink = [&out](const LegacyMessage& msg) {
+        if (msg.kind == LegacyKind::Joystick)
+            out.push_back({ msg.pad, msg.values[LEGACY_LX], msg.values[LEGACY_LY],
+                            msg.values[LEGACY_B0], msg.values[LEGACY_B1] });
+    };
+    for (auto cut : cuts) {
+        parser.parse(stream.data() + from, cut - from, carry, sink);
+        from = cut;
+    }
+    parser.parse(stream.data() + from, stream.size() - from, carry, sink);
+    return out;
+}
+
+void
+checkJoysticks(const std::vector<Joystick>& got, const std::vector<Joystick>& want)
+{
+    CHECK_EQ(got.size(), want.size());
+    for (size_t i = 0; i < std::min(got.size(), want.size()); ++i) {
+        CHECK_EQ(got[i].pad, want[i].pad);
+        CHECK_EQ(got[i].lx, want[i].lx);
+        CHECK_EQ(got[i].ly, want[i].ly);
+        CHECK_EQ(got[i].b0, want[i].b0);
+        CHECK_EQ(got[i].b1, want[i].b1);
+    }
+}
+
+std::vector<ScanLevel>
+scanLevels()
+{
+    std::vector<ScanLevel> levels;
+    for (auto level : { ScanLevel::Scalar, ScanLevel::SSE42, ScanLevel::AVX2 }) {
+        if (level <= detectScanLevel())
+            levels.push_back(level);
+    }
+    return levels;
+}
+
+// frames back to back without separators, cut in two at every offset
+void
+testLegacySplitFrames()
+{
+    std::vector<Joystick> want = {
+        { 0, -12000, 345, 1, 0 }, { 0, 7, -32768, 1, 1 }, { 1, 0, 0, 0, 0 }
+    };
+    std::string stream;
+    for (auto& j : want)
+        stream += legacyFrame(j);
+    for (auto level : scanLevels()) {
+        LegacyParser parser(level);
+        for (size_t cut = 0; cut <= stream.size(); ++cut)
+            checkJoysticks(parseInPieces(parser, stream, { cut }), want);
+    }
+}
+
+// one byte per read, the worst a stream can be cut up
+void
+testLegacyByteAtATime()
+{
+    std::vector<Joystick> want = { { 0, 100, -100, 0, 1 }, { 0, 200, -200, 1, 0 } };
+    std::string stream = legacyFrame(want[0]) + "\n" + legacyFrame(want[1]);
+    std::vector<size_t> cuts;
+    for (size_t i = 1; i < stream.size(); ++i)
+        cuts.push_back(i);
+    LegacyParser parser;
+    checkJoysticks(parseInPieces(parser, stream, cuts), want);
+}
+
+// a broken frame costs only itself, even with no separator after it
+void
+testLegacyResync()
+{
+    std::vector<Joystick> want = { { 0, 1, 2, 1, 0 }, { 0, 3, 4, 0, 0 } };
+    std::string stream = "'{'j0':{'lx':'5','l" + legacyFrame(want[0]) +
+                         "garbage" + legacyFrame(want[1]);
+    LegacyParser parser;
+    checkJoysticks(parseInPieces(parser, stream, {}), want);
+
+    // a frame cut short by a separator is dropped, the next one isn't
+    stream = "'{'j0':{'lx':'5'\n" + legacyFrame(want[0]);
+    checkJoysticks(parseInPieces(parser, stream, {}), { want[0] });
+}
+
+// the stateless overload drops a trailing partial frame instead of
+// emitting it
+void
+testLegacyNoPartialFrames()
+{
+    auto frame = legacyFrame({ 0, 10, 20, 1, 0 });
+    LegacyParser parser;
+    for (size_t cut = 1; cut < frame.size() - 2; ++cut) {
+        size_t joysticks = 0;
+        parser.parse(frame.data(), cut, [&joysticks](const LegacyMessage& msg) {
+            joysticks += msg.kind == LegacyKind::Joystick;
+        });
+        CHECK_EQ(joysticks, 0u);
+    }
+}
+
+void
+testLegacyRemoteMessages()
+{
+    std::string stream = "k:hello\nm:-3,7\nld\nlu";
+    std::vector<LegacyKind> kinds;
+    LegacyParser parser;
+    LegacyCarry carry;
+    parser.parse(stream.data(), stream.size(), carry, [&kinds](const LegacyMessage& msg) {
+        kinds.push_back(msg.kind);
+        if (msg.kind == LegacyKind::Text)
+            CHECK(std::string(msg.text, msg.textLen) == "hello");
+        if (msg.kind == LegacyKind::MouseMove) {
+            CHECK_EQ(msg.values[0], -3);
+            CHECK_EQ(msg.values[1], 7);
+        }
+    });
+    CHECK(kinds == std::vector<LegacyKind>({ LegacyKind::Text, LegacyKind::MouseMove,
+                                             LegacyKind::MouseDown, LegacyKind::MouseUp }));
+    CHECK_EQ(carry.len, 0u);
+}
+
+// numbers longer than an int saturate instead of overflowing, and the
+// ones that just fit come through exactly
+void
+testLegacyOverlongNumbers()
+{
+    std::string digits(40, '9');
+    std::string stream = "'{'j0':{'lx':'" + digits + "','ly':'-" + digits +
+                         "','b0':'2147483647','b1':'-2147483648'}}'\nm:" + digits + ",-" + digits;
+    std::vector<Joystick> joysticks;
+    std::vector<int> moves;
+    LegacyParser parser;
+    LegacyCarry carry;
+    parser.parse(stream.data(), stream.size(), carry, [&](const LegacyMessage& msg) {
+        if (msg.kind == LegacyKind::Joystick)
+            joysticks.push_back({ msg.pad, msg.values[LEGACY_LX], msg.values[LEGACY_LY],
+                                  msg.values[LEGACY_B0], msg.values[LEGACY_B1] });
+        if (msg.kind == LegacyKind::MouseMove)
+            moves = { msg.values[0], msg.values[1] };
+    });
+    checkJoysticks(joysticks, { { 0, INT_MAX, INT_MIN, INT_MAX, INT_MIN } });
+    CHECK(moves == std::vector<int>({ INT_MAX, INT_MIN }));
+}
+
+// key map
+
+// VkKeyScanEx style answers for two made-up layouts: on layout 1 'A' is
+// shift+a and '@' needs ctrl+alt, layout 2 puts 'a' where 'q' is
+int16_t
+fakeKeyLookup(char c, LayoutId layout)
+{
+    if (c >= 'a' && c <= 'z')
+        return (int16_t)(layout == 2 && c == 'a' ? 'q' : c);
+    if (c >= 'A' && c <= 'Z')
+        return (int16_t)(KEYMOD_SHIFT << 8 | (c - 'A' + 'a'));
+    if (c == '@')
+        return (int16_t)((KEYMOD_CTRL | KEYMOD_ALT) << 8 | '2');
+    // a bit above the modifiers, like VkKeyScanEx's hankaku flag
+    if (c == '~')
+        return (int16_t)(0x08 << 8 | '`');
+    return -1;
+}
+
+enum FakeModifierKey : uint16_t {
+    FAKE_SHIFT = 0x100,
+    FAKE_CTRL,
+    FAKE_ALT
+};
+
+void
+testKeyMapTranslate()
+{
+    int lookups = 0;
+    KeyTranslationTable table([&lookups](char c, LayoutId layout) {
+        ++lookups;
+        return fakeKeyLookup(c, layout);
+    }, { FAKE_SHIFT, FAKE_CTRL, FAKE_ALT });
+    table.setLayout(1);
+    CHECK_EQ(lookups, 256);
+
+    auto& a = table.translate('a');
+    CHECK(a.valid);
+    CHECK_EQ(a.keycode, 'a');
+    CHECK_EQ(a.modifiers, KEYMOD_NONE);
+    auto& upper = table.translate('A');
+    CHECK(upper.valid);
+    CHECK_EQ(upper.keycode, 'a');
+    CHECK_EQ(upper.modifiers, KEYMOD_SHIFT);
+    auto& at = table.translate('@');
+    CHECK_EQ(at.keycode, '2');
+    CHECK_EQ(at.modifiers, KEYMOD_CTRL | KEYMOD_ALT);
+    auto& tilde = table.translate('~');
+    CHECK(tilde.valid);
+    CHECK_EQ(tilde.modifiers, KEYMOD_NONE);
+    CHECK(!table.translate('#').valid);
+
+    // tables are built once per layout
+    table.setLayout(1);
+    CHECK_EQ(lookups, 256);
+    table.setLayout(2);
+    CHECK_EQ(lookups, 512);
+    CHECK_EQ(table.translate('a').keycode, 'q');
+    table.setLayout(1);
+    CHECK_EQ(lookups, 512);
+    CHECK_EQ(table.translate('a').keycode, 'a');
+}
+
+void
+testKeyMapModifiers()
+{
+    KeyTranslationTable table(fakeKeyLookup, { FAKE_SHIFT, FAKE_CTRL, FAKE_ALT });
+    std::vector<KeyEvent> events;
+    CHECK_EQ(table.buildEvents("a", 1, events), 0u);
+    table.setLayout(1);
+
+    // shift held across "AB", dropped for "c", then ctrl+alt for '@';
+    // modifiers go down in order and come up in reverse, untypable
+    // characters are skipped
+    const char* text = "AB#c@";
+    CHECK_EQ(table.buildEvents(text, (int)strlen(text), events), 14u);
+    std::vector<std::pair<uint16_t, bool>> want = {
+        { FAKE_SHIFT, false }, { 'a', false }, { 'a', true }, { 'b', false }, { 'b', true },
+        { FAKE_SHIFT, true }, { 'c', false }, { 'c', true },
+        { FAKE_CTRL, false }, { FAKE_ALT, false }, { '2', false }, { '2', true },
+        { FAKE_ALT, true }, { FAKE_CTRL, true }
+    };
+    CHECK_EQ(events.size(), want.size());
+    for (size_t i = 0; i < std::min(events.size(), want.size()); ++i) {
+        CHECK_EQ(events[i].keycode, want[i].first);
+        CHECK_EQ(events[i].up, want[i].second);
+    }
+
+    // straight from one modifier set to another, appended after what's there
+    events.clear();
+    events.push_back({ 1, false });
+    CHECK_EQ(table.buildEvents("A@", 2, events), 10u);
+    std::vector<std::pair<uint16_t, bool>> switched = {
+        { 1, false }, { FAKE_SHIFT, false }, { 'a', false }, { 'a', true },
+        { FAKE_SHIFT, true }, { FAKE_CTRL, false }, { FAKE_ALT, false },
+        { '2', false }, { '2', true }, { FAKE_ALT, true }, { FAKE_CTRL, true }
+    };
+    CHECK_EQ(events.size(), switched.size());
+    for (size_t i = 0; i < std::min(events.size(), switched.size()); ++i) {
+        CHECK_EQ(events[i].keycode, switched[i].first);
+        CHECK_EQ(events[i].up, switched[i].second);
+    }
+}
+
+// timer wheel
+
+// one microsecond ticks from 0, so a deadline is the tick it fires in
+struct Fired {
+    uint64_t data;
+    uint64_t now;
+};
+
+// advances to every time in probes, in order, and returns what fired when
+std::vector<Fired>
+advanceThrough(TimerWheel& wheel, std::vector<uint64_t> probes)
+{
+    std::sort(probes.begin(), probes.end());
+    std::vector<Fired> fired;
+    for (auto now : probes)
+        wheel.advance(now, [&](uint64_t data) { fired.push_back({ data, now }); });
+    return fired;
+}
+
+// deadlines on both sides of every level boundary fire in the tick they are
+// due, not before, after cascading down however many levels they sit above
+void
+testTimerWheelCascade()
+{
+    TimerWheel wheel(0, 1);
+    std::vector<uint64_t> deadlines;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; ++level) {
+        uint64_t boundary = 1ull << (level * TIMER_WHEEL_BITS);
+        for (uint64_t d : { boundary - 1, boundary, boundary + 1,
+                            3 * boundary + 7, 2 * boundary - 1 })
+            deadlines.push_back(d);
+    }
+    deadlines.push_back(1);
+    deadlines.push_back(TIMER_WHEEL_SLOTS / 2);
+    std::sort(deadlines.begin(), deadlines.end());
+    deadlines.erase(std::unique(deadlines.begin(), deadlines.end()), deadlines.end());
+
+    std::vector<uint64_t> probes;
+    for (auto d : deadlines) {
+        wheel.schedule(d, d);
+        probes.push_back(d - 1);
+        probes.push_back(d);
+    }
+    CHECK_EQ(wheel.size(), deadlines.size());
+
+    auto fired = advanceThrough(wheel, probes);
+    CHECK_EQ(fired.size(), deadlines.size());
+    for (size_t i = 0; i < std::min(fired.size(), deadlines.size()); ++i) {
+        CHECK_EQ(fired[i].data, deadlines[i]);
+        CHECK_EQ(fired[i].now, deadlines[i]);
+    }
+    CHECK_EQ(wheel.size(), (size_t)0);
+    CHECK_EQ(wheel.timeout(deadlines.back()), -1);
+}
+
+// a cancelled timer never fires wherever it sits, including after it came
+// down a level, and its handle stays dead once the node is reused
+void
+testTimerWheelCancel()
+{
+    TimerWheel wheel(0, 1);
+    uint64_t far = 1ull << (2 * TIMER_WHEEL_BITS);
+    auto near = wheel.schedule(10, 1);
+    auto cascaded = wheel.schedule(far + 5, 2);
+    auto kept = wheel.schedule(far + 6, 3);
+    auto top = wheel.schedule(1ull << (3 * TIMER_WHEEL_BITS), 4);
+    CHECK_EQ(wheel.size(), (size_t)4);
+
+    CHECK(wheel.cancel(near));
+    CHECK(!wheel.cancel(near));
+    CHECK(wheel.cancel(top));
+    CHECK_EQ(wheel.size(), (size_t)2);
+
+    // far + 5 has been brought down to level 0 by now
+    auto fired = advanceThrough(wheel, { far + 1 });
+    CHECK(fired.empty());
+    CHECK(wheel.cancel(cascaded));
+
+    // the freed nodes are reused, the old handles must not touch them
+    auto reused = wheel.schedule(far + 8, 5);
+    CHECK(!wheel.cancel(near));
+    CHECK(!wheel.cancel(cascaded));
+
+    fired = advanceThrough(wheel, { far + 6, far + 8 });
+    CHECK_EQ(fired.size(), (size_t)2);
+    if (fired.size() == 2) {
+        CHECK_EQ(fired[0].data, (uint64_t)3);
+        CHECK_EQ(fired[1].data, (uint64_t)5);
+    }
+    CHECK(!wheel.cancel(kept));
+    CHECK(!wheel.cancel(reused));
+    CHECK_EQ(wheel.size(), (size_t)0);
+}
+
+// timers re-armed from their own expiry right before and on a wrap of each
+// level, the way heartbeats are, keep firing on time
+void
+testTimerWheelRearmAtWrap()
+{
+    TimerWheel wheel(0, 1);
+    std::map<uint64_t, uint64_t> period;
+    std::map<uint64_t, std::vector<uint64_t>> due;
+    uint64_t id = 0;
+    for (int level = 1; level < TIMER_WHEEL_LEVELS - 1; ++level) {
+        uint64_t wrap = 1ull << (level * TIMER_WHEEL_BITS);
+        for (uint64_t first : { wrap - 1, wrap }) {
+            for (uint64_t step : { (uint64_t)1, wrap - 1, wrap, wrap + 1 }) {
+                period[id] = step;
+                due[id].push_back(first);
+                wheel.schedule(first, id++);
+            }
+        }
+    }
+    // every timer fires four times; the last rounds are the reference
+    std::vector<uint64_t> probes;
+    for (auto& p : period) {
+        auto& d = due[p.first];
+        while (d.size() < 4)
+            d.push_back(d.back() + p.second);
+        for (auto t : d) {
+            probes.push_back(t - 1);
+            probes.push_back(t);
+        }
+    }
+    std::sort(probes.begin(), probes.end());
+    probes.erase(std::unique(probes.begin(), probes.end()), probes.end());
+
+    std::map<uint64_t, std::vector<uint64_t>> fired;
+    for (auto now : probes) {
+        wheel.advance(now, [&](uint64_t data) {
+            fired[data].push_back(now);
+            if (fired[data].size() < 4)
+                wheel.schedule(now + period[data], data);
+        });
+    }
+    CHECK_EQ(fired.size(), period.size());
+    for (auto& p : period)
+        CHECK(fired[p.first] == due[p.first]);
+    CHECK_EQ(wheel.size(), (size_t)0);
+}
+
+// handshake
+
+// a host that answers after the timeout still upgrades the session, and
+// the sender sees the change
+void
+testHandshakeLateAccept()
+{
+    // unconnected, so the hello goes nowhere and the wait times out
+    Client client;
+    client.handshake(1);
+    auto fellBack = client.getHostCapabilitiesChanges();
+    CHECK_EQ(client.getHostCapabilities().encodings, ENCODING_TEXT);
+
+    // the transport hands onAccept the frame's payload
+    char hello[HANDSHAKE_LEN], frame[FRAME_MAX_LEN];
+    Capabilities agreed;
+    encodeHandshake(CONTROL_HELLO, localCapabilities(), hello);
+    CHECK_EQ(encodeAccept(hello, HANDSHAKE_LEN, frame, agreed), (size_t)(FRAME_HEADER_LEN + HANDSHAKE_LEN));
+    auto accept = frame + FRAME_HEADER_LEN;
+    client.onAccept(accept, HANDSHAKE_LEN);
+    CHECK(client.getHostCapabilitiesChanges() != fellBack);
+    CHECK_EQ(client.getHostCapabilities().encodings, ENCODING_STATE);
+    CHECK_EQ(client.getHostCapabilities().features, agreed.features);
+
+    // once settled, a second accept changes nothing
+    auto settled = client.getHostCapabilitiesChanges();
+    client.onAccept(accept, HANDSHAKE_LEN);
+    CHECK_EQ(client.getHostCapabilitiesChanges(), settled);
+}
+
+struct Test {
+    const char* name;
+    std::function<void()> run;
+};
+
+int
+main(int argc, char **argv)
+{
+    std::vector<Test> tests = {
+        { "frame.chunk_reassembly", testFrameChunkReassembly },
+        { "frame.mux_priority", testFrameMuxPriority },
+        { "frame.legacy_fallback", testFrameLegacyFallback },
+        { "frame.oversize", testFrameOversize },
+        { "legacy.split_frames", testLegacySplitFrames },
+        { "legacy.byte_at_a_time", testLegacyByteAtATime },
+        { "legacy.resync", testLegacyResync },
+        { "legacy.no_partial_frames", testLegacyNoPartialFrames },
+        { "legacy.remote_messages", testLegacyRemoteMessages },
+        { "legacy.overlong_numbers", testLegacyOverlongNumbers },
+        { "keymap.translate", testKeyMapTranslate },
+        { "keymap.modifiers", testKeyMapModifiers },
+        { "timer.cascade", testTimerWheelCascade },
+        { "timer.cancel", testTimerWheelCancel },
+        { "timer.rearm_at_wrap", testTimerWheelRearmAtWrap },
+        { "handshake.late_accept", testHandshakeLateAccept },
+    };
+
+    const char* filter = argc > 1 ? argv[1] : "";
+    int failed = 0, ran = 0;
+    for (auto& test : tests) {
+        if (!strstr(test.name, filter))
+            continue;
+        auto before = checkFailures;
+        test.run();
+        ++ran;
+        bool ok = checkFailures == before;
+        failed += !ok;
+        printf("%-34s %s\n", test.name, ok ? "ok" : "FAILED");
+    }
+    printf("%d of %d tests failed\n", failed, ran);
+    return failed;
+}